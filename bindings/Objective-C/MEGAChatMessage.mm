@@ -14,6 +14,7 @@ using namespace megachat;
 
 @property MegaChatMessage *megaChatMessage;
 @property BOOL cMemoryOwn;
+@property (strong) id owner;
 
 @end
 
@@ -31,6 +32,16 @@ using namespace megachat;
     return self;
 }
 
+- (instancetype)initWithMegaChatMessage:(megachat::MegaChatMessage *)megaChatMessage owner:(id)owner {
+    self = [self initWithMegaChatMessage:megaChatMessage cMemoryOwn:NO];
+    
+    if (self != nil) {
+        _owner = owner;
+    }
+    
+    return self;
+}
+
 - (void)dealloc {
     if (self.cMemoryOwn){
         delete _megaChatMessage;
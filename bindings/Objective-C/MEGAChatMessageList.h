@@ -0,0 +1,12 @@
+#import <Foundation/Foundation.h>
+#import "MEGAChatMessage.h"
+
+@interface MEGAChatMessageList : NSObject
+
+@property (readonly, nonatomic) NSUInteger size;
+
+- (instancetype)clone;
+
+- (MEGAChatMessage *)messageAtIndex:(NSUInteger)index;
+
+@end
@@ -0,0 +1,56 @@
+#import "MEGAChatMessageList.h"
+#import "megachatapi.h"
+#import "MEGAChatMessage+init.h"
+
+using namespace megachat;
+
+@interface MEGAChatMessageList ()
+
+@property MegaChatMessageList *megaChatMessageList;
+@property BOOL cMemoryOwn;
+
+@end
+
+@implementation MEGAChatMessageList
+
+- (instancetype)initWithMegaChatMessageList:(MegaChatMessageList *)megaChatMessageList cMemoryOwn:(BOOL)cMemoryOwn {
+    self = [super init];
+    
+    if (self != nil) {
+        _megaChatMessageList = megaChatMessageList;
+        _cMemoryOwn = cMemoryOwn;
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    if (self.cMemoryOwn){
+        delete _megaChatMessageList;
+    }
+}
+
+- (instancetype)clone {
+    return self.megaChatMessageList ? [[MEGAChatMessageList alloc] initWithMegaChatMessageList:self.megaChatMessageList->copy() cMemoryOwn:YES] : nil;
+}
+
+- (MegaChatMessageList *)getCPtr {
+    return self.megaChatMessageList;
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"<%@: size=%ld>",
+            [self class], (long)self.size];
+}
+
+- (NSUInteger)size {
+    return self.megaChatMessageList ? self.megaChatMessageList->size() : 0;
+}
+
+- (MEGAChatMessage *)messageAtIndex:(NSUInteger)index {
+    // the message is not copied, it keeps the list alive instead
+    MegaChatMessage *message = self.megaChatMessageList ? (MegaChatMessage *)self.megaChatMessageList->get((unsigned int)index) : NULL;
+    return message ? [[MEGAChatMessage alloc] initWithMegaChatMessage:message owner:self] : nil;
+}
+
+@end
@@ -30,7 +30,9 @@ typedef NS_ENUM (NSInteger, MEGAChatRequestType) {
     MEGAChatRequestTypeSignalActivity,
     MEGAChatRequestTypeSetPresencePersist,
     MEGAChatRequestTypeSetPresenceAutoaway,
-    MEGAChatRequestTypeLoadAudioVideoDevices
+    MEGAChatRequestTypeLoadAudioVideoDevices,
+    MEGAChatRequestTypePushReceived,
+    MEGAChatRequestTypeSearchMessages
 };
 
 enum {
@@ -41,6 +43,7 @@ enum {
 @class MEGAChatMessage;
 @class MEGAChatPeerList;
 @class MEGANodeList;
+@class MEGAHandleList;
 
 @interface MEGAChatRequest : NSObject
 
@@ -57,7 +60,9 @@ enum {
 @property (readonly, nonatomic) MEGAChatMessage *chatMessage;
 @property (readonly, nonatomic) MEGANodeList *nodeList;
 @property (readonly, nonatomic) NSInteger paramType;
+@property (readonly, nonatomic) MEGAHandleList *megaHandleList;
 
 - (instancetype)clone;
+- (MEGAHandleList *)megaHandleListForChat:(uint64_t)chatId;
 
 @end
@@ -5,6 +5,7 @@
 #import "MEGAChatMessage+init.h"
 #import "MEGAChatPeerList+init.h"
 #import "MEGANodeList+init.h"
+#import "MEGAHandleList+init.h"
 
 using namespace megachat;
 
@@ -103,4 +104,14 @@ using namespace megachat;
     return self.megaChatRequest ? self.megaChatRequest->getParamType() : 0;
 }
 
+- (MEGAHandleList *)megaHandleList {
+    return (self.megaChatRequest && self.megaChatRequest->getMegaHandleList()) ? [[MEGAHandleList alloc] initWithMegaHandleList:self.megaChatRequest->getMegaHandleList()->copy() cMemoryOwn:YES] : nil;
+}
+
+- (MEGAHandleList *)megaHandleListForChat:(uint64_t)chatId {
+    if (!self.megaChatRequest) return nil;
+    mega::MegaHandleList *handleList = self.megaChatRequest->getMegaHandleListByChat(chatId);
+    return handleList ? [[MEGAHandleList alloc] initWithMegaHandleList:handleList->copy() cMemoryOwn:YES] : nil;
+}
+
 @end
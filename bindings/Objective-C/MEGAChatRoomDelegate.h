@@ -1,6 +1,7 @@
 #import <Foundation/Foundation.h>
 #import "MEGAChatRoom.h"
 #import "MEGAChatMessage.h"
+#import "MEGAChatMessageList.h"
 
 @class MEGAChatSdk;
 
@@ -10,6 +11,7 @@
 
 - (void)onChatRoomUpdate:(MEGAChatSdk *)api chat:(MEGAChatRoom *)chat;
 - (void)onMessageLoaded:(MEGAChatSdk *)api message:(MEGAChatMessage *)message;
+- (void)onMessagesLoaded:(MEGAChatSdk *)api messages:(MEGAChatMessageList *)messages;
 - (void)onMessageReceived:(MEGAChatSdk *)api message:(MEGAChatMessage *)message;
 - (void)onMessageUpdate:(MEGAChatSdk *)api message:(MEGAChatMessage *)message;
 - (void)onHistoryReloaded:(MEGAChatSdk *)api chat:(MEGAChatRoom *)chat;
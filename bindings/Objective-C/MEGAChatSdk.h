@@ -69,6 +69,7 @@ typedef NS_ENUM (NSInteger, MEGAChatConnection) {
 @property (nonatomic, readonly) NSInteger unreadChats;
 @property (nonatomic, readonly) MEGAChatListItemList *activeChatListItems;
 @property (nonatomic, readonly) MEGAChatListItemList *inactiveChatListItems;
+@property (nonatomic, readonly) int64_t chatListVersion;
 
 #pragma mark - Init
 
@@ -142,6 +143,8 @@ typedef NS_ENUM (NSInteger, MEGAChatConnection) {
 - (MEGAChatRoom *)chatRoomByUser:(uint64_t)userHandle;
 
 - (MEGAChatListItem *)chatListItemForChatId:(uint64_t)chatId;
+- (MEGAChatListItemList *)chatListItemsChangedSinceVersion:(int64_t)version;
+- (MEGAChatListItemList *)chatListItemsByLastActivityWithOffset:(NSUInteger)offset count:(NSUInteger)count;
 
 - (uint64_t)chatIdByUserHandle:(uint64_t)userHandle;
 
@@ -192,6 +195,8 @@ typedef NS_ENUM (NSInteger, MEGAChatConnection) {
 
 - (MEGAChatSource)loadMessagesForChat:(uint64_t)chatId count:(NSInteger)count;
 - (BOOL)isFullHistoryLoadedForChat:(uint64_t)chatId;
+- (void)setBatchedHistoryLoading:(BOOL)enable;
+- (BOOL)isBatchedHistoryLoading;
 
 - (MEGAChatMessage *)messageForChat:(uint64_t)chatId messageId:(uint64_t)messageId;
 - (MEGAChatMessage *)sendMessageToChat:(uint64_t)chatId message:(NSString *)message;
@@ -204,6 +209,9 @@ typedef NS_ENUM (NSInteger, MEGAChatConnection) {
 - (void)attachNodeToChat:(uint64_t)chatId node:(uint64_t)nodeHandle;
 - (MEGAChatMessage *)revokeAttachmentMessageForChat:(uint64_t)chatId messageId:(uint64_t)messageId;
 - (BOOL)isRevokedNode:(uint64_t)nodeHandle inChat:(uint64_t)chatId;
+- (NSArray<MEGAChatMessage *> *)nodeAttachmentMessagesForChat:(uint64_t)chatId beforeIndex:(NSInteger)beforeIndex count:(NSUInteger)count;
+- (void)searchMessagesInChat:(uint64_t)chatId query:(NSString *)query limit:(NSUInteger)limit cursor:(long long)cursor delegate:(id<MEGAChatRequestDelegate>)delegate;
+- (void)searchMessagesInChat:(uint64_t)chatId query:(NSString *)query limit:(NSUInteger)limit cursor:(long long)cursor;
 - (MEGAChatMessage *)editMessageForChat:(uint64_t)chatId messageId:(uint64_t)messageId message:(NSString *)message;
 - (MEGAChatMessage *)deleteMessageForChat:(uint64_t)chatId messageId:(uint64_t)messageId;
 - (MEGAChatMessage *)removeRichLinkForChat:(uint64_t)chatId messageId:(uint64_t)messageId;
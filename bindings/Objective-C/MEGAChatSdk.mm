@@ -428,6 +428,19 @@ static DelegateMEGAChatLoggerListener *externalLogger = NULL;
     return [[MEGAChatListItemList alloc] initWithMegaChatListItemList:self.megaChatApi->getInactiveChatListItems() cMemoryOwn:YES];
 }
 
+- (int64_t)chatListVersion {
+    return self.megaChatApi->getChatListVersion();
+}
+
+- (MEGAChatListItemList *)chatListItemsChangedSinceVersion:(int64_t)version {
+    MegaChatListItemList *items = self.megaChatApi->getChatListItemsChangedSince(version);
+    return items ? [[MEGAChatListItemList alloc] initWithMegaChatListItemList:items cMemoryOwn:YES] : nil;
+}
+
+- (MEGAChatListItemList *)chatListItemsByLastActivityWithOffset:(NSUInteger)offset count:(NSUInteger)count {
+    return [[MEGAChatListItemList alloc] initWithMegaChatListItemList:self.megaChatApi->getChatListItemsByLastActivity((unsigned int)offset, (unsigned int)count) cMemoryOwn:YES];
+}
+
 - (MEGAChatListItem *)chatListItemForChatId:(uint64_t)chatId {
     return self.megaChatApi->getChatListItem(chatId) ? [[MEGAChatListItem alloc] initWithMegaChatListItem:self.megaChatApi->getChatListItem(chatId) cMemoryOwn:YES] : nil;
 }
@@ -564,6 +577,14 @@ static DelegateMEGAChatLoggerListener *externalLogger = NULL;
     return self.megaChatApi->isFullHistoryLoaded(chatId);
 }
 
+- (void)setBatchedHistoryLoading:(BOOL)enable {
+    self.megaChatApi->setBatchedHistoryLoading(enable);
+}
+
+- (BOOL)isBatchedHistoryLoading {
+    return self.megaChatApi->isBatchedHistoryLoading();
+}
+
 - (MEGAChatMessage *)messageForChat:(uint64_t)chatId messageId:(uint64_t)messageId {
     return self.megaChatApi->getMessage(chatId, messageId) ? [[MEGAChatMessage alloc] initWithMegaChatMessage:self.megaChatApi->getMessage(chatId, messageId) cMemoryOwn:YES] : nil;
 }
@@ -628,6 +649,26 @@ static DelegateMEGAChatLoggerListener *externalLogger = NULL;
     return self.megaChatApi->isRevoked(chatId, nodeHandle);
 }
 
+- (NSArray<MEGAChatMessage *> *)nodeAttachmentMessagesForChat:(uint64_t)chatId beforeIndex:(NSInteger)beforeIndex count:(NSUInteger)count {
+    if (!self.megaChatApi) return nil;
+    MegaChatMessageList *messageList = self.megaChatApi->getNodeAttachmentMessages(chatId, (int)beforeIndex, (unsigned int)count);
+    if (!messageList) return nil;
+    NSMutableArray<MEGAChatMessage *> *messages = [NSMutableArray arrayWithCapacity:messageList->size()];
+    for (unsigned int i = 0; i < messageList->size(); i++) {
+        [messages addObject:[[MEGAChatMessage alloc] initWithMegaChatMessage:messageList->get(i)->copy() cMemoryOwn:YES]];
+    }
+    delete messageList;
+    return messages;
+}
+
+- (void)searchMessagesInChat:(uint64_t)chatId query:(NSString *)query limit:(NSUInteger)limit cursor:(long long)cursor delegate:(id<MEGAChatRequestDelegate>)delegate {
+    self.megaChatApi->searchMessages(chatId, query ? [query UTF8String] : NULL, (unsigned int)limit, cursor, [self createDelegateMEGAChatRequestListener:delegate singleListener:YES]);
+}
+
+- (void)searchMessagesInChat:(uint64_t)chatId query:(NSString *)query limit:(NSUInteger)limit cursor:(long long)cursor {
+    self.megaChatApi->searchMessages(chatId, query ? [query UTF8String] : NULL, (unsigned int)limit, cursor);
+}
+
 - (MEGAChatMessage *)editMessageForChat:(uint64_t)chatId messageId:(uint64_t)messageId message:(NSString *)message {
     return self.megaChatApi ? [[MEGAChatMessage alloc] initWithMegaChatMessage:self.megaChatApi->editMessage(chatId, messageId, message ? [message UTF8String] : NULL) cMemoryOwn:YES] : nil;
 }
@@ -1,6 +1,7 @@
 #import "DelegateMEGAChatRoomListener.h"
 #import "MEGAChatRoom+init.h"
 #import "MEGAChatMessage+init.h"
+#import "MEGAChatMessageList+init.h"
 #import "MEGAChatSdk+init.h"
 
 using namespace megachat;
@@ -37,6 +38,20 @@ void DelegateMEGAChatRoomListener::onMessageLoaded(megachat::MegaChatApi *api, m
     }
 }
 
+void DelegateMEGAChatRoomListener::onMessagesLoaded(megachat::MegaChatApi *api, megachat::MegaChatMessageList *messages) {
+    if (listener != nil && [listener respondsToSelector:@selector(onMessagesLoaded:messages:)]) {
+        MegaChatMessageList *tempMessages = messages->copy();
+        MEGAChatSdk *tempMegaChatSDK = this->megaChatSDK;
+        id<MEGAChatRoomDelegate> tempListener = this->listener;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [tempListener onMessagesLoaded:tempMegaChatSDK messages:[[MEGAChatMessageList alloc] initWithMegaChatMessageList:tempMessages cMemoryOwn:YES]];
+        });
+    } else {
+        // the default implementation calls onMessageLoaded() for every message
+        MegaChatRoomListener::onMessagesLoaded(api, messages);
+    }
+}
+
 void DelegateMEGAChatRoomListener::onMessageReceived(megachat::MegaChatApi *api, megachat::MegaChatMessage *message) {
     if (listener != nil && [listener respondsToSelector:@selector(onMessageReceived:message:)]) {
         MegaChatMessage *tempMessage = message->copy();
@@ -4,6 +4,7 @@
 @interface MEGAChatMessage (init)
 
 - (instancetype)initWithMegaChatMessage:(megachat::MegaChatMessage *)megaChatMessage cMemoryOwn:(BOOL)cMemoryOwn;
+- (instancetype)initWithMegaChatMessage:(megachat::MegaChatMessage *)megaChatMessage owner:(id)owner;
 - (megachat::MegaChatMessage *)getCPtr;
 
 @end
@@ -0,0 +1,9 @@
+#import "MEGAChatMessageList.h"
+#import "megachatapi.h"
+
+@interface MEGAChatMessageList (init)
+
+- (instancetype)initWithMegaChatMessageList:(megachat::MegaChatMessageList *)megaChatMessageList cMemoryOwn:(BOOL)cMemoryOwn;
+- (megachat::MegaChatMessageList *)getCPtr;
+
+@end
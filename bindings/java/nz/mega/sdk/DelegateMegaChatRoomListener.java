@@ -64,6 +64,23 @@ class DelegateMegaChatRoomListener extends MegaChatRoomListener {
         }
     }
 
+    @Override
+    public void onMessagesLoaded(MegaChatApi api, MegaChatMessageList msgs){
+        if (listener instanceof MegaChatRoomBatchListenerInterface) {
+            final MegaChatRoomBatchListenerInterface batchListener = (MegaChatRoomBatchListenerInterface) listener;
+            final MegaChatMessageList megaChatMessages = msgs.copy();
+            megaChatApi.runCallback(new Runnable() {
+                public void run() {
+                    batchListener.onMessagesLoaded(megaChatApi, megaChatMessages);
+                }
+            });
+        }
+        else {
+            // the default implementation calls onMessageLoaded() for every message
+            super.onMessagesLoaded(api, msgs);
+        }
+    }
+
     @Override
     public void onMessageReceived(MegaChatApi api, MegaChatMessage msg){
         if (listener != null) {
@@ -189,6 +189,72 @@ public class MegaChatApiJava {
         return megaChatApi.init(sid);
     }
 
+    /**
+     * Sets the storage settings of the local cache
+     *
+     * Valid values are:
+     *  - MegaChatApi::STORAGE_PROFILE_DEFAULT = 0
+     *  - MegaChatApi::STORAGE_PROFILE_LOW_MEMORY = 1
+     *  - MegaChatApi::STORAGE_PROFILE_THROUGHPUT = 2
+     *  - MegaChatApi::STORAGE_PROFILE_LEGACY = 3
+     *
+     * This function must be called before MegaChatApi::init. Otherwise, it takes effect
+     * the next time the cache is opened.
+     *
+     * @param profile Storage profile of the local cache
+     */
+    public void setStorageProfile(int profile)
+    {
+        megaChatApi.setStorageProfile(profile);
+    }
+
+    /**
+     * Sets for how long the messages are kept in the local cache
+     *
+     * The messages sent before that time are deleted from the cache by its periodic maintenance,
+     * and they are loaded from the server again if the app requests them. If the retention time
+     * of a chat, set in the server, is shorter, that one is used for the chat instead.
+     *
+     * The history of a chat is only pruned while the chat is not connected to the chat server.
+     *
+     * @param seconds Time in seconds, or 0 to keep all the messages (default)
+     */
+    public void setHistoryRetention(long seconds)
+    {
+        megaChatApi.setHistoryRetention(seconds);
+    }
+
+    /**
+     * Sets where the history of the chats is kept in the local cache
+     *
+     * Valid values are:
+     *  - MegaChatApi::HISTORY_STORAGE_SQLITE = 0
+     *  - MegaChatApi::HISTORY_STORAGE_SEGMENTS = 1
+     *
+     * This function must be called before MegaChatApi::init. If the local cache has the
+     * history in the other storage, it's cleared and loaded from the server again.
+     *
+     * @param storage Storage of the history
+     */
+    public void setHistoryStorage(int storage)
+    {
+        megaChatApi.setHistoryStorage(storage);
+    }
+
+    /**
+     * Sets how many messages of history are loaded ahead of the app
+     *
+     * While a chatroom is open, the messages older than the ones loaded via loadMessages
+     * are loaded in the background, from the local cache or from the server, so that the
+     * next calls are served from memory.
+     *
+     * @param count Number of messages to load ahead, or 0 to disable it (default)
+     */
+    public void setHistoryPrefetch(long count)
+    {
+        megaChatApi.setHistoryPrefetch(count);
+    }
+
     /**
      * Returns the current initialization state
      *
@@ -1035,6 +1101,56 @@ public class MegaChatApiJava {
         return chatRoomListItemToArray(megaChatApi.getUnreadChatListItems());
     }
 
+    /**
+     * Get the current version of the list of chatrooms
+     *
+     * The version is increased every time that any MegaChatListItem changes, is
+     * added or is removed. It can be passed later to MegaChatApiJava::getChatListItemsChangedSince
+     * in order to get only the chatrooms that have changed since then, instead of
+     * the whole list.
+     *
+     * Versions are only meaningful for the current session. After a logout, the
+     * version keeps increasing, but the list starts from scratch.
+     *
+     * @return The current version of the list of chatrooms
+     */
+    public long getChatListVersion(){
+        return megaChatApi.getChatListVersion();
+    }
+
+    /**
+     * Return the chatrooms that have changed after a given version of the list
+     *
+     * The returned list includes the chatrooms that have been added or updated after
+     * the version. It also includes the chatrooms that have been removed from the list,
+     * with the change MegaChatListItem::CHANGE_TYPE_CLOSED.
+     *
+     * Only the most recent removals are remembered, and none of them survive a logout.
+     * If some removal after the version has been forgotten, this function returns null,
+     * and the app has to reload the whole list with MegaChatApiJava::getChatListItems.
+     *
+     * @param version Version of the list returned by MegaChatApiJava::getChatListVersion. A
+     * version of 0 returns all the chatrooms.
+     * @return List of the chatrooms changed after the version, or null if it is too old
+     */
+    public ArrayList<MegaChatListItem> getChatListItemsChangedSince(long version){
+        return chatRoomListItemToArray(megaChatApi.getChatListItemsChangedSince(version));
+    }
+
+    /**
+     * Return a page of the chatrooms, sorted by last activity
+     *
+     * The chatrooms are sorted by the timestamp of their last activity (see
+     * MegaChatListItem::getLastTimestamp), most recent first.
+     *
+     * @param offset Number of chatrooms to skip from the most recent one
+     * @param count Maximum number of chatrooms to return
+     * @return List including up to count chatrooms
+     */
+    public ArrayList<MegaChatListItem> getChatListItemsByLastActivity(long offset, long count){
+        return chatRoomListItemToArray(megaChatApi.getChatListItemsByLastActivity(offset, count));
+    }
+
     /**
      * Get the chat id for the 1on1 chat with the specified user
      *
@@ -1214,6 +1330,28 @@ public class MegaChatApiJava {
         return megaChatApi.loadMessages(chatid, count);
     }
 
+    /**
+     * Enable or disable the batched delivery of loaded history
+     *
+     * When enabled, the messages loaded by MegaChatApiJava::loadMessages are delivered
+     * in a single call to MegaChatRoomBatchListenerInterface::onMessagesLoaded instead
+     * of one call per message.
+     *
+     * @param enable True to deliver loaded history in batches
+     */
+    public void setBatchedHistoryLoading(boolean enable){
+        megaChatApi.setBatchedHistoryLoading(enable);
+    }
+
+    /**
+     * Returns whether loaded history is delivered in batches
+     *
+     * @return True if batched history loading is enabled
+     */
+    public boolean isBatchedHistoryLoading(){
+        return megaChatApi.isBatchedHistoryLoading();
+    }
+
     /**
      * Returns the MegaChatMessage specified from the chat room.
      *
@@ -1480,6 +1618,84 @@ public class MegaChatApiJava {
         return megaChatApi.isRevoked(chatid, nodeHandle);
     }
 
+    /**
+     * Returns the node attachment messages of a chatroom stored in the local history
+     *
+     * Messages are returned from the newest to the oldest, starting right before beforeIndex.
+     * To get the next page, pass the index of the oldest message of the previous page.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param beforeIndex Index of the message to start from, excluded. MEGACHAT_INVALID_INDEX
+     * to start from the newest attachment
+     * @param count Maximum number of messages to return
+     * @return List of node attachment messages, or null if the chatroom doesn't exist
+     */
+    public ArrayList<MegaChatMessage> getNodeAttachmentMessages(long chatid, int beforeIndex, long count){
+        return messageListToArray(megaChatApi.getNodeAttachmentMessages(chatid, beforeIndex, count));
+    }
+
+    /**
+     * Returns a window of the local history around a message
+     *
+     * The messages are returned from the oldest to the newest: up to before messages older
+     * than the given one, the message itself and up to after newer messages. They are read from
+     * memory or the local history, without loading them by MegaChatApi::loadMessages.
+     * Messages only available in the server are not included.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param msgid MegaChatHandle that identifies the message
+     * @param before Maximum number of older messages to return
+     * @param after Maximum number of newer messages to return
+     * @return List of messages, or null if the chatroom doesn't exist or the message
+     * is not in the local history
+     */
+    public ArrayList<MegaChatMessage> getMessagesAround(long chatid, long msgid, long before, long after){
+        return messageListToArray(megaChatApi.getMessagesAround(chatid, msgid, before, after));
+    }
+
+    /**
+     * Returns a window of the local history around a point in time
+     *
+     * Same as MegaChatApiJava::getMessagesAround, but the window is centered on the newest
+     * message sent at or before ts.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param ts Timestamp (in seconds since epoch)
+     * @param before Maximum number of older messages to return
+     * @param after Maximum number of newer messages to return
+     * @return List of messages, or null if the chatroom doesn't exist or all of the local
+     * history is newer than ts
+     */
+    public ArrayList<MegaChatMessage> getMessagesAroundTime(long chatid, long ts, long before, long after){
+        return messageListToArray(megaChatApi.getMessagesAroundTime(chatid, ts, before, after));
+    }
+
+    /**
+     * Searches the text of the messages stored in the local history
+     *
+     * The search uses a full-text index of the local history, so the messages don't need
+     * to be loaded by MegaChatApi::loadMessages. Only normal messages are indexed, and a message
+     * matches if every word of the query is a prefix of one of its words. Hits are returned from
+     * the newest to the oldest.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getMegaHandleList - Returns the list of chatids with hits, ordered by their newest hit
+     * - MegaChatRequest::getMegaHandleListByChat - Returns the msgids of the hits in a given chat, newest first
+     * - MegaChatRequest::getNumber - Returns the cursor of the next page, or 0 if there are no more hits
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE
+     * to search all chats
+     * @param query Words to search
+     * @param limit Maximum number of hits
+     * @param cursor 0 for the first page, or the cursor returned by the previous page
+     * @param listener MegaChatRequestListener to track this request
+     */
+    public void searchMessages(long chatid, String query, long limit, long cursor, MegaChatRequestListenerInterface listener){
+        megaChatApi.searchMessages(chatid, query, limit, cursor, createDelegateRequestListener(listener));
+    }
+
     /**
      * Edits an existing message
      *
@@ -2032,4 +2248,18 @@ public class MegaChatApiJava {
 
         return result;
     }
+
+    static ArrayList<MegaChatMessage> messageListToArray(MegaChatMessageList messageList) {
+
+        if (messageList == null) {
+            return null;
+        }
+
+        ArrayList<MegaChatMessage> result = new ArrayList<MegaChatMessage>((int)messageList.size());
+        for (int i = 0; i < messageList.size(); i++) {
+            result.add(messageList.get(i).copy());
+        }
+
+        return result;
+    }
 };
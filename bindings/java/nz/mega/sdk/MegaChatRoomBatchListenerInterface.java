@@ -0,0 +1,29 @@
+/*
+ * (c) 2013-2015 by Mega Limited, Auckland, New Zealand
+ *
+ * This file is part of the MEGA SDK - Client Access Engine.
+ *
+ * Applications using the MEGA API must present a valid application key
+ * and comply with the the rules set forth in the Terms of Service.
+ *
+ * The MEGA SDK is distributed in the hope that it will be useful,\
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * @copyright Simplified (2-clause) BSD License.
+ * You should have received a copy of the license along with this
+ * program.
+ */
+package nz.mega.sdk;
+
+/**
+ * Listener that receives the loaded history in batches (see MegaChatApiJava::setBatchedHistoryLoading)
+ *
+ * The list is handed over as is, without copying its messages one by one. The
+ * messages returned by MegaChatMessageList::get are valid while the list is, so
+ * use MegaChatMessage::copy to keep any of them for longer. Listeners that don't
+ * implement this interface receive the history through onMessageLoaded, one
+ * message at a time.
+ */
+public interface MegaChatRoomBatchListenerInterface extends MegaChatRoomListenerInterface {
+    public void onMessagesLoaded(MegaChatApiJava api, MegaChatMessageList msgs);
+}
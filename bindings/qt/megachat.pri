@@ -13,12 +13,14 @@ SOURCES += megachatapi.cpp \
             base64url.cpp \
             chatClient.cpp \
             chatd.cpp \
+            historyStore.cpp \
             url.cpp \
             karereCommon.cpp \
             userAttrCache.cpp \
             base/logger.cpp \
             base/cservices.cpp \
             net/websocketsIO.cpp \
+            net/tlsSessionCache.cpp \
             karereDbSchema.cpp \
             net/libwebsocketsIO.cpp \
             waiter/libuvWaiter.cpp
@@ -46,6 +48,9 @@ HEADERS  += asyncTest-framework.h \
             url.h \
             base64url.h \
             chatdDb.h \
+            chatdSegmentDb.h \
+            historyCodec.h \
+            historyStore.h \
             IGui.h \
             megachatapi_impl.h \
             sdkApi.h \
@@ -61,10 +66,12 @@ HEADERS  += asyncTest-framework.h \
             base/addrinfo.hpp \
             base/cservices-thread.h \
             base/cservices.h \
+            base/fetchQueue.h \
             base/gcmpp.h \
             base/logger.h \
             base/loggerFile.h \
             base/loggerConsole.h \
+            base/msgPool.h \
             base/retryHandler.h \
             base/promise.h \
             base/services.h \
@@ -73,6 +80,7 @@ HEADERS  += asyncTest-framework.h \
             net/libwsIO.h \
             net/libwebsocketsIO.h \
             net/websocketsIO.h \
+            net/tlsSessionCache.h \
             rtcModule/IDeviceListImpl.h \
             rtcModule/IRtcCrypto.h \
             rtcModule/IRtcStats.h \
@@ -315,11 +315,11 @@ function buildInstall_zlib
 function buildInstall_sqlite
 {
     if [[ $shared == "1" ]]; then
-        $CC $CPPFLAGS $CFLAGS sqlite3.c -fPIC -DSQLITE_API= -O2 -shared -D NDEBUG -o ./libsqlite3.so
+        $CC $CPPFLAGS $CFLAGS sqlite3.c -fPIC -DSQLITE_API= -O2 -shared -D NDEBUG -DSQLITE_ENABLE_FTS5 -o ./libsqlite3.so
         chmod a+x ./libsqlite3.so
         cp -v ./libsqlite3.so "$buildroot/usr/lib"
     else
-        $CC $CPPFLAGS $CFLAGS sqlite3.c -c -O2 -D NDEBUG -o ./sqlite3.o
+        $CC $CPPFLAGS $CFLAGS sqlite3.c -c -O2 -D NDEBUG -DSQLITE_ENABLE_FTS5 -o ./sqlite3.o
         ar -rcs ./libsqlite3.a ./sqlite3.o
         cp -v ./libsqlite3.a "$buildroot/usr/lib"
     fi
@@ -421,10 +421,10 @@ function buildInstall_cares
 function buildInstall_sqlite
 {
     if [[ $shared == "1" ]]; then
-        cl sqlite3.c $runtimeFlag "-DSQLITE_API=__declspec(dllexport)" /O2 /Ob2 /D NDEBUG -link -dll -out:sqlite3.dll
+        cl sqlite3.c $runtimeFlag "-DSQLITE_API=__declspec(dllexport)" /O2 /Ob2 /D NDEBUG /D SQLITE_ENABLE_FTS5 -link -dll -out:sqlite3.dll
         cp -v ./sqlite3.dll "$buildroot/usr/lib"
     else
-        cl sqlite3.c -c $runtimeFlag /O2 /Ob2 /D NDEBUG
+        cl sqlite3.c -c $runtimeFlag /O2 /Ob2 /D NDEBUG /D SQLITE_ENABLE_FTS5
         lib sqlite3.obj -OUT:sqlite3.lib
     fi
     cp -v ./sqlite3.lib "$buildroot/usr/lib"
@@ -0,0 +1,31 @@
+# Find Zstd
+# ~~~~~~~~~
+#
+# CMake module to search for the zstd library
+#
+# If it's found it sets ZSTD_FOUND to TRUE
+# and following variables are set:
+#    ZSTD_INCLUDE_DIR
+#    ZSTD_LIBRARY
+
+FIND_PATH(ZSTD_INCLUDE_DIR NAMES zstd.h zdict.h)
+FIND_LIBRARY(ZSTD_LIBRARY NAMES zstd zstd_static libzstd)
+
+IF (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+   SET(ZSTD_FOUND TRUE)
+ENDIF (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+
+
+IF (ZSTD_FOUND)
+
+   IF (NOT Zstd_FIND_QUIETLY)
+      MESSAGE(STATUS "Found Zstd: ${ZSTD_LIBRARY}")
+   ENDIF (NOT Zstd_FIND_QUIETLY)
+
+ELSE (ZSTD_FOUND)
+
+   IF (Zstd_FIND_REQUIRED)
+      MESSAGE(FATAL_ERROR "Could not find Zstd")
+   ENDIF (Zstd_FIND_REQUIRED)
+
+ENDIF (ZSTD_FOUND)
@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <inttypes.h> //for PRIu64
 #include <cstdlib> //for abs
+#include <memory>
+#include <functional>
 
 /** default timeout for a done() item */
 #ifndef TESTLOOP_DEFAULT_DONE_TIMEOUT
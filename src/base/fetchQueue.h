@@ -0,0 +1,107 @@
+#ifndef KARERE_FETCHQUEUE_H
+#define KARERE_FETCHQUEUE_H
+
+#include <deque>
+#include <set>
+#include <functional>
+#include <promise.h>
+#include "trackDelete.h"
+
+namespace karere
+{
+/** @brief Coalesces requests for keys made during one event loop turn, and
+ * dispatches them in the next one, in the order they were requested, with at most
+ * \c maxInFlight of them in flight at the same time. A key that is already queued
+ * is not queued again. Each completion dispatches the next queued key.
+ *
+ * The event loop is abstracted by \c ScheduleFunc, which must run the function
+ * asynchronously (i.e. marshallCall()), and the backend by \c DispatchFunc, so the
+ * queue can be tested without either
+ */
+template <class K>
+class FetchQueue: public DeleteTrackable
+{
+public:
+    typedef std::function<promise::Promise<void>(const K&)> DispatchFunc;
+    typedef std::function<void(std::function<void()>&&)> ScheduleFunc;
+
+    FetchQueue(unsigned maxInFlight, DispatchFunc&& dispatch, ScheduleFunc&& schedule)
+    : mMaxInFlight(maxInFlight), mDispatch(std::move(dispatch)), mSchedule(std::move(schedule)) {}
+
+    /** Queues \c key and schedules a flush. Returns false if it was already queued */
+    bool push(const K& key)
+    {
+        if (!mQueued.insert(key).second)
+            return false;
+
+        mQueue.push_back(key);
+        if (mFlushScheduled)
+            return true;
+
+        mFlushScheduled = true;
+        auto wptr = weakHandle();
+        mSchedule([wptr, this]()
+        {
+            if (wptr.deleted())
+                return;
+
+            mFlushScheduled = false;
+            process();
+        });
+        return true;
+    }
+    /** Drops the queued keys. The ones in flight complete as usual */
+    void clear()
+    {
+        mQueue.clear();
+        mQueued.clear();
+    }
+    size_t queued() const { return mQueue.size(); }
+    unsigned inFlight() const { return mInFlight; }
+
+protected:
+    unsigned mMaxInFlight;
+    DispatchFunc mDispatch;
+    ScheduleFunc mSchedule;
+    std::deque<K> mQueue;
+    /** Same keys as \c mQueue, to deduplicate them */
+    std::set<K> mQueued;
+    unsigned mInFlight = 0;
+    bool mFlushScheduled = false;
+    /** Set while dispatching, as a dispatch may complete synchronously */
+    bool mProcessing = false;
+
+    void process()
+    {
+        if (mProcessing)
+            return;
+
+        mProcessing = true;
+        while (!mQueue.empty() && (mInFlight < mMaxInFlight))
+        {
+            K key = mQueue.front();
+            mQueue.pop_front();
+            mQueued.erase(key);
+
+            mInFlight++;
+            auto wptr = weakHandle();
+            mDispatch(key)
+            .fail([](const promise::Error&)
+            {
+                return promise::_Void(); //the backend reports its errors itself
+            })
+            .then([wptr, this]()
+            {
+                if (wptr.deleted())
+                    return;
+
+                assert(mInFlight > 0);
+                mInFlight--;
+                process();
+            });
+        }
+        mProcessing = false;
+    }
+};
+}
+#endif
@@ -6,6 +6,7 @@
 #include "karereCommon.h"
 #include "gcm.h"
 #include "logger.h"
+#include "msgPool.h"
 #include <memory>
 #include <assert.h>
 
@@ -16,12 +17,13 @@ namespace karere
  * be used with a std::function or any other object with operator()). It provides
  * type safety since it generates both the message type and the code that processes
  * it. Further, it allows for code optimization as all types are known at compile time
- * and all code is in the same compilation unit, so it can be inlined
+ * and all code is in the same compilation unit, so it can be inlined.
+ * The message objects are allocated from the MsgPool.
  */
 template <class F>
 static inline void marshallCall(F&& func, void *appCtx)
 {
-    struct Msg: public megaMessage
+    struct Msg: public megaMessage, public MsgPoolAllocated
     {
         F mFunc;
         Msg(F&& aFunc, megaMessageFunc cHandler)
@@ -0,0 +1,191 @@
+#ifndef _MEGA_MSGPOOL_INCLUDED
+#define _MEGA_MSGPOOL_INCLUDED
+
+/* Size-class pool for the message objects of the GUI call marshaller (see gcmpp.h
+ * and timers.hpp).
+ * Unlike promise::Pool, the blocks here are normally allocated by one thread
+ * (the one that posts the message) and freed by another (the app's thread that processes
+ * it), so per-thread free lists alone would never be reused. Instead, each thread has a
+ * small cache per size class, and full batches of free blocks are moved between the caches
+ * and a shared pool. The mutex of the shared pool is taken once per kBatchSize blocks.
+ */
+
+#include <mutex>
+#include <new>
+#include <stddef.h>
+
+namespace karere
+{
+class MsgPool
+{
+public:
+    enum
+    {
+        kGranularity = 16,
+        kMaxBlockSize = 512,
+        /** Number of blocks moved at once between a thread's cache and the shared pool */
+        kBatchSize = 32,
+        /** Free batches above this count in a size class are returned to the heap */
+        kMaxSharedBatches = 64
+    };
+    static void* alloc(size_t size)
+    {
+#ifndef KARERE_NO_MSGPOOL
+        if (size && (size <= kMaxBlockSize))
+        {
+            ThreadCache& cache = threadCache();
+            if (!cache.mDestroyed)
+            {
+                size_t cls = (size-1)/kGranularity;
+                FreeList& list = cache.mLists[cls];
+                if (!list.mHead)
+                {
+                    SharedList& shared = sharedLists()[cls];
+                    std::lock_guard<std::mutex> lock(shared.mMutex);
+                    if (shared.mBatches)
+                    {
+                        list.mHead = shared.mBatches;
+                        list.mCount = kBatchSize;
+                        shared.mBatches = shared.mBatches->mNextBatch;
+                        shared.mCount--;
+                    }
+                }
+                if (list.mHead)
+                {
+                    Node* node = list.mHead;
+                    list.mHead = node->mNext;
+                    list.mCount--;
+                    return node;
+                }
+            }
+            // the full block size also after our cache is destroyed, as the message
+            // is normally freed by another thread, to its cache
+            return ::operator new(blockSize(size));
+        }
+#endif
+        return ::operator new(size);
+    }
+    static void free(void* ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+#ifndef KARERE_NO_MSGPOOL
+        if (size && (size <= kMaxBlockSize))
+        {
+            ThreadCache& cache = threadCache();
+            if (!cache.mDestroyed)
+            {
+                size_t cls = (size-1)/kGranularity;
+                FreeList& list = cache.mLists[cls];
+                Node* node = static_cast<Node*>(ptr);
+                node->mNext = list.mHead;
+                list.mHead = node;
+                if (++list.mCount >= 2 * kBatchSize)
+                {
+                    releaseBatch(list, sharedLists()[cls]);
+                }
+                return;
+            }
+        }
+#endif
+        ::operator delete(ptr);
+    }
+protected:
+    struct Node
+    {
+        Node* mNext;
+        /** Only valid for the first node of a batch in the shared pool */
+        Node* mNextBatch;
+    };
+    struct FreeList
+    {
+        Node* mHead = nullptr;
+        unsigned mCount = 0;
+    };
+    struct SharedList
+    {
+        std::mutex mMutex;
+        Node* mBatches = nullptr;
+        unsigned mCount = 0;
+    };
+    struct ThreadCache
+    {
+        FreeList mLists[kMaxBlockSize/kGranularity];
+        bool mDestroyed = false;
+        ~ThreadCache()
+        {
+            // messages freed later during thread exit go straight to the heap
+            mDestroyed = true;
+            for (size_t i = 0; i < kMaxBlockSize/kGranularity; i++)
+            {
+                FreeList& list = mLists[i];
+                while (list.mCount >= kBatchSize)
+                {
+                    releaseBatch(list, sharedLists()[i]);
+                }
+                while (list.mHead)
+                {
+                    Node* node = list.mHead;
+                    list.mHead = node->mNext;
+                    ::operator delete(node);
+                }
+                list.mCount = 0;
+            }
+        }
+    };
+    /** Moves kBatchSize blocks from the head of \c list to the shared pool, or to the heap
+     * if the shared pool is full */
+    static void releaseBatch(FreeList& list, SharedList& shared)
+    {
+        Node* batch = list.mHead;
+        Node* last = batch;
+        for (unsigned i = 1; i < kBatchSize; i++)
+        {
+            last = last->mNext;
+        }
+        list.mHead = last->mNext;
+        list.mCount -= kBatchSize;
+        last->mNext = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(shared.mMutex);
+            if (shared.mCount < kMaxSharedBatches)
+            {
+                batch->mNextBatch = shared.mBatches;
+                shared.mBatches = batch;
+                shared.mCount++;
+                return;
+            }
+        }
+        while (batch)
+        {
+            Node* node = batch;
+            batch = batch->mNext;
+            ::operator delete(node);
+        }
+    }
+    static size_t blockSize(size_t size)
+    {
+        return ((size + kGranularity - 1) / kGranularity) * kGranularity;
+    }
+    static ThreadCache& threadCache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+    static SharedList* sharedLists()
+    {
+        // Never destroyed, as messages may still be freed by other threads during static destruction
+        static SharedList* lists = new SharedList[kMaxBlockSize/kGranularity];
+        return lists;
+    }
+};
+
+/** Base for message types that are allocated from the MsgPool. Deleting them
+ * must be done via a pointer to the most derived type */
+struct MsgPoolAllocated
+{
+    static void* operator new(size_t size) { return MsgPool::alloc(size); }
+    static void operator delete(void* ptr, size_t size) { MsgPool::free(ptr, size); }
+};
+}
+#endif
@@ -4,11 +4,94 @@
 
 #include <asyncTest-framework.h>
 #define PROMISE_ON_UNHANDLED_ERROR testUnhandledError
+#define PROMISE_POOL_STATS
 #include <promise.h>
+#include <chrono>
 
 TESTS_INIT();
 using namespace promise;
 
+/** Runs \c func \c count times after a warm-up run that fills the promise pool.
+ * Prints and returns the number of blocks that the pool took from the heap per run */
+template <class F>
+size_t benchAllocs(const char* name, F&& func, size_t count = 100000)
+{
+    func();
+    auto start = std::chrono::steady_clock::now();
+    size_t allocsBefore = Pool::heapAllocs();
+    for (size_t i = 0; i < count; i++)
+    {
+        func();
+    }
+    size_t allocs = Pool::heapAllocs() - allocsBefore;
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    printf("%s: %.2f allocations/chain, %lld ns/chain\n", name, (double)allocs / count, (long long)(elapsed / count));
+    return allocs / count;
+}
+
+#ifdef __cpp_impl_coroutine
+#define PROMISE_CORO_NO_KARERE
+#include <promiseCoro.h>
+
+/** Mimics the shape of ProtocolHandler::msgDecrypt(): fetch the key, then the
+ * sender's public key, then decrypt, checking that the handler is still alive */
+struct DecryptBench: public karere::DeleteTrackable
+{
+    Promise<int> mKey;
+    Promise<int> mPubKey;
+    Promise<int> getKey() { return mKey; }
+    Promise<int> getPubKey() { return mPubKey; }
+    Promise<int> decryptLambda(int msg)
+    {
+        auto wptr = weakHandle();
+        return getKey()
+        .then([this, wptr, msg](int key)
+        {
+            wptr.throwIfDeleted();
+            return getPubKey()
+            .then([wptr, msg, key](int pubkey)
+            {
+                wptr.throwIfDeleted();
+                return msg + key + pubkey;
+            });
+        });
+    }
+    Promise<int> decryptCoro(int msg)
+    {
+        co_await co::context(nullptr, nullptr, weakHandle());
+        int key = co_await getKey();
+        int pubkey = co_await getPubKey();
+        co_return msg + key + pubkey;
+    }
+};
+
+Promise<void> coroAwaitVoid(Promise<void> pms, int& steps)
+{
+    steps++;
+    co_await pms;
+    steps++;
+}
+
+Promise<int> coroAwaitFail(Promise<int> pms)
+{
+    try
+    {
+        co_await pms;
+    }
+    catch(Error& err)
+    {
+        co_return err.code();
+    }
+    co_return 0;
+}
+
+Promise<int> coroThrow()
+{
+    co_await Promise<void>(_Void());
+    throw std::runtime_error("coroutine exception");
+}
+#endif
+
 std::function<void(const std::string&, int, int)> gUnhandledHandler =
 [](const std::string& msg, int type, int code)
 {
@@ -630,5 +713,162 @@ TestGroup("Unhandled promise fail")
     });
 });
 
+TestGroup("Allocations")
+{
+    syncTest("Chain on an already resolved promise should not allocate")
+    {
+        int result = 0;
+        size_t allocs = benchAllocs("resolved then->then", [&result]()
+        {
+            Promise<int> pms(1);
+            pms.then([](int a)
+            {
+                return a + 1;
+            })
+            .then([&result](int a)
+            {
+                result = a;
+            });
+        });
+        check(result == 2);
+        check(allocs == 0);
+    });
+    syncTest("Chain on a pending promise should not allocate")
+    {
+        int result = 0;
+        size_t allocs = benchAllocs("pending then->then->fail", [&result]()
+        {
+            Promise<int> pms;
+            pms.then([](int a)
+            {
+                return a + 1;
+            })
+            .then([&result](int a)
+            {
+                result = a;
+            })
+            .fail([](const Error& err)
+            {
+                return err;
+            });
+            pms.resolve(1);
+        });
+        check(result == 2);
+        check(allocs == 0);
+    });
+    syncTest("Chain returning a pending promise should not allocate")
+    {
+        int result = 0;
+        size_t allocs = benchAllocs("pending then(ret promise)->then", [&result]()
+        {
+            Promise<int> pms;
+            Promise<int> inner;
+            pms.then([inner](int a)
+            {
+                return inner;
+            })
+            .then([&result](int a)
+            {
+                result = a;
+            });
+            pms.resolve(1);
+            inner.resolve(3);
+        });
+        check(result == 3);
+        check(allocs == 0);
+    });
+    syncTest("Rejected chain should not allocate")
+    {
+        int result = 0;
+        size_t allocs = benchAllocs("pending reject->then->fail", [&result]()
+        {
+            Promise<int> pms;
+            pms.then([](int a)
+            {
+                return a + 1;
+            })
+            .fail([&result](const Error& err)
+            {
+                result = err.code();
+                return 0;
+            });
+            pms.reject("short", 5, 1);
+        });
+        check(result == 5);
+        check(allocs == 0);
+    });
+});
+
+#ifdef __cpp_impl_coroutine
+TestGroup("Coroutines")
+{
+    syncTest("co_await pending Promise<void>")
+    {
+        int steps = 0;
+        Promise<void> pms;
+        auto ret = coroAwaitVoid(pms, steps);
+        check(steps == 1 && !ret.done());
+        pms.resolve();
+        check(steps == 2 && ret.succeeded());
+    });
+    syncTest("co_await rejected promise throws its error")
+    {
+        Promise<int> pms;
+        auto ret = coroAwaitFail(pms);
+        pms.reject("test", 7, 1);
+        check(ret.succeeded() && ret.value() == 7);
+        auto ret2 = coroAwaitFail(Promise<int>(Error("test", 8, 1)));
+        check(ret2.succeeded() && ret2.value() == 8);
+    });
+    syncTest("Exception in coroutine rejects the returned promise")
+    {
+        auto ret = coroThrow();
+        check(ret.failed() && ret.error().msg() == "coroutine exception");
+        ret.error().setHandled();
+    });
+    syncTest("Coroutine is aborted if its owner is deleted")
+    {
+        auto bench = new DecryptBench;
+        auto ret = bench->decryptCoro(1);
+        auto key = bench->mKey;
+        delete bench;
+        key.resolve(1);
+        check(ret.failed() && ret.error().code() == kErrAbort);
+        ret.error().setHandled();
+    });
+    syncTest("Decrypt path: lambda chain vs coroutine")
+    {
+        DecryptBench bench;
+        bench.mKey = Promise<int>(10);
+        bench.mPubKey = Promise<int>(20);
+        int result = 0;
+        benchAllocs("decrypt, cached keys, lambdas", [&]() { result = bench.decryptLambda(5).value(); });
+        check(result == 35);
+        result = 0;
+        benchAllocs("decrypt, cached keys, coroutine", [&]() { result = bench.decryptCoro(5).value(); });
+        check(result == 35);
+
+        auto pending = [&](Promise<int>(DecryptBench::*method)(int))
+        {
+            bench.mKey = Promise<int>();
+            bench.mPubKey = Promise<int>();
+            auto ret = (bench.*method)(5);
+            ret.then([&result](int value)
+            {
+                result = value;
+            });
+            bench.mKey.resolve(10);
+            bench.mPubKey.resolve(20);
+        };
+        result = 0;
+        benchAllocs("decrypt, pending keys, lambdas", [&]() { pending(&DecryptBench::decryptLambda); });
+        check(result == 35);
+        result = 0;
+        benchAllocs("decrypt, pending keys, coroutine", [&]() { pending(&DecryptBench::decryptCoro); });
+        check(result == 35);
+    });
+});
+#endif
+
 return test::gNumFailed;
 }
@@ -60,7 +60,150 @@ struct FuncTraits <R(C::*)(Args...)> { typedef R RetType; enum {nargs = sizeof..
 template <class C, class R, class...Args>
 struct FuncTraits <R(C::*)(Args...) const> { typedef R RetType; enum {nargs = sizeof...(Args)};};
 //===
-struct IVirtDtor
+/** @brief Per-thread free lists of small memory blocks. Promises create and destroy
+ * their shared state, callbacks and errors at a high rate, and these objects have
+ * only a few distinct sizes, so recycling the blocks avoids most of the heap
+ * allocations of a promise chain. Blocks freed by a thread go to that thread's
+ * lists, regardless of which thread allocated them.
+ * Define PROMISE_NO_POOL to use the global heap directly, i.e. for memory debugging.
+ * Define PROMISE_POOL_STATS to count the blocks taken from the heap, see heapAllocs().
+ */
+class Pool
+{
+public:
+    enum
+    {
+        kGranularity = 16,
+        /** Big enough for small coroutine frames as well, see promiseCoro.h */
+        kMaxBlockSize = 1024,
+        /** Free blocks above this size in a size class are returned to the heap */
+        kMaxFreeBytes = 64 * 1024
+    };
+    static void* alloc(size_t size)
+    {
+#ifndef PROMISE_NO_POOL
+        if (size && (size <= kMaxBlockSize))
+        {
+            ThreadLists& lists = threadLists();
+            if (!lists.mDestroyed)
+            {
+                FreeList& list = lists.mLists[(size-1)/kGranularity];
+                if (list.mHead)
+                {
+                    Node* node = list.mHead;
+                    list.mHead = node->mNext;
+                    list.mCount--;
+                    return node;
+                }
+            }
+            // the full block size also after our lists are destroyed, as the block
+            // may still be freed to the lists of another thread and reused from there
+            return heapAlloc(blockSize(size));
+        }
+#endif
+        return heapAlloc(size);
+    }
+    static void free(void* ptr, size_t size)
+    {
+        if (!ptr)
+            return;
+#ifndef PROMISE_NO_POOL
+        if (size && (size <= kMaxBlockSize))
+        {
+            ThreadLists& lists = threadLists();
+            FreeList& list = lists.mLists[(size-1)/kGranularity];
+            if (!lists.mDestroyed && (list.mCount < kMaxFreeBytes / blockSize(size)))
+            {
+                Node* node = static_cast<Node*>(ptr);
+                node->mNext = list.mHead;
+                list.mHead = node;
+                list.mCount++;
+                return;
+            }
+        }
+#endif
+        ::operator delete(ptr);
+    }
+#ifdef PROMISE_POOL_STATS
+    /** Number of blocks allocated from the heap by the current thread, i.e. for tests
+     * to check that a promise chain is served from the free lists */
+    static size_t& heapAllocs()
+    {
+        static thread_local size_t count = 0;
+        return count;
+    }
+#endif
+protected:
+    struct Node { Node* mNext; };
+    struct FreeList
+    {
+        Node* mHead = nullptr;
+        unsigned mCount = 0;
+    };
+    struct ThreadLists
+    {
+        FreeList mLists[kMaxBlockSize/kGranularity];
+        bool mDestroyed = false;
+        ~ThreadLists()
+        {
+            // promises destroyed later during thread exit go straight to the heap
+            mDestroyed = true;
+            for (auto& list: mLists)
+            {
+                while (list.mHead)
+                {
+                    Node* node = list.mHead;
+                    list.mHead = node->mNext;
+                    ::operator delete(node);
+                }
+                list.mCount = 0;
+            }
+        }
+    };
+    static size_t blockSize(size_t size)
+    {
+        return ((size + kGranularity - 1) / kGranularity) * kGranularity;
+    }
+    static void* heapAlloc(size_t size)
+    {
+#ifdef PROMISE_POOL_STATS
+        heapAllocs()++;
+#endif
+        return ::operator new(size);
+    }
+    static ThreadLists& threadLists()
+    {
+        static thread_local ThreadLists lists;
+        return lists;
+    }
+};
+
+/** @brief Base for the objects that are allocated from the Pool */
+struct PoolAllocated
+{
+    static void* operator new(size_t size) { return Pool::alloc(size); }
+    static void operator delete(void* ptr, size_t size) { Pool::free(ptr, size); }
+};
+
+/** @brief Standard allocator on top of the Pool, for std::allocate_shared() */
+template <class T>
+struct PoolAllocator
+{
+    typedef T value_type;
+    template <class U>
+    struct rebind { typedef PoolAllocator<U> other; };
+    PoolAllocator(){}
+    template <class U>
+    PoolAllocator(const PoolAllocator<U>&){}
+    T* allocate(size_t n) { return static_cast<T*>(Pool::alloc(n * sizeof(T))); }
+    void deallocate(T* ptr, size_t n) { Pool::free(ptr, n * sizeof(T)); }
+    template <class U>
+    bool operator==(const PoolAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const PoolAllocator<U>&) const { return false; }
+};
+
+struct IVirtDtor: public PoolAllocated
 {  virtual ~IVirtDtor() {}  };
 
 template <class T>
@@ -108,10 +251,10 @@ protected:
 public:
     typedef std::shared_ptr<ErrorShared> Base;
     Error(const std::string& msg, int code=-1, int type=kErrorTypeGeneric)
-        :Base(std::make_shared<ErrorShared>(msg, code, type))
+        :Base(std::allocate_shared<ErrorShared>(PoolAllocator<ErrorShared>(), msg, code, type))
     {}
     Error(const char* msg, int code=-1, int type=kErrorTypeGeneric)
-        :Base(std::make_shared<ErrorShared>(msg?msg:"", code, type))
+        :Base(std::allocate_shared<ErrorShared>(PoolAllocator<ErrorShared>(), msg?msg:"", code, type))
     {}
     using Base::operator=;
     const std::string& msg() const {return get()->mMsg;}
@@ -141,7 +284,10 @@ template <class C>
 class CallbackList
 {
 protected:
-    std::vector<C*> items;
+    //Almost all promises have a single continuation, so the first callback is stored
+    //inline, and only the following ones go to the vector, which doesn't allocate while empty
+    C* mFirst = nullptr;
+    std::vector<C*> mRest;
 public:
     CallbackList(){}
 /**
@@ -153,45 +299,70 @@ public:
     template<class SP>
     inline void push(SP& cb)
     {
-        items.push_back(cb.release());
+        if (!mFirst)
+        {
+            mFirst = cb.release();
+        }
+        else
+        {
+            mRest.push_back(cb.get());
+            cb.release();
+        }
     }
 
     inline C*& operator[](int idx)
     {
-        assert((idx >= 0) && (idx < items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < count()));
+        return idx ? mRest[idx-1] : mFirst;
     }
-    inline const C*& operator[](int idx) const
+    inline C* const& operator[](int idx) const
     {
-        assert((idx >= 0) && (idx < items.size()));
-        return items[idx];
+        assert((idx >= 0) && (idx < count()));
+        return idx ? mRest[idx-1] : mFirst;
     }
     inline C*& first()
     {
-        assert(!items.empty());
-        return items[0];
+        assert(mFirst);
+        return mFirst;
     }
     inline int count() const
     {
-        return items.size();
+        return mFirst ? (int)mRest.size()+1 : 0;
     }
+    /** Moves the callbacks of \c other to the end of this list, without deleting them */
     inline void addListMoveItems(CallbackList& other)
     {
-        items.insert(items.end(), other.items.begin(), other.items.end());
-        other.clear();
+        if (!other.mFirst)
+            return;
+        if (!mFirst)
+        {
+            mFirst = other.mFirst;
+            mRest.swap(other.mRest);
+        }
+        else
+        {
+            mRest.push_back(other.mFirst);
+            mRest.insert(mRest.end(), other.mRest.begin(), other.mRest.end());
+        }
+        other.mFirst = nullptr;
+        other.mRest.clear();
     }
     void clear()
     {
         static_assert(std::is_base_of<IVirtDtor, C>::value, "Callback type must be inherited from IVirtDtor");
-        for (auto it = items.begin(); it != items.end(); it++)
+        if (!mFirst)
+            return;
+        delete ((IVirtDtor*)mFirst); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+        mFirst = nullptr;
+        for (auto it = mRest.begin(); it != mRest.end(); it++)
         {
-            delete ((IVirtDtor*)*it); //static_cast wont work here because there is no info that ICallback inherits from IVirtDtor
+            delete ((IVirtDtor*)*it);
         }
-        items.clear();
+        mRest.clear();
     }
     ~CallbackList()
     {
-        assert(items.empty());
+        assert(!mFirst && mRest.empty());
     }
 };
 
@@ -256,7 +427,7 @@ protected:
         return new Callback<typename MaskVoid<P>::type, CB, TP>(std::forward<CB>(cb), next);
     }
 //===
-    struct SharedObj
+    struct SharedObj: public PoolAllocated
     {
         struct CbLists
         {
@@ -264,14 +435,14 @@ protected:
             CallbackList<IFailCb> mFailCbs;
         };
         int mRefCount;
-        CbLists* mCbs;
+        CbLists mCbs;
         ResolvedState mResolved;
         bool mPending;
         Promise<T> mMaster;
         typename MaskVoid<typename std::remove_const<T>::type>::type mResult;
         Error mError;
         SharedObj()
-        :mRefCount(1), mCbs(NULL), mResolved(kNotResolved),
+        :mRefCount(1), mResolved(kNotResolved),
          mPending(false), mMaster(_Empty())
         {
             PROMISE_LOG_REF("%p: addRef -> 1 (SharedObj ctor)", this);
@@ -294,18 +465,13 @@ protected:
         }
         ~SharedObj()
         {
-            if (mCbs)
-            {
-                mCbs->mSuccessCbs.clear();
-                mCbs->mFailCbs.clear();
-                delete mCbs;
-            }
+            mCbs.mSuccessCbs.clear();
+            mCbs.mFailCbs.clear();
         }
-        inline CbLists& cbs()
+        inline CbLists& cbs() { return mCbs; }
+        inline bool hasCallbacks() const
         {
-            if (!mCbs)
-                mCbs = new CbLists;
-            return *mCbs;
+            return mCbs.mSuccessCbs.count() || mCbs.mFailCbs.count();
         }
     };
 
@@ -450,6 +616,34 @@ protected:
         return ret;
     }
 
+/** Calls a then() or fail() handler, converting any exception thrown by it to a
+ * rejected promise. \c In is the type of the callback's parameter, \c Out is its
+ * return type, \c CB is the type of the callback itself.
+ */
+    template <typename In, typename Out, typename RealOut, class CB>
+    static Promise<Out> callCb(CB& cb, const In& arg)
+    {
+        try
+        {
+            return CallCbHandleVoids::template call<Out, RealOut, In>(cb, arg);
+        }
+        catch(std::exception& e)
+        {
+            return Error(e.what(), kErrException);
+        }
+        catch(Error& e)
+        {
+            return e;
+        }
+        catch(const char* e)
+        {
+            return Error(e, kErrException);
+        }
+        catch(...)
+        {
+            return Error("(unknown exception type)", kErrException);
+        }
+    }
 /** Creates a wrapper function around a then() or fail() handler that handles exceptions and propagates
  * the result to resolve/reject chained promises. \c In is the type of the callback's parameter,
  * \c Out is its return type, \c CB is the type of the callback itself.
@@ -463,31 +657,7 @@ protected:
             mutable->void
         {
             Promise<Out>& next = handler.nextPromise; //the 'chaining' promise
-            Promise<Out> promise((_Empty())); //the promise returned by the user callback
-            try
-            {
-                promise = CallCbHandleVoids::template call<Out, RealOut, In>(cb, result);
-            }
-            catch(std::exception& e)
-            {
-                next.reject(Error(e.what(), kErrException));
-                return;
-            }
-            catch(Error& e)
-            {
-                next.reject(e);
-                return;
-            }
-            catch(const char* e)
-            {
-                next.reject(Error(e, kErrException));
-                return;
-            }
-            catch(...)
-            {
-                next.reject(Error("(unknown exception type)", kErrException));
-                return;
-            }
+            Promise<Out> promise = callCb<In, Out, RealOut>(cb, result); //the promise returned by the user callback
 
 // connect the promise returned by the user's callback (actually its master)
 // to the chaining promise, returned earlier by then() or fail()
@@ -496,21 +666,8 @@ protected:
             next.mSharedObj->mMaster = master; //makes 'next' attach subsequently added callbacks to 'master'
             assert(next.hasMaster());
             // Move the callbacks and errbacks of 'next' to 'master'
-            if (!master.hasCallbacks())
-            {
-                master.mSharedObj->mCbs = next.mSharedObj->mCbs;
-                next.mSharedObj->mCbs = nullptr;
-            }
-            else
-            {
-                auto& nextCbs = next.thenCbs();
-                if (nextCbs.count())
-                    master.thenCbs().addListMoveItems(nextCbs);
-
-                auto& nextEbs = next.failCbs();
-                if (nextEbs.count())
-                    master.failCbs().addListMoveItems(nextEbs);
-            }
+            master.thenCbs().addListMoveItems(next.thenCbs());
+            master.failCbs().addListMoveItems(next.failCbs());
             //====
             if (master.mSharedObj->mPending)
                 master.doPendingResolveOrFail();
@@ -534,21 +691,19 @@ public:
             return mSharedObj->mError;
 
         typedef typename RemovePromise<typename FuncTraits<F>::RetType>::Type Out;
-        Promise<Out> next;
-
-        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
-            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
-
         if (mSharedObj->mResolved == kSucceeded)
         {
-            (*resolveCb)(mSharedObj->mResult);
-        }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            thenCbs().push(resolveCb);
+            //fast path: the promise returned by the callback is the chained one,
+            //no need to store the callback or create an intermediate promise
+            return callCb<typename MaskVoid<T>::type, Out, typename FuncTraits<F>::RetType>(cb, mSharedObj->mResult);
         }
 
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<Out> next;
+        std::unique_ptr<ISuccessCb> resolveCb(createChainedCb<typename MaskVoid<T>::type, Out,
+            typename FuncTraits<F>::RetType>(std::forward<F>(cb), next));
+        thenCbs().push(resolveCb);
+
         return next;
     }
 /** Adds a handler to be executed in case the promise is rejected
@@ -571,20 +726,19 @@ public:
         if (mSharedObj->mResolved == kSucceeded)
             return mSharedObj->mResult; //don't call the errorback, just return the successful resolve value
 
-        Promise<T> next;
-        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
-            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
-
         if (mSharedObj->mResolved == kFailed)
         {
-            (*failCb)(mSharedObj->mError);
+            //fast path, same as in then()
+            Promise<T> ret = callCb<Error, T, typename FuncTraits<F>::RetType>(eb, mSharedObj->mError);
             mSharedObj->mError.setHandled();
+            return ret;
         }
-        else
-        {
-            assert((mSharedObj->mResolved == kNotResolved));
-            failCbs().push(failCb);
-        }
+
+        assert((mSharedObj->mResolved == kNotResolved));
+        Promise<T> next;
+        std::unique_ptr<IFailCb> failCb(createChainedCb<Error, T,
+            typename FuncTraits<F>::RetType>(std::forward<F>(eb), next));
+        failCbs().push(failCb);
 
         return next;
     }
@@ -610,7 +764,7 @@ public:
     }
 
 protected:
-    inline bool hasCallbacks() const { return (mSharedObj->mCbs!=NULL); }
+    inline bool hasCallbacks() const { return mSharedObj->hasCallbacks(); }
     void doResolve(const typename MaskVoid<T>::type& val)
     {
         auto& cbs = thenCbs();
@@ -0,0 +1,278 @@
+#ifndef _PROMISE_CORO_H
+#define _PROMISE_CORO_H
+
+/* C++20 coroutine support for promise::Promise.
+ *
+ * This is opt-in: only code that includes this header needs to be built with
+ * coroutines enabled (i.e. -std=c++20), the rest of the library keeps building as C++11.
+ * Any function returning a Promise<T> can be written as a coroutine, and a
+ * Promise<T> can be co_await-ed inside it. Awaiting a rejected promise throws its
+ * promise::Error, and any exception escaping the coroutine rejects the returned promise,
+ * the same as with then()/fail() callbacks:
+ *
+ *     promise::Promise<chatd::Message*> ProtocolHandler::msgDecrypt(chatd::Message* message)
+ *     {
+ *         co_await karere::coContext(appCtx, weakHandle());
+ *         auto key = co_await getKey(UserKeyId(message->userid, message->keyid));
+ *         auto edKey = co_await mUserAttrCache.getAttr(message->userid, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY);
+ *         ...
+ *         co_return message;
+ *     }
+ *
+ * By default a coroutine that awaits a pending promise is resumed synchronously, from the
+ * resolve()/reject() call. When a context is awaited at the start of the coroutine, resumption
+ * is posted through its post function instead (for karere: marshallCall() on the app context),
+ * and if the context has an owner, the coroutine is aborted instead of resumed if the owner
+ * has been deleted in the meantime - there is no need to check weakHandle() after each step.
+ * Coroutine frames are allocated from the promise::Pool.
+ */
+
+#if !defined(__cpp_impl_coroutine)
+    #error "promiseCoro.h requires a compiler with C++20 coroutines enabled"
+#endif
+
+#include <coroutine>
+#include <optional>
+#include "promise.h"
+#include "trackDelete.h"
+
+namespace promise
+{
+namespace co
+{
+class PromiseTypeBase;
+
+/** Posts the resumption of a coroutine to the thread that owns \c ctx. The posted call
+ * must call \c PromiseTypeBase::resumeNow() on \c coro
+ */
+typedef void(*PostFunc)(void* ctx, PromiseTypeBase* coro);
+
+/** @brief Execution context of a coroutine. Awaiting it doesn't suspend, it only
+ * configures how the coroutine is resumed after that */
+struct Context
+{
+    PostFunc mPost = nullptr;
+    void* mCtx = nullptr;
+    std::optional<karere::DeleteTrackable::Handle> mOwner;
+};
+
+inline Context context(PostFunc post, void* ctx)
+{
+    Context ret;
+    ret.mPost = post;
+    ret.mCtx = ctx;
+    return ret;
+}
+
+inline Context context(PostFunc post, void* ctx, const karere::DeleteTrackable::Handle& owner)
+{
+    Context ret = context(post, ctx);
+    ret.mOwner.emplace(owner);
+    return ret;
+}
+
+template <class P>
+struct IsPromise: public std::false_type {};
+template <class U>
+struct IsPromise<Promise<U>>: public std::true_type {};
+
+/** Common part of the coroutine promise types, independent of the result type */
+class PromiseTypeBase
+{
+protected:
+    Context mContext;
+    std::coroutine_handle<> mHandle;
+    virtual void abort(const Error& err) = 0;
+public:
+    virtual ~PromiseTypeBase() {}
+    static void* operator new(size_t size) { return Pool::alloc(size); }
+    static void operator delete(void* ptr, size_t size) { Pool::free(ptr, size); }
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+
+    /** Called when an awaited promise is resolved or rejected */
+    void resume()
+    {
+        if (mContext.mPost)
+            mContext.mPost(mContext.mCtx, this);
+        else
+            resumeNow();
+    }
+    /** Resumes the coroutine in the current thread, or aborts it if its owner has been deleted */
+    void resumeNow()
+    {
+        if (mContext.mOwner && mContext.mOwner->deleted())
+        {
+            abort(Error("Coroutine aborted: owner has been deleted", kErrAbort));
+            mHandle.destroy();
+            return;
+        }
+        mHandle.resume();
+    }
+
+    template <class U>
+    struct Awaiter
+    {
+        Promise<U> mPromise;
+        PromiseTypeBase& mCoro;
+        bool await_ready() const { return mPromise.done() != kNotResolved; }
+        void await_suspend(std::coroutine_handle<>)
+        {
+            PromiseTypeBase* coro = &mCoro;
+            attach(mPromise, coro);
+            mPromise.fail([coro](const Error& err)
+            {
+                coro->resume();
+                return err;
+            });
+        }
+        U await_resume()
+        {
+            if (mPromise.failed())
+            {
+                Error err = mPromise.error();
+                err.setHandled();
+                throw err;
+            }
+            return value(mPromise);
+        }
+    protected:
+        template <class V>
+        static void attach(Promise<V>& pms, PromiseTypeBase* coro)
+        {
+            pms.then([coro](const V& ret)
+            {
+                coro->resume();
+                return ret;
+            });
+        }
+        static void attach(Promise<void>& pms, PromiseTypeBase* coro)
+        {
+            pms.then([coro]()
+            {
+                coro->resume();
+            });
+        }
+        template <class V>
+        static V value(Promise<V>& pms) { return pms.value(); }
+        static void value(Promise<void>&) {}
+    };
+
+    template <class U>
+    Awaiter<U> await_transform(const Promise<U>& pms)
+    {
+        return Awaiter<U>{pms, *this};
+    }
+    std::suspend_never await_transform(const Context& ctx)
+    {
+        mContext.mPost = ctx.mPost;
+        mContext.mCtx = ctx.mCtx;
+        mContext.mOwner.reset();
+        if (ctx.mOwner)
+            mContext.mOwner.emplace(*ctx.mOwner);
+        return {};
+    }
+    /** Any other awaitable is used as is */
+    template <class A, class=typename std::enable_if<!IsPromise<typename std::decay<A>::type>::value
+        && !std::is_same<typename std::decay<A>::type, Context>::value>::type>
+    A&& await_transform(A&& awaitable)
+    {
+        return std::forward<A>(awaitable);
+    }
+};
+
+/** Result part of the coroutine promise type, different for void and non-void results */
+template <class T>
+class PromiseTypeResult: public PromiseTypeBase
+{
+protected:
+    Promise<T> mResult;
+public:
+    template <class V>
+    void return_value(V&& val)
+    {
+        mResult.resolve(std::forward<V>(val));
+    }
+};
+
+template <>
+class PromiseTypeResult<void>: public PromiseTypeBase
+{
+protected:
+    Promise<void> mResult;
+public:
+    void return_void()
+    {
+        mResult.resolve();
+    }
+};
+
+template <class T>
+class PromiseType: public PromiseTypeResult<T>
+{
+protected:
+    virtual void abort(const Error& err)
+    {
+        if (!this->mResult.done())
+            this->mResult.reject(err);
+    }
+public:
+    Promise<T> get_return_object()
+    {
+        this->mHandle = std::coroutine_handle<PromiseType>::from_promise(*this);
+        return this->mResult;
+    }
+    void unhandled_exception()
+    {
+        try
+        {
+            throw;
+        }
+        catch(Error& e)
+        {
+            this->mResult.reject(e);
+        }
+        catch(std::exception& e)
+        {
+            this->mResult.reject(Error(e.what(), kErrException));
+        }
+        catch(const char* e)
+        {
+            this->mResult.reject(Error(e, kErrException));
+        }
+        catch(...)
+        {
+            this->mResult.reject(Error("(unknown exception type)", kErrException));
+        }
+    }
+};
+}
+}
+
+template <class T, class... Args>
+struct std::coroutine_traits<promise::Promise<T>, Args...>
+{
+    typedef promise::co::PromiseType<T> promise_type;
+};
+
+#ifndef PROMISE_CORO_NO_KARERE
+#include "gcmpp.h"
+
+namespace karere
+{
+/** @brief Context for coroutines running on the karere thread: they are resumed
+ * via marshallCall(), and aborted if \c owner has been deleted. Await it at the start
+ * of the coroutine: co_await karere::coContext(appCtx, weakHandle());
+ */
+inline promise::co::Context coContext(void* appCtx, const DeleteTrackable::Handle& owner)
+{
+    return promise::co::context([](void* ctx, promise::co::PromiseTypeBase* coro)
+    {
+        marshallCall([coro]() { coro->resumeNow(); }, ctx);
+    }, appCtx, owner);
+}
+}
+#endif
+
+#endif
@@ -6,6 +6,11 @@
 #include <karereCommon.h>
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
 
 #define RETRY_DEBUG_LOGGING 1
 
@@ -76,6 +81,225 @@ public:
 template <typename CB> inline static void callFuncIfNotNull(const CB& cb) { cb(); }
 inline static void callFuncIfNotNull(std::nullptr_t){}
 
+/** @brief
+ * Client-wide coordinator of the RetryControllers of the connections to the servers
+ * (presenced and the chatd shards), so that they don't all reconnect at once when
+ * the network comes back:
+ * - Limits the number of attempts in progress at the same time. The attempts that
+ * don't get a slot are queued, and started by priority (i.e. the shards of the chats
+ * open in the app go first)
+ * - Calculates the wait time between attempts with "decorrelated jitter", so that
+ * the attempts of all the connections, and of all the clients, spread over time
+ * - When an attempt succeeds, the network is assumed to be back, and the attempts
+ * waiting for their backoff timer are queued right away
+ * - Keeps stats of the attempts and of the time it takes to reconnect
+ * A RetryController uses it if \c setScheduler() is called before starting it.
+ */
+class ReconnectScheduler: public karere::DeleteTrackable
+{
+public:
+    enum
+    {
+        kDefaultMaxConcurrent = 4,
+        /** An attempt that has not finished in this time no longer counts against the limit */
+        kSlotTimeout = 15000,
+        /** Priority of the connections that must go before any other */
+        kPriorityTop = 1 << 30
+    };
+    struct Stats
+    {
+        size_t attempts = 0;            /** attempts started */
+        size_t failures = 0;            /** attempts that failed or timed out */
+        size_t slotTimeouts = 0;        /** attempts that held their slot for more than kSlotTimeout */
+        size_t reconnects = 0;          /** retry sequences that succeeded */
+        size_t wakeups = 0;             /** attempts queued before the end of their backoff */
+        size_t maxQueued = 0;           /** max number of attempts waiting for a slot at once */
+        int64_t totalQueueWaitMs = 0;   /** total time the attempts waited for a slot */
+        int64_t lastReconnectMs = 0;    /** duration of the last successful retry sequence */
+        int64_t maxReconnectMs = 0;
+        int64_t totalReconnectMs = 0;   /** divide by \c reconnects for the mean */
+    };
+    typedef std::function<void()> StartFunc;
+
+    ReconnectScheduler(void *ctx, unsigned maxConcurrent = kDefaultMaxConcurrent)
+        : mAppCtx(ctx), mMaxConcurrent(maxConcurrent ? maxConcurrent : 1), mRng(std::random_device()())
+    {}
+    ~ReconnectScheduler()
+    {
+        for (auto& slot: mRunning)
+        {
+            cancelTimeout(slot.second, mAppCtx);
+        }
+    }
+    void setMaxConcurrent(unsigned maxConcurrent)
+    {
+        mMaxConcurrent = maxConcurrent ? maxConcurrent : 1;
+        dispatch();
+    }
+    unsigned maxConcurrent() const { return mMaxConcurrent; }
+    size_t running() const { return mRunning.size(); }
+    size_t queued() const { return mQueue.size(); }
+    const Stats& stats() const { return mStats; }
+
+    /** @brief Queues an attempt with the given \c priority (higher first, FIFO among equals).
+     * It's started via \c func from \c dispatch(), which must be called after storing
+     * the returned id, as \c func may need it.
+     * @return The id of the attempt, to pass to \c done() when it finishes, or to \c cancel()
+     */
+    unsigned enqueue(const std::string& name, int priority, StartFunc&& func)
+    {
+        unsigned id = ++mLastId;
+        auto it = mQueue.begin();
+        while (it != mQueue.end() && it->priority >= priority)
+        {
+            it++;
+        }
+        mQueue.emplace(it, Request{id, priority, timestampMs(), name, std::move(func)});
+        if (mQueue.size() > mStats.maxQueued)
+        {
+            mStats.maxQueued = mQueue.size();
+        }
+        return id;
+    }
+    /** @brief Starts the queued attempts, while there are free slots */
+    void dispatch()
+    {
+        if (mDispatching)
+            return;    // called from the start of an attempt, the loop below continues
+
+        mDispatching = true;
+        while (!mQueue.empty() && mRunning.size() < mMaxConcurrent)
+        {
+            Request req = std::move(mQueue.front());
+            mQueue.pop_front();
+            auto wptr = weakHandle();
+            unsigned id = req.id;
+            mRunning[id] = setTimeout([this, wptr, id]()
+            {
+                if (wptr.deleted())
+                    return;
+                if (mRunning.erase(id))
+                {
+                    KR_LOG_WARNING("ReconnectScheduler: attempt %u has not finished in %d ms, releasing its slot", id, kSlotTimeout);
+                    mStats.slotTimeouts++;
+                    dispatch();
+                }
+            }, kSlotTimeout, mAppCtx);
+            mStats.attempts++;
+            mStats.totalQueueWaitMs += timestampMs() - req.queuedTs;
+            KR_LOG_DEBUG("ReconnectScheduler: starting attempt %u of %s (%zu running, %zu queued)",
+                         id, req.name.c_str(), mRunning.size(), mQueue.size());
+            req.func();
+        }
+        mDispatching = false;
+    }
+    /** @brief The attempt \c id has finished, which frees its slot.
+     * @param retryStartTs When the retry sequence of the attempt started (for the stats)
+     */
+    void done(unsigned id, bool success, int64_t retryStartTs)
+    {
+        if (success)
+        {
+            int64_t elapsed = timestampMs() - retryStartTs;
+            mStats.reconnects++;
+            mStats.lastReconnectMs = elapsed;
+            mStats.totalReconnectMs += elapsed;
+            if (elapsed > mStats.maxReconnectMs)
+            {
+                mStats.maxReconnectMs = elapsed;
+            }
+            wakeWaiting();
+        }
+        else
+        {
+            mStats.failures++;
+        }
+        release(id);
+    }
+    /** @brief Removes a queued attempt, or frees the slot of a running one, without stats */
+    void cancel(unsigned id)
+    {
+        for (auto it = mQueue.begin(); it != mQueue.end(); it++)
+        {
+            if (it->id == id)
+            {
+                mQueue.erase(it);
+                return;
+            }
+        }
+        release(id);
+    }
+    /** @brief Registers an attempt waiting for its backoff timer. \c wake is called
+     * (at most once) to start it earlier, when another attempt succeeds
+     * @return The id to pass to \c removeWaiting() when the attempt no longer waits
+     */
+    unsigned addWaiting(StartFunc&& wake)
+    {
+        unsigned id = ++mLastId;
+        mWaiting[id] = std::move(wake);
+        return id;
+    }
+    void removeWaiting(unsigned id) { mWaiting.erase(id); }
+    /** @brief The wait time before the next attempt: a random value between \c base and
+     * three times the previous wait, capped at \c cap
+     */
+    unsigned backoff(unsigned prevWait, unsigned base, unsigned cap)
+    {
+        if (!base)
+            return 0;
+        uint64_t high = std::max<uint64_t>(base, (uint64_t)prevWait * 3);
+        uint64_t wait = std::uniform_int_distribution<uint64_t>(base, high)(mRng);
+        return (unsigned)std::min<uint64_t>(wait, cap);
+    }
+
+protected:
+    struct Request
+    {
+        unsigned id;
+        int priority;
+        int64_t queuedTs;
+        std::string name;
+        StartFunc func;
+    };
+    void *mAppCtx;
+    unsigned mMaxConcurrent;
+    unsigned mLastId = 0;
+    bool mDispatching = false;
+    std::list<Request> mQueue;
+    std::map<unsigned, megaHandle> mRunning; // id of the attempt -> its slot timeout timer
+    std::map<unsigned, StartFunc> mWaiting;
+    Stats mStats;
+    std::mt19937 mRng;
+
+    void wakeWaiting()
+    {
+        if (mWaiting.empty())
+            return;
+
+        KR_LOG_DEBUG("ReconnectScheduler: an attempt succeeded, queueing %zu waiting attempts", mWaiting.size());
+        std::map<unsigned, StartFunc> waiting;
+        waiting.swap(mWaiting);
+        mStats.wakeups += waiting.size();
+        // they are queued by priority, and started by the next dispatch()
+        bool wasDispatching = mDispatching;
+        mDispatching = true;
+        for (auto& wait: waiting)
+        {
+            wait.second();
+        }
+        mDispatching = wasDispatching;
+    }
+    void release(unsigned id)
+    {
+        auto it = mRunning.find(id);
+        if (it == mRunning.end())
+            return;  // its slot timed out
+        cancelTimeout(it->second, mAppCtx);
+        mRunning.erase(it);
+        dispatch();
+    }
+};
+
 /** @brief
  * This is a simple class that retries a promise-returning function call, until the
  * returned promise is resolved (indiating that the operation succeeded), a maximum
@@ -113,11 +337,30 @@ protected:
     unsigned mRestart = 0;
     void *appCtx;
     DeleteTrackable::Handle wptr;
+    ReconnectScheduler* mScheduler = nullptr;
+    std::unique_ptr<DeleteTrackable::Handle> mSchedulerWptr;
+    std::function<int()> mPriorityFunc;
+    unsigned mSlot = 0;         //id of the attempt in the scheduler, while queued or in progress
+    unsigned mWaitId = 0;       //id in the scheduler, while waiting for the backoff timer
+    unsigned mLastWait = 0;
+    int64_t mStartTs = 0;
     
 public:
     /** Gets the output promise that is resolved. */
     promise::Promise<RetType>& getPromise() {return mPromise;}
     void setWaitRandomnessPct(unsigned short pct) { mDelayRandPct = pct; }
+    /** @brief Makes the attempts wait for a free slot of \c scheduler, and uses it
+     * to calculate the wait times between them. Must be called before start().
+     * @param priority Returns the priority of the next attempt in the queue of the
+     * scheduler (called when the attempt is queued). If null, the priority is 0
+     */
+    void setScheduler(ReconnectScheduler& scheduler, std::function<int()>&& priority = nullptr)
+    {
+        assert(mState == kStateNotStarted);
+        mScheduler = &scheduler;
+        mSchedulerWptr.reset(new DeleteTrackable::Handle(scheduler.weakHandle()));
+        mPriorityFunc = std::move(priority);
+    }
     /**
      * @param func - The function that does the operation being retried.
      * This can be a lambda, function object or a C funtion pointer. The function
@@ -145,6 +388,8 @@ public:
     ~RetryController()
     {
         //RETRY_LOG("Deleting RetryController instance");
+        cancelTimer();
+        cancelSlot();
     }
     /** @brief Starts the retry attempts */
     promise::PromiseBase& start(unsigned delay=0)
@@ -152,8 +397,11 @@ public:
         if (mState != kStateNotStarted)
             throw std::runtime_error("RetryController: Already started or not reset after finished");
         assert(mTimer == 0);
+        assert(mSlot == 0);
         mCurrentAttemptId++;
         mCurrentAttemptNo = 1; //mCurrentAttempt increments immediately before the wait delay (if any)
+        mLastWait = 0;
+        mStartTs = timestampMs();
         if (delay)
         {
             mState = kStateRetryWait;
@@ -185,6 +433,7 @@ public:
             return false;
 
         cancelTimer();
+        cancelSlot();
         if ((mState == kStateInProgress) && !std::is_same<CancelFunc, void*>::value)
             callFuncIfNotNull(mCancelFunc);
         mPromise.reject("aborted", promise::kErrAbort, promise::kErrorTypeGeneric);
@@ -234,6 +483,7 @@ public:
         else //kStateRetryWait or kStateNotStarted
         {
             cancelTimer();
+            cancelSlot();
             mState = kStateNotStarted;
             start(delay);
         }
@@ -241,6 +491,11 @@ public:
 protected:
     unsigned calcWaitTime()
     {
+        if (hasScheduler())
+        {
+            mLastWait = mScheduler->backoff(mLastWait, mInitialWaitTime, mMaxSingleWaitTime);
+            return mLastWait;
+        }
         unsigned t = calcWaitTimeNoRandomness();
         unsigned randRange = (t * mDelayRandPct) / 100;
         t = t - randRange + (rand() % 1000) * (randRange * 2) / 1000;
@@ -263,11 +518,40 @@ protected:
     }
     void cancelTimer()
     {
+        if (mWaitId)
+        {
+            if (hasScheduler())
+                mScheduler->removeWaiting(mWaitId);
+            mWaitId = 0;
+        }
         if (!mTimer)
             return;
         cancelTimeout(mTimer, appCtx);
         mTimer = 0;
     }
+    bool hasScheduler() const
+    {
+        return mScheduler && !mSchedulerWptr->deleted();
+    }
+    /** Tells the scheduler that the current attempt has finished */
+    void releaseSlot(bool success)
+    {
+        if (!mSlot)
+            return;
+        unsigned slot = mSlot;
+        mSlot = 0;
+        if (hasScheduler())
+            mScheduler->done(slot, success, mStartTs);
+    }
+    void cancelSlot()
+    {
+        if (!mSlot)
+            return;
+        unsigned slot = mSlot;
+        mSlot = 0;
+        if (hasScheduler())
+            mScheduler->cancel(slot);
+    }
 
     template <class P>
     void attachThenHandler(P& promise, unsigned attempt)
@@ -282,6 +566,7 @@ protected:
                 return ret;
             }
             cancelTimer();
+            releaseSlot(true);
             mState = kStateFinished;
             mPromise.resolve(ret);
             mPromise = promise::Promise<RetType>(); //we must release previous promise as it may hold references captured in its lambdas
@@ -303,6 +588,7 @@ protected:
                 return;
             }
             cancelTimer();
+            releaseSlot(true);
             mState = kStateFinished;
             mPromise.resolve();
             mPromise = promise::Promise<RetType>();
@@ -315,6 +601,22 @@ protected:
     {
         assert(mState == kStateRetryWait || mState == kStateNotStarted);
         assert(mTimer == 0);
+        if (hasScheduler())
+        {
+            //wait for a free slot of the scheduler
+            assert(mSlot == 0);
+            mState = kStateRetryWait;
+            mSlot = mScheduler->enqueue(mName, mPriorityFunc ? mPriorityFunc() : 0, [this]()
+            {
+                doTry();
+            });
+            mScheduler->dispatch();
+            return;
+        }
+        doTry();
+    }
+    void doTry()
+    {
         auto attempt = mCurrentAttemptId;
     //set an attempt timeout timer
         if (mAttemptTimeout)
@@ -328,6 +630,7 @@ protected:
                 mTimer = 0;
                 static const promise::Error timeoutError("timeout", promise::kErrTimeout, promise::kErrorTypeGeneric);
                 RETRY_LOG("Attempt %zu timed out after %u ms", mCurrentAttemptNo, mAttemptTimeout);
+                releaseSlot(false);
                 if (!std::is_same<CancelFunc, std::nullptr_t>::value)
                 {
                     auto id = mCurrentAttemptId;
@@ -351,6 +654,7 @@ protected:
             }
             RETRY_LOG("Attempt %zu failed with message '%s'", mCurrentAttemptNo, err.what());
             cancelTimer();
+            releaseSlot(false);
             schedNextRetry(err);
             return err;
         });
@@ -379,7 +683,7 @@ protected:
         }
 
         size_t waitTime = calcWaitTime();
-        RETRY_LOG("Will retry in %u ms", waitTime);
+        RETRY_LOG("Will retry in %zu ms", waitTime);
         mState = kStateRetryWait;
         //schedule next attempt
         auto wptr = weakHandle();
@@ -388,8 +692,19 @@ protected:
             if (wptr.deleted())
                 return;
             mTimer = 0;
+            cancelTimer();
             nextTry();
         }, waitTime, appCtx);
+        if (hasScheduler())
+        {
+            mWaitId = mScheduler->addWaiting([this]()
+            {
+                mWaitId = 0;
+                cancelTimer();
+                RETRY_LOG("Another connection succeeded, retrying now");
+                nextTry();
+            });
+        }
         return true;
     }
 };
@@ -412,6 +727,8 @@ static inline void _emptyCancelFunc(){}
    @param backoffStart - the wait time after the first try, which is also the starting
    point of the backoff time algorithm: \c backoffStart * 2^(current_retry_number).
    See the constructor of RetryController for more details
+ * @param scheduler - if not null, the attempts are coordinated with the ones of other
+ * RetryControllers, with the given \c priority. See RetryController::setScheduler()
  */
 template <class Func, class CancelFunc=decltype(&rh::_emptyCancelFunc)>
 static inline auto retry(const std::string& aName, Func&& func, DeleteTrackable::Handle wptr, void *ctx,
@@ -419,7 +736,9 @@ static inline auto retry(const std::string& aName, Func&& func, DeleteTrackable:
     unsigned attemptTimeout = 0,
     size_t maxRetries = rh::kDefaultMaxAttemptCount,
     size_t maxSingleWaitTime = rh::kDefaultMaxSingleWaitTime,
-    short backoffStart = 1000)
+    short backoffStart = 1000,
+    rh::ReconnectScheduler* scheduler = nullptr,
+    std::function<int()>&& priority = nullptr)
 ->decltype(func(0, wptr))
 {
     auto self = new rh::RetryController<Func, CancelFunc>(aName,
@@ -427,6 +746,8 @@ static inline auto retry(const std::string& aName, Func&& func, DeleteTrackable:
         maxSingleWaitTime, maxRetries, backoffStart);
     auto promise = self->getPromise();
     self->setAutoDestroy();
+    if (scheduler)
+        self->setScheduler(*scheduler, std::move(priority));
     self->start(); //self may get destroyed synchronously here, but we have a reference to the promise
     return promise;
 }
@@ -29,13 +29,16 @@ extern std::recursive_mutex timerMutex;
 
 namespace karere
 {
-struct TimerMsg: public megaMessage
+struct TimerMsg: public megaMessage, public MsgPoolAllocated
 {
     timerevent* timerEvent = nullptr;
     bool canceled = false;
+    /** Deletes the message as its actual type, which is only known by setTimer().
+     * The pool needs the real size of the object to free it */
+    void (*destroy)(TimerMsg*);
     megaHandle handle;
-    TimerMsg(megaMessageFunc aFunc)
-        :megaMessage(aFunc),
+    TimerMsg(megaMessageFunc aFunc, void (*aDestroy)(TimerMsg*))
+        :megaMessage(aFunc), destroy(aDestroy),
           handle(services_hstore_add_handle(MEGA_HTYPE_TIMER, this))
     {}
    ~TimerMsg()
@@ -69,7 +72,7 @@ inline megaHandle setTimer(CB&& callback, unsigned time, void *ctx)
         CB cb;
         void *appCtx;
         Msg(CB&& aCb, megaMessageFunc cFunc)
-        :TimerMsg(cFunc), cb(aCb)
+        :TimerMsg(cFunc, [](TimerMsg* msg) { delete static_cast<Msg*>(msg); }), cb(aCb)
         {}
         unsigned time;
         int loop;
@@ -172,10 +175,10 @@ static inline bool cancelTimeout(megaHandle handle, void *ctx)
 
         marshallCall([timer, ctx]()
         {
-            delete timer;
+            timer->destroy(timer);
         }, ctx);
 #else
-        delete timer;   //also deletes the timerEvent
+        timer->destroy(timer);   //also deletes the timerEvent
 #endif
     }, ctx);
     return true;
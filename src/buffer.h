@@ -165,12 +165,57 @@ class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    /** mBuf points to the inline storage of a SmallBuffer, it must not be freed or realloc-ed */
+    bool mIsInline = false;
     enum {kMinBufSize = 64};
     void zero()
     {
         mBuf = nullptr;
         mBufSize = 0;
         mDataSize = 0;
+        mIsInline = false;
+    }
+    /** Used by SmallBuffer, starts with the inline storage \c inlineBuf */
+    Buffer(char* inlineBuf, size_t inlineSize, size_t dataSize)
+    :StaticBuffer(inlineBuf, dataSize), mBufSize(inlineSize), mIsInline(true)
+    {
+        assert(dataSize <= inlineSize);
+    }
+    /** Reallocates the buffer to exactly \c newsize bytes, moving the data out of
+     * the inline storage if needed */
+    void resize(size_t newsize, const char* errPrefix)
+    {
+        char* newbuf;
+        if (mIsInline)
+        {
+            newbuf = (char*)::malloc(newsize);
+            if (newbuf)
+            {
+                memcpy(newbuf, mBuf, mDataSize);
+                mIsInline = false;
+            }
+        }
+        else
+        {
+            newbuf = (char*)::realloc(mBuf, newsize);
+        }
+        if (!newbuf)
+            throw std::runtime_error(std::string(errPrefix)+": Out of memory allocating block of size "+std::to_string(newsize));
+        mBuf = newbuf;
+        mBufSize = newsize;
+    }
+    /** Makes room for at least \c reqdSize bytes. The buffer grows geometrically,
+     * so that building it by appending many small fields is amortized O(1) per append */
+    void grow(size_t reqdSize, const char* errPrefix)
+    {
+        if (reqdSize <= mBufSize)
+            return;
+        size_t newsize = mBufSize * 2;
+        if (newsize < reqdSize)
+            newsize = reqdSize;
+        if (newsize < kMinBufSize)
+            newsize = kMinBufSize;
+        resize(newsize, errPrefix);
     }
 public:
     char* buf() { return mBuf;}
@@ -210,7 +255,16 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize)
+    {
+        if (other.mIsInline) // can't take over the inline storage of other
+        {
+            mBuf = nullptr;
+            resize(mDataSize ? mDataSize : kMinBufSize, "Buffer::Buffer(Buffer&&)");
+            memcpy(mBuf, other.mBuf, mDataSize);
+        }
+        other.zero();
+    }
 
     template <bool withNull>
     Buffer(const std::string& src)
@@ -230,7 +284,9 @@ public:
                 mDataSize = datalen;
                 return;
             }
-            ::free(mBuf);
+            if (!mIsInline)
+                ::free(mBuf);
+            mIsInline = false;
         }
         mBufSize = (kMinBufSize>datalen) ? kMinBufSize : datalen;
         mBuf = (char*)malloc(mBufSize);
@@ -258,14 +314,7 @@ public:
             size_t newsize = mDataSize+size;
             if (newsize <= mBufSize)
                 return;
-            char* save = mBuf;
-            mBuf = (char*)::realloc(mBuf, newsize);
-            if (!mBuf)
-            {
-                mBuf = save;
-                throw std::runtime_error("Buffer::reserve: Out of memory");
-            }
-            mBufSize = newsize;
+            resize(newsize, "Buffer::reserve");
         }
     }
     void setDataSize(size_t size)
@@ -279,7 +328,7 @@ public:
         auto reqdSize = offset+dataLen;
         if (reqdSize > mBufSize)
         {
-            reserve(reqdSize);
+            grow(reqdSize, "Buffer::writePtr");
             mDataSize = reqdSize;
         }
         else if (reqdSize > mDataSize)
@@ -305,17 +354,7 @@ public:
         }
         else
         {
-            if (reqdSize > mBufSize)
-            {
-                auto save = mBuf;
-                mBuf = (char*)::realloc(mBuf, reqdSize);
-                if (!mBuf)
-                {
-                    mBuf = save;
-                    throw std::runtime_error("Buffer::write: error reallocating block of size "+std::to_string(reqdSize));
-                }
-                mBufSize = reqdSize;
-            }
+            grow(reqdSize, "Buffer::write");
             memcpy(mBuf+offset, data, datalen);
             mDataSize = reqdSize;
         }
@@ -346,15 +385,60 @@ public:
     {
         if (!mBuf)
             return;
-        ::free(mBuf);
-        mBuf = nullptr;
-        mBufSize = mDataSize = 0;
+        if (!mIsInline)
+            ::free(mBuf);
+        zero();
     }
 
     ~Buffer()
     {
-        if (mBuf)
+        if (mBuf && !mIsInline)
             ::free(mBuf);
     }
 };
+
+/** A Buffer that has inline storage for the first \c N bytes, so that small
+ * buffers (i.e. most protocol commands) don't need a heap allocation. When the
+ * data outgrows it, it's moved to the heap as with a normal Buffer.
+ * Note that moving a SmallBuffer copies the inline data, so pointers to its data
+ * don't survive a move.
+ */
+template <size_t N>
+class SmallBuffer: public Buffer
+{
+protected:
+    char mInlineBuf[N];
+public:
+    enum { kInlineSize = N };
+    explicit SmallBuffer(size_t size=N, size_t dataSize=0)
+    :Buffer(mInlineBuf, N, 0)
+    {
+        assert(dataSize <= size);
+        if (size > N)
+            resize(size, "SmallBuffer");
+        mDataSize = dataSize;
+    }
+    SmallBuffer(const char* data, size_t datalen)
+    :Buffer(mInlineBuf, N, 0)
+    {
+        if (data && datalen)
+            write(0, data, datalen);
+    }
+    SmallBuffer(SmallBuffer&& other)
+    :Buffer(mInlineBuf, N, 0)
+    {
+        if (!other.mIsInline)
+        {
+            mBuf = other.mBuf;
+            mBufSize = other.mBufSize;
+            mIsInline = false;
+        }
+        else
+        {
+            memcpy(mInlineBuf, other.mBuf, other.mDataSize);
+        }
+        mDataSize = other.mDataSize;
+        other.zero();
+    }
+};
 #endif
@@ -23,10 +23,14 @@
 #include "sdkApi.h"
 #include <serverListProvider.h>
 #include <memory>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
 #include <chatd.h>
 #include <db.h>
 #include <buffer.h>
 #include <chatdDb.h>
+#include <chatdSegmentDb.h>
 #include <megaapi_impl.h>
 #include <autoHandle.h>
 #include <asyncTools.h>
@@ -66,15 +70,20 @@ std::string encodeFirstName(const std::string& first);
         : mAppDir(appDir),
           websocketIO(websocketsIO),
           appCtx(ctx),
+          historyCodec(db),
           api(sdk, ctx),
           app(aApp),
           contactList(new ContactList(*this)),
           chats(new ChatRoomList(*this)),
           mMyName("\0", 1),
           mOwnPresence(Presence::kInvalid),
+          mReconnectScheduler(ctx),
           mPresencedClient(&api, this, *this, caps),
           mSyncCount(-1)
 {
+    // the heartbeat does the timed commits, so it must be armed for the deadline
+    // of the changes done after a commit
+    db.setOnPendingChanges([this]() { rescheduleHeartbeat(); });
 }
 
 KARERE_EXPORT const std::string& createAppDir(const char* dirname, const char *envVarName)
@@ -183,6 +192,7 @@ bool Client::openDb(const std::string& sid)
                 // clients with version 2 missed the call-history msgs, need to clear cached history
                 // in order to fetch fresh history including the missing management messages
                 db.query("delete from history");
+                HistoryStore::remove(historyStorePath(sid));
                 db.query("update chat_vars set value = 0 where name = 'have_all_history'");
                 db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
                 db.commit();
@@ -201,6 +211,22 @@ bool Client::openDb(const std::string& sid)
         return false;
     }
 
+    if (!historyCodec.load())
+    {
+        db.close();
+        KR_LOG_WARNING("Database has compressed history that can't be read by this build, will rebuild it");
+        return false;
+    }
+
+    SqliteStmt stmtStorage(db, "select value from vars where name = 'history_storage'");
+    int storage = stmtStorage.step() ? stmtStorage.intCol(0) : kHistoryStorageSqlite;
+    if (storage != mHistoryStorage)
+    {
+        KR_LOG_WARNING("Storage of the history has changed, clearing history from cached chats...");
+        resetDbHistory(sid);
+        db.commit();
+    }
+
     mSid = sid;
     return true;
 }
@@ -212,49 +238,356 @@ void Client::createDbSchema()
     std::string ver(gDbSchemaHash);
     ver.append("_").append(gDbSchemaVersionSuffix);
     db.query("insert into vars(name, value) values('schema_version', ?)", ver);
+    db.query("insert into vars(name, value) values('history_storage', ?)", (int)mHistoryStorage);
+    try
+    {
+        // not part of the schema, since SQLite may be built without FTS5
+        db.simpleQuery("CREATE VIRTUAL TABLE text_search USING fts5(text, tokenize = 'unicode61 remove_diacritics 1')");
+    }
+    catch (std::exception& e)
+    {
+        KR_LOG_WARNING("Full-text search of messages is not available: %s", e.what());
+    }
     db.commit();
+    historyCodec.load();
 }
 
 void Client::heartbeat()
 {
     if (db.isOpen())
     {
+        historyCodec.installTrainedDict();
         db.timedCommit();
+        db.idleCheckpoint();
+        if (time(NULL) >= mNextDbMaintenanceTs)
+        {
+            startDbMaintenance(0);
+        }
     }
 
     if (mConnState != kConnected)
     {
-        KR_LOG_WARNING("Heartbeat timer tick without being connected");
-        return;
+        KR_LOG_DEBUG("Heartbeat timer tick without being connected");
+    }
+    else
+    {
+        mPresencedClient.heartbeat();
+        if (chatd)
+        {
+            chatd->heartbeat();
+        }
     }
 
-    mPresencedClient.heartbeat();
-    if (chatd)
+    armHeartbeat();
+}
+
+time_t Client::nextHeartbeatTs()
+{
+    time_t now = time(NULL);
+    time_t next = now + kHeartbeatMaxInterval;
+    time_t ts;
+    if (mConnState == kConnected)
     {
-        chatd->heartbeat();
+        ts = mPresencedClient.nextHeartbeatTs();
+        if (ts && ts < next)
+        {
+            next = ts;
+        }
+        ts = chatd ? chatd->nextHeartbeatTs() : 0;
+        if (ts && ts < next)
+        {
+            next = ts;
+        }
     }
+    ts = db.isOpen() ? db.nextCommitTs() : 0;
+    if (ts && ts < next)
+    {
+        next = ts;
+    }
+
+    if (next <= now)
+    {
+        next = now + 1;
+    }
+    return ((next + kHeartbeatGranularity - 1) / kHeartbeatGranularity) * kHeartbeatGranularity;
 }
 
-Client::~Client()
+void Client::armHeartbeat()
+{
+    assert(!mHeartbeatTimer);
+    mHeartbeatTs = nextHeartbeatTs();
+    auto wptr = weakHandle();
+    mHeartbeatTimer = karere::setTimeout([this, wptr]()
+    {
+        if (wptr.deleted() || !mHeartbeatTimer)
+        {
+            return;
+        }
+
+        mHeartbeatTimer = 0;
+        heartbeat();
+    }, (mHeartbeatTs - time(NULL)) * 1000, appCtx);
+}
+
+void Client::cancelHeartbeat()
 {
     if (mHeartbeatTimer)
     {
-        karere::cancelInterval(mHeartbeatTimer, appCtx);
+        karere::cancelTimeout(mHeartbeatTimer, appCtx);
         mHeartbeatTimer = 0;
     }
 }
 
-promise::Promise<void> Client::retryPendingConnections()
+void Client::rescheduleHeartbeat()
+{
+    // if not armed, heartbeats are stopped or it's running right now (and will arm it)
+    if (!mHeartbeatTimer || nextHeartbeatTs() >= mHeartbeatTs)
+    {
+        return;
+    }
+
+    cancelHeartbeat();
+    armHeartbeat();
+}
+
+void Client::startDbMaintenance(unsigned delayMs)
+{
+    if (mDbMaintenanceStep != kDbMaintenanceIdle)
+    {
+        return;
+    }
+
+    mNextDbMaintenanceTs = time(NULL) + kDbMaintenanceInterval;
+    mDbMaintenanceStep = kDbMaintenanceHistory;
+    mDbMaintenanceChats.clear();
+    for (auto& item: *chats)
+    {
+        mDbMaintenanceChats.push_back(item.first);
+    }
+    mDbMaintenanceTable = 0;
+    mDbMaintenanceChatid = std::numeric_limits<int64_t>::min();
+    KR_LOG_DEBUG("Starting maintenance of the local cache");
+    scheduleDbMaintenanceSlice(delayMs);
+}
+
+void Client::scheduleDbMaintenanceSlice(unsigned delayMs)
+{
+    assert(!mDbMaintenanceTimer);
+    auto wptr = weakHandle();
+    mDbMaintenanceTimer = karere::setTimeout([this, wptr]()
+    {
+        if (wptr.deleted() || !mDbMaintenanceTimer)
+        {
+            return;
+        }
+
+        mDbMaintenanceTimer = 0;
+        dbMaintenanceSlice();
+    }, delayMs, appCtx);
+}
+
+void Client::cancelDbMaintenance()
+{
+    if (mDbMaintenanceTimer)
+    {
+        karere::cancelTimeout(mDbMaintenanceTimer, appCtx);
+        mDbMaintenanceTimer = 0;
+    }
+    mDbMaintenanceStep = kDbMaintenanceIdle;
+    mDbMaintenanceChats.clear();
+}
+
+void Client::dbMaintenanceSlice()
+{
+    if (!db.isOpen())
+    {
+        mDbMaintenanceStep = kDbMaintenanceIdle;
+        return;
+    }
+
+    // the changes are committed by the heartbeat, as any other
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kDbMaintenanceSliceTime);
+    try
+    {
+        do
+        {
+            bool more;
+            switch (mDbMaintenanceStep)
+            {
+                case kDbMaintenanceHistory:
+                    more = pruneHistoryBatch();
+                    break;
+                case kDbMaintenanceOrphans:
+                    more = deleteOrphansBatch();
+                    break;
+                case kDbMaintenanceVacuum:
+                    more = db.incrementalVacuum(kDbMaintenanceVacuumPages);
+                    break;
+                default:
+                    return;
+            }
+            if (!more)
+            {
+                if (mDbMaintenanceStep == kDbMaintenanceVacuum)
+                {
+                    KR_LOG_DEBUG("Maintenance of the local cache completed");
+                    mDbMaintenanceStep = kDbMaintenanceIdle;
+                    return;
+                }
+                mDbMaintenanceStep = (DbMaintenanceStep)(mDbMaintenanceStep + 1);
+            }
+        } while (std::chrono::steady_clock::now() < deadline);
+    }
+    catch (std::exception& e)
+    {
+        // retried in the next pass
+        KR_LOG_ERROR("Error during the maintenance of the local cache: %s", e.what());
+        mDbMaintenanceStep = kDbMaintenanceIdle;
+        mDbMaintenanceChats.clear();
+        return;
+    }
+
+    scheduleDbMaintenanceSlice(kDbMaintenanceSlicePause);
+}
+
+bool Client::pruneHistoryBatch()
+{
+    if (mDbMaintenanceChats.empty())
+    {
+        return false;
+    }
+
+    auto chat = chatd ? chatd->chatFromId(mDbMaintenanceChats.back()) : nullptr;
+    if (chat)
+    {
+        // the shortest of the local and the server retention times
+        uint32_t retention = chat->retentionTime();
+        if (mHistoryRetention && (!retention || mHistoryRetention < retention))
+        {
+            retention = mHistoryRetention;
+        }
+        uint32_t now = (uint32_t)time(NULL);
+        if (retention && (retention < now)
+                && (chat->pruneDbHistory(now - retention, kDbMaintenanceBatch) == kDbMaintenanceBatch))
+        {
+            return true;    // there may be more to prune in this chat
+        }
+    }
+    mDbMaintenanceChats.pop_back();
+    return !mDbMaintenanceChats.empty();
+}
+
+bool Client::deleteOrphansBatch()
+{
+    // tables with rows of each chat. All but the send queues, which are small, have an index
+    // by chatid, so each chatid in them is found with a seek instead of a scan
+    static const char* tables[] = { "history", "node_history", "text_index", "chat_vars",
+                                    "chat_peers", "sendkeys", "sending", "manual_sending" };
+    static const unsigned tableCount = sizeof(tables) / sizeof(tables[0]);
+
+    if (mDbMaintenanceTable < tableCount)
+    {
+        std::string table = tables[mDbMaintenanceTable];
+        bool textIndex = (table == "text_index");
+        if (textIndex && !hasTextSearch())
+        {
+            mDbMaintenanceTable++;
+            return true;
+        }
+
+        SqliteStmt stmt(db, "select min(chatid) from " + table + " where chatid >= ?");
+        stmt << mDbMaintenanceChatid;
+        stmt.step();
+        if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+        {
+            mDbMaintenanceTable++;
+            mDbMaintenanceChatid = std::numeric_limits<int64_t>::min();
+            return true;
+        }
+
+        int64_t chatid = stmt.int64Col(0);
+        SqliteStmt stmtChat(db, "select 1 from chats where chatid = ?");
+        stmtChat << chatid;
+        int changes = 0;
+        if (!stmtChat.step())
+        {
+            std::string rows = "select rowid from " + table + " where chatid = ?1 order by rowid limit ?2";
+            if (textIndex)
+            {
+                db.query(("delete from text_search where rowid in (" + rows + ")").c_str(), chatid, (int)kDbMaintenanceBatch);
+            }
+            db.query(("delete from " + table + " where rowid in (" + rows + ")").c_str(), chatid, (int)kDbMaintenanceBatch);
+            changes = sqlite3_changes(db);
+        }
+        if (changes < kDbMaintenanceBatch)
+        {
+            // done with this chatid
+            if (chatid == std::numeric_limits<int64_t>::max())
+            {
+                mDbMaintenanceTable++;
+                mDbMaintenanceChatid = std::numeric_limits<int64_t>::min();
+            }
+            else
+            {
+                mDbMaintenanceChatid = chatid + 1;
+            }
+        }
+        return true;
+    }
+
+    if (mDbMaintenanceTable == tableCount)
+    {
+        mDbMaintenanceTable++;
+        if (mHistoryStorage == kHistoryStorageSegments)
+        {
+            // history stores of chats that are not in the chats table
+            std::string root = historyStorePath(mSid);
+            for (auto& name: HistoryStore::list(root))
+            {
+                Id chatid(name.c_str());
+                SqliteStmt stmtChat(db, "select 1 from chats where chatid = ?");
+                stmtChat << chatid;
+                if (!stmtChat.step() && !(chatd && chatd->chatFromId(chatid)))
+                {
+                    KR_LOG_DEBUG("Deleting the history store of the removed chat %s", name.c_str());
+                    HistoryStore::remove(root + "/" + name);
+                }
+            }
+        }
+        return true;
+    }
+
+    // cached attributes of users that are neither contacts nor peers of any chat. The peers of
+    // 1on1 chats are in chats.peer, not in chat_peers
+    db.query("delete from userattrs where rowid in (select rowid from userattrs where ts < ? and userid != ? "
+             "and userid not in (select userid from contacts where visibility = ?) "
+             "and userid not in (select userid from chat_peers) "
+             "and userid not in (select peer from chats where peer != -1) limit ?)",
+             (int64_t)(time(NULL) - kUserAttrsMaxAge), mMyHandle,
+             (int)::mega::MegaUser::VISIBILITY_VISIBLE, (int)kDbMaintenanceBatch);
+    return sqlite3_changes(db) == kDbMaintenanceBatch;
+}
+
+Client::~Client()
+{
+    cancelHeartbeat();
+    cancelDbMaintenance();
+}
+
+promise::Promise<void> Client::retryPendingConnections(bool disconnectedOnly)
 {
     if (mConnState == kConnecting)
         return mConnectPromise;
 
     std::vector<Promise<void>> promises;
 
-    promises.push_back(mPresencedClient.retryPendingConnection());
+    if (!disconnectedOnly || !mPresencedClient.isOnline())
+    {
+        promises.push_back(mPresencedClient.retryPendingConnection());
+    }
     if (chatd)
     {
-        promises.push_back(chatd->retryPendingConnections());
+        promises.push_back(chatd->retryPendingConnections(disconnectedOnly));
     }
     return promise::when(promises);
 }
@@ -377,6 +710,90 @@ void Client::saveDb()
     }
 }
 
+bool Client::hasTextSearch()
+{
+    SqliteStmt stmt(db, "select 1 from sqlite_master where type = 'table' and name = 'text_search'");
+    return stmt.step();
+}
+
+uint64_t Client::searchMessages(const std::string& query, Id chatid, unsigned limit,
+                                uint64_t cursor, std::vector<SearchHit>& hits)
+{
+    // every word is matched as a quoted prefix, so FTS5 operators in the query are plain text
+    std::string match;
+    size_t pos = 0;
+    while (pos < query.size())
+    {
+        size_t start = query.find_first_not_of(" \t\r\n", pos);
+        if (start == std::string::npos)
+            break;
+        size_t end = query.find_first_of(" \t\r\n", start);
+        if (end == std::string::npos)
+            end = query.size();
+
+        if (!match.empty())
+            match.push_back(' ');
+        match.push_back('"');
+        for (size_t i = start; i < end; i++)
+        {
+            if (query[i] == '"')
+                match.push_back('"');
+            match.push_back(query[i]);
+        }
+        match.append("\"*");
+        pos = end;
+    }
+    if (match.empty())
+        throw std::invalid_argument("searchMessages: empty query");
+    if (!limit)
+        throw std::invalid_argument("searchMessages: invalid limit");
+    if (!hasTextSearch())
+        throw std::runtime_error("searchMessages: full-text search is not available");
+
+    // rowids are ordered by ts (see ChatdSqliteDb::addMsgToTextIndex()), the cursor is the last one returned
+    std::string sql = "select s.rowid, i.chatid, i.msgid, i.idx, i.ts from text_search s "
+            "join text_index i on i.rowid = s.rowid where text_search match ?1";
+    if (chatid != Id::inval())
+        sql += " and i.chatid = ?2";
+    if (cursor)
+        sql += " and s.rowid < ?3";
+    sql += " order by s.rowid desc limit ?4";
+
+    SqliteStmt stmt(db, sql);
+    stmt.bind(1, match);
+    if (chatid != Id::inval())
+        stmt.bind(2, chatid.val);
+    if (cursor)
+        stmt.bind(3, cursor);
+    stmt.bind(4, limit);
+
+    unsigned count = 0;
+    uint64_t last = 0;
+    try
+    {
+        while (stmt.step())
+        {
+            SearchHit hit;
+            hit.chatid = stmt.uint64Col(1);
+            hit.msgid = stmt.uint64Col(2);
+            hit.idx = stmt.intCol(3);
+            hit.ts = stmt.uintCol(4);
+            hits.push_back(hit);
+            last = stmt.uint64Col(0);
+            count++;
+        }
+    }
+    catch (std::runtime_error& e)
+    {
+        // the statement itself is valid, so a plain SQLITE_ERROR comes from parsing the
+        // MATCH expression (i.e. "fts5: syntax error near ..."), unlike I/O or corruption
+        if (sqlite3_errcode(db) == SQLITE_ERROR)
+            throw std::invalid_argument(std::string("searchMessages: invalid query: ") + sqlite3_errmsg(db));
+        throw;
+    }
+    return (count < limit) ? 0 : last;
+}
+
 promise::Promise<void> Client::pushReceived()
 {
     // if already sent SYNCs or we are not logged in right now...
@@ -438,6 +855,7 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
 
     mSid = sid;
     createDb();
+    websocketIO->mDnsCache.setDb(&db);
 
 // We have a complete snapshot of the SDK contact and chat list state.
 // Commit it with the accompanying scsn
@@ -472,6 +890,70 @@ void Client::setCommitMode(bool commitEach)
     db.setCommitMode(commitEach);
 }
 
+void Client::setStorageProfile(int profile)
+{
+    db.setProfile(SqliteDb::profile(profile));
+}
+
+void Client::setHistoryRetention(uint32_t seconds)
+{
+    mHistoryRetention = seconds;
+}
+
+void Client::setHistoryPrefetch(unsigned count)
+{
+    mHistoryPrefetch = count;
+    if (chatd)
+    {
+        chatd->historyPrefetchCount = count;
+    }
+}
+
+void Client::setHistoryStorage(int storage)
+{
+    if (storage != kHistoryStorageSqlite && storage != kHistoryStorageSegments)
+    {
+        KR_LOG_ERROR("setHistoryStorage: Invalid storage %d", storage);
+        return;
+    }
+#ifdef _WIN32
+    if (storage == kHistoryStorageSegments)
+    {
+        KR_LOG_WARNING("setHistoryStorage: The history store is not available on Windows");
+        return;
+    }
+#endif
+    if (mInitState > kInitCreated)
+    {
+        KR_LOG_WARNING("setHistoryStorage: Must be called before init, ignoring it");
+        return;
+    }
+    mHistoryStorage = (HistoryStorage)storage;
+}
+
+std::string Client::historyStoreDir(Id chatid)
+{
+    // each store creates its own directory, but not the parent one
+    std::string path = historyStorePath(mSid);
+    mkdir(path.c_str(), 0700);
+    return path.append("/").append(chatid.toString());
+}
+
+void Client::resetDbHistory(const std::string& sid)
+{
+    db.query("delete from history");
+    db.query("delete from node_history");
+    if (hasTextSearch())
+    {
+        db.query("delete from text_index");
+        db.query("delete from text_search");
+    }
+    db.query("update chat_vars set value = 0 where name = 'have_all_history'");
+    db.query("update chats set last_text_idx = null, last_text_data = null");
+    HistoryStore::remove(historyStorePath(sid));
+    db.query("insert or replace into vars(name, value) values('history_storage', ?)", (int)mHistoryStorage);
+}
+
 void Client::commit(const std::string& scsn)
 {
     if (scsn.empty())
@@ -587,6 +1069,10 @@ void Client::initWithDbSession(const char* sid)
             name.assign(buf->buf(), buf->dataSize());
         });
 
+        // connect to the shards with the persisted IPs, while resolving them again
+        websocketIO->mDnsCache.setDb(&db);
+        websocketIO->refreshDnsCache();
+
         loadOwnKeysFromDb();
         contactList->loadFromDb();
         mContactsLoaded = true;
@@ -600,6 +1086,9 @@ void Client::initWithDbSession(const char* sid)
         return;
     }
 
+    // before the chats are joined, so that their history can be pruned
+    startDbMaintenance(kDbMaintenanceStartDelay);
+
     setInitState(kInitHasOfflineSession);
     return;
 }
@@ -782,9 +1271,14 @@ void Client::onRequestFinish(::mega::MegaApi* apiObj, ::mega::MegaRequest *reque
 void Client::wipeDb(const std::string& sid)
 {
     assert(!sid.empty());
+    cancelDbMaintenance();
+    websocketIO->mDnsCache.setDb(NULL);
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
+    remove((path + "-wal").c_str());
+    remove((path + "-shm").c_str());
+    HistoryStore::remove(historyStorePath(sid));
     struct stat info;
     if (stat(path.c_str(), &info) == 0)
         throw std::runtime_error("wipeDb: Could not delete old database file in "+mAppDir);
@@ -941,6 +1435,8 @@ promise::Promise<void> Client::doConnect(Presence pres, bool isInBackground)
         }
 
         setConnState(kConnected);
+        // the deadlines of presenced and chatd are considered from now on
+        rescheduleHeartbeat();
     })
     .fail([this](const promise::Error& err)
     {
@@ -948,16 +1444,7 @@ promise::Promise<void> Client::doConnect(Presence pres, bool isInBackground)
         return err;
     });
 
-    assert(!mHeartbeatTimer);
-    mHeartbeatTimer = karere::setInterval([this, wptr]()
-    {
-        if (wptr.deleted() || !mHeartbeatTimer)
-        {
-            return;
-        }
-
-        heartbeat();
-    }, 10000, appCtx);
+    armHeartbeat();
     return pms;
 }
 
@@ -973,11 +1460,7 @@ void Client::disconnect()
     mUserAttrCache->onLogOut();
 
     // stop heartbeats
-    if (mHeartbeatTimer)
-    {
-        karere::cancelInterval(mHeartbeatTimer, appCtx);
-        mHeartbeatTimer = 0;
-    }
+    cancelHeartbeat();
 
     // disconnect from chatd shards and presenced
     chatd->disconnect();
@@ -1241,6 +1724,13 @@ void Client::notifyNetworkOffline()
 }
 void Client::notifyNetworkOnline()
 {
+    if (!mPrewarmOnNetworkOnline || mConnState != kConnected)
+        return;
+
+    // don't wait for the retry backoff of each connection: open the ones to presenced
+    // and to all the chatd shards in parallel, right away (TLS sessions are resumed)
+    KR_LOG_DEBUG("Network online, reconnecting to all shards...");
+    retryPendingConnections(true);
 }
 void Client::notifyUserIdle()
 {
@@ -1270,6 +1760,7 @@ void Client::terminate(bool deleteDb)
 #endif
 
     disconnect();
+    cancelDbMaintenance();
     mUserAttrCache.reset();
 
     try
@@ -1281,6 +1772,7 @@ void Client::terminate(bool deleteDb)
         else if (db.isOpen())
         {
             KR_LOG_INFO("Doing final COMMIT to database");
+            websocketIO->mDnsCache.setDb(NULL);
             db.commit();
             db.close();
         }
@@ -1806,7 +2298,7 @@ void GroupChatRoom::deleteSelf()
             return;
         }
 
-        auto db = parent.client.db;
+        auto& db = parent.client.db;
         db.query("delete from chat_peers where chatid=?", mChatid);
         db.query("delete from chats where chatid=?", mChatid);
         delete this;
@@ -2044,7 +2536,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     }
 
     //save to db
-    auto db = parent.client.db;
+    auto& db = parent.client.db;
     db.query("delete from chat_peers where chatid=?", mChatid);
     db.query(
         "insert or replace into chats(chatid, shard, peer, peer_priv, "
@@ -2283,7 +2775,15 @@ bool ChatRoom::syncRoomPropertiesWithApi(const mega::MegaTextChat &chat)
 void ChatRoom::init(chatd::Chat& chat, chatd::DbInterface*& dbIntf)
 {
     mChat = &chat;
-    dbIntf = new ChatdSqliteDb(*mChat, parent.client.db);
+    auto& client = parent.client;
+    if (client.historyStorage() == Client::kHistoryStorageSegments)
+    {
+        dbIntf = new ChatdSegmentDb(*mChat, client.db, client.historyStoreDir(mChat->chatId()), &client.historyCodec);
+    }
+    else
+    {
+        dbIntf = new ChatdSqliteDb(*mChat, client.db, &client.historyCodec);
+    }
     if (mAppChatHandler)
     {
         setAppChatHandler(mAppChatHandler);
@@ -2310,6 +2810,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->cancelHistoryPrefetch();
 }
 
 bool ChatRoom::hasChatHandler() const
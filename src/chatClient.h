@@ -9,6 +9,7 @@
 #include <retryHandler.h>
 #include "userAttrCache.h"
 #include <db.h>
+#include "historyCodec.h"
 #include "chatd.h"
 #include "presenced.h"
 #include "IGui.h"
@@ -571,6 +572,40 @@ protected:
     promise::Promise<void> mConnectPromise;
 public:
     enum { kInitErrorType = 0x9e9a1417 }; //should resemble 'megainit'
+    enum
+    {
+        /** Heartbeat deadlines are rounded up to a multiple of this (in seconds), so
+         * the checks of presenced, chatd and the db are done in the same wakeup */
+        kHeartbeatGranularity = 5,
+        /** Max time without a heartbeat, even if nothing is due */
+        kHeartbeatMaxInterval = 60
+    };
+    enum
+    {
+        /** Interval between the maintenance passes of the db (in seconds), see \c startDbMaintenance() */
+        kDbMaintenanceInterval = 3600,
+        /** Delay of the first pass after the db is loaded (in ms) */
+        kDbMaintenanceStartDelay = 2000,
+        /** Max time that a slice of a pass blocks the event loop (in ms) */
+        kDbMaintenanceSliceTime = 4,
+        /** Pause between slices (in ms) */
+        kDbMaintenanceSlicePause = 50,
+        /** Max rows deleted by each statement */
+        kDbMaintenanceBatch = 128,
+        /** Max pages returned to the filesystem by each incremental vacuum */
+        kDbMaintenanceVacuumPages = 32,
+        /** Age (in seconds) of the cached attributes of users that are not contacts nor
+         * peers of any chat, after which they are deleted */
+        kUserAttrsMaxAge = 30 * 24 * 3600
+    };
+    /** Where the history of the chats is kept, see \c setHistoryStorage() */
+    enum HistoryStorage: uint8_t
+    {
+        /** The history table of the db */
+        kHistoryStorageSqlite = 0,
+        /** A memory-mapped karere::HistoryStore per chat, next to the db */
+        kHistoryStorageSegments = 1
+    };
     enum InitState: uint8_t
     {
         /** The client has just been created. \c init() has not been called yet */
@@ -636,6 +671,8 @@ public:
     WebsocketsIO *websocketIO;
     void *appCtx;
     SqliteDb db;
+    /** Compresses the message payloads stored in the history of \c db */
+    HistoryCodec historyCodec;
     std::unique_ptr<chatd::Client> chatd;
     MyMegaApi api;
     IApp& app;
@@ -648,6 +685,12 @@ public:
     IApp::ILoginDialog::Handle mLoginDlg;
     UserAttrCache& userAttrCache() const { return *mUserAttrCache; }
     presenced::Client& presenced() { return mPresencedClient; }
+    /** @brief Coordinates the reconnections to presenced and chatd. Its stats can be used
+     * to monitor how long reconnections take */
+    rh::ReconnectScheduler& reconnectScheduler() { return mReconnectScheduler; }
+    /** @brief Must be called when a deadline checked by the heartbeat may have become
+     * earlier than the one the heartbeat timer is armed for */
+    void rescheduleHeartbeat();
     bool contactsLoaded() const { return mContactsLoaded; }
     ConnState connState() const { return mConnState; }
     bool connected() const { return mConnState == kConnected; }
@@ -752,9 +795,10 @@ public:
 
     /**
      * @brief Retry pending connections to chatd and presenced
+     * @param disconnectedOnly If true, the connections that are established are kept
      * @return A promise to track the result of the action.
      */
-    promise::Promise<void> retryPendingConnections();
+    promise::Promise<void> retryPendingConnections(bool disconnectedOnly = false);
 
     /**
      * @brief A convenience method that logs in the Mega SDK and then inits
@@ -768,8 +812,14 @@ public:
     /** @brief Notifies the client that network connection is down */
     void notifyNetworkOffline();
 
-    /** @brief Notifies the client that internet connection is again available */
+    /** @brief Notifies the client that internet connection is again available.
+     * If enabled via \c setPrewarmOnNetworkOnline(), the connections to presenced and
+     * chatd that are not established are reconnected immediately, in parallel
+     */
     void notifyNetworkOnline();
+
+    /** @brief Enables or disables reconnecting on \c notifyNetworkOnline(). Disabled by default */
+    void setPrewarmOnNetworkOnline(bool enable) { mPrewarmOnNetworkOnline = enable; }
     /** @brief Call this when the app goes into background, so that it notifies
      * the servers to enable PUSH notifications
      */
@@ -815,7 +865,53 @@ public:
     promise::Promise<karere::Id>
     createGroupChat(std::vector<std::pair<uint64_t, chatd::Priv>> peers);
     void setCommitMode(bool commitEach);
+    /** @brief Sets the storage profile of the local cache (see SqliteDb::Profile), which
+     * is applied the next time it's opened */
+    void setStorageProfile(int profile);
+    /** @brief Sets the time (in seconds) for which the messages are kept in the local history.
+     * The older ones are deleted by the periodic maintenance of the db, and fetched from the
+     * server again when needed. If the server retention time of a chat is shorter, it's used
+     * instead. Only the chats that aren't joined to chatd are pruned (see Chat::pruneDbHistory()).
+     * 0 (the default) keeps all the messages */
+    void setHistoryRetention(uint32_t seconds);
+    /** @brief Sets where the history of the chats is kept (see \c HistoryStorage). Must
+     * be called before init(). If the cache has the history in the other storage, it's
+     * cleared and fetched from the server again. Not available on Windows */
+    void setHistoryStorage(int storage);
+    int historyStorage() const { return mHistoryStorage; }
+    /** @brief Sets the minimum number of messages loaded ahead of the app in the open chats
+     * (see chatd::Client::historyPrefetchCount). 0 (the default) disables the prefetch */
+    void setHistoryPrefetch(unsigned count);
+    unsigned historyPrefetch() const { return mHistoryPrefetch; }
+    /** @brief Directory of the history store of a chat, with kHistoryStorageSegments */
+    std::string historyStoreDir(karere::Id chatid);
     void saveDb();  // forces a commit
+
+    /** @brief A message matching a full-text search */
+    struct SearchHit
+    {
+        karere::Id chatid;
+        karere::Id msgid;
+        chatd::Idx idx;
+        uint32_t ts;
+    };
+    /** @brief Searches the text of the messages in the local history, via the full-text
+     * index maintained by the chatd db interface (requires SQLite with FTS5).
+     *
+     * Every word of \c query must be present in a message for it to match, as a
+     * prefix of one of its words (case and diacritics are ignored).
+     * @param chatid The chat to search, or \c Id::inval() to search all chats
+     * @param limit Max number of hits. They are returned from newest to oldest
+     * @param cursor Zero for the first page, then the value returned by the previous call
+     * @return The cursor of the next page, or zero if there are no more hits.
+     * Throws std::invalid_argument if the query is empty or not valid, or the limit
+     * is zero, and std::runtime_error if the search index is not available or the
+     * search fails
+     */
+    uint64_t searchMessages(const std::string& query, karere::Id chatid, unsigned limit,
+                            uint64_t cursor, std::vector<SearchHit>& hits);
+    /** @brief Whether the local db has the full-text search index */
+    bool hasTextSearch();
     bool isCallInProgress() const;
 #ifndef KARERE_DISABLE_WEBRTC
     std::unique_ptr<rtcModule::IRtcModule> rtc;
@@ -835,22 +931,68 @@ public:
 protected:
     std::string mMyName;
     bool mContactsLoaded = false;
+    bool mPrewarmOnNetworkOnline = false;
     promise::Promise<void> mSessionReadyPromise;
     Presence mOwnPresence;
     /** @brief Our own email address */
     std::string mEmail;
     /** @brief Our password */
     std::string mPassword;
+    rh::ReconnectScheduler mReconnectScheduler;
     /** @brief Client's contact list */
     presenced::Client mPresencedClient;
     std::string mPresencedUrl;
     UserAttrCache::Handle mOwnNameAttrHandle;
     megaHandle mHeartbeatTimer = 0;
+    /** Time at which the heartbeat timer will fire */
+    time_t mHeartbeatTs = 0;
     std::string mLastScsn;
     void heartbeat();
+    /** The heartbeat timer is not periodic, it is armed for the earliest deadline of
+     * presenced, chatd and the db, so there are no wakeups while there's nothing to check */
+    void armHeartbeat();
+    void cancelHeartbeat();
+    time_t nextHeartbeatTs();
+    enum DbMaintenanceStep: uint8_t
+    {
+        kDbMaintenanceIdle = 0,
+        /** Pruning of the history out of the retention time, chat by chat */
+        kDbMaintenanceHistory,
+        /** Deletion of the rows and history stores of chats that are not in the chats table,
+         * and of old attributes */
+        kDbMaintenanceOrphans,
+        /** Incremental vacuum */
+        kDbMaintenanceVacuum
+    };
+    DbMaintenanceStep mDbMaintenanceStep = kDbMaintenanceIdle;
+    megaHandle mDbMaintenanceTimer = 0;
+    /** Time at which the heartbeat starts the next pass */
+    time_t mNextDbMaintenanceTs = 0;
+    uint32_t mHistoryRetention = 0;
+    HistoryStorage mHistoryStorage = kHistoryStorageSqlite;
+    unsigned mHistoryPrefetch = 0;
+    /** Chats not pruned yet in the current pass */
+    std::vector<karere::Id> mDbMaintenanceChats;
+    /** Table and next chatid to check in kDbMaintenanceOrphans */
+    unsigned mDbMaintenanceTable = 0;
+    int64_t mDbMaintenanceChatid = 0;
+    /** Starts a maintenance pass of the db, done in slices of a few ms from the event
+     * loop. Does nothing if a pass is in progress */
+    void startDbMaintenance(unsigned delayMs);
+    void scheduleDbMaintenanceSlice(unsigned delayMs);
+    void cancelDbMaintenance();
+    void dbMaintenanceSlice();
+    /** Each of these does a bounded amount of work of its step, and returns false when
+     * the step is completed */
+    bool pruneHistoryBatch();
+    bool deleteOrphansBatch();
     InitState mInitState = kInitCreated;
     void setInitState(InitState newState);
     std::string dbPath(const std::string& sid) const;
+    /** Directory with the history stores of the chats */
+    std::string historyStorePath(const std::string& sid) const { return dbPath(sid) + ".history"; }
+    /** Clears the history of all chats, in both storages, and selects the current one */
+    void resetDbHistory(const std::string& sid);
     bool openDb(const std::string& sid);
     void createDb();
     void wipeDb(const std::string& sid);
@@ -88,6 +88,7 @@ namespace chatd
 Client::Client(karere::Client *client, Id userId)
 :mUserId(userId), mApi(&client->api), karereClient(client)
 {
+    historyPrefetchCount = client->historyPrefetch();
     mRichPrevAttrCbHandle = karereClient->userAttrCache().getAttr(mUserId, ::mega::MegaApi::USER_ATTR_RICH_PREVIEWS, this,
        [](::Buffer *buf, void* userp)
        {
@@ -239,18 +240,7 @@ uint8_t Client::richLinkState() const
 
 bool Client::areAllChatsLoggedIn()
 {
-    bool allConnected = true;
-
-    for (map<Id, shared_ptr<Chat>>::iterator it = mChatForChatId.begin(); it != mChatForChatId.end(); it++)
-    {
-        Chat* chat = it->second.get();
-        if (chat->onlineState() != kChatStateOnline && !chat->isDisabled())
-        {
-            allConnected = false;
-            break;
-        }
-    }
-
+    bool allConnected = (mChatsNotLoggedIn == 0);
     if (allConnected)
     {
         CHATD_LOG_DEBUG("We are now logged in to all chats");
@@ -338,6 +328,7 @@ Connection::Connection(Client& client, int shardNo)
 
 void Connection::wsConnectCb()
 {
+    mTargetIp = wsConnectedIp();
     CHATDS_LOG_DEBUG("Chatd connected to %s", mTargetIp.c_str());
     mDNScache.connectDone(mUrl.host, mTargetIp);
     mState = kStateConnected;
@@ -386,6 +377,11 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
     usingipv6 = !usingipv6;
     mTargetIp.clear();
 
+    if (oldState == kStateConnecting && mDNScache.connectFailed(mUrl.host))
+    {
+        CHATDS_LOG_WARNING("Cached IPs discarded for shard %d, will be resolved again", mShardNo);
+    }
+
     if (oldState < kStateConnected) //tell retry controller that the connect attempt failed
     {
         CHATDS_LOG_DEBUG("Socket close and state is not kStateConnected (but %s), start retry controller", connStateToStr(oldState));
@@ -536,19 +532,23 @@ Promise<void> Connection::reconnect()
                     return;
                 }
 
-                if (mDNScache.isMatch(mUrl.host, ipsv4, ipsv6))
+                // compare with the IP in use rather than with the cache, which may have been
+                // updated meanwhile by WebsocketsIO::refreshDnsCache()
+                bool match = mTargetIp.empty()
+                        ? mDNScache.isMatch(mUrl.host, ipsv4, ipsv6)
+                        : DNScache::isResolved(mTargetIp, ipsv4, ipsv6);
+                if (match)
                 {
-                    CHATDS_LOG_DEBUG("DNS resolve matches cached IPs.");
+                    CHATDS_LOG_DEBUG("DNS resolve matches the IP in use.");
                 }
                 else
                 {
                     // update DNS cache
-                    bool ret = mDNScache.set(mUrl.host,
+                    mDNScache.set(mUrl.host,
                                   ipsv4.size() ? ipsv4.at(0) : "",
                                   ipsv6.size() ? ipsv6.at(0) : "");
-                    assert(!ret);
 
-                    CHATDS_LOG_WARNING("DNS resolve doesn't match cached IPs. Forcing reconnect...");
+                    CHATDS_LOG_WARNING("DNS resolve doesn't match the IP in use (%s). Forcing reconnect...", mTargetIp.c_str());
                     onSocketClose(0, 0, "DNS resolve doesn't match cached IPs (chatd)");
                 }
             });
@@ -583,14 +583,36 @@ Promise<void> Connection::reconnect()
                 sendCommand(Command(OP_CLIENTID)+mChatdClient.karereClient->myIdentity());
                 mTsLastRecv = time(NULL);   // data has been received right now, since connection is established
                 mHeartbeatEnabled = true;
+                mChatdClient.karereClient->rescheduleHeartbeat();
                 sendKeepalive(mChatdClient.mKeepaliveType);
                 return rejoinExistingChats();
             });
-        }, wptr, mChatdClient.karereClient->appCtx, nullptr, 0, 0, KARERE_RECONNECT_DELAY_MAX, KARERE_RECONNECT_DELAY_INITIAL);
+        }, wptr, mChatdClient.karereClient->appCtx, nullptr, 0, 0, KARERE_RECONNECT_DELAY_MAX, KARERE_RECONNECT_DELAY_INITIAL,
+        &mChatdClient.karereClient->reconnectScheduler(), [this, wptr]()
+        {
+            return wptr.deleted() ? 0 : reconnectPriority();
+        });
     }
     KR_EXCEPTION_TO_PROMISE(kPromiseErrtype_chatd);
 }
 
+int Connection::reconnectPriority() const
+{
+    // shards with chats open in the app go first
+    int priority = 0;
+    auto& chats = mChatdClient.karereClient->chats;
+    if (!chats)
+        return priority;
+
+    for (auto chatid: mChatIds)
+    {
+        auto it = chats->find(chatid);
+        if (it != chats->end() && it->second->hasChatHandler())
+            priority++;
+    }
+    return priority;
+}
+
 void Connection::disconnect()
 {
     mState = kStateDisconnected;
@@ -607,7 +629,10 @@ void Connection::doConnect()
     string ipv4, ipv6;
     bool cachedIPs = mDNScache.get(mUrl.host, ipv4, ipv6);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+    // start with the IP family that connected last time, and race it with the other one (if any)
+    bool ipv6First = mDNScache.preferIpv6(mUrl.host, usingipv6) && ipv6.size();
+    mTargetIp = (ipv6First || ipv4.empty()) ? ipv6 : ipv4;
+    const string& fallbackIp = (mTargetIp == ipv4) ? ipv6 : ipv4;
 
     mState = kStateConnecting;
     CHATDS_LOG_DEBUG("Connecting to chatd using the IP: %s", mTargetIp.c_str());
@@ -616,37 +641,12 @@ void Connection::doConnect()
               mUrl.host.c_str(),
               mUrl.port,
               mUrl.path.c_str(),
-              mUrl.isSecure);
+              mUrl.isSecure,
+              fallbackIp.size() ? fallbackIp.c_str() : NULL);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)    // immediate failure for both IP families
     {
         CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            CHATDS_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mChatdClient.karereClient->websocketIO, mTargetIp.c_str(),
-                                      mUrl.host.c_str(),
-                                      mUrl.port,
-                                      mUrl.path.c_str(),
-                                      mUrl.isSecure))
-            {
-                return;
-            }
-            CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-        }
-
         onSocketClose(0, 0, "Websocket error on wsConnect (chatd)");
     }
 }
@@ -688,6 +688,11 @@ void Connection::heartbeat()
     }
 }
 
+time_t Connection::nextHeartbeatTs() const
+{
+    return mHeartbeatEnabled ? mTsLastRecv + kIdleTimeout : 0;
+}
+
 int Connection::shardNo() const
 {
     return mShardNo;
@@ -701,11 +706,13 @@ void Client::disconnect()
     }
 }
 
-promise::Promise<void> Client::retryPendingConnections()
+promise::Promise<void> Client::retryPendingConnections(bool disconnectedOnly)
 {
     std::vector<Promise<void>> promises;
     for (auto& conn: mConnections)
     {
+        if (disconnectedOnly && conn.second->isConnected())
+            continue;
         promises.push_back(conn.second->retryPendingConnection());
     }
     return promise::when(promises);
@@ -719,6 +726,20 @@ void Client::heartbeat()
     }
 }
 
+time_t Client::nextHeartbeatTs() const
+{
+    time_t next = 0;
+    for (auto& conn: mConnections)
+    {
+        time_t ts = conn.second->nextHeartbeatTs();
+        if (ts && (!next || ts < next))
+        {
+            next = ts;
+        }
+    }
+    return next;
+}
+
 bool Connection::sendBuf(Buffer&& buf)
 {
     if (!isConnected())
@@ -921,11 +942,13 @@ void Chat::onDisconnect()
         CALL_LISTENER(onHistoryDone, kHistSourceServer);
     }
     mServerFetchState = kHistNotFetching;
+    mServerHistPrefetch = false;
     setOnlineState(kChatStateOffline);
 }
 
 HistSource Chat::getHistory(unsigned count)
 {
+    mLastHistRequestCount = count;
     if (isNotifyingOldHistFromServer())
     {
         return kHistSourceServer;
@@ -950,11 +973,18 @@ HistSource Chat::getHistory(unsigned count)
                 fetchEnd = end;
             }
 
-            for (Idx i = mNextHistFetchIdx; i > fetchEnd; i--)
+            Idx i = mNextHistFetchIdx;
+            for (; i > fetchEnd; i--)
             {
                 auto& msg = at(i);
                 if (msg.isPendingToDecrypt())
                 {
+                    if (mServerHistPrefetch)
+                    {
+                        // prefetched from server and still decrypting, the history fetch
+                        // will send it to the app (see getHistoryFromDbOrServer())
+                        break;
+                    }
                     assert(false);
                     CHATID_LOG_WARNING("Skipping the load of a message still encrypted. "
                                        "msgid: %s idx: %d", ID_CSTR(msg.id()), i);
@@ -963,11 +993,12 @@ HistSource Chat::getHistory(unsigned count)
 
                 CALL_LISTENER(onRecvHistoryMessage, i, msg, getMsgStatus(msg, i), true);
             }
-            countSoFar = mNextHistFetchIdx - fetchEnd;
-            mNextHistFetchIdx -= countSoFar;
+            countSoFar = mNextHistFetchIdx - i;
+            mNextHistFetchIdx = i;
             if (countSoFar >= (int)count)
             {
                 CALL_LISTENER(onHistoryDone, kHistSourceRam);
+                scheduleHistoryPrefetch();
                 return kHistSourceRam;
             }
         }
@@ -985,6 +1016,10 @@ HistSource Chat::getHistory(unsigned count)
     {
         CALL_LISTENER(onHistoryDone, nextSource);
     }
+    if (nextSource == kHistSourceDb)
+    {
+        scheduleHistoryPrefetch();
+    }
     return nextSource;
 }
 
@@ -1007,6 +1042,8 @@ HistSource Chat::getHistoryFromDbOrServer(unsigned count)
         if (mServerFetchState & kHistOldFlag)
         {
             CHATID_LOG_DEBUG("getHistoryFromDbOrServer: Need more history, and server history fetch is already in progress, will get next messages from there");
+            // a prefetch becomes a regular fetch: the messages not sent yet are sent as they are decrypted
+            mServerHistPrefetch = false;
         }
         else
         {
@@ -1068,6 +1105,9 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     {
         CHATID_LOG_DEBUG("All backward history of chat is available locally");
     }
+    mRetentionTime = mDbInterface->getRetentionTime();
+    // so the list of chats can show it without searching the history
+    mDbInterface->loadLastTextMessage(mLastTextMsg);
 
     if (!mOldestKnownMsgId)
     {
@@ -1087,9 +1127,15 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
         loadAndProcessUnsent();
         getHistoryFromDb(initialHistoryFetchCount); // ensure we have a minimum set of messages loaded and ready
     }
+    updateNotLoggedInCount();
 }
 Chat::~Chat()
 {
+    if (mCountedNotLoggedIn)
+    {
+        assert(mClient.mChatsNotLoggedIn);
+        mClient.mChatsNotLoggedIn--;
+    }
     CALL_LISTENER(onDestroy); //we don't delete because it may have its own idea of its lifetime (i.e. it could be a GUI class)
     try { delete mCrypto; }
     catch(std::exception& e)
@@ -1104,22 +1150,28 @@ Chat::~Chat()
 
 Idx Chat::getHistoryFromDb(unsigned count)
 {
-    assert(mHasMoreHistoryInDb); //we are within the db range
-    std::vector<Message*> messages;
-    CALL_DB(fetchDbHistory, lownum()-1, count, messages);
-    for (auto msg: messages)
-    {
-        msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
-    }
+    Idx loaded = loadHistoryFromDb(count);
     if (mNextHistFetchIdx == CHATD_IDX_INVALID)
     {
-        mNextHistFetchIdx = mForwardStart - 1 - messages.size();
+        mNextHistFetchIdx = mForwardStart - 1 - loaded;
     }
     else
     {
-        mNextHistFetchIdx -= messages.size();
+        mNextHistFetchIdx -= loaded;
     }
     CALL_LISTENER(onHistoryDone, kHistSourceDb);
+    return loaded;
+}
+
+Idx Chat::loadHistoryFromDb(unsigned count)
+{
+    assert(mHasMoreHistoryInDb); //we are within the db range
+    std::vector<Message*> messages;
+    CALL_DB(fetchDbHistory, lownum()-1, count, messages);
+    for (auto msg: messages)
+    {
+        msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
+    }
 
     // If we haven't yet seen the message with the last-seen msgid, then all messages
     // in the buffer (and in the loaded range) are unseen - so we just loaded
@@ -1129,6 +1181,66 @@ Idx Chat::getHistoryFromDb(unsigned count)
     return (Idx)messages.size();
 }
 
+void Chat::scheduleHistoryPrefetch()
+{
+    if (!mClient.historyPrefetchCount || mHistPrefetchScheduled)
+        return;
+
+    // after returning to the event loop, so that the app can process the history it got first
+    mHistPrefetchScheduled = true;
+    auto wptr = weakHandle();
+    unsigned gen = mHistPrefetchGen;
+    marshallCall([wptr, this, gen]()
+    {
+        if (wptr.deleted() || gen != mHistPrefetchGen)
+            return;
+
+        mHistPrefetchScheduled = false;
+        prefetchHistory();
+    }, mClient.karereClient->appCtx);
+}
+
+void Chat::prefetchHistory()
+{
+    if ((mNextHistFetchIdx == CHATD_IDX_INVALID) || (mNextHistFetchIdx < lownum()-1)
+        || isFetchingFromServer())
+    {
+        return;
+    }
+
+    // enough for the next two requests of the app, so that they are served from RAM
+    unsigned target = std::min(std::max(mClient.historyPrefetchCount, 2 * mLastHistRequestCount),
+        (unsigned)Client::kMaxHistoryPrefetch);
+    unsigned ahead = mNextHistFetchIdx - lownum() + 1;   // in RAM and not sent to the app yet
+    if (ahead >= target)
+        return;
+
+    unsigned count = target - ahead;
+    if (mHasMoreHistoryInDb)
+    {
+        // a page per call, so that requests of the app are not delayed by a long read
+        count = std::min(count, (unsigned)Client::kHistoryPrefetchDbPage);
+        CHATID_LOG_DEBUG("Prefetching history(%u) from db...", count);
+        mHistPrefetching = true;
+        loadHistoryFromDb(count);
+        mHistPrefetching = false;
+        scheduleHistoryPrefetch();
+    }
+    else if (!mHaveAllHistory && (mOnlineState == kChatStateOnline))
+    {
+        CHATID_LOG_DEBUG("Prefetching history(%u) from server...", count);
+        mServerOldHistCbEnabled = false;
+        mServerHistPrefetch = true;
+        requestHistoryFromServer(-(int32_t)count);
+    }
+}
+
+void Chat::cancelHistoryPrefetch()
+{
+    mHistPrefetchGen++;
+    mHistPrefetchScheduled = false;
+}
+
 #define READ_ID(varname, offset)\
     assert(offset==pos-base); Id varname(buf.read<uint64_t>(pos)); pos+=sizeof(uint64_t)
 #define READ_CHATID(offset)\
@@ -1260,6 +1372,7 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_32(period, 16);
                 CHATDS_LOG_DEBUG("%s: recv RETENTION by user '%s' to %u second(s)",
                                 ID_CSTR(chatid), ID_CSTR(userid), period);
+                mChatdClient.chats(chatid).onRetentionTime(period);
                 break;
             }
             case OP_MSGID:
@@ -1547,7 +1660,11 @@ void Chat::onFetchHistDone()
         else
         {
             mServerFetchState = kHistNotFetching;
-            mNextHistFetchIdx = lownum()-1;
+            if (!mServerHistPrefetch)
+            {
+                mNextHistFetchIdx = lownum()-1;
+            }
+            mServerHistPrefetch = false;
         }
         if (mLastServerHistFetchCount <= 0)
         {
@@ -1577,6 +1694,7 @@ void Chat::onFetchHistDone()
             //we are forwarding to the app the history we are receiving from
             //server. Tell app that is complete.
             CALL_LISTENER(onHistoryDone, kHistSourceServer);
+            scheduleHistoryPrefetch();
         }
         if (mLastSeenIdx == CHATD_IDX_INVALID)
             CALL_LISTENER(onUnreadChanged);
@@ -1598,6 +1716,10 @@ void Chat::loadAndProcessUnsent()
     if (mSending.empty())
         return;
     mNextUnsent = mSending.begin();
+    for (auto it = mSending.begin(); it != mSending.end(); it++)
+    {
+        addToSendingIndex(it);
+    }
     replayUnsentNotifications();
 
     //last text message stuff
@@ -1630,7 +1752,6 @@ void Chat::replayUnsentNotifications()
         else if (item.opcode() == OP_MSGUPD)
         {
             CHATID_LOG_DEBUG("Adding a pending edit of msgid %s", ID_CSTR(item.msg->id()));
-            mPendingEdits[item.msg->id()] = item.msg;
             CALL_LISTENER(onUnsentEditLoaded, *item.msg, false);
         }
         else if (item.opcode() == OP_MSGUPDX)
@@ -1700,18 +1821,78 @@ void Chat::sendSync()
 
 Message* Chat::getMsgByXid(Id msgxid)
 {
-    for (auto& item: mSending)
+    auto item = findSendingItem(msgxid);
+    //id() of MSGUPD messages is a real msgid, not a msgxid
+    if (!item || (item->opcode() == OP_MSGUPD))
+        return nullptr;
+
+    assert(item->msg->isSending());
+    return item->msg;
+}
+
+Chat::SendingItem* Chat::findSendingItem(Id id)
+{
+    // the NEWMSG of a msgxid is always queued before its edits
+    auto it = mSendingByXid.find(id);
+    if (it != mSendingByXid.end())
+        return &(*it->second);
+
+    auto edits = mSendingEdits.find(id);
+    if (edits != mSendingEdits.end())
+        return &(*edits->second.front());
+
+    return nullptr;
+}
+
+void Chat::addToSendingIndex(OutputQueue::iterator it)
+{
+    assert(it->msg);
+    if (it->opcode() == OP_NEWMSG)
     {
-        if (!item.msg)
-            continue;
-        //id() of MSGUPD messages is a real msgid, not a msgxid
-        if ((item.msg->id() == msgxid) && (item.opcode() != OP_MSGUPD))
-        {
-            assert(item.msg->isSending());
-            return item.msg;
-        }
+        mSendingByXid[it->msg->id()] = it;
+    }
+    else if (it->isEdit())
+    {
+        mSendingEdits[it->msg->id()].push_back(it);
+        updatePendingEdit(it->msg->id());
+    }
+}
+
+void Chat::removeFromSendingIndex(OutputQueue::iterator it)
+{
+    assert(it->msg);
+    if (it->opcode() == OP_NEWMSG)
+    {
+        mSendingByXid.erase(it->msg->id());
+        return;
+    }
+    if (!it->isEdit())
+        return;
+
+    auto edits = mSendingEdits.find(it->msg->id());
+    if (edits == mSendingEdits.end())
+        return;
+
+    auto& items = edits->second;
+    items.erase(std::remove(items.begin(), items.end(), it), items.end());
+    if (items.empty())
+    {
+        mSendingEdits.erase(edits);
+    }
+    updatePendingEdit(it->msg->id());
+}
+
+void Chat::updatePendingEdit(Id id)
+{
+    auto edits = mSendingEdits.find(id);
+    if (edits == mSendingEdits.end())
+    {
+        mPendingEdits.erase(id);
+    }
+    else
+    {
+        mPendingEdits[id] = edits->second.back()->msg;
     }
-    return nullptr;
 }
 
 bool Chat::haveAllHistoryNotified() const
@@ -2079,7 +2260,10 @@ void Chat::createMsgBackRefs(Chat::OutputQueue::iterator msgit)
 Chat::SendingItem* Chat::postMsgToSending(uint8_t opcode, Message* msg)
 {
     mSending.emplace_back(opcode, msg, mUsers);
+    addToSendingIndex(std::prev(mSending.end()));
     CALL_DB(saveMsgToSending, mSending.back());
+    // the message must not be sent before it's in the send queue of the db
+    CALL_DB(commit);
     if (mNextUnsent == mSending.end())
     {
         mNextUnsent--;
@@ -2166,15 +2350,7 @@ Message* Chat::msgModify(Message& msg, const char* newdata, size_t newlen, void*
 
     if (msg.isSending()) //update the not yet sent(or at least not yet confirmed) original as well, trying to avoid sending the original content
     {
-        SendingItem* item = nullptr;
-        for (auto& loopItem: mSending)
-        {
-            if (loopItem.msg->id() == msg.id())
-            {
-                item = &loopItem;
-                break;
-            }
-        }
+        SendingItem* item = findSendingItem(msg.id());
         assert(item);
         if ((item->opcode() == OP_MSGUPD) || (item->opcode() == OP_MSGUPDX))
         {
@@ -2265,6 +2441,15 @@ void Chat::onLastReceived(Id msgid)
     }
 }
 
+void Chat::onRetentionTime(uint32_t period)
+{
+    if (period == mRetentionTime)
+        return;
+
+    mRetentionTime = period;
+    CALL_DB(setRetentionTime, period);
+}
+
 void Chat::onLastSeen(Id msgid)
 {
     Idx idx = CHATD_IDX_INVALID;
@@ -2307,7 +2492,7 @@ void Chat::onLastSeen(Id msgid)
     {
         // it means the SEEN sent to chatd was not applied remotely (network issue), but it was locally
         CHATID_LOG_WARNING("onLastSeen: chatd last seen message is older than local last seen message. Updating chatd...");
-        sendCommand(Command(OP_SEEN) + mChatId + mLastSeenId);
+        sendCommand(CommandBuilder::build(OP_SEEN, mChatId, mLastSeenId));
         return;
     }
 
@@ -2367,7 +2552,7 @@ bool Chat::setMessageSeen(Idx idx)
             return;
 
         CHATID_LOG_DEBUG("setMessageSeen: Setting last seen msgid to %s", ID_CSTR(id));
-        sendCommand(Command(OP_SEEN) + mChatId + id);
+        sendCommand(CommandBuilder::build(OP_SEEN, mChatId, id));
 
         Idx notifyStart;
         if (mLastSeenIdx == CHATD_IDX_INVALID)
@@ -2474,6 +2659,7 @@ void Chat::moveItemToManualSending(OutputQueue::iterator it, ManualSendReason re
     CALL_DB(deleteItemFromSending, it->rowid);
     CALL_DB(saveItemToManualSending, *it, reason);
     CALL_LISTENER(onManualSendRequired, it->msg, it->rowid, reason); //GUI should put this message at end of that list of messages requiring 'manual' resend
+    removeFromSendingIndex(it);
     it->msg = nullptr; //don't delete the Message object, it will be owned by the app
     mSending.erase(it);
 }
@@ -2509,7 +2695,7 @@ void Chat::joinRangeHist(const ChatDbInfo& dbInfo)
     CHATID_LOG_DEBUG("Sending JOINRANGEHIST based on app db: %s - %s",
             dbInfo.oldestDbId.toString().c_str(), dbInfo.newestDbId.toString().c_str());
 
-    sendCommand(Command(OP_JOINRANGEHIST) + mChatId + dbInfo.oldestDbId + at(highnum()).id());
+    sendCommand(CommandBuilder::build(OP_JOINRANGEHIST, mChatId, dbInfo.oldestDbId, at(highnum()).id()));
 }
 
 Client::~Client()
@@ -2583,9 +2769,10 @@ Message* Chat::msgRemoveFromSending(Id msgxid, Id msgid)
         return nullptr;
     }
     auto msg = item.msg;
-    item.msg = nullptr;
     assert(msg);
     assert(msg->isSending());
+    removeFromSendingIndex(mSending.begin());
+    item.msg = nullptr;
 
     CALL_DB(deleteItemFromSending, item.rowid);
     mSending.pop_front(); //deletes item
@@ -2614,15 +2801,22 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
     auto idx = mIdToIndexMap[msgid] = highnum();
     CALL_DB(addMsgToHistory, *msg, idx);
     //update any following MSGUPDX-s referring to this msgxid
-    for (auto& item: mSending)
+    auto edits = mSendingEdits.find(msgxid);
+    if (edits != mSendingEdits.end())
     {
-        if (item.msg->id() == msgxid)
+        auto items = std::move(edits->second);
+        mSendingEdits.erase(edits);
+        auto& msgidEdits = mSendingEdits[msgid];
+        for (auto it: items)
         {
-            assert(item.opcode() == OP_MSGUPDX);
-            CALL_DB(sendingItemMsgupdxToMsgupd, item, msgid);
-            item.msg->setId(msgid, false);
-            item.setOpcode(OP_MSGUPD);
+            assert(it->opcode() == OP_MSGUPDX);
+            CALL_DB(sendingItemMsgupdxToMsgupd, *it, msgid);
+            it->msg->setId(msgid, false);
+            it->setOpcode(OP_MSGUPD);
+            msgidEdits.push_back(it);
         }
+        updatePendingEdit(msgxid);
+        updatePendingEdit(msgid);
     }
     CALL_LISTENER(onMessageConfirmed, msgxid, *msg, idx);
 
@@ -2640,6 +2834,8 @@ Idx Chat::msgConfirm(Id msgxid, Id msgid)
                 mLastTextMsg.confirm(idx, msgid);
                 if (!mLastTextMsg.mIsNotified)
                     notifyLastTextMsg();
+                else
+                    saveLastTextMsg();
             }
         }
         else if (idx > mLastTextMsg.idx())
@@ -2735,6 +2931,7 @@ void Chat::rejectMsgupd(Id id, uint8_t serverReason)
     {
         CHATID_LOG_DEBUG("Message can't be update with meta contained. Reason: %d", serverReason);
         CALL_DB(deleteItemFromSending, mSending.front().rowid);
+        removeFromSendingIndex(mSending.begin());
         mSending.pop_front();
         return;
     }
@@ -2748,6 +2945,7 @@ void Chat::rejectMsgupd(Id id, uint8_t serverReason)
     {
         CALL_LISTENER(onEditRejected, msg, kManualSendEditNoChange);
         CALL_DB(deleteItemFromSending, mSending.front().rowid);
+        removeFromSendingIndex(mSending.begin());
         mSending.pop_front();
     }
     else
@@ -2770,25 +2968,22 @@ void Chat::onMsgUpdated(Message* cipherMsg)
     time_t updateTs = 0;
     bool richLinkRemoved = false;
 
-    if (cipherMsg->userid == client().userId())
+    auto edits = (cipherMsg->userid == client().userId())
+        ? mSendingEdits.find(cipherMsg->id())
+        : mSendingEdits.end();
+    if (edits != mSendingEdits.end())
     {
-        for (auto it = mSending.begin(); it != mSending.end(); )
+        auto items = std::move(edits->second);
+        mSendingEdits.erase(edits);
+        mPendingEdits.erase(cipherMsg->id());
+        for (auto it: items)
         {
-            auto& item = *it;
-            if (((item.opcode() != OP_MSGUPD) && (item.opcode() != OP_MSGUPDX))
-                || (item.msg->id() != cipherMsg->id()))
-            {
-                it++;
-                continue;
-            }
-            //erase item
-            CALL_DB(deleteItemFromSending, item.rowid);
-            auto erased = it;
-            it++;
-            mPendingEdits.erase(cipherMsg->id());
-            mSending.erase(erased);
-            updateTs = item.msg->updated;
-            richLinkRemoved = item.msg->richLinkRemoved;
+            CALL_DB(deleteItemFromSending, it->rowid);
+            updateTs = it->msg->updated;
+            richLinkRemoved = it->msg->richLinkRemoved;
+            if (mNextUnsent == it)
+                mNextUnsent++;
+            mSending.erase(it);
         }
     }
     mCrypto->msgDecrypt(cipherMsg)
@@ -3052,6 +3247,145 @@ void Chat::deleteMessagesBefore(Idx idx)
     }
 }
 
+NodeAccess Chat::nodeAccess(karere::Id nodehandle, Idx beforeIdx)
+{
+    try
+    {
+        return mDbInterface->getNodeAccess(nodehandle, beforeIdx);
+    }
+    catch(std::exception& e)
+    {
+        CHATID_LOG_ERROR("Exception thrown from DbInterface::getNodeAccess():\n%s", e.what());
+        return kNodeAccessUnknown;
+    }
+}
+
+void Chat::nodeAttachmentMsgids(karere::Id nodehandle, std::vector<karere::Id>& msgids)
+{
+    CALL_DB(getNodeAttachmentMsgids, nodehandle, msgids);
+}
+
+void Chat::fetchNodeHistory(Idx beforeIdx, unsigned count, std::vector<std::pair<Idx, Message*>>& messages)
+{
+    CALL_DB(fetchNodeHistory, beforeIdx, count, messages);
+}
+
+Idx Chat::seekMsgid(karere::Id msgid)
+{
+    Idx idx = msgIndexFromId(msgid);
+    if (idx != CHATD_IDX_INVALID)
+        return idx;
+
+    try
+    {
+        return mDbInterface->getIdxOfMsgid(msgid);
+    }
+    catch(std::exception& e)
+    {
+        CHATID_LOG_ERROR("Exception thrown from DbInterface::getIdxOfMsgid():\n%s", e.what());
+        return CHATD_IDX_INVALID;
+    }
+}
+
+Idx Chat::seekTs(uint32_t ts)
+{
+    try
+    {
+        return mDbInterface->getIdxOfTs(ts);
+    }
+    catch(std::exception& e)
+    {
+        CHATID_LOG_ERROR("Exception thrown from DbInterface::getIdxOfTs():\n%s", e.what());
+        return CHATD_IDX_INVALID;
+    }
+}
+
+bool Chat::getHistoryWindow(Idx from, Idx to, const std::function<void(Idx, const Message&)>& cb)
+{
+    if (from > to)
+        return true;
+
+    // the buffer is a contiguous range, so the window is at most: db, buffer, db
+    std::vector<std::pair<Idx, Message*>> older;
+    std::vector<std::pair<Idx, Message*>> newer;
+    Idx ramFrom = empty() ? to + 1 : std::max(from, lownum());
+    Idx ramTo = empty() ? to : std::min(to, highnum());
+    if (from < ramFrom)
+    {
+        CALL_DB(fetchDbHistoryRange, from, std::min(to, ramFrom - 1), older);
+    }
+    if (!empty() && ramTo < to)
+    {
+        CALL_DB(fetchDbHistoryRange, std::max(from, ramTo + 1), to, newer);
+    }
+
+    bool complete = mHaveAllHistory || (older.size() && older.front().first == from)
+            || (older.empty() && from >= ramFrom);
+    for (auto& item: older)
+    {
+        cb(item.first, *item.second);
+        delete item.second;
+    }
+    for (Idx i = ramFrom; i <= ramTo; i++)
+    {
+        cb(i, at(i));
+    }
+    for (auto& item: newer)
+    {
+        cb(item.first, *item.second);
+        delete item.second;
+    }
+    return complete;
+}
+
+unsigned Chat::pruneDbHistory(uint32_t ts, unsigned maxCount)
+{
+    // A joined chat is not pruned: chatd sends the older history from the oldest message
+    // that the db had when the chat joined, so the pruned range would become a gap in it
+    if (!mHasMoreHistoryInDb || empty() || !maxCount
+        || (mOnlineState >= kChatStateJoining) || isFetchingFromServer())
+    {
+        return 0;
+    }
+
+    Idx last = mDbInterface->getIdxOfTs(ts);
+    if (last == CHATD_IDX_INVALID)
+    {
+        return 0;
+    }
+
+    // the messages below the buffer are deleted from the oldest one, so what remains in
+    // the db is still contiguous with the buffer
+    Idx oldest = mDbInterface->getOldestIdx();
+    Idx end = std::min(std::min(last + 1, lownum()), oldest + (Idx)maxCount);
+    if (end <= oldest)
+    {
+        return 0;
+    }
+
+    CALL_DB(deleteHistoryBefore, end);
+    if (end == lownum())
+    {
+        mHasMoreHistoryInDb = false;
+        mOldestKnownMsgId = at(lownum()).id();
+    }
+    else
+    {
+        ChatDbInfo info;
+        mDbInterface->getHistoryInfo(info);
+        mOldestKnownMsgId = info.oldestDbId;
+    }
+
+    // the deleted messages must be fetched from the server again
+    if (mHaveAllHistory)
+    {
+        mHaveAllHistory = false;
+        CALL_DB(setHaveAllHistory, false);
+    }
+    CHATID_LOG_DEBUG("Pruned %d message(s) sent before %u from the local history", end - oldest, ts);
+    return end - oldest;
+}
+
 Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
 {
     assert(idx != CHATD_IDX_INVALID);
@@ -3061,15 +3395,9 @@ Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
             return Message::kSending;
 
         // Check if we have an unconfirmed edit
-        for (auto& item: mSending)
-        {
-            if (item.msg->id() == msg.id())
-            {
-                auto op = item.opcode();
-                if (op == OP_MSGUPD || op == OP_MSGUPDX)
-                    return Message::kSending;
-            }
-        }
+        if (mSendingEdits.find(msg.id()) != mSendingEdits.end())
+            return Message::kSending;
+
         if (idx <= mLastReceivedIdx)
             return Message::kDelivered;
         else
@@ -3162,6 +3490,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         else    // --> unknown management msg type, we may want to try to decode it again
         {
             Message *message = &msg;
+            bool prefetching = mHistPrefetching;
             mCrypto->msgDecrypt(message)
             .fail([this, message](const promise::Error& err) -> promise::Promise<Message*>
             {
@@ -3183,13 +3512,16 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
                 }
                 return message;
             })
-            .then([this, isNew, idx](Message* message)
+            .then([this, isNew, idx, prefetching](Message* message)
             {
                 if (message->isEncrypted() != Message::kEncryptedNoType)
                 {
                     CALL_DB(updateMsgInHistory, message->id(), *message);   // update 'data' & 'is_encrypted'
                 }
+                // if it was prefetched, it's sent to the app by getHistory()
+                mHistPrefetching = prefetching;
                 msgIncomingAfterDecrypt(isNew, true, *message, idx);
+                mHistPrefetching = false;
             })
             .fail([this, message](const promise::Error& err)
             {
@@ -3346,8 +3678,11 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
                 (mDecryptOldHaltedAt == CHATD_IDX_INVALID))
             {
                 mServerFetchState = kHistNotFetching;
+                mServerHistPrefetch = false;
                 if (mServerOldHistCbEnabled)
                 {
+                    // as in onFetchHistDone(), the decrypted messages have been sent to the app
+                    mNextHistFetchIdx = lownum()-1;
                     CALL_LISTENER(onHistoryDone, kHistSourceServer);
                 }
             }
@@ -3405,7 +3740,7 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             mLastIdReceivedFromServer = msgid;
             // TODO: the update of those variables should be persisted
 
-            sendCommand(Command(OP_RECEIVED) + mChatId + msgid);
+            sendCommand(CommandBuilder::build(OP_RECEIVED, mChatId, msgid));
         }
     }
     if (msg.backRefId && !mRefidToIdxMap.emplace(msg.backRefId, idx).second)
@@ -3431,7 +3766,7 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             isChatRoomOpened = it->second->hasChatHandler();
         }
 
-        if (isLocal || (mServerOldHistCbEnabled && isChatRoomOpened))
+        if ((isLocal && !mHistPrefetching) || (mServerOldHistCbEnabled && isChatRoomOpened))
         {
             CALL_LISTENER(onRecvHistoryMessage, idx, msg, status, isLocal);
         }
@@ -3600,6 +3935,31 @@ void Chat::resetGetHistory()
 {
     mNextHistFetchIdx = CHATD_IDX_INVALID;
     mServerOldHistCbEnabled = false;
+    cancelHistoryPrefetch();
+}
+
+void Chat::disable(bool state)
+{
+    mIsDisabled = state;
+    updateNotLoggedInCount();
+}
+
+void Chat::updateNotLoggedInCount()
+{
+    bool notLoggedIn = (mOnlineState != kChatStateOnline) && !mIsDisabled;
+    if (notLoggedIn == mCountedNotLoggedIn)
+        return;
+
+    mCountedNotLoggedIn = notLoggedIn;
+    if (notLoggedIn)
+    {
+        mClient.mChatsNotLoggedIn++;
+    }
+    else
+    {
+        assert(mClient.mChatsNotLoggedIn);
+        mClient.mChatsNotLoggedIn--;
+    }
 }
 
 void Chat::setOnlineState(ChatState state)
@@ -3608,6 +3968,7 @@ void Chat::setOnlineState(ChatState state)
         return;
 
     mOnlineState = state;
+    updateNotLoggedInCount();
     CHATID_LOG_DEBUG("Online state changed to %s", chatStateToStr(mOnlineState));
     CALL_CRYPTO(onOnlineStateChange, state);
     CALL_LISTENER(onOnlineStateChange, state);
@@ -3643,6 +4004,17 @@ void Chat::notifyLastTextMsg()
 {
     CALL_LISTENER(onLastTextMessageUpdated, mLastTextMsg);
     mLastTextMsg.mIsNotified = true;
+    saveLastTextMsg();
+}
+
+void Chat::saveLastTextMsg()
+{
+    // a message in the send queue is found again when the queue is loaded, so the
+    // stored one is still the last of the history
+    if (mLastTextMsg.isValid() && (mLastTextMsg.idx() == CHATD_IDX_INVALID))
+        return;
+
+    CALL_DB(saveLastTextMessage, mLastTextMsg);
 }
 
 uint8_t Chat::lastTextMessage(LastTextMsg*& msg)
@@ -3661,6 +4033,7 @@ uint8_t Chat::lastTextMessage(LastTextMsg*& msg)
 
     if (mLastTextMsg.isValid()) // findLastTextMsg() may have found it locally
     {
+        saveLastTextMsg();
         msg = &mLastTextMsg;
         return LastTextMsgState::kHave;
     }
@@ -3739,6 +4112,14 @@ bool Chat::findLastTextMsg()
 
 void Chat::findAndNotifyLastTextMsg()
 {
+    // Called only when the last text message is unknown or no longer valid: it was deleted,
+    // turned into a management message, removed from the send queue or cut by a truncate.
+    // The search stops at the first valid message, newest first, in the send queue, RAM and
+    // the db. This is usually the message right before it. The server is asked only when
+    // none is left locally and the history is incomplete.
+    // The stored message may be gone, it's stored again when notified
+    CALL_DB(saveLastTextMessage, LastTextMsgState());
+
     auto wptr = weakHandle();
     marshallCall([wptr, this]() //prevent re-entrancy
     {
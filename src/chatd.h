@@ -5,6 +5,7 @@
 #include <string>
 #include <buffer.h>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <list>
 #include <deque>
@@ -65,6 +66,15 @@ enum HistSource
     kHistSourceServer = 3, //< History is being retrieved from the server
     kHistSourceNotLoggedIn = 4 //< History has to be fetched from server, but we are not logged in yet
 };
+/** Access to a node attached to the chat, according to the newest attachment
+ * or revoke message for it in the local history */
+enum NodeAccess
+{
+    kNodeAccessUnknown = -1, //< No attachment nor revoke message for the node in the local history
+    kNodeAccessRevoked = 0,
+    kNodeAccessGranted = 1
+};
+
 /** Timeout to send SEEN (Milliseconds)**/
 enum { kSeenTimeout = 200 };
 /** Timeout to recv SYNC (Milliseconds)**/
@@ -398,12 +408,17 @@ public:
     const std::set<karere::Id>& chatIds() const { return mChatIds; }
     uint32_t clientId() const { return mClientId; }
     promise::Promise<void> retryPendingConnection();
+    /** @brief Priority of the reconnection attempts in the client's ReconnectScheduler */
+    int reconnectPriority() const;
     virtual ~Connection()
     {
         disconnect();
     }
 
     void heartbeat();
+    /** @brief The time at which the connection is considered idle, if nothing is
+     * received until then, or 0 if not connected */
+    time_t nextHeartbeatTs() const;
 
     int shardNo() const;
     promise::Promise<void> sendSync();
@@ -566,6 +581,8 @@ protected:
     std::vector<std::unique_ptr<Message>> mBackwardList;
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
+    /// NEWMSG items of mSending by msgxid
+    std::unordered_map<karere::Id, OutputQueue::iterator> mSendingByXid;
     bool mIsFirstJoin = true;
     std::map<karere::Id, Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
@@ -596,8 +613,23 @@ protected:
     bool mServerOldHistCbEnabled = false;
     /** @brief Have reached the beggining of the history (not necessarily the end of it) */
     bool mHaveAllHistory = false;
+    /** Retention time of the chat set in the server, in seconds. 0 if disabled */
+    uint32_t mRetentionTime = 0;
     bool mIsDisabled = false;
+    /** Whether the chat is counted in Client::mChatsNotLoggedIn */
+    bool mCountedNotLoggedIn = false;
     Idx mNextHistFetchIdx = CHATD_IDX_INVALID;
+    /** The count of the last getHistory(), the read-ahead of history adapts to it */
+    unsigned mLastHistRequestCount = 0;
+    /** A prefetchHistory() call has been marshalled and not run yet */
+    bool mHistPrefetchScheduled = false;
+    /** Incremented by cancelHistoryPrefetch(), to discard the marshalled prefetchHistory() calls */
+    unsigned mHistPrefetchGen = 0;
+    /** Messages are being loaded from db ahead of the app, they must not be sent to it */
+    bool mHistPrefetching = false;
+    /** The history fetch from server in progress was started by the prefetch, so the
+     * messages are kept in RAM for the next getHistory() instead of being sent to the app */
+    bool mServerHistPrefetch = false;
     DbInterface* mDbInterface = nullptr;
     // last text message stuff
     LastTextMsgState mLastTextMsg;
@@ -637,6 +669,10 @@ protected:
     bool mIsGroup;
     std::set<karere::Id> mMsgsToUpdateWithRichLink;
     // ====
+    /// MSGUPD and MSGUPDX items of mSending by the msgid or msgxid of the message
+    /// they edit, in the order of the queue
+    std::unordered_map<karere::Id, std::vector<OutputQueue::iterator>> mSendingEdits;
+    /// The latest of mSendingEdits for each message, see pendingEdits()
     std::map<karere::Id, Message*> mPendingEdits;
     std::map<BackRefId, Idx> mRefidToIdxMap;
     std::set<EndpointId> mCallParticipants;
@@ -665,12 +701,17 @@ protected:
     void initialFetchHistory(karere::Id serverNewest);
     void requestHistoryFromServer(int32_t count);
     Idx getHistoryFromDb(unsigned count);
+    Idx loadHistoryFromDb(unsigned count);
     HistSource getHistoryFromDbOrServer(unsigned count);
+    void scheduleHistoryPrefetch();
+    void prefetchHistory();
     void onLastReceived(karere::Id msgid);
     void onLastSeen(karere::Id msgid);
+    void onRetentionTime(uint32_t period);
     void handleLastReceivedSeen(karere::Id msgid);
     bool msgSend(const Message& message);
     void setOnlineState(ChatState state);
+    void updateNotLoggedInCount();
     SendingItem* postMsgToSending(uint8_t opcode, Message* msg);
     bool sendKeyAndMessage(std::pair<MsgCommand*, KeyCommand*> cmd);
     void flushOutputQueue(bool fromStart=false);
@@ -686,6 +727,7 @@ protected:
     void handleBroadcast(karere::Id userid, uint8_t type);
     void findAndNotifyLastTextMsg();
     void notifyLastTextMsg();
+    void saveLastTextMsg();
     void onMsgTimestamp(uint32_t ts); //support for newest-message-timestamp
     bool manualResendWhenUserJoins() const;
     void onInCall(karere::Id userid, uint32_t clientid);
@@ -723,7 +765,7 @@ public:
     bool empty() const { return mForwardList.empty() && mBackwardList.empty();}
     bool isDisabled() const { return mIsDisabled; }
     bool isFirstJoin() const { return mIsFirstJoin; }
-    void disable(bool state) { mIsDisabled = state; }
+    void disable(bool state);
     /** The index of the oldest decrypted message in the RAM history buffer.
      * This will be greater than lownum() if there are not-yet-decrypted messages
      * at the start of the buffer, i.e. when more history has been fetched, but
@@ -760,7 +802,8 @@ public:
     /** @brief Contains all not-yet-confirmed edits of messages.
       *  This can be used by the app to replace the text of messages who have
       * been edited before they have been sent/confirmed. Normally the app needs
-      * to display the edited text in the unsent message.*/
+      * to display the edited text in the unsent message. If a message was edited
+      * more than once, it has the latest edit */
     const std::map<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
 
     /** @brief Whether the listener will be notified upon receiving
@@ -799,6 +842,64 @@ public:
      * sinte the last call to \c resetGetHistory()
      */
     bool haveAllHistoryNotified() const;
+
+    /**
+     * @brief Returns the access to an attached node, as per the node index of the
+     * local db. Unlike the RAM history buffer, the index covers all history ever
+     * stored locally.
+     * @param beforeIdx Only messages older than this index are considered.
+     * CHATD_IDX_INVALID to consider all the local history
+     */
+    NodeAccess nodeAccess(karere::Id nodehandle, Idx beforeIdx=CHATD_IDX_INVALID);
+
+    /** @brief Returns the ids of the local attachment messages that contain the node */
+    void nodeAttachmentMsgids(karere::Id nodehandle, std::vector<karere::Id>& msgids);
+
+    /**
+     * @brief Loads from the local db the node attachment messages older than
+     * \c beforeIdx, newest first, without touching the history buffer.
+     * You take the ownership of the returned messages.
+     */
+    void fetchNodeHistory(Idx beforeIdx, unsigned count, std::vector<std::pair<Idx, Message*>>& messages);
+
+    /**
+     * @brief Returns the index of a message in the RAM history buffer or, if not loaded,
+     * in the local db. CHATD_IDX_INVALID if it's not known locally
+     */
+    Idx seekMsgid(karere::Id msgid);
+
+    /**
+     * @brief Returns the index of the newest local message sent at or before \c ts,
+     * or CHATD_IDX_INVALID if all of the local history is newer
+     */
+    Idx seekTs(uint32_t ts);
+
+    /**
+     * @brief Calls \c cb for the messages with index in [\c from, \c to], oldest first,
+     * to show a window of history that doesn't need to be contiguous with the history buffer.
+     * The messages in the buffer are passed from it, and the rest are read from the local db
+     * via the (chatid, idx) index, without adding them to the buffer. The messages passed to
+     * \c cb are only valid during the call.
+     * @return false if part of the range is older than the local history and not all
+     * history has been fetched yet (it must be fetched from the server via \c getHistory())
+     */
+    bool getHistoryWindow(Idx from, Idx to, const std::function<void(Idx, const Message&)>& cb);
+
+    /** @brief The retention time of the chat set in the server, in seconds. 0 if disabled */
+    uint32_t retentionTime() const { return mRetentionTime; }
+
+    /**
+     * @brief Deletes from the local db up to \c maxCount of the oldest messages sent before
+     * \c ts, in order to keep only a window of the history locally. Only the messages older
+     * than the history buffer are deleted, so the buffer is not affected. The deleted messages
+     * are fetched again from the server if the app requests them via \c getHistory().
+     * A chat that is joining or joined is not pruned, since chatd sends its older history
+     * from the oldest message known at the join (the JOINRANGEHIST range).
+     * @return The number of messages deleted. Less than \c maxCount if there are no more
+     * messages to delete (or they can't be deleted right now, i.e. while joined or during
+     * a history fetch)
+     */
+    unsigned pruneDbHistory(uint32_t ts, unsigned maxCount);
     /**
      * @brief The last number of history messages that have actually been
      * returned to the app via * \c getHitory() */
@@ -897,6 +998,13 @@ public:
      */
     void resetGetHistory();
 
+    /**
+     * @brief Cancels the read-ahead of history started by getHistory(), i.e. when the
+     * app closes the chatroom. A fetch from server that is already in progress is
+     * completed, but its messages are only kept in RAM.
+     */
+    void cancelHistoryPrefetch();
+
     /**
      * @brief setMessageSeen Move the last-seen-by-us pointer to the message with the
      * specified index.
@@ -977,10 +1085,12 @@ public:
     int unreadMsgCount() const;
 
     /** @brief Returns the text of the most-recent message in the chat that can
-     * be displayed as text in the chat list. If it is not found in RAM,
-     * the database will be queried. If not found there as well, server is queried,
-     * and 0xff is returned. When the message is received from server, the
-     * \c onLastTextMsgUpdated callback will be called.
+     * be displayed as text in the chat list. It's kept as messages are received
+     * and edited, and stored in the database, so normally it's returned directly.
+     * Otherwise, if it is not found in RAM, the database will be queried. If not
+     * found there as well, server is queried, and 0xff is returned. When the
+     * message is received from server, the \c onLastTextMsgUpdated callback
+     * will be called.
      * @param [out] msg Output pointer that will be set to the internal last-text-message
      * object. The object is owned by the client, and you should use this
      * pointer synchronously after the call to this function, and not in an
@@ -1075,6 +1185,11 @@ protected:
     void rejectMsgupd(karere::Id id, uint8_t serverReason);
     void rejectGeneric(uint8_t opcode, uint8_t reason);
     void moveItemToManualSending(OutputQueue::iterator it, ManualSendReason reason);
+    void addToSendingIndex(OutputQueue::iterator it);
+    void removeFromSendingIndex(OutputQueue::iterator it);
+    void updatePendingEdit(karere::Id id);
+    /** @brief The first item of the send queue with a message of that id, or nullptr */
+    SendingItem* findSendingItem(karere::Id id);
     void handleTruncate(const Message& msg, Idx idx);
     void deleteMessagesBefore(Idx idx);
     void createMsgBackRefs(OutputQueue::iterator msgit);
@@ -1105,6 +1220,8 @@ protected:
     std::map<int, std::shared_ptr<Connection>> mConnections;
 /// maps a chatid to the handling Shard connection
     std::map<karere::Id, Connection*> mConnectionForChatId;
+/// number of chats that are neither logged in nor disabled (updated by the chats themselves)
+    size_t mChatsNotLoggedIn = 0;
 /// maps chatids to the Message object
     std::map<karere::Id, std::shared_ptr<Chat>> mChatForChatId;
 /// set of seen timers
@@ -1128,7 +1245,15 @@ protected:
 public:
     enum: uint32_t { kOptManualResendWhenUserJoins = 1 };
     enum: uint8_t { kRichLinkNotDefined = 0,  kRichLinkEnabled = 1, kRichLinkDisabled = 2};
+    /** Maximum number of messages loaded ahead of the app, and per db read of the prefetch */
+    enum { kMaxHistoryPrefetch = 512, kHistoryPrefetchDbPage = 64 };
     unsigned inactivityCheckIntervalSec = 20;
+    /** Minimum number of messages that each chat keeps loaded (from db, or from server and
+     * decrypted) ahead of the messages sent to the app by Chat::getHistory(). It grows with
+     * the count requested by the app, up to kMaxHistoryPrefetch. Zero, the default, disables
+     * the prefetch, since it also fetches from the server history that the app may never show.
+     * Set by the app via karere::Client::setHistoryPrefetch() */
+    unsigned historyPrefetchCount = 0;
     uint32_t options = 0;
     MyMegaApi *mApi;
     karere::Client *karereClient;
@@ -1160,8 +1285,12 @@ public:
     /** @brief Leaves the specified chatroom */
     void leave(karere::Id chatid);
     void disconnect();
-    promise::Promise<void> retryPendingConnections();
+    /** @brief Reconnects all the shard connections, or only the ones that are not
+     * connected if \c disconnectedOnly is true, without waiting for their retry backoff */
+    promise::Promise<void> retryPendingConnections(bool disconnectedOnly = false);
     void heartbeat();
+    /** @brief The earliest idle deadline of the connections, or 0 if none is connected */
+    time_t nextHeartbeatTs() const;
     bool manualResendWhenUserJoins() const { return options & kOptManualResendWhenUserJoins; }
     void notifyUserIdle();
     void notifyUserActive();
@@ -1249,6 +1378,28 @@ public:
     virtual bool haveAllHistory() = 0;
     virtual void getLastTextMessage(Idx from, chatd::LastTextMsgState& msg) = 0;
     virtual void clearHistory() = 0;
+    /// Node index, filled by \c addMsgToHistory() from attachment and revoke messages.
+    /// See Chat::nodeAccess() and Chat::fetchNodeHistory()
+    virtual NodeAccess getNodeAccess(karere::Id nodehandle, Idx beforeIdx) = 0;
+    virtual void getNodeAttachmentMsgids(karere::Id nodehandle, std::vector<karere::Id>& msgids) = 0;
+    virtual void fetchNodeHistory(Idx beforeIdx, unsigned count, std::vector<std::pair<Idx, Message*>>& messages) = 0;
+    /// Durability barrier: the changes done so far must survive a crash of the app
+    virtual void commit() = 0;
+    /// Random access to the history, see Chat::getHistoryWindow() and Chat::seekTs().
+    /// \c fetchDbHistoryRange returns the messages with index in [from, to], oldest first
+    virtual void fetchDbHistoryRange(Idx from, Idx to, std::vector<std::pair<Idx, Message*>>& messages) = 0;
+    virtual Idx getIdxOfTs(uint32_t ts) = 0;
+    /// Pruning of the local history, see Chat::pruneDbHistory(). Deletes the messages with
+    /// index lower than \c idx, without implying that the history starts there (unlike truncate)
+    virtual void deleteHistoryBefore(Idx idx) = 0;
+    /// Retention time of the chat set in the server (OP_RETENTION), in seconds. 0 if disabled
+    virtual void setRetentionTime(uint32_t period) = 0;
+    virtual uint32_t getRetentionTime() = 0;
+    /// Last text message of the history (not of the send queue), kept so the list of chats
+    /// doesn't have to search for it, see Chat::lastTextMessage(). \c saveLastTextMessage
+    /// forgets it if \c msg is not valid or has no index
+    virtual void saveLastTextMessage(const LastTextMsgState& msg) = 0;
+    virtual void loadLastTextMessage(LastTextMsgState& msg) = 0;
     virtual ~DbInterface(){}
 };
 
@@ -3,6 +3,8 @@
 
 #include "db.h"
 #include "chatd.h"
+#include "historyCodec.h"
+#include <rapidjson/document.h>
 //extern sqlite3* db;
 
 class ChatdSqliteDb: public chatd::DbInterface
@@ -12,9 +14,18 @@ protected:
     chatd::Chat& mChat;
     std::string mSendingTblName;
     std::string mHistTblName;
+    // whether the FTS5 table exists (see Client::createDbSchema())
+    bool mTextSearch = false;
+    // compresses the payloads of history, if not null
+    karere::HistoryCodec* mCodec;
 public:
-    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, const std::string& sendingTblName="sending", const std::string& histTblName="history")
-        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
+    ChatdSqliteDb(chatd::Chat& chat, SqliteDb& db, karere::HistoryCodec* codec=nullptr,
+        const std::string& sendingTblName="sending", const std::string& histTblName="history")
+        :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName), mCodec(codec)
+    {
+        SqliteStmt stmt(mDb, "select 1 from sqlite_master where type = 'table' and name = 'text_search'");
+        mTextSearch = stmt.step();
+    }
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
         SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
@@ -138,24 +149,216 @@ public:
             assert(false);
         }
 #endif
+        Buffer packed;
+        uint8_t format = encodeData(msg, packed);
         mDb.query("insert into history"
-            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
-            "values(?,?,?,?,?,?,?,?,?,?,?)", idx, mChat.chatId(), msg.id(), msg.keyid,
-            msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
+            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted, compression) "
+            "values(?,?,?,?,?,?,?,?,?,?,?,?)", idx, mChat.chatId(), msg.id(), msg.keyid,
+            msg.type, msg.userid, msg.ts, msg.updated, storedData(msg, packed, format),
+            msg.backRefId, msg.isEncrypted(), format);
+        addMsgToNodeHistory(msg, idx);
+        addMsgToTextIndex(msg, idx, msg.ts);
+    }
+    uint8_t encodeData(const chatd::Message& msg, Buffer& packed)
+    {
+        // ciphertext doesn't compress, and must not be used to train the dictionary
+        return (mCodec && !msg.isEncrypted())
+            ? mCodec->compress(msg, packed)
+            : (uint8_t)karere::HistoryCodec::kFormatNone;
+    }
+    const StaticBuffer& storedData(const chatd::Message& msg, const Buffer& packed, uint8_t format)
+    {
+        return (format == karere::HistoryCodec::kFormatNone)
+            ? static_cast<const StaticBuffer&>(msg)
+            : static_cast<const StaticBuffer&>(packed);
+    }
+    // reads the payload of a history row, given the columns of the data and its format
+    void dataCol(SqliteStmt& stmt, int col, int formatCol, Buffer& buf)
+    {
+        uint8_t format = (uint8_t)stmt.intCol(formatCol);
+        if (format == karere::HistoryCodec::kFormatNone)
+        {
+            stmt.blobCol(col, buf);
+            return;
+        }
+        if (!mCodec || !mCodec->decompress(format, sqlite3_column_blob(stmt, col), sqlite3_column_bytes(stmt, col), buf))
+        {
+            CHATD_LOG_ERROR("chatid %s: Can't decompress a message in history (format %d)",
+                mChat.chatId().toString().c_str(), format);
+            assert(false);
+            buf.clear();
+        }
+    }
+    // builds a message from a history row, selected as "msgid, userid, ts, type, data, idx,
+    // keyid, backrefid, updated, is_encrypted, compression"
+    chatd::Message* msgFromRow(SqliteStmt& stmt)
+    {
+        Buffer buf;
+        dataCol(stmt, 4, 10, buf);
+        auto msg = new chatd::Message(stmt.uint64Col(0), stmt.uint64Col(1), stmt.uintCol(2),
+            stmt.intCol(8), std::move(buf), false, stmt.uintCol(6), (unsigned char)stmt.intCol(3));
+        msg->backRefId = stmt.uint64Col(7);
+        msg->setEncrypted(stmt.intCol(9));
+        return msg;
+    }
+    bool isSearchable(const chatd::Message& msg)
+    {
+        return msg.type == chatd::Message::kMsgNormal && !msg.isEncrypted() && !msg.empty();
+    }
+    void addMsgToTextIndex(const chatd::Message& msg, chatd::Idx idx, uint32_t ts)
+    {
+        if (!mTextSearch || !isSearchable(msg))
+            return;
+
+        // rowids are (ts << 24) + seq, so that FTS5 can return the hits by ts in rowid order,
+        // stopping at the limit, instead of sorting all of them
+        int64_t minRowid = (int64_t)ts << 24;
+        mDb.query("insert into text_index(rowid, chatid, msgid, idx, ts) values("
+            "(select coalesce(max(rowid) + 1, ?1) from text_index where rowid between ?1 and ?2), ?3, ?4, ?5, ?6)",
+            minRowid, minRowid + (1 << 24) - 1, mChat.chatId(), msg.id(), idx, ts);
+        int64_t rowid = sqlite3_last_insert_rowid(mDb);
+        mDb.query("insert into text_search(rowid, text) values(?,?)", rowid, msg.toText());
+    }
+    void delMsgsFromTextIndex(const std::string& where, chatd::Idx idx=CHATD_IDX_INVALID)
+    {
+        if (!mTextSearch)
+            return;
+
+        std::string sql = "delete from text_search where rowid in (select rowid from text_index where " + where + ")";
+        SqliteStmt stmt(mDb, sql);
+        stmt << mChat.chatId();
+        if (idx != CHATD_IDX_INVALID)
+            stmt << idx;
+        stmt.step();
+        SqliteStmt stmt2(mDb, "delete from text_index where " + where);
+        stmt2 << mChat.chatId();
+        if (idx != CHATD_IDX_INVALID)
+            stmt2 << idx;
+        stmt2.step();
+    }
+    // forgets the stored last text message if it's older than idx, so by default always
+    void forgetLastTextMessage(chatd::Idx idx=CHATD_IDX_INVALID)
+    {
+        mDb.query("update chats set last_text_idx = null, last_text_data = null "
+            "where chatid = ? and last_text_idx < ?", mChat.chatId(), idx);
+    }
+    void addMsgToNodeHistory(const chatd::Message& msg, chatd::Idx idx)
+    {
+        if (msg.isEncrypted() || msg.empty())
+            return;
+
+        if (msg.type == chatd::Message::kMsgRevokeAttachment)
+        {
+            mDb.query("insert or ignore into node_history(chatid, idx, msgid, nodehandle, type) "
+                "values(?,?,?,?,?)", mChat.chatId(), idx, msg.id(),
+                ::mega::MegaApi::base64ToHandle(msg.toText().c_str()), msg.type);
+            return;
+        }
+        if (msg.type != chatd::Message::kMsgAttachment)
+            return;
+
+        // only the handles are needed, the rest of the attachment JSON is parsed by the app layer
+        std::string json = msg.toText();
+        rapidjson::Document document;
+        document.Parse(json.c_str());
+        if (document.HasParseError() || !document.IsArray())
+        {
+            CHATD_LOG_WARNING("chatid %s: addMsgToNodeHistory: invalid attachment JSON in msg %s",
+                mChat.chatId().toString().c_str(), msg.id().toString().c_str());
+            return;
+        }
+        for (rapidjson::SizeType i = 0; i < document.Size(); i++)
+        {
+            const rapidjson::Value& file = document[i];
+            if (!file.IsObject())
+                continue;
+            auto it = file.FindMember("h");
+            if (it == file.MemberEnd() || !it->value.IsString())
+                continue;
+            mDb.query("insert or ignore into node_history(chatid, idx, msgid, nodehandle, type) "
+                "values(?,?,?,?,?)", mChat.chatId(), idx, msg.id(),
+                ::mega::MegaApi::base64ToHandle(it->value.GetString()), msg.type);
+        }
     }
     virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
     {
+        Buffer packed;
+        uint8_t format = encodeData(msg, packed);
         if (msg.type == chatd::Message::kMsgTruncate)
         {
-            mDb.query("update history set type = ?, data = ?, ts = ?, userid = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.ts, msg.userid, mChat.chatId(), msgid);
+            mDb.query("update history set type = ?, data = ?, compression = ?, ts = ?, userid = ? where chatid = ? and msgid = ?",
+                msg.type, storedData(msg, packed, format), format, msg.ts, msg.userid, mChat.chatId(), msgid);
         }
         else    // "updated" instead of "ts"
         {
-            mDb.query("update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?",
-                msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
+            mDb.query("update history set type = ?, data = ?, compression = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?",
+                msg.type, storedData(msg, packed, format), format, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
         }
         assertAffectedRowCount(1, "updateMsgInHistory");
+        updateMsgInIndexes(msgid, msg);
+    }
+    // idx and ts of a message in history, for the indexes. Returns false if it's not in history
+    virtual bool getMsgPosition(karere::Id msgid, chatd::Idx& idx, uint32_t& ts)
+    {
+        SqliteStmt stmt(mDb, "select idx, ts from history where chatid = ? and msgid = ?");
+        stmt << mChat.chatId() << msgid;
+        if (!stmt.step())
+            return false;
+        idx = stmt.intCol(0);
+        ts = stmt.uintCol(1);
+        return true;
+    }
+    // e.g. the history store of ChatdSegmentDb, if it was behind the db after a crash of the OS.
+    // The message is left out of the index instead of failing the update
+    void logNotInHistory(karere::Id msgid, const char* index)
+    {
+        CHATD_LOG_WARNING("chatid %s: msgid %s is not in history, can't add it to the %s",
+            mChat.chatId().toString().c_str(), msgid.toString().c_str(), index);
+    }
+    // updates the node history and the text index after an edit of a message
+    void updateMsgInIndexes(karere::Id msgid, const chatd::Message& msg)
+    {
+        if (msg.type == chatd::Message::kMsgTruncate || (msg.updated && msg.empty()))
+        {
+            // truncated or deleted attachments are not listed anymore
+            mDb.query("delete from node_history where chatid = ? and msgid = ?", mChat.chatId(), msgid);
+        }
+        else if (!msg.isEncrypted() && (msg.type == chatd::Message::kMsgAttachment
+                 || msg.type == chatd::Message::kMsgRevokeAttachment))
+        {
+            // it was stored undecrypted. Attachments can't be edited, so it's not listed yet
+            chatd::Idx idx;
+            uint32_t ts;
+            if (getMsgPosition(msgid, idx, ts))
+                addMsgToNodeHistory(msg, idx);
+            else
+                logNotInHistory(msgid, "node history");
+        }
+        if (mTextSearch)
+        {
+            // edits replace the indexed text, keeping the position of the message in the hits
+            SqliteStmt stmt(mDb, "select rowid from text_index where chatid = ? and msgid = ?");
+            stmt << mChat.chatId() << msgid;
+            if (stmt.step())
+            {
+                int64_t rowid = stmt.int64Col(0);
+                mDb.query("delete from text_search where rowid = ?", rowid);
+                if (isSearchable(msg))
+                    mDb.query("insert into text_search(rowid, text) values(?,?)", rowid, msg.toText());
+                else
+                    mDb.query("delete from text_index where rowid = ?", rowid);
+            }
+            else if (isSearchable(msg))
+            {
+                // it was stored undecrypted
+                chatd::Idx idx;
+                uint32_t ts;
+                if (getMsgPosition(msgid, idx, ts))
+                    addMsgToTextIndex(msg, idx, ts);
+                else
+                    logNotInHistory(msgid, "text index");
+            }
+        }
     }
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
@@ -197,19 +400,11 @@ public:
     }
     virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
     {
-        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from history "
+        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted, compression from history "
             "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3");
         stmt << mChat.chatId() << idx << count;
-        int i = 0;
         while(stmt.step())
         {
-            i++;
-            karere::Id msgid(stmt.uint64Col(0));
-            karere::Id userid(stmt.uint64Col(1));
-            unsigned ts = stmt.uintCol(2);
-            chatd::KeyId keyid = stmt.uintCol(6);
-            Buffer buf;
-            stmt.blobCol(4, buf);
 #ifndef NDEBUG
             auto idx = stmt.intCol(5);
             if(idx != mChat.lownum()-1-(int)messages.size()) //we go backward in history, hence the -messages.size()
@@ -220,13 +415,49 @@ public:
                 assert(false);
             }
 #endif
-            auto msg = new chatd::Message(msgid, userid, ts, stmt.intCol(8), std::move(buf),
-                false, keyid, (unsigned char)stmt.intCol(3));
-            msg->backRefId = stmt.uint64Col(7);
-            msg->setEncrypted(stmt.intCol(9));
-            messages.push_back(msg);
+            messages.push_back(msgFromRow(stmt));
         }
     }
+    virtual void commit()
+    {
+        mDb.commitBarrier();
+    }
+    virtual void fetchDbHistoryRange(chatd::Idx from, chatd::Idx to, std::vector<std::pair<chatd::Idx, chatd::Message*>>& messages)
+    {
+        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted, compression from history "
+            "where chatid = ?1 and idx >= ?2 and idx <= ?3 order by idx asc");
+        stmt << mChat.chatId() << from << to;
+        while(stmt.step())
+        {
+            messages.emplace_back(stmt.intCol(5), msgFromRow(stmt));
+        }
+    }
+    virtual chatd::Idx getIdxOfTs(uint32_t ts)
+    {
+        SqliteStmt stmt(mDb, "select idx from history where chatid = ? and ts <= ? order by ts desc, idx desc limit 1");
+        stmt << mChat.chatId() << ts;
+        return (stmt.step()) ? stmt.intCol(0) : CHATD_IDX_INVALID;
+    }
+    virtual void deleteHistoryBefore(chatd::Idx idx)
+    {
+        mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        mDb.query("delete from node_history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        delMsgsFromTextIndex("chatid = ? and idx < ?", idx);
+        forgetLastTextMessage(idx);
+    }
+    virtual void setRetentionTime(uint32_t period)
+    {
+        mDb.query(
+            "insert or replace into chat_vars(chatid, name, value) "
+            "values(?, 'retention_time', ?)", mChat.chatId(), period);
+    }
+    virtual uint32_t getRetentionTime()
+    {
+        SqliteStmt stmt(mDb,
+            "select value from chat_vars where chatid=? and name='retention_time'");
+        stmt << mChat.chatId();
+        return stmt.step() ? stmt.uintCol(0) : 0;
+    }
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid)
     {
         SqliteStmt stmt(mDb, "select idx from history where chatid = ? and msgid = ?");
@@ -309,6 +540,9 @@ public:
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
         mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        mDb.query("delete from node_history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        delMsgsFromTextIndex("chatid = ? and idx < ?", idx);
+        forgetLastTextMessage(idx);
 #if 1
         SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
         stmt << mChat.chatId() << msg.id();
@@ -351,7 +585,7 @@ public:
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
     {
         SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid from history where chatid=?1 and "
+            "select type, idx, data, msgid, userid, compression from history where chatid=?1 and "
             "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
             "order by idx desc limit 1");
         stmt << mChat.chatId()
@@ -365,15 +599,78 @@ public:
             return;
         }
         Buffer buf(128);
-        stmt.blobCol(2, buf);
+        dataCol(stmt, 2, 5, buf);
         msg.assign(buf, stmt.intCol(0), stmt.uint64Col(3), stmt.intCol(1), stmt.uint64Col(4));
     }
 
     virtual void clearHistory()
     {
         mDb.query("delete from history where chatid = ?", mChat.chatId());
+        mDb.query("delete from node_history where chatid = ?", mChat.chatId());
+        delMsgsFromTextIndex("chatid = ?");
+        forgetLastTextMessage();
         setHaveAllHistory(false);
     }
+    virtual void saveLastTextMessage(const chatd::LastTextMsgState& msg)
+    {
+        if (!msg.isValid() || msg.idx() == CHATD_IDX_INVALID)
+        {
+            forgetLastTextMessage();
+            return;
+        }
+        mDb.query("update chats set last_text_idx = ?, last_text_msgid = ?, last_text_userid = ?, "
+            "last_text_type = ?, last_text_data = ? where chatid = ?", msg.idx(), msg.id(), msg.sender(),
+            msg.type(), StaticBuffer(msg.contents().data(), msg.contents().size()), mChat.chatId());
+    }
+    virtual void loadLastTextMessage(chatd::LastTextMsgState& msg)
+    {
+        SqliteStmt stmt(mDb, "select last_text_idx, last_text_msgid, last_text_userid, last_text_type, "
+            "last_text_data from chats where chatid = ? and last_text_idx is not null");
+        stmt << mChat.chatId();
+        if (!stmt.step())
+            return;
+
+        Buffer buf;
+        stmt.blobCol(4, buf);
+        msg.assign(buf, stmt.intCol(3), stmt.uint64Col(1), stmt.intCol(0), stmt.uint64Col(2));
+    }
+    virtual chatd::NodeAccess getNodeAccess(karere::Id nodehandle, chatd::Idx beforeIdx)
+    {
+        std::string sql = "select type from node_history where chatid = ?1 and nodehandle = ?2";
+        if (beforeIdx != CHATD_IDX_INVALID)
+            sql += " and idx < ?3";
+        sql += " order by idx desc limit 1";
+
+        SqliteStmt stmt(mDb, sql);
+        stmt << mChat.chatId() << nodehandle;
+        if (beforeIdx != CHATD_IDX_INVALID)
+            stmt << beforeIdx;
+        if (!stmt.step())
+            return chatd::kNodeAccessUnknown;
+
+        return (stmt.intCol(0) == chatd::Message::kMsgRevokeAttachment)
+                ? chatd::kNodeAccessRevoked : chatd::kNodeAccessGranted;
+    }
+    virtual void getNodeAttachmentMsgids(karere::Id nodehandle, std::vector<karere::Id>& msgids)
+    {
+        SqliteStmt stmt(mDb, "select msgid from node_history where chatid = ? and nodehandle = ? and type = ?");
+        stmt << mChat.chatId() << nodehandle << chatd::Message::kMsgAttachment;
+        while (stmt.step())
+        {
+            msgids.emplace_back(stmt.uint64Col(0));
+        }
+    }
+    virtual void fetchNodeHistory(chatd::Idx beforeIdx, unsigned count, std::vector<std::pair<chatd::Idx, chatd::Message*>>& messages)
+    {
+        SqliteStmt stmt(mDb, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted, compression from history "
+            "where chatid = ?1 and idx in (select distinct idx from node_history where chatid = ?1 "
+            "and type = ?2 and idx < ?3 order by idx desc limit ?4) order by idx desc");
+        stmt << mChat.chatId() << chatd::Message::kMsgAttachment << beforeIdx << count;
+        while(stmt.step())
+        {
+            messages.emplace_back(stmt.intCol(5), msgFromRow(stmt));
+        }
+    }
 };
 
 #endif
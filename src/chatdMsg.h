@@ -617,23 +617,24 @@ protected:
     friend class Chat;
 };
 
-class Command: public Buffer
+/** Most commands fit in the inline storage, and are built without any heap allocation */
+class Command: public SmallBuffer<64>
 {
 private:
     Command(const Command&) = delete;
 protected:
     Command(uint8_t opcode, uint8_t reserve, uint8_t payloadSize=0)
-    : Buffer(reserve, payloadSize+1) { write(0, opcode); }
-    Command(const char* data, size_t size): Buffer(data, size){}
+    : SmallBuffer(reserve, payloadSize+1) { write(0, opcode); }
+    Command(const char* data, size_t size): SmallBuffer(data, size){}
 public:
     enum { kBroadcastUserTyping = 1,  kBroadcastUserStopTyping = 2};
-    Command(): Buffer(){}
+    Command(): SmallBuffer(){}
     Command(Command&& other)
-    : Buffer(std::forward<Buffer>(other))
+    : SmallBuffer(std::forward<SmallBuffer>(other))
     { assert(!other.buf() && !other.bufSize() && !other.dataSize()); }
 
-    explicit Command(uint8_t opcode, size_t reserve=64)
-    : Buffer(reserve) { write(0, opcode); }
+    explicit Command(uint8_t opcode, size_t reserve=kInlineSize)
+    : SmallBuffer(reserve) { write(0, opcode); }
 
     template<class T>
     Command&& operator+(const T& val)
@@ -665,9 +666,55 @@ public:
     virtual ~Command(){}
 };
 
+/** Builds a command from its fields, allocating it only once, with the size computed
+ * from the field layout. The fields are encoded as with Command::operator+, i.e.:
+ *     CommandBuilder::build(OP_JOINRANGEHIST, mChatId, oldestId, newestId)
+ * is the same as
+ *     Command(OP_JOINRANGEHIST) + mChatId + oldestId + newestId
+ * but it never reallocates, even if the command doesn't fit in the inline storage.
+ */
+class CommandBuilder
+{
+public:
+    template <class... Args>
+    static Command build(uint8_t opcode, const Args&... fields)
+    {
+        Command cmd(opcode, 1 + fieldsSize(fields...));
+        appendFields(cmd, fields...);
+        return cmd;
+    }
+    static size_t fieldsSize() { return 0; }
+    template <class T, class... Args>
+    static size_t fieldsSize(const T& field, const Args&... fields)
+    {
+        return fieldSize(field, std::is_base_of<Buffer, T>()) + fieldsSize(fields...);
+    }
+protected:
+    template <class T>
+    static size_t fieldSize(const T&, std::false_type)
+    {
+        static_assert(!std::is_base_of<StaticBuffer, T>::value, "Only Buffer fields are supported, as they are length-prefixed");
+        return sizeof(T);
+    }
+    static size_t fieldSize(const Buffer& buf, std::true_type) { return 4 + buf.dataSize(); } //len.4+data
+    static void appendFields(Command&) {}
+    template <class T, class... Args>
+    static void appendFields(Command& cmd, const T& field, const Args&... fields)
+    {
+        cmd + field;
+        appendFields(cmd, fields...);
+    }
+};
+
 class KeyCommand: public Command
 {
 public:
+    enum { kHeaderSize = 17 }; //opcode.1+chatid.8+keyid.4+length.4
+    /** Size of a KeyCommand with \c keyCount keys of \c keyLen bytes, to allocate it at once */
+    static size_t sizeFor(size_t keyCount, size_t keyLen)
+    {
+        return kHeaderSize + keyCount * (10 + keyLen);
+    }
     explicit KeyCommand(karere::Id chatid, uint32_t keyid=CHATD_KEYID_UNCONFIRMED,
         size_t reserve=128)
     : Command(OP_NEWKEY, reserve)
@@ -686,8 +733,8 @@ public:
         append<uint64_t>(userid.val).append<uint16_t>(keylen);
         append(keydata, keylen);
     }
-    bool hasKeys() const { return dataSize() > 17; }
-    void clearKeys() { setDataSize(17); } //opcode.1+chatid.8+keyid.4+length.4
+    bool hasKeys() const { return dataSize() > kHeaderSize; }
+    void clearKeys() { setDataSize(kHeaderSize); }
     virtual std::string toString() const;
 };
 
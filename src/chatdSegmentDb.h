@@ -0,0 +1,303 @@
+#ifndef CHATD_SEGMENT_DB_H
+#define CHATD_SEGMENT_DB_H
+
+#include "chatdDb.h"
+#include "historyStore.h"
+
+/** Keeps the history of a chat in a karere::HistoryStore instead of the history table.
+ * The rest of the data of the chat (send queues, node history, text index, etc.) stays
+ * in the db. Selected with Client::setHistoryStorage().
+ * The store is synced before each commit of the db, so that after a crash of the OS it may
+ * be ahead of the db, but never behind it */
+class ChatdSegmentDb: public ChatdSqliteDb
+{
+protected:
+    karere::HistoryStore mStore;
+public:
+    ChatdSegmentDb(chatd::Chat& chat, SqliteDb& db, const std::string& storeDir, karere::HistoryCodec* codec=nullptr)
+        :ChatdSqliteDb(chat, db, codec)
+    {
+        if (!mStore.open(storeDir))
+        {
+            // the history is fetched from the server again
+            CHATD_LOG_ERROR("chatid %s: Can't open the history store, clearing it", mChat.chatId().toString().c_str());
+            karere::HistoryStore::remove(storeDir);
+            if (!mStore.open(storeDir))
+                throw std::runtime_error("Can't create the history store in "+storeDir);
+            delMsgsFromIndexes("chatid = ?");
+            forgetLastTextMessage();
+            setHaveAllHistory(false);
+        }
+        mDb.addCommitHook(this, [this]() { mStore.sync(); });
+    }
+    virtual ~ChatdSegmentDb()
+    {
+        mDb.removeCommitHook(this);
+        mStore.sync();
+    }
+    virtual void getHistoryInfo(chatd::ChatDbInfo& info)
+    {
+        if (mStore.empty())
+        {
+            memset(&info, 0, sizeof(info));
+            return;
+        }
+        info.oldestDbId = mStore.msgidAt(mStore.low());
+        info.newestDbIdx = mStore.high();
+        info.newestDbId = mStore.msgidAt(mStore.high());
+        SqliteStmt stmt(mDb, "select last_seen, last_recv from chats where chatid=?");
+        stmt << mChat.chatId();
+        stmt.stepMustHaveData();
+        info.lastSeenId = stmt.uint64Col(0);
+        info.lastRecvId = stmt.uint64Col(1);
+    }
+    virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
+    {
+        if (!mStore.empty() && (idx != mStore.low()-1) && (idx != mStore.high()+1))
+        {
+            CHATD_LOG_ERROR("chatid %s: addMsgToHistory: history discontinuity detected: "
+                "index of added msg %s is not adjacent to neither end of db history: "
+                "add idx=%d, histlow=%d, histhigh=%d, fwdStart=%d, lownum=%d, highnum=%d",
+                mChat.chatId().toString().c_str(), msg.id().toString().c_str(),
+                idx, mStore.low(), mStore.high(), mChat.forwardStart(), mChat.lownum(), mChat.highnum());
+            assert(false);
+            return;     // the store can't have gaps
+        }
+        Buffer packed;
+        karere::HistoryStore::Record rec;
+        toRecord(msg, packed, rec);
+        mStore.add(idx, rec, msgFlags(rec));
+        addMsgToNodeHistory(msg, idx);
+        addMsgToTextIndex(msg, idx, msg.ts);
+    }
+    virtual void updateMsgInHistory(karere::Id msgid, const chatd::Message& msg)
+    {
+        chatd::Idx idx = mStore.find(msgid);
+        karere::HistoryStore::Record old;
+        if (idx == CHATD_IDX_INVALID || !mStore.get(idx, old))
+            throw std::runtime_error("updateMsgInHistory: msgid "+msgid.toString()+" is not in history");
+
+        Buffer packed;
+        karere::HistoryStore::Record rec;
+        toRecord(msg, packed, rec);
+        // same fields as updated by ChatdSqliteDb::updateMsgInHistory()
+        rec.msgid = msgid;
+        rec.keyid = old.keyid;
+        rec.backrefid = old.backrefid;
+        if (msg.type == chatd::Message::kMsgTruncate)
+        {
+            rec.updated = old.updated;
+            rec.encrypted = old.encrypted;
+        }
+        else    // "updated" instead of "ts"
+        {
+            rec.ts = old.ts;
+        }
+        mStore.update(idx, rec, msgFlags(rec));
+        updateMsgInIndexes(msgid, msg);
+    }
+    virtual bool getMsgPosition(karere::Id msgid, chatd::Idx& idx, uint32_t& ts)
+    {
+        idx = mStore.find(msgid);
+        if (idx == CHATD_IDX_INVALID)
+            return false;
+        ts = mStore.tsAt(idx);
+        return true;
+    }
+    virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
+    {
+        chatd::Idx idx = mStore.find(msgid);
+        karere::HistoryStore::Record rec;
+        if (idx == CHATD_IDX_INVALID || !mStore.get(idx, rec))
+            throw std::runtime_error("getMessageDelta: msgid "+msgid.toString()+" is not in history");
+        *updated = rec.updated;
+    }
+    virtual void fetchDbHistory(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
+    {
+        if (mStore.empty() || idx < mStore.low())
+            return;
+
+        for (chatd::Idx i = std::min(idx, mStore.high()); count && i >= mStore.low(); i--, count--)
+        {
+#ifndef NDEBUG
+            if(i != mChat.lownum()-1-(int)messages.size()) //we go backward in history, hence the -messages.size()
+            {
+                CHATD_LOG_ERROR("chatid %s: fetchDbHistory: History discontinuity detected: "
+                    "expected idx %d, retrieved from db:%d", mChat.chatId().toString().c_str(),
+                    mChat.lownum()-1-(int)messages.size(), i);
+                assert(false);
+            }
+#endif
+            auto msg = loadMsg(i);
+            if (!msg)
+                return;
+            messages.push_back(msg);
+        }
+    }
+    virtual void fetchDbHistoryRange(chatd::Idx from, chatd::Idx to, std::vector<std::pair<chatd::Idx, chatd::Message*>>& messages)
+    {
+        if (mStore.empty())
+            return;
+
+        for (chatd::Idx i = std::max(from, mStore.low()); i <= std::min(to, mStore.high()); i++)
+        {
+            auto msg = loadMsg(i);
+            if (!msg)
+                return;
+            messages.emplace_back(i, msg);
+        }
+    }
+    virtual chatd::Idx getIdxOfTs(uint32_t ts)
+    {
+        return mStore.findTs(ts);
+    }
+    virtual void deleteHistoryBefore(chatd::Idx idx)
+    {
+        mStore.eraseBefore(idx);
+        delMsgsFromIndexes("chatid = ? and idx < ?", idx);
+        forgetLastTextMessage(idx);
+    }
+    virtual chatd::Idx getIdxOfMsgid(karere::Id msgid)
+    {
+        return mStore.find(msgid);
+    }
+    virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
+    {
+        return mStore.count(idx, karere::HistoryStore::kFlagUnread);
+    }
+    virtual void truncateHistory(const chatd::Message& msg)
+    {
+        auto idx = getIdxOfMsgid(msg.id());
+        if (idx == CHATD_IDX_INVALID)
+            throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
+        mStore.eraseBefore(idx);
+        delMsgsFromIndexes("chatid = ? and idx < ?", idx);
+        forgetLastTextMessage(idx);
+        karere::HistoryStore::Record rec;
+        if (!mStore.get(idx, rec) || rec.type != chatd::Message::kMsgTruncate)
+            throw std::runtime_error("DbInterface::truncateHistory: Truncate message type is not 'truncate'");
+    }
+    virtual chatd::Idx getOldestIdx()
+    {
+        return mStore.empty() ? 0 : mStore.low();
+    }
+    virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg)
+    {
+        chatd::Idx idx = mStore.findLast(from, karere::HistoryStore::kFlagLastText);
+        karere::HistoryStore::Record rec;
+        if (idx == CHATD_IDX_INVALID || !mStore.get(idx, rec))
+        {
+            msg.clear();
+            return;
+        }
+        Buffer buf(128);
+        decodeData(rec, buf);
+        msg.assign(buf, rec.type, rec.msgid, idx, rec.userid);
+    }
+    virtual void clearHistory()
+    {
+        mStore.clear();
+        delMsgsFromIndexes("chatid = ?");
+        forgetLastTextMessage();
+        setHaveAllHistory(false);
+    }
+    virtual void fetchNodeHistory(chatd::Idx beforeIdx, unsigned count, std::vector<std::pair<chatd::Idx, chatd::Message*>>& messages)
+    {
+        SqliteStmt stmt(mDb, "select distinct idx from node_history where chatid = ?1 "
+            "and type = ?2 and idx < ?3 order by idx desc limit ?4");
+        stmt << mChat.chatId() << chatd::Message::kMsgAttachment << beforeIdx << count;
+        while(stmt.step())
+        {
+            chatd::Idx idx = stmt.intCol(0);
+            auto msg = loadMsg(idx);
+            if (msg)
+                messages.emplace_back(idx, msg);
+        }
+    }
+
+protected:
+    void delMsgsFromIndexes(const std::string& where, chatd::Idx idx=CHATD_IDX_INVALID)
+    {
+        SqliteStmt stmt(mDb, "delete from node_history where " + where);
+        stmt << mChat.chatId();
+        if (idx != CHATD_IDX_INVALID)
+            stmt << idx;
+        stmt.step();
+        delMsgsFromTextIndex(where, idx);
+    }
+    void toRecord(const chatd::Message& msg, Buffer& packed, karere::HistoryStore::Record& rec)
+    {
+        rec.format = encodeData(msg, packed);
+        const StaticBuffer& data = storedData(msg, packed, rec.format);
+        rec.msgid = msg.id();
+        rec.userid = msg.userid;
+        rec.backrefid = msg.backRefId;
+        rec.ts = msg.ts;
+        rec.keyid = msg.keyid;
+        rec.updated = msg.updated;
+        rec.type = msg.type;
+        rec.encrypted = msg.isEncrypted();
+        rec.data = data.buf();
+        rec.dataSize = (uint32_t)data.dataSize();
+    }
+    // flags to count unread messages and find the last text message without reading the
+    // records. The conditions match the queries of the same functions in ChatdSqliteDb
+    uint8_t msgFlags(const karere::HistoryStore::Record& rec)
+    {
+        uint8_t flags = 0;
+        if (karere::Id(rec.userid) != mChat.client().userId()
+            && !(rec.updated && !rec.dataSize)
+            && (rec.encrypted == chatd::Message::kNotEncrypted
+                || rec.encrypted == chatd::Message::kEncryptedMalformed
+                || rec.encrypted == chatd::Message::kEncryptedSignature)
+            && (rec.type == chatd::Message::kMsgNormal
+                || rec.type == chatd::Message::kMsgAttachment
+                || rec.type == chatd::Message::kMsgContact
+                || rec.type == chatd::Message::kMsgContainsMeta))
+        {
+            flags |= karere::HistoryStore::kFlagUnread;
+        }
+        if ((rec.dataSize || rec.type == chatd::Message::kMsgTruncate)
+            && rec.type != chatd::Message::kMsgRevokeAttachment
+            && rec.type != chatd::Message::kMsgInvalid)
+        {
+            flags |= karere::HistoryStore::kFlagLastText;
+        }
+        return flags;
+    }
+    void decodeData(const karere::HistoryStore::Record& rec, Buffer& buf)
+    {
+        if (rec.format == karere::HistoryCodec::kFormatNone)
+        {
+            buf.assign(rec.data, rec.dataSize);
+            return;
+        }
+        if (!mCodec || !mCodec->decompress(rec.format, rec.data, rec.dataSize, buf))
+        {
+            CHATD_LOG_ERROR("chatid %s: Can't decompress a message in history (format %d)",
+                mChat.chatId().toString().c_str(), rec.format);
+            assert(false);
+            buf.clear();
+        }
+    }
+    chatd::Message* loadMsg(chatd::Idx idx)
+    {
+        karere::HistoryStore::Record rec;
+        if (!mStore.get(idx, rec))
+        {
+            CHATD_LOG_ERROR("chatid %s: Corrupt record of idx %d in the history store",
+                mChat.chatId().toString().c_str(), idx);
+            assert(false);
+            return nullptr;
+        }
+        Buffer buf;
+        decodeData(rec, buf);
+        auto msg = new chatd::Message(rec.msgid, rec.userid, rec.ts, rec.updated, std::move(buf),
+            false, rec.keyid, rec.type);
+        msg->backRefId = rec.backrefid;
+        msg->setEncrypted(rec.encrypted);
+        return msg;
+    }
+};
+
+#endif
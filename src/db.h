@@ -2,6 +2,14 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 
 struct SqliteString
 {
@@ -16,15 +24,159 @@ struct SqliteString
 };
 class SqliteStmt;
 
+/** Thread that checkpoints the WAL of a database via its own connection.
+ * With journal_mode=WAL and synchronous=NORMAL, a commit only appends to the WAL,
+ * and the fsyncs are done by the checkpoints. Running them here, instead of in the
+ * connection that commits (sqlite's auto-checkpoint), keeps the disk syncs out of the
+ * thread that writes to the db. Checkpoints are PASSIVE, so they never block it.
+ */
+class SqliteCheckpointer
+{
+public:
+    enum { kCheckpointPages = 256 };    // WAL size (in pages) that triggers a checkpoint
+    ~SqliteCheckpointer() { stop(); }
+    bool start(const char* fname)
+    {
+        assert(!mDb);
+        // the connection must be in WAL mode too, or the checkpoints do nothing
+        if (sqlite3_open_v2(fname, &mDb, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK
+                || sqlite3_exec(mDb, "PRAGMA journal_mode=WAL", nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            sqlite3_close(mDb);
+            mDb = nullptr;
+            return false;
+        }
+        mStop = mPending = false;
+        mThread = std::thread([this]() { run(); });
+        return true;
+    }
+    void stop()
+    {
+        if (!mDb)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCond.notify_one();
+        mThread.join();
+        sqlite3_close(mDb);
+        mDb = nullptr;
+    }
+    bool isRunning() const { return mDb != nullptr; }
+    /** Pages in the WAL that may not be checkpointed yet */
+    int walPages() const { return mWalPages; }
+    void request()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mPending = true;
+        }
+        mCond.notify_one();
+    }
+    /** Installed as the WAL hook of the writer connection, called after each commit */
+    static int onWalCommit(void* ctx, sqlite3*, const char*, int pages)
+    {
+        auto self = static_cast<SqliteCheckpointer*>(ctx);
+        self->mWalPages = pages;
+        if (pages >= kCheckpointPages)
+        {
+            self->request();
+        }
+        return SQLITE_OK;
+    }
+protected:
+    sqlite3* mDb = nullptr;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    bool mStop = false;
+    bool mPending = false;
+    std::atomic<int> mWalPages{0};
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mCond.wait(lock, [this]() { return mStop || mPending; });
+            if (mStop)
+                return;
+            mPending = false;
+            lock.unlock();
+            // may not be complete if the writer has a newer snapshot, the rest is done next time
+            int logPages = 0;
+            int ckptPages = 0;
+            if (sqlite3_wal_checkpoint_v2(mDb, nullptr, SQLITE_CHECKPOINT_PASSIVE, &logPages, &ckptPages) == SQLITE_OK
+                    && logPages == ckptPages)
+            {
+                // unless there's a commit meanwhile, which sets it again
+                int expected = logPages;
+                mWalPages.compare_exchange_strong(expected, 0);
+            }
+            lock.lock();
+        }
+    }
+};
+
+/** Storage settings of a SqliteDb, applied when it's opened */
+struct SqliteProfile
+{
+    /** journal_mode=WAL and synchronous=NORMAL, with the checkpoints done by a SqliteCheckpointer.
+     * Otherwise, rollback journal and synchronous=FULL (sqlite's defaults) */
+    bool wal = true;
+    /** Max bytes of the db that are accessed via mmap instead of read(). 0 disables it */
+    int64_t mmapSize = 0;
+    /** Size of the page cache in KiB. 0 for sqlite's default (2MB) */
+    int cacheSizeKb = 0;
+};
+
 class SqliteDb
 {
+public:
+    enum Profile
+    {
+        kProfileDefault = 0,    // WAL, 32MB mmap, 4MB page cache
+        kProfileLowMemory = 1,  // WAL, no mmap, 1MB page cache
+        kProfileThroughput = 2, // WAL, 256MB mmap, 16MB page cache
+        kProfileLegacy = 3      // rollback journal, sqlite's defaults
+    };
+    static SqliteProfile profile(int id)
+    {
+        SqliteProfile profile;
+        switch (id)
+        {
+            case kProfileLowMemory:
+                profile.cacheSizeKb = 1024;
+                break;
+            case kProfileThroughput:
+                profile.mmapSize = 256 << 20;
+                profile.cacheSizeKb = 16384;
+                break;
+            case kProfileLegacy:
+                profile.wal = false;
+                break;
+            default:
+                profile.mmapSize = 32 << 20;
+                profile.cacheSizeKb = 4096;
+                break;
+        }
+        return profile;
+    }
 protected:
     friend class SqliteStmt;
     sqlite3* mDb = nullptr;
+    SqliteProfile mProfile = profile(kProfileDefault);
+    SqliteCheckpointer mCheckpointer;
+    int mChangesAtIdleCheck = 0;
     bool mCommitEach = true;
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    int mChangesAtCommit = 0;
+    /** Whether mOnPendingChanges was called since the last commit */
+    bool mPendingChangesNotified = false;
+    std::function<void()> mOnPendingChanges;
+    std::map<const void*, std::function<void()>> mCommitHooks;
     inline int step(SqliteStmt& stmt);
     void beginTransaction()
     {
@@ -36,15 +188,23 @@ protected:
     {
         if (!mHasOpenTransaction)
             return false;
+        for (auto& hook: mCommitHooks)
+        {
+            hook.second();
+        }
         simpleQuery("COMMIT TRANSACTION");
         mHasOpenTransaction = false;
         mLastCommitTs = time(NULL);
+        mChangesAtCommit = sqlite3_total_changes(mDb);
+        mPendingChangesNotified = false;
         return true;
     }
 public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
+    SqliteDb(const SqliteDb&) = delete;
+    SqliteDb& operator=(const SqliteDb&) = delete;
     bool open(const char* fname, bool commitEach=true)
     {
         assert(!mDb);
@@ -57,6 +217,7 @@ public:
             mDb = nullptr;
             return false;
         }
+        applyProfile(fname);
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
@@ -71,11 +232,43 @@ public:
             return;
         if (!mCommitEach)
             commitTransaction();
+        mCheckpointer.stop();
+        // the last connection to close checkpoints the whole WAL
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
     }
     bool isOpen() const { return mDb != nullptr; }
+    /** Whether the db is in WAL mode, with the checkpoints done by a separate thread */
+    bool isWal() const { return mCheckpointer.isRunning(); }
+    /** The profile is applied the next time the db is opened */
+    void setProfile(const SqliteProfile& profile) { mProfile = profile; }
+    const SqliteProfile& getProfile() const { return mProfile; }
+    /** Checkpoints the WAL (in the checkpoint thread) if there haven't been changes
+     * since the previous call. Meant to be called periodically, so that the WAL is
+     * synced and emptied while the app is idle, instead of when it's busy */
+    void idleCheckpoint()
+    {
+        if (!isWal())
+            return;
+        int changes = sqlite3_total_changes(mDb);
+        if (changes == mChangesAtIdleCheck && mCheckpointer.walPages() > 0 && nextCommitTs() == 0)
+        {
+            mCheckpointer.request();
+        }
+        mChangesAtIdleCheck = changes;
+    }
+    /** Returns up to \c pages free pages of the db to the filesystem, if it was created
+     * with auto_vacuum=INCREMENTAL. Returns whether there are free pages left, so that it
+     * can be called in short slices until the db is compacted */
+    bool incrementalVacuum(int pages)
+    {
+        if (pragmaInt("auto_vacuum") != 2 || pragmaInt("freelist_count") <= 0)
+            return false;
+        std::string sql = "PRAGMA incremental_vacuum(" + std::to_string(pages) + ")";
+        simpleQuery(sql.c_str());
+        return pragmaInt("freelist_count") > 0;
+    }
     void setCommitMode(bool commitEach)
     {
         if (commitEach == mCommitEach)
@@ -87,6 +280,14 @@ public:
         }
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
+    /** \c cb is called on the first change after a commit, when nextCommitTs() goes
+     * from 0 to a deadline, so that a timer can be armed for timedCommit() */
+    void setOnPendingChanges(std::function<void()>&& cb) { mOnPendingChanges = std::move(cb); }
+    /** \c cb is called before each commit of the transaction, so that the files that the
+     * committed rows depend on (e.g. a HistoryStore) are synced first. It's not called in
+     * commit-each mode. \c owner is the key to remove it with removeCommitHook() */
+    void addCommitHook(const void* owner, std::function<void()>&& cb) { mCommitHooks[owner] = std::move(cb); }
+    void removeCommitHook(const void* owner) { mCommitHooks.erase(owner); }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
@@ -125,6 +326,15 @@ public:
         beginTransaction();
         return true;
     }
+    /** Durability barrier, for the changes that must survive a crash of the app before
+     * acting on them (e.g. the send queue before a message is sent). In WAL mode, a commit
+     * doesn't sync the disk, so it's cheap enough to do it at every barrier. Otherwise,
+     * the changes are committed as usual by timedCommit() */
+    void commitBarrier()
+    {
+        if (isWal())
+            commit();
+    }
     bool timedCommit()
     {
         if (mCommitEach)
@@ -137,6 +347,75 @@ public:
         commit();
         return true;
     }
+    /** Time at which timedCommit() will commit the changes done since the last
+     * commit, or 0 if there are none */
+    time_t nextCommitTs() const
+    {
+        if (mCommitEach || !mHasOpenTransaction || (sqlite3_total_changes(mDb) == mChangesAtCommit))
+            return 0;
+        return mLastCommitTs + mCommitInterval;
+    }
+protected:
+    void applyProfile(const char* fname)
+    {
+        // only takes effect in a new db, before the first table is created and the
+        // journal is switched to WAL. Older dbs keep auto_vacuum=NONE
+        sqlite3_exec(mDb, "PRAGMA auto_vacuum=INCREMENTAL", nullptr, nullptr, nullptr);
+        if (mProfile.mmapSize)
+        {
+            std::string sql = "PRAGMA mmap_size=" + std::to_string(mProfile.mmapSize);
+            sqlite3_exec(mDb, sql.c_str(), nullptr, nullptr, nullptr);
+        }
+        if (mProfile.cacheSizeKb)
+        {
+            // negative values are in KiB, instead of pages
+            std::string sql = "PRAGMA cache_size=-" + std::to_string(mProfile.cacheSizeKb);
+            sqlite3_exec(mDb, sql.c_str(), nullptr, nullptr, nullptr);
+        }
+        if (mProfile.wal)
+        {
+            enableWal(fname);
+        }
+        else
+        {
+            // the db may have been left in WAL mode by another profile
+            sqlite3_exec(mDb, "PRAGMA journal_mode=DELETE", nullptr, nullptr, nullptr);
+        }
+    }
+    int pragmaInt(const char* name)
+    {
+        std::string sql = std::string("PRAGMA ") + name;
+        sqlite3_stmt* stmt = nullptr;
+        int value = -1;
+        if (sqlite3_prepare_v2(mDb, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK
+                && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            value = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return value;
+    }
+    void enableWal(const char* fname)
+    {
+        // files in memory or in filesystems without shared memory support stay in rollback-journal mode
+        sqlite3_stmt* stmt = nullptr;
+        bool wal = false;
+        if (sqlite3_prepare_v2(mDb, "PRAGMA journal_mode=WAL", -1, &stmt, nullptr) == SQLITE_OK
+                && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            const char* mode = (const char*)sqlite3_column_text(stmt, 0);
+            wal = mode && (strcmp(mode, "wal") == 0);
+        }
+        sqlite3_finalize(stmt);
+        if (!wal || !mCheckpointer.start(fname))
+            return;
+
+        sqlite3_exec(mDb, "PRAGMA synchronous=NORMAL", nullptr, nullptr, nullptr);
+        // the WAL is reused from its start after a complete checkpoint, this trims it then
+        sqlite3_exec(mDb, "PRAGMA journal_size_limit=4194304", nullptr, nullptr, nullptr);
+        // replaces the auto-checkpoints done by this connection
+        sqlite3_wal_hook(mDb, &SqliteCheckpointer::onWalCommit, &mCheckpointer);
+    }
 };
 
 class SqliteStmt
@@ -294,9 +573,11 @@ inline bool SqliteDb::query(const char* sql, Args&&... args)
 inline int SqliteDb::step(SqliteStmt& stmt)
 {
     auto ret = sqlite3_step(stmt);
-    if (ret == SQLITE_DONE)
+    if (ret == SQLITE_DONE && !timedCommit() && !mPendingChangesNotified
+        && mOnPendingChanges && nextCommitTs())
     {
-        timedCommit();
+        mPendingChangesNotified = true;
+        mOnPendingChanges();
     }
     return ret;
 }
@@ -12,7 +12,9 @@ CREATE TABLE vars(name text not null primary key, value blob);
 CREATE TABLE chats(chatid int64 unique primary key, shard tinyint,
     own_priv tinyint, peer int64 default -1, peer_priv tinyint default 0,
     title text, ts_created int64 not null default 0,
-    last_seen int64 default 0, last_recv int64 default 0);
+    last_seen int64 default 0, last_recv int64 default 0,
+    last_text_idx int, last_text_msgid int64, last_text_userid int64,
+    last_text_type tinyint, last_text_data blob);
 
 CREATE TABLE contacts(userid int64 PRIMARY KEY, email text, visibility int,
     since int64 not null default 0);
@@ -29,8 +31,21 @@ CREATE TABLE chat_vars(chatid int64 not null, name text not null, value text,
 
 CREATE TABLE history(idx int not null, chatid int64 not null, msgid int64 not null,
     userid int64, keyid int not null, type tinyint, updated smallint, ts int,
-    is_encrypted tinyint, data blob, backrefid int64 not null, UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+    is_encrypted tinyint, data blob, backrefid int64 not null, compression tinyint not null default 0,
+    UNIQUE(chatid,msgid), UNIQUE(chatid,idx));
+CREATE INDEX history_by_ts ON history(chatid, ts, idx);
+
+CREATE TABLE node_history(chatid int64 not null, idx int not null, msgid int64 not null,
+    nodehandle int64 not null, type tinyint not null, UNIQUE(chatid, idx, nodehandle));
+CREATE INDEX node_history_by_node ON node_history(chatid, nodehandle, idx);
+
+CREATE TABLE text_index(rowid integer primary key, chatid int64 not null, msgid int64 not null,
+    idx int not null, ts int not null, UNIQUE(chatid, msgid));
+CREATE INDEX text_index_by_idx ON text_index(chatid, idx);
 
 CREATE TABLE sendkeys(chatid int64 not null, userid int64 not null, keyid int64 not null, key blob not null,
     ts int not null, UNIQUE(chatid, userid, keyid));
 
+CREATE TABLE dns_cache(host text not null primary key, ipv4 text, ipv6 text,
+    resolve_ts int64 not null default 0, connect_ipv4_ts int64 not null default 0,
+    connect_ipv6_ts int64 not null default 0);
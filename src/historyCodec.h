@@ -0,0 +1,287 @@
+#ifndef KARERE_HISTORY_CODEC_H
+#define KARERE_HISTORY_CODEC_H
+
+/* Compression of the message payloads stored in the history table of the local cache
+ * (see ChatdSqliteDb). Each row has a 'compression' column with the format of its data,
+ * so rows written before compression was enabled, or by a build without it, stay readable.
+ * Short messages barely compress on their own, so a dictionary is trained once from the
+ * first messages that are stored, and saved in the 'vars' table. The training runs in its
+ * own thread, and the dictionary is installed afterwards by the thread that uses the codec.
+ * Until then, only the payloads that are long enough (i.e. attachment and rich-link JSON)
+ * are compressed.
+ * Requires building with KARERE_USE_ZSTD, otherwise all rows are written uncompressed.
+ */
+
+#include "buffer.h"
+#include "db.h"
+#include "karereCommon.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#ifdef KARERE_USE_ZSTD
+    #include <zstd.h>
+    #include <zdict.h>
+#endif
+
+namespace karere
+{
+class HistoryCodec
+{
+public:
+    enum: uint8_t
+    {
+        kFormatNone = 0,
+        kFormatZstd = 1,
+        /** zstd with the dictionary stored in vars */
+        kFormatZstdDict = 2
+    };
+    enum
+    {
+        kLevel = 3,
+        /** Minimum payload size to compress without a dictionary */
+        kMinSize = 192,
+        /** Minimum payload size to compress with the dictionary */
+        kMinDictSize = 24,
+        kDictSize = 16 * 1024,
+        /** Messages longer than this are not used as training samples */
+        kMaxSampleSize = 1024,
+        kTrainSamples = 4000,
+        kTrainBytes = 512 * 1024,
+        /** Upper bound of a decompressed payload, to reject corrupt frames */
+        kMaxDataSize = 16 * 1024 * 1024
+    };
+
+    HistoryCodec(SqliteDb& db): mDb(db) {}
+    ~HistoryCodec() { reset(); }
+    HistoryCodec(const HistoryCodec&) = delete;
+    HistoryCodec& operator=(const HistoryCodec&) = delete;
+
+    /** Must be called whenever the db is opened or created. Returns false if the db has
+     * compressed history that this build can't read, in which case it must be rebuilt */
+    bool load()
+    {
+        reset();
+        SqliteStmt stmt(mDb, "select value from vars where name = 'history_compressed'");
+        mHasCompressed = stmt.step();
+#ifdef KARERE_USE_ZSTD
+        SqliteStmt stmtDict(mDb, "select value from vars where name = 'history_dict'");
+        if (stmtDict.step())
+        {
+            Buffer dict;
+            stmtDict.blobCol(0, dict);
+            if (!setDict(dict))
+            {
+                KR_LOG_ERROR("HistoryCodec: Can't load the dictionary of the history, the cache must be rebuilt");
+                return false;
+            }
+        }
+        return true;
+#else
+        return !mHasCompressed;
+#endif
+    }
+
+    /** Compresses \c data into \c out if it saves space, and returns the format of
+     * \c out, or kFormatNone if \c data must be stored as is */
+    uint8_t compress(const StaticBuffer& data, Buffer& out)
+    {
+#ifdef KARERE_USE_ZSTD
+        size_t size = data.dataSize();
+        if (!mDDict && !installTrainedDict() && !mTrainThread.joinable())
+        {
+            addSample(data);
+        }
+        if (size < (mDDict ? kMinDictSize : kMinSize))
+        {
+            return kFormatNone;
+        }
+        if (!mCCtx)
+        {
+            mCCtx = ZSTD_createCCtx();
+            ZSTD_CCtx_setParameter(mCCtx, ZSTD_c_compressionLevel, kLevel);
+            // there's a single dictionary, its id would take 4 bytes of each message
+            ZSTD_CCtx_setParameter(mCCtx, ZSTD_c_dictIDFlag, 0);
+        }
+        ZSTD_CCtx_refCDict(mCCtx, mCDict);
+        out.clear();
+        char* dst = out.writePtr(0, ZSTD_compressBound(size));
+        size_t ret = ZSTD_compress2(mCCtx, dst, out.dataSize(), data.buf(), size);
+        if (ZSTD_isError(ret))
+        {
+            KR_LOG_WARNING("HistoryCodec: Error compressing a message: %s", ZSTD_getErrorName(ret));
+            return kFormatNone;
+        }
+        if (ret >= size)
+        {
+            return kFormatNone;
+        }
+        out.setDataSize(ret);
+        if (!mHasCompressed)
+        {
+            mDb.query("insert or replace into vars(name, value) values('history_compressed', '1')");
+            mHasCompressed = true;
+        }
+        return mCDict ? kFormatZstdDict : kFormatZstd;
+#else
+        (void)data; (void)out;
+        return kFormatNone;
+#endif
+    }
+
+    /** Installs and saves the dictionary, if its training has finished. Returns true
+     * if it has been installed. Called by compress(), and periodically by the owner so
+     * the dictionary is saved even if no more messages are stored */
+    bool installTrainedDict()
+    {
+#ifdef KARERE_USE_ZSTD
+        if (!mTrainDone)
+        {
+            return false;
+        }
+        mTrainThread.join();
+        mTrainDone = false;
+        mSamples.free();
+        mSampleSizes.clear();
+        mSampleSizes.shrink_to_fit();
+        if (ZDICT_isError(mTrainResult))
+        {
+            // not retried until the next session
+            KR_LOG_WARNING("HistoryCodec: Error training the dictionary of the history: %s", ZDICT_getErrorName(mTrainResult));
+            mTrainedDict.free();
+            mTrainFailed = true;
+            return false;
+        }
+        mTrainedDict.setDataSize(mTrainResult);
+        if (!setDict(mTrainedDict))
+        {
+            KR_LOG_WARNING("HistoryCodec: Error loading the trained dictionary");
+            freeDicts();
+            mTrainedDict.free();
+            mTrainFailed = true;
+            return false;
+        }
+        mDb.query("insert or replace into vars(name, value) values('history_dict', ?)", mTrainedDict);
+        KR_LOG_DEBUG("HistoryCodec: Trained a dictionary of %zu bytes for the history", mTrainResult);
+        mTrainedDict.free();
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /** Decompresses the payload of a row with format \c format into \c out */
+    bool decompress(uint8_t format, const void* data, size_t size, Buffer& out)
+    {
+        if (format == kFormatNone)
+        {
+            out.assign(data, size);
+            return true;
+        }
+#ifdef KARERE_USE_ZSTD
+        if ((format != kFormatZstd && format != kFormatZstdDict)
+            || (format == kFormatZstdDict && !mDDict))
+        {
+            return false;
+        }
+        unsigned long long len = ZSTD_getFrameContentSize(data, size);
+        if (len == ZSTD_CONTENTSIZE_UNKNOWN || len == ZSTD_CONTENTSIZE_ERROR || len > kMaxDataSize)
+        {
+            return false;
+        }
+        if (!mDCtx)
+        {
+            mDCtx = ZSTD_createDCtx();
+        }
+        out.clear();
+        char* dst = out.writePtr(0, len);
+        size_t ret = (format == kFormatZstdDict)
+            ? ZSTD_decompress_usingDDict(mDCtx, dst, len, data, size, mDDict)
+            : ZSTD_decompressDCtx(mDCtx, dst, len, data, size);
+        if (ZSTD_isError(ret) || ret != len)
+        {
+            out.clear();
+            return false;
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+protected:
+    SqliteDb& mDb;
+    bool mHasCompressed = false;
+#ifdef KARERE_USE_ZSTD
+    ZSTD_CCtx* mCCtx = nullptr;
+    ZSTD_DCtx* mDCtx = nullptr;
+    ZSTD_CDict* mCDict = nullptr;
+    ZSTD_DDict* mDDict = nullptr;
+    Buffer mSamples;
+    std::vector<size_t> mSampleSizes;
+    bool mTrainFailed = false;
+    /** Trains the dictionary from the samples into mTrainedDict, see installTrainedDict() */
+    std::thread mTrainThread;
+    std::atomic<bool> mTrainDone{false};
+    Buffer mTrainedDict;
+    size_t mTrainResult = 0;
+
+    bool setDict(const StaticBuffer& dict)
+    {
+        mCDict = ZSTD_createCDict(dict.buf(), dict.dataSize(), kLevel);
+        mDDict = ZSTD_createDDict(dict.buf(), dict.dataSize());
+        return mCDict && mDDict;
+    }
+    void addSample(const StaticBuffer& data)
+    {
+        if (mTrainFailed || !data.dataSize() || data.dataSize() > kMaxSampleSize)
+        {
+            return;
+        }
+        mSamples.append(data.buf(), data.dataSize());
+        mSampleSizes.push_back(data.dataSize());
+        if (mSampleSizes.size() < kTrainSamples && mSamples.dataSize() < kTrainBytes)
+        {
+            return;
+        }
+
+        // the samples and mTrainedDict belong to the training thread until installTrainedDict()
+        mTrainedDict.writePtr(0, kDictSize);
+        mTrainThread = std::thread([this]()
+        {
+            mTrainResult = ZDICT_trainFromBuffer(mTrainedDict.buf(), kDictSize, mSamples.buf(),
+                mSampleSizes.data(), (unsigned)mSampleSizes.size());
+            mTrainDone = true;
+        });
+    }
+    void freeDicts()
+    {
+        ZSTD_freeCDict(mCDict);
+        mCDict = nullptr;
+        ZSTD_freeDDict(mDDict);
+        mDDict = nullptr;
+    }
+#endif
+    void reset()
+    {
+        mHasCompressed = false;
+#ifdef KARERE_USE_ZSTD
+        if (mTrainThread.joinable())
+        {
+            // the training can't be interrupted, and it uses the samples
+            mTrainThread.join();
+        }
+        mTrainDone = false;
+        mTrainedDict.free();
+        freeDicts();
+        ZSTD_freeCCtx(mCCtx);
+        mCCtx = nullptr;
+        ZSTD_freeDCtx(mDCtx);
+        mDCtx = nullptr;
+        mSamples.free();
+        mSampleSizes.clear();
+        mTrainFailed = false;
+#endif
+    }
+};
+}
+#endif
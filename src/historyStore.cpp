@@ -0,0 +1,724 @@
+#include "historyStore.h"
+#include "karereCommon.h"
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <assert.h>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <set>
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <dirent.h>
+#endif
+
+namespace karere
+{
+enum: uint32_t
+{
+    kIndexMagic = 0x5849484b,   // "KHIX"
+    kHashMagic = 0x4849484b,    // "KHIH"
+    kVersion = 1
+};
+
+static inline uint32_t alignRecord(uint32_t size) { return (size + 7) & ~7u; }
+static inline uint64_t location(uint32_t seg, uint32_t offset) { return ((uint64_t)seg << 32) | offset; }
+static inline uint32_t hashMsgid(uint64_t msgid) { return (uint32_t)((msgid * 0x9E3779B97F4A7C15ULL) >> 32); }
+
+#ifndef _WIN32
+/** Maps the whole file, creating it with \c size bytes if \c create is set.
+ * Otherwise, \c size is set to the size of the existing file */
+static char* mapFile(const std::string& path, bool create, size_t& size)
+{
+    int fd = ::open(path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0600);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat info;
+    if (create ? (ftruncate(fd, size) != 0) : (fstat(fd, &info) != 0 || !info.st_size))
+    {
+        ::close(fd);
+        return nullptr;
+    }
+    if (!create)
+        size = info.st_size;
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);    // the mapping keeps the file open
+    return (data == MAP_FAILED) ? nullptr : static_cast<char*>(data);
+}
+static void unmapFile(void* data, size_t size)
+{
+    if (data)
+        munmap(data, size);
+}
+static bool makeDir(const std::string& path)
+{
+    return mkdir(path.c_str(), 0700) == 0 || errno == EEXIST;
+}
+#else
+static char* mapFile(const std::string&, bool, size_t&) { return nullptr; }
+static void unmapFile(void*, size_t) {}
+static bool makeDir(const std::string&) { return false; }
+#endif
+
+uint32_t HistoryStore::segmentSize(uint32_t seg, uint32_t recordSize)
+{
+    uint32_t size = (seg < 6) ? (kMinSegmentSize << seg) : kMaxSegmentSize;
+    return (recordSize > size) ? ((recordSize + 4095) & ~4095u) : size;
+}
+
+int32_t HistoryStore::low() const
+{
+    return mIndex ? mIndex->low : 0;
+}
+
+int32_t HistoryStore::high() const
+{
+    return mIndex ? mIndex->high : -1;
+}
+
+bool HistoryStore::open(const std::string& dir)
+{
+    close();
+    if (!makeDir(dir))
+    {
+        KR_LOG_ERROR("HistoryStore: Can't create the directory %s", dir.c_str());
+        return false;
+    }
+    mDir = dir;
+
+    std::string file = path("index");
+    mIndex = reinterpret_cast<IndexHeader*>(mapFile(file, false, mIndexSize));
+    if (!mIndex)
+    {
+        if (!createIndex(file, kMinCapacity, 0, mIndex, mIndexSize))
+        {
+            KR_LOG_ERROR("HistoryStore: Can't create %s", file.c_str());
+            return false;
+        }
+    }
+    else if (mIndexSize < sizeof(IndexHeader)
+        || mIndex->magic != kIndexMagic || mIndex->version != kVersion
+        || mIndexSize < sizeof(IndexHeader) + (size_t)mIndex->capacity * sizeof(Entry)
+        || (!empty() && ((int64_t)mIndex->low < mIndex->base
+            || (int64_t)mIndex->high >= (int64_t)mIndex->base + mIndex->capacity)))
+    {
+        KR_LOG_ERROR("HistoryStore: Corrupt index in %s", dir.c_str());
+        close();
+        return false;
+    }
+
+    if (!loadSegments())
+    {
+        KR_LOG_ERROR("HistoryStore: Missing or corrupt segments in %s", dir.c_str());
+        close();
+        return false;
+    }
+
+    // the hash table can always be rebuilt from the index
+    mHash = reinterpret_cast<HashHeader*>(mapFile(path("msgids"), false, mHashSize));
+    if (!mHash || mHashSize < sizeof(HashHeader)
+        || mHash->magic != kHashMagic || mHash->version != kVersion
+        || !mHash->capacity || (mHash->capacity & (mHash->capacity - 1))
+        || mHashSize < sizeof(HashHeader) + (size_t)mHash->capacity * sizeof(Slot))
+    {
+        try
+        {
+            rehash();
+        }
+        catch (std::exception& e)
+        {
+            KR_LOG_ERROR("HistoryStore: %s", e.what());
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+void HistoryStore::close()
+{
+    for (auto& it: mSegments)
+    {
+        unmapFile(it.second.data, it.second.size);
+    }
+    mSegments.clear();
+    unmapFile(mHash, mHashSize);
+    mHash = nullptr;
+    mHashSize = 0;
+    unmapFile(mIndex, mIndexSize);
+    mIndex = nullptr;
+    mIndexSize = 0;
+    mDirty = mDirChanged = false;
+}
+
+bool HistoryStore::remove(const std::string& dir)
+{
+#ifndef _WIN32
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        return errno == ENOENT;
+
+    std::vector<std::string> subdirs;
+    while (struct dirent* ent = readdir(d))
+    {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        std::string file = dir + "/" + ent->d_name;
+        if (::remove(file.c_str()) != 0)
+            subdirs.push_back(file);   // not empty
+    }
+    closedir(d);
+    for (auto& subdir: subdirs)
+    {
+        remove(subdir);
+    }
+    return rmdir(dir.c_str()) == 0;
+#else
+    (void)dir;
+    return false;
+#endif
+}
+
+std::vector<std::string> HistoryStore::list(const std::string& root)
+{
+    std::vector<std::string> names;
+#ifndef _WIN32
+    DIR* d = opendir(root.c_str());
+    if (!d)
+        return names;
+
+    while (struct dirent* ent = readdir(d))
+    {
+        struct stat info;
+        if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")
+            && stat((root + "/" + ent->d_name).c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+        {
+            names.emplace_back(ent->d_name);
+        }
+    }
+    closedir(d);
+#else
+    (void)root;
+#endif
+    return names;
+}
+
+bool HistoryStore::createIndex(const std::string& file, uint32_t capacity, int32_t base,
+    IndexHeader*& index, size_t& size)
+{
+    size = sizeof(IndexHeader) + (size_t)capacity * sizeof(Entry);
+    index = reinterpret_cast<IndexHeader*>(mapFile(file, true, size));
+    if (!index)
+        return false;
+
+    // the new file is filled with zeros
+    mDirty = mDirChanged = true;
+    index->magic = kIndexMagic;
+    index->version = kVersion;
+    index->base = base;
+    index->capacity = capacity;
+    index->low = 0;
+    index->high = -1;
+    return true;
+}
+
+bool HistoryStore::createHash(const std::string& file, uint32_t capacity, HashHeader*& hash, size_t& size)
+{
+    size = sizeof(HashHeader) + (size_t)capacity * sizeof(Slot);
+    hash = reinterpret_cast<HashHeader*>(mapFile(file, true, size));
+    if (!hash)
+        return false;
+
+    mDirty = mDirChanged = true;
+    hash->magic = kHashMagic;
+    hash->version = kVersion;
+    hash->capacity = capacity;
+    return true;
+}
+
+bool HistoryStore::loadSegments()
+{
+    uint32_t tail = mIndex->tailSegment;
+    if (!empty())
+    {
+        for (int32_t i = mIndex->low; i <= mIndex->high; i++)
+        {
+            uint64_t loc = entry(i).location;
+            Segment* seg = mapSegment(loc >> 32, false, 0);
+            if (!seg || (uint32_t)loc > seg->size - sizeof(RecordHeader))
+                return false;
+            seg->live++;
+        }
+    }
+    if (!mSegments.empty() && mSegments.rbegin()->first > tail)
+        return false;
+
+#ifndef _WIN32
+    // segments left behind by a crash while they were being deleted
+    if (DIR* d = opendir(mDir.c_str()))
+    {
+        std::set<std::string> stale;
+        while (struct dirent* ent = readdir(d))
+        {
+            unsigned long seg;
+            char end;
+            if (sscanf(ent->d_name, "seg.%lu%c", &seg, &end) == 1
+                && seg < tail && !mSegments.count((uint32_t)seg))
+            {
+                stale.insert(ent->d_name);
+            }
+        }
+        closedir(d);
+        for (auto& name: stale)
+        {
+            ::remove(path(name.c_str()).c_str());
+        }
+    }
+#endif
+    return true;
+}
+
+HistoryStore::Segment* HistoryStore::mapSegment(uint32_t seg, bool create, uint32_t recordSize)
+{
+    auto it = mSegments.find(seg);
+    if (it != mSegments.end())
+        return &it->second;
+
+    std::string file = segmentPath(seg);
+    size_t size = 0;
+    char* data = mapFile(file, false, size);
+    if (!data && create)
+    {
+        size = segmentSize(seg, recordSize);
+        data = mapFile(file, true, size);
+        mDirChanged = true;
+    }
+    if (!data)
+        return nullptr;
+    if (size > std::numeric_limits<uint32_t>::max() || size < sizeof(RecordHeader))
+    {
+        unmapFile(data, size);
+        return nullptr;
+    }
+
+    Segment& segment = mSegments[seg];
+    segment.data = data;
+    segment.size = (uint32_t)size;
+    return &segment;
+}
+
+void HistoryStore::reserveIdx(int32_t idx)
+{
+    int64_t base = mIndex->base;
+    int64_t capacity = mIndex->capacity;
+    if (idx >= base && idx < base + capacity)
+        return;
+
+    static const int64_t kMinIdx = std::numeric_limits<int32_t>::min();
+    if (empty())
+    {
+        // nothing to move, just center the array around the first message
+        mIndex->base = (int32_t)std::max(kMinIdx, (int64_t)idx - capacity / 2);
+        return;
+    }
+
+    // there's history in both directions, keep it centered
+    int64_t newLow = std::min(idx, mIndex->low);
+    int64_t newHigh = std::max(idx, mIndex->high);
+    int64_t span = newHigh - newLow + 1;
+    while (capacity < 2 * span)
+    {
+        capacity *= 2;
+    }
+    if (capacity > std::numeric_limits<uint32_t>::max() / 2)
+        throw std::runtime_error("HistoryStore: history is too long");
+    base = std::max(kMinIdx, newLow - (capacity - span) / 2);
+
+    // the array is written to a new file, which replaces the index once complete
+    std::string file = path("index");
+    std::string tmp = file + ".tmp";
+    IndexHeader* index;
+    size_t size;
+    if (!createIndex(tmp, (uint32_t)capacity, (int32_t)base, index, size))
+        throw std::runtime_error("HistoryStore: Can't grow " + file + ": " + strerror(errno));
+
+    int32_t low = mIndex->low;
+    memcpy(reinterpret_cast<Entry*>(index + 1) + (low - base), &entry(low),
+           ((size_t)mIndex->high - low + 1) * sizeof(Entry));
+    index->low = low;
+    index->high = mIndex->high;
+    index->tailSegment = mIndex->tailSegment;
+    index->tailOffset = mIndex->tailOffset;
+    if (rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        unmapFile(index, size);
+        ::remove(tmp.c_str());
+        throw std::runtime_error("HistoryStore: Can't replace " + file + ": " + strerror(errno));
+    }
+    unmapFile(mIndex, mIndexSize);
+    mIndex = index;
+    mIndexSize = size;
+}
+
+bool HistoryStore::isLive(int32_t idx, uint64_t msgid) const
+{
+    return !empty() && idx >= mIndex->low && idx <= mIndex->high && entry(idx).msgid == msgid;
+}
+
+void HistoryStore::rehash()
+{
+    // load factor of 1/4 after rebuilding, rebuilt again at 1/2
+    uint64_t live = empty() ? 0 : ((int64_t)mIndex->high - mIndex->low + 1);
+    uint64_t capacity = 2 * kMinCapacity;
+    while (capacity < 4 * live)
+    {
+        capacity *= 2;
+    }
+    if (capacity > std::numeric_limits<uint32_t>::max() / 2)
+        throw std::runtime_error("HistoryStore: history is too long");
+
+    std::string file = path("msgids");
+    std::string tmp = file + ".tmp";
+    HashHeader* hash;
+    size_t size;
+    if (!createHash(tmp, (uint32_t)capacity, hash, size))
+        throw std::runtime_error("HistoryStore: Can't create " + tmp + ": " + strerror(errno));
+
+    Slot* table = reinterpret_cast<Slot*>(hash + 1);
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (uint64_t i = 0; i < live; i++)
+    {
+        int32_t idx = (int32_t)(mIndex->low + (int64_t)i);
+        uint64_t msgid = entry(idx).msgid;
+        uint32_t pos = hashMsgid(msgid) & mask;
+        while (table[pos].msgid)
+        {
+            pos = (pos + 1) & mask;
+        }
+        table[pos].msgid = msgid;
+        table[pos].idx = idx;
+    }
+    hash->used = (uint32_t)live;
+    if (rename(tmp.c_str(), file.c_str()) != 0)
+    {
+        unmapFile(hash, size);
+        ::remove(tmp.c_str());
+        throw std::runtime_error("HistoryStore: Can't replace " + file + ": " + strerror(errno));
+    }
+    unmapFile(mHash, mHashSize);
+    mHash = hash;
+    mHashSize = size;
+}
+
+void HistoryStore::insertMsgid(uint64_t msgid, int32_t idx)
+{
+    if (((uint64_t)mHash->used + 1) * 2 > mHash->capacity)
+    {
+        rehash();   // includes the new entry
+        return;
+    }
+
+    // slots of messages that were removed from the history are reused
+    uint32_t mask = mHash->capacity - 1;
+    uint32_t pos = hashMsgid(msgid) & mask;
+    Slot* table = slots();
+    while (table[pos].msgid && table[pos].msgid != msgid && isLive(table[pos].idx, table[pos].msgid))
+    {
+        pos = (pos + 1) & mask;
+    }
+    if (!table[pos].msgid)
+        mHash->used++;
+    table[pos].idx = idx;
+    table[pos].msgid = msgid;
+}
+
+int32_t HistoryStore::find(uint64_t msgid) const
+{
+    if (!mIndex || empty() || !msgid)
+        return kIdxInvalid;
+
+    uint32_t mask = mHash->capacity - 1;
+    uint32_t pos = hashMsgid(msgid) & mask;
+    const Slot* table = slots();
+    for (uint32_t i = 0; i < mHash->capacity && table[pos].msgid; i++)
+    {
+        if (table[pos].msgid == msgid && isLive(table[pos].idx, msgid))
+            return table[pos].idx;
+        pos = (pos + 1) & mask;
+    }
+    return kIdxInvalid;
+}
+
+uint64_t HistoryStore::appendRecord(int32_t idx, const Record& rec)
+{
+    uint32_t size = alignRecord(sizeof(RecordHeader) + rec.dataSize);
+    uint32_t seg = mIndex->tailSegment;
+    uint32_t offset = mIndex->tailOffset;
+    Segment* segment = mapSegment(seg, true, size);
+    if (segment && (uint64_t)offset + size > segment->size)
+    {
+        uint32_t prev = seg++;
+        offset = 0;
+        segment = mapSegment(seg, true, size);
+        if (segment)
+        {
+            mIndex->tailSegment = seg;
+            mIndex->tailOffset = 0;
+            releaseLocation(location(prev, 0) | 0xffffffff);    // deleted if nothing points to it
+        }
+    }
+    if (!segment || (uint64_t)offset + size > segment->size)
+        throw std::runtime_error("HistoryStore: Can't write " + segmentPath(seg) + ": " + strerror(errno));
+
+    char* data = segment->data + offset;
+    RecordHeader* header = reinterpret_cast<RecordHeader*>(data);
+    header->msgid = rec.msgid;
+    header->userid = rec.userid;
+    header->backrefid = rec.backrefid;
+    header->idx = idx;
+    header->ts = rec.ts;
+    header->keyid = rec.keyid;
+    header->dataSize = rec.dataSize;
+    header->updated = rec.updated;
+    header->type = rec.type;
+    header->encrypted = rec.encrypted;
+    header->format = rec.format;
+    memset(header->reserved, 0, sizeof(header->reserved));
+    if (rec.dataSize)
+        memcpy(data + sizeof(RecordHeader), rec.data, rec.dataSize);
+    mIndex->tailOffset = offset + size;
+    mDirty = true;
+    segment->dirty = true;
+    segment->live++;
+    return location(seg, offset);
+}
+
+void HistoryStore::releaseLocation(uint64_t loc)
+{
+    uint32_t seg = loc >> 32;
+    auto it = mSegments.find(seg);
+    if (it == mSegments.end())
+        return;
+
+    // a full tail segment is passed with an invalid offset, to delete it if it's not used
+    if ((uint32_t)loc != 0xffffffff)
+    {
+        assert(it->second.live);
+        it->second.live--;
+    }
+    if (it->second.live || seg == mIndex->tailSegment)
+        return;
+
+    unmapFile(it->second.data, it->second.size);
+    mSegments.erase(it);
+    ::remove(segmentPath(seg).c_str());
+    mDirChanged = true;
+}
+
+void HistoryStore::add(int32_t idx, const Record& rec, uint8_t flags)
+{
+    assert(isOpen());
+    if (idx == kIdxInvalid)
+        throw std::runtime_error("HistoryStore: Invalid idx");
+    bool prepend = !empty() && (int64_t)idx == (int64_t)mIndex->low - 1;
+    if (!empty() && !prepend && (int64_t)idx != (int64_t)mIndex->high + 1)
+    {
+        throw std::runtime_error("HistoryStore: idx " + std::to_string(idx) + " is not adjacent to the history ["
+            + std::to_string(mIndex->low) + ", " + std::to_string(mIndex->high) + "]");
+    }
+
+    reserveIdx(idx);
+    uint64_t loc = appendRecord(idx, rec);
+    Entry& e = entry(idx);
+    e.msgid = rec.msgid;
+    e.location = loc;
+    e.ts = rec.ts;
+    e.flags = flags;
+    if (empty())
+    {
+        // the bounds of an empty history may enclose stale entries, it must stay empty meanwhile
+        mIndex->low = std::numeric_limits<int32_t>::max();
+        mIndex->high = idx;
+        mIndex->low = idx;
+    }
+    else if (prepend)
+    {
+        mIndex->low = idx;
+    }
+    else
+    {
+        mIndex->high = idx;
+    }
+    insertMsgid(rec.msgid, idx);
+}
+
+void HistoryStore::update(int32_t idx, const Record& rec, uint8_t flags)
+{
+    assert(isOpen());
+    if (empty() || idx < mIndex->low || idx > mIndex->high)
+        throw std::runtime_error("HistoryStore: update: idx " + std::to_string(idx) + " is not in the history");
+
+    uint64_t loc = appendRecord(idx, rec);
+    Entry& e = entry(idx);
+    assert(e.msgid == rec.msgid);
+    uint64_t prev = e.location;
+    e.location = loc;
+    e.ts = rec.ts;
+    e.flags = flags;
+    releaseLocation(prev);
+}
+
+bool HistoryStore::get(int32_t idx, Record& rec) const
+{
+    if (!mIndex || empty() || idx < mIndex->low || idx > mIndex->high)
+        return false;
+
+    const Entry& e = entry(idx);
+    auto it = mSegments.find(e.location >> 32);
+    uint32_t offset = (uint32_t)e.location;
+    if (it == mSegments.end() || offset > it->second.size - sizeof(RecordHeader))
+        return false;
+
+    const char* data = it->second.data + offset;
+    const RecordHeader* header = reinterpret_cast<const RecordHeader*>(data);
+    if (header->idx != idx || header->msgid != e.msgid
+        || header->dataSize > it->second.size - offset - sizeof(RecordHeader))
+    {
+        return false;
+    }
+    rec.msgid = header->msgid;
+    rec.userid = header->userid;
+    rec.backrefid = header->backrefid;
+    rec.ts = header->ts;
+    rec.keyid = header->keyid;
+    rec.updated = header->updated;
+    rec.type = header->type;
+    rec.encrypted = header->encrypted;
+    rec.format = header->format;
+    rec.data = data + sizeof(RecordHeader);
+    rec.dataSize = header->dataSize;
+    return true;
+}
+
+int32_t HistoryStore::findTs(uint32_t ts) const
+{
+    if (!mIndex || empty() || entry(mIndex->low).ts > ts)
+        return kIdxInvalid;
+
+    // the last idx with ts <= ts is in [lo, hi]
+    int32_t lo = mIndex->low;
+    int32_t hi = mIndex->high;
+    while (lo < hi)
+    {
+        int32_t mid = lo + (int32_t)(((int64_t)hi - lo + 1) / 2);
+        if (entry(mid).ts <= ts)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+int32_t HistoryStore::findLast(int32_t from, uint8_t flags) const
+{
+    if (!mIndex || empty() || from < mIndex->low)
+        return kIdxInvalid;
+
+    for (int32_t i = std::min(from, mIndex->high); i >= mIndex->low; i--)
+    {
+        if (entry(i).flags & flags)
+            return i;
+    }
+    return kIdxInvalid;
+}
+
+unsigned HistoryStore::count(int32_t idx, uint8_t flags) const
+{
+    if (!mIndex || empty())
+        return 0;
+
+    int64_t start = (idx == kIdxInvalid) ? mIndex->low : std::max<int64_t>((int64_t)idx + 1, mIndex->low);
+    unsigned count = 0;
+    for (int64_t i = start; i <= mIndex->high; i++)
+    {
+        count += (entry((int32_t)i).flags & flags) ? 1 : 0;
+    }
+    return count;
+}
+
+void HistoryStore::eraseBefore(int32_t idx)
+{
+    assert(isOpen());
+    if (empty() || idx <= mIndex->low)
+        return;
+
+    int32_t end = (int32_t)std::min<int64_t>(idx, (int64_t)mIndex->high + 1);
+    std::vector<uint64_t> locations;
+    locations.reserve(end - mIndex->low);
+    for (int32_t i = mIndex->low; i < end; i++)
+    {
+        locations.push_back(entry(i).location);
+    }
+    // bounds first, so that a crash doesn't leave entries pointing to deleted segments
+    mIndex->low = end;
+    mDirty = true;
+    for (uint64_t loc: locations)
+    {
+        releaseLocation(loc);
+    }
+}
+
+void HistoryStore::clear()
+{
+    std::string dir = mDir;
+    close();
+    remove(dir);
+    if (!open(dir))
+        throw std::runtime_error("HistoryStore: Can't recreate " + dir);
+}
+
+bool HistoryStore::sync()
+{
+#ifndef _WIN32
+    if (!mIndex)
+        return true;
+
+    // the records, before the entries that point to them
+    bool ok = true;
+    for (auto& it: mSegments)
+    {
+        Segment& segment = it.second;
+        if (segment.dirty)
+        {
+            segment.dirty = (msync(segment.data, segment.size, MS_SYNC) != 0);
+            ok = ok && !segment.dirty;
+        }
+    }
+    if (mDirty && ok)
+    {
+        mDirty = (msync(mHash, mHashSize, MS_SYNC) != 0 || msync(mIndex, mIndexSize, MS_SYNC) != 0);
+        ok = !mDirty;
+    }
+    if (mDirChanged && ok)
+    {
+        int fd = ::open(mDir.c_str(), O_RDONLY);
+        mDirChanged = (fd < 0 || fsync(fd) != 0);
+        if (fd >= 0)
+            ::close(fd);
+        ok = !mDirChanged;
+    }
+    if (!ok)
+        KR_LOG_ERROR("HistoryStore: Can't sync %s: %s", mDir.c_str(), strerror(errno));
+    return ok;
+#else
+    return true;
+#endif
+}
+}
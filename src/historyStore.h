@@ -0,0 +1,202 @@
+#ifndef KARERE_HISTORY_STORE_H
+#define KARERE_HISTORY_STORE_H
+
+/* Append-only store of the history of a chat, an alternative to the history table of the
+ * local cache (see ChatdSegmentDb). History is addressed by a dense index, and new messages
+ * are only added at either end of it, so each chat has a directory with:
+ *  - index: an array of fixed-size entries, one per idx, with the msgid, ts, some flags
+ *    set by the caller and the location of the latest record of the message
+ *  - msgids: an open-addressing hash table from msgid to idx
+ *  - seg.<n>: segments where the records of the messages are appended. Edits append a new
+ *    record (an overlay) and point the entry to it. A segment is deleted once none of the
+ *    messages points to it anymore.
+ * All the files are memory-mapped. Writes are visible in the files as soon as they are done,
+ * so they survive a crash of the app, but they only reach the disk when sync() is called (or
+ * when the OS writes them back). The entry of a message is written after its record, and the
+ * bounds of the history after the entry, so a store that is left half-written by a crash of
+ * the OS is detected when reading and must be cleared.
+ * Not available on Windows, where open() always fails.
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+namespace karere
+{
+class HistoryStore
+{
+public:
+    enum: uint8_t
+    {
+        /** Flags of the entries, set by the caller to find messages without reading them */
+        kFlagUnread = 1,
+        kFlagLastText = 2
+    };
+    enum: int32_t { kIdxInvalid = 0x7fffffff };
+    enum: uint32_t
+    {
+        kMinSegmentSize = 64 * 1024,
+        /** Segments double their size up to this one, so small chats take little space */
+        kMaxSegmentSize = 4 * 1024 * 1024,
+        kMinCapacity = 256
+    };
+
+    /** The fields of a message. When returned by get(), \c data points to the mapped
+     * segment, and is valid until the next change of the store */
+    struct Record
+    {
+        uint64_t msgid = 0;
+        uint64_t userid = 0;
+        uint64_t backrefid = 0;
+        uint32_t ts = 0;
+        uint32_t keyid = 0;
+        uint16_t updated = 0;
+        uint8_t type = 0;
+        uint8_t encrypted = 0;
+        /** Format of the data, see HistoryCodec */
+        uint8_t format = 0;
+        const void* data = nullptr;
+        uint32_t dataSize = 0;
+    };
+
+    HistoryStore() {}
+    ~HistoryStore() { close(); }
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    /** Opens the store in \c dir, creating it if it doesn't exist. Returns false if it
+     * can't be created or is corrupt, in which case it should be removed */
+    bool open(const std::string& dir);
+    void close();
+    bool isOpen() const { return mIndex != nullptr; }
+    /** Deletes \c dir and everything in it. A store in it must not be open */
+    static bool remove(const std::string& dir);
+    /** Returns the names of the directories in \c root, i.e. the stores of each chat */
+    static std::vector<std::string> list(const std::string& root);
+
+    bool empty() const { return high() < low(); }
+    int32_t low() const;
+    int32_t high() const;
+    /** Adds a message at \c idx, which must be next to either end of the history, or
+     * anything if it's empty. Throws std::runtime_error if the files can't be written */
+    void add(int32_t idx, const Record& rec, uint8_t flags);
+    /** Replaces the message at \c idx with \c rec, appending an overlay record */
+    void update(int32_t idx, const Record& rec, uint8_t flags);
+    /** Returns false if \c idx is out of the history, or its record is corrupt */
+    bool get(int32_t idx, Record& rec) const;
+    uint64_t msgidAt(int32_t idx) const { return entry(idx).msgid; }
+    uint32_t tsAt(int32_t idx) const { return entry(idx).ts; }
+    uint8_t flagsAt(int32_t idx) const { return entry(idx).flags; }
+    /** Returns the idx of \c msgid, or kIdxInvalid */
+    int32_t find(uint64_t msgid) const;
+    /** Returns the highest idx of a message sent at \c ts or before, or kIdxInvalid.
+     * The messages are in order of ts, save for clock skews of the senders, so it's
+     * found by a binary search */
+    int32_t findTs(uint32_t ts) const;
+    /** Returns the highest idx up to \c from with any of \c flags, or kIdxInvalid */
+    int32_t findLast(int32_t from, uint8_t flags) const;
+    /** Counts the messages after \c idx with any of \c flags */
+    unsigned count(int32_t idx, uint8_t flags) const;
+    /** Removes the messages before \c idx */
+    void eraseBefore(int32_t idx);
+    void clear();
+    /** Writes the changes since the previous call to disk, so that they survive a crash of
+     * the OS. Returns false if any of the files couldn't be synced, which are retried in the
+     * next call */
+    bool sync();
+
+protected:
+    struct Entry
+    {
+        uint64_t msgid;
+        /** segment << 32 | offset */
+        uint64_t location;
+        uint32_t ts;
+        uint8_t flags;
+        uint8_t reserved[3];
+    };
+    struct IndexHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        /** idx of the first entry of the array */
+        int32_t base;
+        uint32_t capacity;
+        int32_t low;
+        int32_t high;
+        /** where the next record is appended */
+        uint32_t tailSegment;
+        uint32_t tailOffset;
+        uint8_t reserved[32];
+    };
+    struct Slot
+    {
+        uint64_t msgid;
+        int32_t idx;
+        uint32_t reserved;
+    };
+    struct HashHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint32_t used;
+    };
+    struct RecordHeader
+    {
+        uint64_t msgid;
+        uint64_t userid;
+        uint64_t backrefid;
+        int32_t idx;
+        uint32_t ts;
+        uint32_t keyid;
+        uint32_t dataSize;
+        uint16_t updated;
+        uint8_t type;
+        uint8_t encrypted;
+        uint8_t format;
+        uint8_t reserved[7];
+    };
+    struct Segment
+    {
+        char* data = nullptr;
+        uint32_t size = 0;
+        /** number of entries pointing to it */
+        uint32_t live = 0;
+        /** whether it has records that were not synced */
+        bool dirty = false;
+    };
+
+    std::string mDir;
+    IndexHeader* mIndex = nullptr;
+    size_t mIndexSize = 0;
+    HashHeader* mHash = nullptr;
+    size_t mHashSize = 0;
+    std::map<uint32_t, Segment> mSegments;
+    /** whether the index or the hash table changed since the last sync() */
+    bool mDirty = false;
+    /** whether files were created, replaced or deleted since the last sync() */
+    bool mDirChanged = false;
+
+    Entry* entries() const { return reinterpret_cast<Entry*>(mIndex + 1); }
+    Entry& entry(int32_t idx) const { return entries()[(int64_t)idx - mIndex->base]; }
+    Slot* slots() const { return reinterpret_cast<Slot*>(mHash + 1); }
+    std::string path(const char* name) const { return mDir + "/" + name; }
+    std::string segmentPath(uint32_t seg) const { return mDir + "/seg." + std::to_string(seg); }
+    static uint32_t segmentSize(uint32_t seg, uint32_t recordSize);
+    bool isLive(int32_t idx, uint64_t msgid) const;
+
+    bool createIndex(const std::string& file, uint32_t capacity, int32_t base, IndexHeader*& index, size_t& size);
+    bool createHash(const std::string& file, uint32_t capacity, HashHeader*& hash, size_t& size);
+    bool loadSegments();
+    Segment* mapSegment(uint32_t seg, bool create, uint32_t recordSize);
+    void reserveIdx(int32_t idx);
+    void rehash();
+    void insertMsgid(uint64_t msgid, int32_t idx);
+    uint64_t appendRecord(int32_t idx, const Record& rec);
+    void releaseLocation(uint64_t location);
+};
+}
+#endif
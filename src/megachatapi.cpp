@@ -383,6 +383,21 @@ MegaChatListItemList *MegaChatApi::getUnreadChatListItems()
     return pImpl->getUnreadChatListItems();
 }
 
+int64_t MegaChatApi::getChatListVersion()
+{
+    return pImpl->getChatListVersion();
+}
+
+MegaChatListItemList *MegaChatApi::getChatListItemsChangedSince(int64_t version)
+{
+    return pImpl->getChatListItemsChangedSince(version);
+}
+
+MegaChatListItemList *MegaChatApi::getChatListItemsByLastActivity(unsigned int offset, unsigned int count)
+{
+    return pImpl->getChatListItemsByLastActivity(offset, count);
+}
+
 MegaChatHandle MegaChatApi::getChatHandleByUser(MegaChatHandle userhandle)
 {
     return pImpl->getChatHandleByUser(userhandle);
@@ -443,6 +458,16 @@ int MegaChatApi::loadMessages(MegaChatHandle chatid, int count)
     return pImpl->loadMessages(chatid, count);
 }
 
+void MegaChatApi::setBatchedHistoryLoading(bool enable)
+{
+    pImpl->setBatchedHistoryLoading(enable);
+}
+
+bool MegaChatApi::isBatchedHistoryLoading()
+{
+    return pImpl->isBatchedHistoryLoading();
+}
+
 bool MegaChatApi::isFullHistoryLoaded(MegaChatHandle chatid)
 {
     return pImpl->isFullHistoryLoaded(chatid);
@@ -498,6 +523,11 @@ bool MegaChatApi::isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle) co
     return pImpl->isRevoked(chatid, nodeHandle);
 }
 
+MegaChatMessageList *MegaChatApi::getNodeAttachmentMessages(MegaChatHandle chatid, int beforeIndex, unsigned int count)
+{
+    return pImpl->getNodeAttachmentMessages(chatid, beforeIndex, count);
+}
+
 MegaChatMessage *MegaChatApi::editMessage(MegaChatHandle chatid, MegaChatHandle msgid, const char *msg)
 {
     if (!msg)   // force to use deleteMessage() to delete message instead
@@ -553,11 +583,46 @@ bool MegaChatApi::isMessageReceptionConfirmationActive() const
     return pImpl->isMessageReceptionConfirmationActive();
 }
 
+void MegaChatApi::setStorageProfile(int profile)
+{
+    pImpl->setStorageProfile(profile);
+}
+
+void MegaChatApi::setHistoryRetention(unsigned int seconds)
+{
+    pImpl->setHistoryRetention(seconds);
+}
+
+void MegaChatApi::setHistoryStorage(int storage)
+{
+    pImpl->setHistoryStorage(storage);
+}
+
+void MegaChatApi::setHistoryPrefetch(unsigned int count)
+{
+    pImpl->setHistoryPrefetch(count);
+}
+
 void MegaChatApi::saveCurrentState()
 {
     pImpl->saveCurrentState();
 }
 
+MegaChatMessageList *MegaChatApi::getMessagesAround(MegaChatHandle chatid, MegaChatHandle msgid, unsigned int before, unsigned int after)
+{
+    return pImpl->getMessagesAround(chatid, msgid, before, after);
+}
+
+MegaChatMessageList *MegaChatApi::getMessagesAroundTime(MegaChatHandle chatid, int64_t ts, unsigned int before, unsigned int after)
+{
+    return pImpl->getMessagesAroundTime(chatid, ts, before, after);
+}
+
+void MegaChatApi::searchMessages(MegaChatHandle chatid, const char *query, unsigned int limit, long long cursor, MegaChatRequestListener *listener)
+{
+    pImpl->searchMessages(chatid, query, limit, cursor, listener);
+}
+
 void MegaChatApi::pushReceived(bool beep, MegaChatRequestListener *listener)
 {
     pImpl->pushReceived(beep, listener);
@@ -1171,6 +1236,19 @@ void MegaChatRoomListener::onMessageLoaded(MegaChatApi *api, MegaChatMessage *ms
 
 }
 
+void MegaChatRoomListener::onMessagesLoaded(MegaChatApi *api, MegaChatMessageList *msgs)
+{
+    // listeners that don't handle batches get the messages one by one
+    for (unsigned int i = 0; i < msgs->size(); i++)
+    {
+        MegaChatMessage *msg = msgs->get(i)->copy();
+        onMessageLoaded(api, msg);
+        delete msg;
+    }
+
+    onMessageLoaded(api, NULL);
+}
+
 void MegaChatRoomListener::onMessageReceived(MegaChatApi *api, MegaChatMessage *msg)
 {
 
@@ -1397,6 +1475,21 @@ unsigned int MegaChatListItemList::size() const
     return 0;
 }
 
+MegaChatMessageList *MegaChatMessageList::copy() const
+{
+    return NULL;
+}
+
+const MegaChatMessage *MegaChatMessageList::get(unsigned int i) const
+{
+    return NULL;
+}
+
+unsigned int MegaChatMessageList::size() const
+{
+    return 0;
+}
+
 MegaChatPresenceConfig *MegaChatPresenceConfig::copy() const
 {
     return NULL;
@@ -57,6 +57,7 @@ class MegaChatVideoListener;
 class MegaChatListener;
 class MegaChatNotificationListener;
 class MegaChatListItem;
+class MegaChatMessageList;
 
 /**
  * @brief Provide information about a call
@@ -587,6 +588,43 @@ public:
 
 };
 
+/**
+ * @brief List of MegaChatMessage objects
+ *
+ * A MegaChatMessageList has the ownership of the MegaChatMessage objects that it contains, so they will be
+ * only valid until the MegaChatMessageList is deleted. If you want to retain a MegaChatMessage returned by
+ * a MegaChatMessageList, use MegaChatMessage::copy.
+ *
+ * Objects of this class are immutable.
+ */
+class MegaChatMessageList
+{
+public:
+    virtual ~MegaChatMessageList() {}
+
+    virtual MegaChatMessageList *copy() const;
+
+    /**
+     * @brief Returns the MegaChatMessage at the position i in the MegaChatMessageList
+     *
+     * The MegaChatMessageList retains the ownership of the returned MegaChatMessage. It will be only valid until
+     * the MegaChatMessageList is deleted.
+     *
+     * If the index is >= the size of the list, this function returns NULL.
+     *
+     * @param i Position of the MegaChatMessage that we want to get for the list
+     * @return MegaChatMessage at the position i in the list
+     */
+    virtual const MegaChatMessage *get(unsigned int i)  const;
+
+    /**
+     * @brief Returns the number of MegaChatMessages in the list
+     * @return Number of MegaChatMessage in the list
+     */
+    virtual unsigned int size() const;
+
+};
+
 /**
  * @brief This class store rich preview data
  *
@@ -1217,6 +1255,7 @@ public:
         TYPE_SEND_TYPING_NOTIF, TYPE_SIGNAL_ACTIVITY,
         TYPE_SET_PRESENCE_PERSIST, TYPE_SET_PRESENCE_AUTOAWAY,
         TYPE_LOAD_AUDIO_VIDEO_DEVICES, TYPE_PUSH_RECEIVED,
+        TYPE_SEARCH_MESSAGES,
         TOTAL_OF_REQUEST_TYPES
     };
 
@@ -1745,6 +1784,20 @@ public:
         INIT_NO_CACHE               = 7     /// Cache not available for \c sid provided --> it requires login+fetchnodes
     };
 
+    enum
+    {
+        STORAGE_PROFILE_DEFAULT     = 0,    /// WAL journal, 32MB of memory-mapped I/O, 4MB of page cache
+        STORAGE_PROFILE_LOW_MEMORY  = 1,    /// WAL journal, no memory-mapped I/O, 1MB of page cache
+        STORAGE_PROFILE_THROUGHPUT  = 2,    /// WAL journal, 256MB of memory-mapped I/O, 16MB of page cache
+        STORAGE_PROFILE_LEGACY      = 3     /// Rollback journal and SQLite's default settings
+    };
+
+    enum
+    {
+        HISTORY_STORAGE_SQLITE      = 0,    /// History in the SQLite database of the local cache
+        HISTORY_STORAGE_SEGMENTS    = 1     /// History in memory-mapped files of each chat
+    };
+
     enum
     {
         DISCONNECTED    = 0,    /// No connection established
@@ -1854,6 +1907,81 @@ public:
      */
     int init(const char *sid);
 
+    /**
+     * @brief Sets the storage settings of the local cache
+     *
+     * With a WAL journal (all profiles but MegaChatApi::STORAGE_PROFILE_LEGACY), commits don't
+     * sync the disk, and the syncs are done by a separate thread. Memory-mapped I/O and a bigger
+     * page cache make loading history from the cache faster, at the cost of memory usage.
+     *
+     * Valid values are:
+     *  - MegaChatApi::STORAGE_PROFILE_DEFAULT = 0
+     *  - MegaChatApi::STORAGE_PROFILE_LOW_MEMORY = 1
+     *  - MegaChatApi::STORAGE_PROFILE_THROUGHPUT = 2
+     *  - MegaChatApi::STORAGE_PROFILE_LEGACY = 3
+     *
+     * This function must be called before MegaChatApi::init. Otherwise, it takes effect
+     * the next time the cache is opened. The default value is MegaChatApi::STORAGE_PROFILE_DEFAULT.
+     *
+     * @param profile Storage profile of the local cache
+     */
+    void setStorageProfile(int profile);
+
+    /**
+     * @brief Sets for how long the messages are kept in the local cache
+     *
+     * The messages sent before that time are deleted from the cache by its periodic maintenance,
+     * and they are loaded from the server again if the app requests them via
+     * MegaChatApi::loadMessages. If the retention time of a chat, set in the server, is shorter,
+     * that one is used for the chat instead.
+     *
+     * The history of a chat is only pruned while the chat is not connected to the chat server
+     * (i.e. before the connection is established, or while it's offline), since the server
+     * delivers the older history of a connected chat from the oldest message that the cache
+     * had when it connected.
+     *
+     * It can be called at any time. The default value is 0, which keeps all the messages.
+     *
+     * @param seconds Time in seconds, or 0 to keep all the messages
+     */
+    void setHistoryRetention(unsigned int seconds);
+
+    /**
+     * @brief Sets where the history of the chats is kept in the local cache
+     *
+     * With MegaChatApi::HISTORY_STORAGE_SEGMENTS, the messages of each chat are appended to
+     * memory-mapped files, with an index by position and by message id, instead of the
+     * SQLite database. It makes loading history and counting unread messages faster, and
+     * uses more disk space. It's not available on Windows.
+     *
+     * Valid values are:
+     *  - MegaChatApi::HISTORY_STORAGE_SQLITE = 0
+     *  - MegaChatApi::HISTORY_STORAGE_SEGMENTS = 1
+     *
+     * This function must be called before MegaChatApi::init. If the local cache has the
+     * history in the other storage, it's cleared and loaded from the server again.
+     * The default value is MegaChatApi::HISTORY_STORAGE_SQLITE.
+     *
+     * @param storage Storage of the history
+     */
+    void setHistoryStorage(int storage);
+
+    /**
+     * @brief Sets how many messages of history are loaded ahead of the app
+     *
+     * While a chatroom is open, the messages older than the ones loaded by the app via
+     * MegaChatApi::loadMessages are loaded in the background, from the local cache or
+     * from the server, so that the next calls are served from memory. At least \c count
+     * messages are kept ahead, or twice the count of the last call to
+     * MegaChatApi::loadMessages if it's bigger, up to 512.
+     *
+     * It can be called at any time. The default value is 0, which disables it, since it
+     * also fetches from the server history that the app may never show.
+     *
+     * @param count Number of messages to load ahead, or 0 to disable it
+     */
+    void setHistoryPrefetch(unsigned int count);
+
     /**
      * @brief Returns the current initialization state
      *
@@ -2431,6 +2559,66 @@ public:
      */
     MegaChatListItemList *getUnreadChatListItems();
 
+    /**
+     * @brief Get the current version of the list of chatrooms
+     *
+     * The version is increased every time that any MegaChatListItem changes, is
+     * added or is removed, and the changes made together (i.e. the chatrooms loaded
+     * from the cache by MegaChatApi::init) share the same version. It can be passed
+     * later to MegaChatApi::getChatListItemsChangedSince in order to get only the
+     * chatrooms that have changed since then, instead of the whole list.
+     *
+     * The chatrooms loaded from the cache are already included in the list when
+     * MegaChatApi::init returns, before the new state is notified.
+     *
+     * Versions are only meaningful for the current session. After a logout, the
+     * version keeps increasing, but the list starts from scratch.
+     *
+     * @return The current version of the list of chatrooms
+     */
+    int64_t getChatListVersion();
+
+    /**
+     * @brief Return the chatrooms that have changed after a given version of the list
+     *
+     * This function allows to keep an up-to-date copy of the list of chatrooms without
+     * requesting the whole list every time a MegaChatListItem is updated. The returned list
+     * includes the chatrooms that have been added or updated after \c version. It also
+     * includes the chatrooms that have been removed from the list, with the change
+     * MegaChatListItem::CHANGE_TYPE_CLOSED.
+     *
+     * In order to not miss any change, the app should call MegaChatApi::getChatListVersion
+     * before calling this function, and use the returned version in the next call. Note
+     * that some items may be returned more than once in that case.
+     *
+     * Only the most recent removals are remembered, and none of them survive a logout.
+     * If some removal after \c version has been forgotten, this function returns NULL,
+     * and the app has to reload the whole list with MegaChatApi::getChatListItems.
+     *
+     * You take the ownership of the returned value.
+     *
+     * @param version Version of the list returned by MegaChatApi::getChatListVersion. A
+     * version of 0 (or a negative one) returns all the chatrooms, without the removed ones.
+     * @return MegaChatListItemList including the chatrooms changed after \c version, or
+     * NULL if \c version is too old
+     */
+    MegaChatListItemList *getChatListItemsChangedSince(int64_t version);
+
+    /**
+     * @brief Return a page of the chatrooms, sorted by last activity
+     *
+     * The chatrooms are sorted by the timestamp of their last activity (see
+     * MegaChatListItem::getLastTimestamp), most recent first. This function is
+     * intended to page through the list, i.e. to show only the top N chatrooms.
+     *
+     * You take the ownership of the returned value.
+     *
+     * @param offset Number of chatrooms to skip from the most recent one
+     * @param count Maximum number of chatrooms to return
+     * @return MegaChatListItemList including up to \c count chatrooms
+     */
+    MegaChatListItemList *getChatListItemsByLastActivity(unsigned int offset, unsigned int count);
+
     /**
      * @brief Get the chat id for the 1on1 chat with the specified user
      *
@@ -2693,6 +2881,36 @@ public:
      */
     int loadMessages(MegaChatHandle chatid, int count);
 
+    /**
+     * @brief Enable or disable the delivery of loaded history in batches
+     *
+     * By default, the messages loaded by MegaChatApi::loadMessages are notified one by one
+     * through MegaChatRoomListener::onMessageLoaded, and the end of each chunk is notified
+     * with a NULL message.
+     *
+     * When this option is enabled, the history messages of each chunk are delivered at once
+     * through MegaChatRoomListener::onMessagesLoaded, in the same order (newest to oldest).
+     * The callback is called once the chunk is complete, even if it's empty, and replaces the
+     * call to MegaChatRoomListener::onMessageLoaded with a NULL message. Messages that are not
+     * part of the history, like those still pending to be sent, are still notified by
+     * MegaChatRoomListener::onMessageLoaded.
+     *
+     * This option is disabled by default.
+     *
+     * @param enable True to receive the loaded history in batches, false to receive
+     * one callback per message.
+     */
+    void setBatchedHistoryLoading(bool enable);
+
+    /**
+     * @brief Returns whether the loaded history is delivered in batches
+     *
+     * @see MegaChatApi::setBatchedHistoryLoading
+     *
+     * @return True if history is delivered through MegaChatRoomListener::onMessagesLoaded
+     */
+    bool isBatchedHistoryLoading();
+
     /**
      * @brief Checks whether the app has already loaded the full history of the chatroom
      *
@@ -2940,9 +3158,9 @@ public:
      * or it was revoked. Usually, apps will show the attachment differently when
      * access has been revoked.
      *
-     * @note The returned value will be valid only for nodes attached to messages
-     * already loaded in an opened chatroom. The list of revoked nodes is updated
-     * accordingly while the chatroom is open, based on new messages received.
+     * @note The returned value is based on the attachment and revoke messages stored
+     * in the local history, even if they have not been loaded by MegaChatApi::loadMessages
+     * or the chatroom is not open. Messages only available in the server are not considered.
      *
      * @deprecated This function must NOT be used in new developments. It will eventually become obsolete.
      *
@@ -2953,6 +3171,112 @@ public:
      */
     bool isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle) const;
 
+    /**
+     * @brief Returns the node attachment messages of a chatroom stored in the local history
+     *
+     * Messages are returned from the newest to the oldest, starting right before \c beforeIndex.
+     * To get the next page, pass the index of the oldest message of the previous page, as
+     * returned by MegaChatMessage::getMsgIndex. The messages are read from an index of the
+     * local history, so they don't need to be loaded by MegaChatApi::loadMessages first.
+     * Attachments only available in the server are not included.
+     *
+     * You take the ownership of the returned value.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param beforeIndex Index of the message to start from, excluded. MEGACHAT_INVALID_INDEX
+     * to start from the newest attachment
+     * @param count Maximum number of messages to return
+     *
+     * @return List of node attachment messages, or NULL if the chatroom doesn't exist
+     */
+    MegaChatMessageList *getNodeAttachmentMessages(MegaChatHandle chatid, int beforeIndex, unsigned int count);
+
+    /**
+     * @brief Returns a window of the local history around a message
+     *
+     * This function allows to show a message (ie. a search result or a quoted message) with
+     * the surrounding history, without loading all the history in between by MegaChatApi::loadMessages.
+     * The messages are returned from the oldest to the newest: up to \c before messages older
+     * than the given one, the message itself and up to \c after newer messages. The messages
+     * already loaded are taken from memory, and the rest are read from the local history
+     * without loading them (they are not notified via MegaChatRoomListener::onMessageLoaded).
+     *
+     * Messages only available in the server are not included: if less than \c before older
+     * messages are returned, either the start of the history has been reached or the older
+     * messages have not been fetched yet (see MegaChatApi::isFullHistoryLoaded).
+     *
+     * You take the ownership of the returned value.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param msgid MegaChatHandle that identifies the message
+     * @param before Maximum number of older messages to return, up to 1000
+     * @param after Maximum number of newer messages to return, up to 1000
+     *
+     * @return List of messages, or NULL if the chatroom doesn't exist, the message
+     * is not in the local history or \c before or \c after are greater than 1000
+     */
+    MegaChatMessageList *getMessagesAround(MegaChatHandle chatid, MegaChatHandle msgid, unsigned int before, unsigned int after);
+
+    /**
+     * @brief Returns a window of the local history around a point in time
+     *
+     * Same as MegaChatApi::getMessagesAround, but the window is centered on the newest
+     * message sent at or before \c ts.
+     *
+     * You take the ownership of the returned value.
+     *
+     * @param chatid MegaChatHandle that identifies the chat room
+     * @param ts Timestamp (in seconds since epoch)
+     * @param before Maximum number of older messages to return, up to 1000
+     * @param after Maximum number of newer messages to return, up to 1000
+     *
+     * @return List of messages, or NULL if the chatroom doesn't exist, all of the local
+     * history is newer than \c ts or \c before or \c after are greater than 1000
+     */
+    MegaChatMessageList *getMessagesAroundTime(MegaChatHandle chatid, int64_t ts, unsigned int before, unsigned int after);
+
+    /**
+     * @brief Searches the text of the messages stored in the local history
+     *
+     * The search uses a full-text index of the local history, so the messages don't need
+     * to be loaded by MegaChatApi::loadMessages. Only normal messages are indexed (not
+     * attachments, contacts or management messages), and messages only available in the
+     * server are not included. A message matches if every word of the query is a prefix of
+     * one of its words, regardless of case and diacritics.
+     *
+     * Hits are returned from the newest to the oldest. To get the next page, call this function
+     * again with the cursor returned by the previous call.
+     *
+     * The associated request type with this request is MegaChatRequest::TYPE_SEARCH_MESSAGES
+     * Valid data in the MegaChatRequest object received on callbacks:
+     * - MegaChatRequest::getChatHandle - Returns the chat to search, or MEGACHAT_INVALID_HANDLE
+     * - MegaChatRequest::getText - Returns the query
+     * - MegaChatRequest::getParamType - Returns the maximum number of hits
+     *
+     * Valid data in the MegaChatRequest object received in onRequestFinish when the error code
+     * is MegaError::ERROR_OK:
+     * - MegaChatRequest::getMegaHandleList - Returns the list of chatids with hits, ordered by their newest hit
+     * - MegaChatRequest::getMegaHandleListByChat - Returns the msgids of the hits in a given chat, newest first
+     * - MegaChatRequest::getNumber - Returns the cursor of the next page, or 0 if there are no more hits
+     *
+     * You can get the MegaChatMessage objects by using the function \c MegaChatApi::getMessage
+     *
+     * On the onRequestFinish error, the error code associated to the MegaChatError can be:
+     * - MegaChatError::ERROR_ARGS - If the query has no words or is not valid, or the limit is zero
+     * - MegaChatError::ERROR_NOENT - If the chatroom doesn't exist
+     * - MegaChatError::ERROR_ACCESS - If the local cache has no search index (e.g. SQLite
+     * was built without FTS5 support)
+     * - MegaChatError::ERROR_UNKNOWN - If the search failed in the local cache
+     *
+     * @param chatid MegaChatHandle that identifies the chat room, or MEGACHAT_INVALID_HANDLE
+     * to search all chats
+     * @param query Words to search
+     * @param limit Maximum number of hits
+     * @param cursor 0 for the first page, or the cursor returned by the previous page
+     * @param listener MegaChatRequestListener to track this request
+     */
+    void searchMessages(MegaChatHandle chatid, const char *query, unsigned int limit, long long cursor = 0, MegaChatRequestListener *listener = NULL);
+
     /**
      * @brief Edits an existing message
      *
@@ -4117,6 +4441,30 @@ public:
      */
     virtual void onMessageLoaded(MegaChatApi* api, MegaChatMessage *msg);   // loaded by loadMessages()
 
+    /**
+     * @brief This function is called when a chunk of history has been loaded
+     *
+     * It is only called if the batched delivery of history has been enabled by
+     * MegaChatApi::setBatchedHistoryLoading. In that case, it replaces the calls to
+     * MegaChatRoomListener::onMessageLoaded for history messages, including the final
+     * call with a NULL message.
+     *
+     * The list contains the messages in the same order they would have been notified
+     * one by one, from newest to oldest. It can be empty if there were no messages to load.
+     *
+     * The default implementation calls MegaChatRoomListener::onMessageLoaded for every
+     * message in the list, followed by a NULL message, so listeners that don't implement
+     * this function still receive the history.
+     *
+     * The SDK retains the ownership of the MegaChatMessageList in the second parameter. The
+     * MegaChatMessageList object will be valid until this function returns. If you want to save
+     * the list or any of its messages, use MegaChatMessageList::copy or MegaChatMessage::copy.
+     *
+     * @param api MegaChatApi connected to the account
+     * @param msgs List of MegaChatMessage loaded in this chunk
+     */
+    virtual void onMessagesLoaded(MegaChatApi* api, MegaChatMessageList *msgs);
+
     /**
      * @brief This function is called when a new message is received
      *
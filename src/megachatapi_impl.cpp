@@ -42,6 +42,9 @@
 #include <IGui.h>
 #include <chatClient.h>
 #include <mega/base64.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
 
 #ifndef _WIN32
 #include <signal.h>
@@ -92,6 +95,14 @@ void MegaChatApiImpl::init(MegaChatApi *chatApi, MegaApi *megaApi)
 
     this->mClient = NULL;
     this->terminating = false;
+    this->mBatchedHistoryLoading = false;
+    this->mStorageProfile = MegaChatApi::STORAGE_PROFILE_DEFAULT;
+    this->mHistoryRetention = 0;
+    this->mHistoryStorage = MegaChatApi::HISTORY_STORAGE_SQLITE;
+    this->mHistoryPrefetch = 0;
+    this->mChatListSnapshot = std::make_shared<ChatListSnapshot>();
+    this->mChatListSnapshotMutex.init(false);
+    this->mChatListDirty = false;
     this->waiter = new MegaChatWaiter();
     this->websocketsIO = new MegaWebsocketsIO(&sdkMutex, waiter, megaApi, this);
 
@@ -126,10 +137,15 @@ void MegaChatApiImpl::loop()
         waiter->wait();
 
         sdkMutex.lock();
+        mChatListWriter = std::this_thread::get_id();
 
         sendPendingEvents();
         sendPendingRequests();
 
+        // all the changes of the chat list made in this turn go in a single snapshot
+        publishChatListSnapshot();
+        mChatListWriter = std::thread::id();
+
         if (threadExit)
         {
             // There must be only one pending events, at maximum: the logout marshall call to delete the client
@@ -303,6 +319,7 @@ void MegaChatApiImpl::sendPendingRequests()
         {
             bool deleteDb = request->getFlag();
             terminating = true;
+            resetChatListSnapshot();
             mClient->terminate(deleteDb);
 
             API_LOG_INFO("Chat engine is logged out!");
@@ -331,6 +348,7 @@ void MegaChatApiImpl::sendPendingRequests()
 
                 delete mClient;
                 mClient = NULL;
+                resetChatListSnapshot();
             }
 
             threadExit = 1;
@@ -981,6 +999,73 @@ void MegaChatApiImpl::sendPendingRequests()
             });
             break;
         }
+        case MegaChatRequest::TYPE_SEARCH_MESSAGES:
+        {
+            MegaChatHandle chatid = request->getChatHandle();
+            const char *query = request->getText();
+            int limit = request->getParamType();
+            if (!query || limit <= 0)
+            {
+                errorCode = MegaChatError::ERROR_ARGS;
+                break;
+            }
+            if (chatid != MEGACHAT_INVALID_HANDLE && !findChatRoom(chatid))
+            {
+                errorCode = MegaChatError::ERROR_NOENT;
+                break;
+            }
+            if (!mClient->hasTextSearch())
+            {
+                API_LOG_ERROR("Search messages - full-text search is not available in the local cache");
+                errorCode = MegaChatError::ERROR_ACCESS;
+                break;
+            }
+
+            std::vector<karere::Client::SearchHit> hits;
+            uint64_t next = 0;
+            try
+            {
+                next = mClient->searchMessages(query, chatid, limit, request->getNumber(), hits);
+            }
+            catch (std::invalid_argument& e)
+            {
+                API_LOG_ERROR("Search messages - %s", e.what());
+                errorCode = MegaChatError::ERROR_ARGS;
+                break;
+            }
+            catch (std::exception& e)
+            {
+                API_LOG_ERROR("Search messages - %s", e.what());
+                errorCode = MegaChatError::ERROR_UNKNOWN;
+                break;
+            }
+
+            // hits are grouped by chat, keeping the order of the newest hit of each chat
+            MegaHandleList *chatids = MegaHandleList::createInstance();
+            std::map<MegaChatHandle, MegaHandleList*> msgids;
+            for (auto& hit: hits)
+            {
+                MegaHandleList *&list = msgids[hit.chatid];
+                if (!list)
+                {
+                    list = MegaHandleList::createInstance();
+                    chatids->addMegaHandle(hit.chatid);
+                }
+                list->addMegaHandle(hit.msgid);
+            }
+            for (auto& it: msgids)
+            {
+                request->setMegaHandleListByChat(it.first, it.second);
+                delete it.second;
+            }
+            request->setMegaHandleList(chatids);    // always a valid list, even if empty
+            request->setNumber(next);
+            delete chatids;
+
+            MegaChatErrorPrivate *megaChatError = new MegaChatErrorPrivate(MegaChatError::ERROR_OK);
+            fireOnChatRequestFinish(request, megaChatError);
+            break;
+        }
 #ifndef KARERE_DISABLE_WEBRTC
         case MegaChatRequest::TYPE_START_CHAT_CALL:
         {
@@ -1228,6 +1313,11 @@ void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
 int MegaChatApiImpl::init(const char *sid)
 {
     sdkMutex.lock();
+
+    // the chats loaded from the cache are added to the list from this thread
+    std::thread::id writer = mChatListWriter;
+    mChatListWriter = std::this_thread::get_id();
+
     if (!mClient)
     {
 #ifndef KARERE_DISABLE_WEBRTC
@@ -1236,6 +1326,10 @@ int MegaChatApiImpl::init(const char *sid)
         uint8_t caps = karere::kClientIsMobile;
 #endif
         mClient = new karere::Client(*this->megaApi, websocketsIO, *this, this->megaApi->getBasePath(), caps, this);
+        mClient->setStorageProfile(mStorageProfile);
+        mClient->setHistoryRetention(mHistoryRetention);
+        mClient->setHistoryStorage(mHistoryStorage);
+        mClient->setHistoryPrefetch(mHistoryPrefetch);
         terminating = false;
     }
 
@@ -1248,6 +1342,9 @@ int MegaChatApiImpl::init(const char *sid)
         localLogout();
     }
 
+    publishChatListSnapshot();
+    mChatListWriter = writer;
+
     sdkMutex.unlock();
 
     return MegaChatApiImpl::convertInitState(state);
@@ -1296,6 +1393,229 @@ void MegaChatApiImpl::removeChatRoomHandler(MegaChatHandle chatid)
     delete roomHandler;
 }
 
+std::shared_ptr<const ChatListSnapshot> MegaChatApiImpl::chatListSnapshot()
+{
+    // the thread making the changes (e.g. from a listener notified about them) has to see
+    // them, while the rest of threads get the last published snapshot without waiting
+    if (mChatListDirty && mChatListWriter == std::this_thread::get_id())
+    {
+        publishChatListSnapshot();
+    }
+
+    mChatListSnapshotMutex.lock();
+    std::shared_ptr<const ChatListSnapshot> snapshot = mChatListSnapshot;
+    mChatListSnapshotMutex.unlock();
+
+    return snapshot;
+}
+
+void MegaChatApiImpl::updateChatListSnapshot(ChatRoom &room, bool item, bool roomInfo)
+{
+    ChatListChange &change = mChatListChanges[room.chatid()];
+    change.room = &room;
+    change.item = change.item || item;
+    change.roomInfo = change.roomInfo || roomInfo;
+    mChatListDirty = true;
+}
+
+void MegaChatApiImpl::updateChatListSnapshot(MegaChatHandle chatid, bool item, bool roomInfo)
+{
+    // the rooms being added aren't in the list of the client yet, but have a pending change
+    ChatRoom *room;
+    map<MegaChatHandle, ChatListChange>::iterator it = mChatListChanges.find(chatid);
+    if (it != mChatListChanges.end())
+    {
+        room = it->second.room;
+    }
+    else
+    {
+        room = findChatRoom(chatid);
+    }
+
+    if (room)
+    {
+        updateChatListSnapshot(*room, item, roomInfo);
+    }
+}
+
+void MegaChatApiImpl::removeFromChatListSnapshot(MegaChatHandle chatid)
+{
+    mChatListChanges[chatid] = ChatListChange();
+    mChatListDirty = true;
+}
+
+void MegaChatApiImpl::publishChatListSnapshot()
+{
+    if (!mChatListDirty)
+    {
+        return;
+    }
+
+    // only the changed entries are copied, the rest are shared with the previous snapshot
+    std::shared_ptr<ChatListSnapshot> snapshot = std::make_shared<ChatListSnapshot>(*mChatListSnapshot);
+    snapshot->version++;
+
+    bool changed = false;
+    map<MegaChatHandle, ChatListChange>::iterator it;
+    for (it = mChatListChanges.begin(); it != mChatListChanges.end(); it++)
+    {
+        const ChatListChange &change = it->second;
+        const ChatListSnapshot::Entry *old = snapshot->find(it->first);
+        ChatListSnapshot::Entry entry;
+        entry.version = snapshot->version;
+        if (change.room)
+        {
+            // keep what didn't change, e.g. the room of a chat that only got a new message
+            entry.item = (change.item || !old)
+                    ? std::make_shared<MegaChatListItemPrivate>(*change.room)
+                    : old->item;
+            entry.room = (change.roomInfo || !old)
+                    ? std::make_shared<MegaChatRoomPrivate>(*change.room)
+                    : old->room;
+        }
+        else if (!old)
+        {
+            continue;   // added and removed before being published
+        }
+
+        snapshot->set(it->first, entry);
+        changed = true;
+    }
+
+    mChatListChanges.clear();
+    mChatListDirty = false;
+    if (!changed)
+    {
+        return;
+    }
+
+    mChatListSnapshotMutex.lock();
+    mChatListSnapshot = snapshot;
+    mChatListSnapshotMutex.unlock();
+}
+
+void MegaChatApiImpl::resetChatListSnapshot()
+{
+    std::shared_ptr<ChatListSnapshot> snapshot = std::make_shared<ChatListSnapshot>();
+    snapshot->version = mChatListSnapshot->version + 1;
+    snapshot->removedSince = snapshot->version;    // the removals of the previous session are lost
+
+    mChatListChanges.clear();
+    mChatListDirty = false;
+
+    mChatListSnapshotMutex.lock();
+    mChatListSnapshot = snapshot;
+    mChatListSnapshotMutex.unlock();
+}
+
+const ChatListSnapshot::Entry *ChatListSnapshot::find(MegaChatHandle chatid) const
+{
+    auto it = changes.find(chatid);
+    if (it != changes.end())
+    {
+        return it->second.item ? &it->second : NULL;
+    }
+
+    it = base->entries.find(chatid);
+    return (it != base->entries.end()) ? &it->second : NULL;
+}
+
+void ChatListSnapshot::set(MegaChatHandle chatid, const Entry &entry)
+{
+    if (entry.item)
+    {
+        if (removed->count(chatid))
+        {
+            std::shared_ptr<EntryMap> newRemoved = std::make_shared<EntryMap>(*removed);
+            newRemoved->erase(chatid);
+            removed = newRemoved;
+        }
+        changes[chatid] = entry;
+    }
+    else
+    {
+        const Entry *old = find(chatid);
+        if (old)
+        {
+            std::shared_ptr<EntryMap> newRemoved = std::make_shared<EntryMap>(*removed);
+            Entry &tombstone = (*newRemoved)[chatid];
+            tombstone = *old;
+            tombstone.version = entry.version;
+            if (newRemoved->size() > kMaxRemoved)
+            {
+                auto oldest = newRemoved->begin();
+                for (auto it = newRemoved->begin(); it != newRemoved->end(); it++)
+                {
+                    if (it->second.version < oldest->second.version)
+                    {
+                        oldest = it;
+                    }
+                }
+                removedSince = oldest->second.version;
+                newRemoved->erase(oldest);
+            }
+            removed = newRemoved;
+        }
+
+        if (base->entries.count(chatid))
+        {
+            changes[chatid] = entry;
+        }
+        else
+        {
+            changes.erase(chatid);
+        }
+    }
+
+    if (changes.size() > kMaxChanges)
+    {
+        compact();
+    }
+}
+
+ChatListSnapshot::ActivityKey ChatListSnapshot::activityKey(const Entry &entry)
+{
+    return ActivityKey(entry.item->getLastTimestamp(), entry.item->getChatId());
+}
+
+void ChatListSnapshot::compact()
+{
+    std::shared_ptr<Base> newBase = std::make_shared<Base>();
+    forEach([&newBase](const Entry &entry)
+    {
+        newBase->entries.emplace_hint(newBase->entries.end(), entry.item->getChatId(), entry);
+    });
+
+    // the order of the base is kept for the entries that didn't change, and only
+    // the changed ones are sorted and merged into it
+    std::vector<ActivityKey> changed;
+    for (auto it = changes.begin(); it != changes.end(); it++)
+    {
+        if (it->second.item)
+        {
+            changed.push_back(activityKey(it->second));
+        }
+    }
+    std::sort(changed.begin(), changed.end(), std::greater<ActivityKey>());
+
+    std::vector<ActivityKey> unchanged;
+    unchanged.reserve(base->byLastActivity.size());
+    for (auto it = base->byLastActivity.begin(); it != base->byLastActivity.end(); it++)
+    {
+        if (!changes.count(it->second))
+        {
+            unchanged.push_back(*it);
+        }
+    }
+
+    newBase->byLastActivity.reserve(newBase->entries.size());
+    std::merge(unchanged.begin(), unchanged.end(), changed.begin(), changed.end(),
+               std::back_inserter(newBase->byLastActivity), std::greater<ActivityKey>());
+
+    base = newBase;
+    changes.clear();
+}
+
 ChatRoom *MegaChatApiImpl::findChatRoom(MegaChatHandle chatid)
 {
     ChatRoom *chatroom = NULL;
@@ -1495,6 +1815,12 @@ void MegaChatApiImpl::fireOnChatLocalVideoData(MegaChatHandle chatid, int width,
 
 void MegaChatApiImpl::fireOnChatListItemUpdate(MegaChatListItem *item)
 {
+    // a new message or presence only changes the list item, the room is kept
+    int itemChanges = MegaChatListItem::CHANGE_TYPE_STATUS
+            | MegaChatListItem::CHANGE_TYPE_LAST_MSG
+            | MegaChatListItem::CHANGE_TYPE_LAST_TS;
+    updateChatListSnapshot(item->getChatId(), true, !item->getChanges() || (item->getChanges() & ~itemChanges));
+
     for(set<MegaChatListener *>::iterator it = listeners.begin(); it != listeners.end() ; it++)
     {
         (*it)->onChatListItemUpdate(chatApi, item);
@@ -1886,18 +2212,10 @@ MegaChatRoomList *MegaChatApiImpl::getChatRooms()
 {
     MegaChatRoomListPrivate *chats = new MegaChatRoomListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    chatListSnapshot()->forEach([chats](const ChatListSnapshot::Entry &entry)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
-        {
-            chats->addChatRoom(new MegaChatRoomPrivate(*it->second));
-        }
-    }
-
-    sdkMutex.unlock();
+        chats->addChatRoom(new MegaChatRoomPrivate(entry.room.get()));
+    });
 
     return chats;
 }
@@ -1906,16 +2224,13 @@ MegaChatRoom *MegaChatApiImpl::getChatRoom(MegaChatHandle chatid)
 {
     MegaChatRoomPrivate *chat = NULL;
 
-    sdkMutex.lock();
-
-    ChatRoom *chatRoom = findChatRoom(chatid);
-    if (chatRoom)
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    const ChatListSnapshot::Entry *entry = snapshot->find(chatid);
+    if (entry)
     {
-        chat = new MegaChatRoomPrivate(*chatRoom);
+        chat = new MegaChatRoomPrivate(entry->room.get());
     }
 
-    sdkMutex.unlock();
-
     return chat;
 }
 
@@ -1923,15 +2238,14 @@ MegaChatRoom *MegaChatApiImpl::getChatRoomByUser(MegaChatHandle userhandle)
 {
     MegaChatRoomPrivate *chat = NULL;
 
-    sdkMutex.lock();
-
-    ChatRoom *chatRoom = findChatRoomByUser(userhandle);
-    if (chatRoom)
+    chatListSnapshot()->forEach([&chat, userhandle](const ChatListSnapshot::Entry &entry)
     {
-        chat = new MegaChatRoomPrivate(*chatRoom);
-    }
-
-    sdkMutex.unlock();
+        if (!chat && !entry.room->isGroup() && entry.room->getPeerCount()
+                && entry.room->getPeerHandle(0) == userhandle)
+        {
+            chat = new MegaChatRoomPrivate(entry.room.get());
+        }
+    });
 
     return chat;
 }
@@ -1940,18 +2254,10 @@ MegaChatListItemList *MegaChatApiImpl::getChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    chatListSnapshot()->forEach([items](const ChatListSnapshot::Entry &entry)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
-        {
-            items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-        }
-    }
-
-    sdkMutex.unlock();
+        items->addChatListItem(new MegaChatListItemPrivate(entry.item.get()));
+    });
 
     return items;
 }
@@ -1960,16 +2266,13 @@ MegaChatListItem *MegaChatApiImpl::getChatListItem(MegaChatHandle chatid)
 {
     MegaChatListItemPrivate *item = NULL;
 
-    sdkMutex.lock();
-
-    ChatRoom *chatRoom = findChatRoom(chatid);
-    if (chatRoom)
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    const ChatListSnapshot::Entry *entry = snapshot->find(chatid);
+    if (entry)
     {
-        item = new MegaChatListItemPrivate(*chatRoom);
+        item = new MegaChatListItemPrivate(entry->item.get());
     }
 
-    sdkMutex.unlock();
-
     return item;
 }
 
@@ -1977,22 +2280,13 @@ int MegaChatApiImpl::getUnreadChats()
 {
     int count = 0;
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    chatListSnapshot()->forEach([&count](const ChatListSnapshot::Entry &entry)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (entry.item->isActive() && entry.item->getUnreadCount())
         {
-            ChatRoom *room = it->second;
-            if (room->isActive() && room->chat().unreadMsgCount())
-            {
-                count++;
-            }
+            count++;
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return count;
 }
@@ -2001,21 +2295,13 @@ MegaChatListItemList *MegaChatApiImpl::getActiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    chatListSnapshot()->forEach([items](const ChatListSnapshot::Entry &entry)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (entry.item->isActive())
         {
-            if (it->second->isActive())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(new MegaChatListItemPrivate(entry.item.get()));
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return items;
 }
@@ -2024,21 +2310,13 @@ MegaChatListItemList *MegaChatApiImpl::getInactiveChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
-
-    if (mClient && !terminating)
+    chatListSnapshot()->forEach([items](const ChatListSnapshot::Entry &entry)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        if (!entry.item->isActive())
         {
-            if (!it->second->isActive())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(new MegaChatListItemPrivate(entry.item.get()));
         }
-    }
-
-    sdkMutex.unlock();
+    });
 
     return items;
 }
@@ -2047,22 +2325,64 @@ MegaChatListItemList *MegaChatApiImpl::getUnreadChatListItems()
 {
     MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
 
-    sdkMutex.lock();
+    chatListSnapshot()->forEach([items](const ChatListSnapshot::Entry &entry)
+    {
+        if (entry.item->isActive() && entry.item->getUnreadCount())
+        {
+            items->addChatListItem(new MegaChatListItemPrivate(entry.item.get()));
+        }
+    });
 
-    if (mClient && !terminating)
+    return items;
+}
+
+int64_t MegaChatApiImpl::getChatListVersion()
+{
+    return chatListSnapshot()->version;
+}
+
+MegaChatListItemList *MegaChatApiImpl::getChatListItemsChangedSince(int64_t version)
+{
+    std::shared_ptr<const ChatListSnapshot> snapshot = chatListSnapshot();
+    if (version <= 0)
     {
-        ChatRoomList::iterator it;
-        for (it = mClient->chats->begin(); it != mClient->chats->end(); it++)
+        version = 0;    // the whole list, without the removed chats
+    }
+    else if ((uint64_t)version < snapshot->removedSince)
+    {
+        return NULL;    // some removals since that version were dropped, the app has to reload the list
+    }
+
+    MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
+    snapshot->forEach([items, version](const ChatListSnapshot::Entry &entry)
+    {
+        if (entry.version > (uint64_t)version)
         {
-            ChatRoom *room = it->second;
-            if (room->isActive() && room->chat().unreadMsgCount())
-            {
-                items->addChatListItem(new MegaChatListItemPrivate(*it->second));
-            }
+            items->addChatListItem(new MegaChatListItemPrivate(entry.item.get()));
+        }
+    });
+
+    for (auto it = snapshot->removed->begin(); version && it != snapshot->removed->end(); it++)
+    {
+        if (it->second.version > (uint64_t)version)
+        {
+            MegaChatListItemPrivate *item = new MegaChatListItemPrivate(it->second.item.get());
+            item->setClosed();
+            items->addChatListItem(item);
         }
     }
 
-    sdkMutex.unlock();
+    return items;
+}
+
+MegaChatListItemList *MegaChatApiImpl::getChatListItemsByLastActivity(unsigned int offset, unsigned int count)
+{
+    MegaChatListItemListPrivate *items = new MegaChatListItemListPrivate();
+
+    chatListSnapshot()->forEachByLastActivity(offset, count, [items](const ChatListSnapshot::Entry &entry)
+    {
+        items->addChatListItem(new MegaChatListItemPrivate(entry.item.get()));
+    });
 
     return items;
 }
@@ -2203,6 +2523,36 @@ int MegaChatApiImpl::loadMessages(MegaChatHandle chatid, int count)
     return ret;
 }
 
+void MegaChatApiImpl::setBatchedHistoryLoading(bool enable)
+{
+    sdkMutex.lock();
+    bool disabled = mBatchedHistoryLoading && !enable;
+    mBatchedHistoryLoading = enable;
+    sdkMutex.unlock();
+
+    if (disabled)
+    {
+        // deliver the pending batches from the karere thread, as any other callback. If a
+        // message is notified before, fireOnMessageLoaded() flushes its batch first
+        marshallCall([this]()
+        {
+            for (auto it = chatRoomHandler.begin(); it != chatRoomHandler.end(); it++)
+            {
+                it->second->stopHistoryBatch();
+            }
+        }, this);
+    }
+}
+
+bool MegaChatApiImpl::isBatchedHistoryLoading()
+{
+    sdkMutex.lock();
+    bool ret = mBatchedHistoryLoading;
+    sdkMutex.unlock();
+
+    return ret;
+}
+
 bool MegaChatApiImpl::isFullHistoryLoaded(MegaChatHandle chatid)
 {
     bool ret = false;
@@ -2452,51 +2802,150 @@ MegaChatMessage *MegaChatApiImpl::forwardContact(MegaChatHandle sourceChatid, Me
     }
 
     sdkMutex.unlock();
-    return megaMsg;
+    return megaMsg;
+}
+
+void MegaChatApiImpl::attachNodes(MegaChatHandle chatid, MegaNodeList *nodes, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_ATTACH_NODE_MESSAGE, listener);
+    request->setChatHandle(chatid);
+    request->setMegaNodeList(nodes);
+    requestQueue.push(request);
+    waiter->notify();
+}
+
+void MegaChatApiImpl::attachNode(MegaChatHandle chatid, MegaChatHandle nodehandle, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_ATTACH_NODE_MESSAGE, listener);
+    request->setChatHandle(chatid);
+    request->setUserHandle(nodehandle);
+    requestQueue.push(request);
+    waiter->notify();
+}
+
+void MegaChatApiImpl::revokeAttachment(MegaChatHandle chatid, MegaChatHandle handle, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_REVOKE_NODE_MESSAGE, listener);
+    request->setChatHandle(chatid);
+    request->setUserHandle(handle);
+    requestQueue.push(request);
+    waiter->notify();
+}
+
+bool MegaChatApiImpl::isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle)
+{
+    bool ret = false;
+
+    sdkMutex.lock();
+
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom)
+    {
+        ret = (chatroom->chat().nodeAccess(nodeHandle) == chatd::kNodeAccessRevoked);
+    }
+
+    sdkMutex.unlock();
+
+    return ret;
+}
+
+MegaChatMessageList *MegaChatApiImpl::getNodeAttachmentMessages(MegaChatHandle chatid, int beforeIndex, unsigned int count)
+{
+    MegaChatMessageListPrivate *list = NULL;
+    sdkMutex.lock();
+
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom)
+    {
+        Chat &chat = chatroom->chat();
+        std::vector<std::pair<Idx, Message*>> messages;
+        chat.fetchNodeHistory(beforeIndex, count, messages);
+
+        list = new MegaChatMessageListPrivate();
+        for (auto& item: messages)
+        {
+            list->addMessage(new MegaChatMessagePrivate(*item.second, chat.getMsgStatus(*item.second, item.first), item.first));
+            delete item.second;
+        }
+    }
+    else
+    {
+        API_LOG_ERROR("Chatroom not found (chatid: %d)", chatid);
+    }
+
+    sdkMutex.unlock();
+    return list;
 }
 
-void MegaChatApiImpl::attachNodes(MegaChatHandle chatid, MegaNodeList *nodes, MegaChatRequestListener *listener)
+MegaChatMessageList *MegaChatApiImpl::getMessagesAround(MegaChatHandle chatid, MegaChatHandle msgid, unsigned int before, unsigned int after)
 {
-    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_ATTACH_NODE_MESSAGE, listener);
-    request->setChatHandle(chatid);
-    request->setMegaNodeList(nodes);
-    requestQueue.push(request);
-    waiter->notify();
-}
+    MegaChatMessageList *list = NULL;
+    sdkMutex.lock();
 
-void MegaChatApiImpl::attachNode(MegaChatHandle chatid, MegaChatHandle nodehandle, MegaChatRequestListener *listener)
-{
-    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_ATTACH_NODE_MESSAGE, listener);
-    request->setChatHandle(chatid);
-    request->setUserHandle(nodehandle);
-    requestQueue.push(request);
-    waiter->notify();
-}
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom)
+    {
+        Idx idx = chatroom->chat().seekMsgid(msgid);
+        if (idx != CHATD_IDX_INVALID)
+        {
+            list = getHistoryWindow(chatroom, idx, before, after);
+        }
+    }
+    else
+    {
+        API_LOG_ERROR("Chatroom not found (chatid: %d)", chatid);
+    }
 
-void MegaChatApiImpl::revokeAttachment(MegaChatHandle chatid, MegaChatHandle handle, MegaChatRequestListener *listener)
-{
-    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_REVOKE_NODE_MESSAGE, listener);
-    request->setChatHandle(chatid);
-    request->setUserHandle(handle);
-    requestQueue.push(request);
-    waiter->notify();
+    sdkMutex.unlock();
+    return list;
 }
 
-bool MegaChatApiImpl::isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle)
+MegaChatMessageList *MegaChatApiImpl::getMessagesAroundTime(MegaChatHandle chatid, int64_t ts, unsigned int before, unsigned int after)
 {
-    bool ret = false;
-
+    MegaChatMessageList *list = NULL;
     sdkMutex.lock();
 
-    auto it = chatRoomHandler.find(chatid);
-    if (it != chatRoomHandler.end())
+    ChatRoom *chatroom = findChatRoom(chatid);
+    if (chatroom && ts >= 0)
     {
-        ret = it->second->isRevoked(nodeHandle);
+        Idx idx = chatroom->chat().seekTs((ts > UINT32_MAX) ? UINT32_MAX : (uint32_t)ts);
+        if (idx != CHATD_IDX_INVALID)
+        {
+            list = getHistoryWindow(chatroom, idx, before, after);
+        }
+    }
+    else if (!chatroom)
+    {
+        API_LOG_ERROR("Chatroom not found (chatid: %d)", chatid);
     }
 
     sdkMutex.unlock();
+    return list;
+}
 
-    return ret;
+MegaChatMessageList *MegaChatApiImpl::getHistoryWindow(ChatRoom *chatroom, Idx idx, unsigned int before, unsigned int after)
+{
+    if (before > (unsigned)kMaxHistoryWindow || after > (unsigned)kMaxHistoryWindow)
+    {
+        API_LOG_ERROR("getHistoryWindow: too many messages requested (%u before, %u after)", before, after);
+        return NULL;
+    }
+
+    // computed in 64 bits, as the indexes may be close to the limits of Idx
+    int64_t from = std::max<int64_t>((int64_t)idx - before, (int64_t)INT32_MIN + 1);
+    int64_t to = std::min<int64_t>((int64_t)idx + after, (int64_t)CHATD_IDX_INVALID - 1);
+    Chat &chat = chatroom->chat();
+    MegaChatMessageListPrivate *list = new MegaChatMessageListPrivate();
+    bool complete = chat.getHistoryWindow((Idx)from, (Idx)to, [list, &chat](Idx i, const Message& msg)
+    {
+        list->addMessage(new MegaChatMessagePrivate(msg, chat.getMsgStatus(msg, i), i));
+    });
+    if (!complete)
+    {
+        API_LOG_DEBUG("getHistoryWindow: older messages of chatid %s are not in the local history",
+                      chat.chatId().toString().c_str());
+    }
+    return list;
 }
 
 MegaChatMessage *MegaChatApiImpl::editMessage(MegaChatHandle chatid, MegaChatHandle msgid, const char *msg)
@@ -2710,6 +3159,80 @@ void MegaChatApiImpl::saveCurrentState()
     sdkMutex.unlock();
 }
 
+void MegaChatApiImpl::searchMessages(MegaChatHandle chatid, const char *query, unsigned int limit, long long cursor, MegaChatRequestListener *listener)
+{
+    MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_SEARCH_MESSAGES, listener);
+    request->setChatHandle(chatid);
+    request->setText(query);
+    request->setParamType(limit);
+    request->setNumber(cursor);
+    requestQueue.push(request);
+    waiter->notify();
+}
+
+void MegaChatApiImpl::setStorageProfile(int profile)
+{
+    if (profile < MegaChatApi::STORAGE_PROFILE_DEFAULT || profile > MegaChatApi::STORAGE_PROFILE_LEGACY)
+    {
+        API_LOG_ERROR("setStorageProfile: invalid profile %d", profile);
+        return;
+    }
+
+    sdkMutex.lock();
+    mStorageProfile = profile;
+    if (mClient)
+    {
+        // the karere thread reads the profile when it opens the cache
+        marshallCall([this]()
+        {
+            if (mClient)
+            {
+                mClient->setStorageProfile(mStorageProfile);
+            }
+        }, this);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setHistoryRetention(unsigned int seconds)
+{
+    sdkMutex.lock();
+    mHistoryRetention = seconds;
+    if (mClient)
+    {
+        mClient->setHistoryRetention(seconds);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setHistoryPrefetch(unsigned int count)
+{
+    sdkMutex.lock();
+    mHistoryPrefetch = count;
+    if (mClient)
+    {
+        mClient->setHistoryPrefetch(count);
+    }
+    sdkMutex.unlock();
+}
+
+void MegaChatApiImpl::setHistoryStorage(int storage)
+{
+    if (storage != MegaChatApi::HISTORY_STORAGE_SQLITE && storage != MegaChatApi::HISTORY_STORAGE_SEGMENTS)
+    {
+        API_LOG_ERROR("setHistoryStorage: invalid storage %d", storage);
+        return;
+    }
+
+    sdkMutex.lock();
+    mHistoryStorage = storage;
+    if (mClient)
+    {
+        mClient->setHistoryStorage(storage);    // ignored after init
+    }
+    sdkMutex.unlock();
+}
+
 void MegaChatApiImpl::pushReceived(bool beep, MegaChatRequestListener *listener)
 {
     MegaChatRequestPrivate *request = new MegaChatRequestPrivate(MegaChatRequest::TYPE_PUSH_RECEIVED, listener);
@@ -3285,6 +3808,8 @@ void MegaChatApiImpl::onInitStateChange(int newState)
             state == MegaChatApi::INIT_ONLINE_SESSION ||
             state == MegaChatApi::INIT_NO_CACHE)
     {
+        // the app may read the chat list from any thread once it knows the state
+        publishChatListSnapshot();
         fireOnChatInitStateUpdate(state);
     }
 }
@@ -3362,6 +3887,9 @@ IApp::IGroupChatListItem *MegaChatApiImpl::addGroupChatItem(GroupChatRoom &chat)
     MegaChatGroupListItemHandler *itemHandler = new MegaChatGroupListItemHandler(*this, chat);
     chatGroupListItemHandler.insert(itemHandler);
 
+    // the room isn't in the list of the client until its constructor returns
+    updateChatListSnapshot(chat, true, true);
+
     // notify the app about the new chatroom
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(chat);
     fireOnChatListItemUpdate(item);
@@ -3374,6 +3902,9 @@ IApp::IPeerChatListItem *MegaChatApiImpl::addPeerChatItem(PeerChatRoom &chat)
     MegaChatPeerListItemHandler *itemHandler = new MegaChatPeerListItemHandler(*this, chat);
     chatPeerListItemHandler.insert(itemHandler);
 
+    // the room isn't in the list of the client until its constructor returns
+    updateChatListSnapshot(chat, true, true);
+
     // notify the app about the new chatroom
     MegaChatListItemPrivate *item = new MegaChatListItemPrivate(chat);
     fireOnChatListItemUpdate(item);
@@ -3389,6 +3920,8 @@ void MegaChatApiImpl::removeGroupChatItem(IGroupChatListItem &item)
         IGroupChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            removeFromChatListSnapshot((*it)->getChatRoom().chatid());
+
 //            TODO: Redmine ticket #5693
 //            MegaChatListItemPrivate *listItem = new MegaChatListItemPrivate((*it)->getChatRoom());
 //            listItem->setClosed();
@@ -3411,6 +3944,8 @@ void MegaChatApiImpl::removePeerChatItem(IPeerChatListItem &item)
         IPeerChatListItem *itemHandler = (*it);
         if (itemHandler == &item)
         {
+            removeFromChatListSnapshot((*it)->getChatRoom().chatid());
+
 //            TODO: Redmine ticket #5693
 //            MegaChatListItemPrivate *listItem = new MegaChatListItemPrivate((*it)->getChatRoom());
 //            listItem->setClosed();
@@ -3652,6 +4187,7 @@ const char *MegaChatRequestPrivate::getRequestString() const
         case TYPE_SET_PRESENCE_PERSIST: return "SET_PRESENCE_PERSIST";
         case TYPE_SET_PRESENCE_AUTOAWAY: return "SET_PRESENCE_AUTOAWAY";
         case TYPE_PUSH_RECEIVED: return "PUSH_RECEIVED";
+        case TYPE_SEARCH_MESSAGES: return "SEARCH_MESSAGES";
     }
     return "UNKNOWN";
 }
@@ -4216,6 +4752,12 @@ MegaChatRoomHandler::MegaChatRoomHandler(MegaChatApiImpl *chatApiImpl, MegaChatA
 
     this->mRoom = NULL;
     this->mChat = NULL;
+    this->mHistoryLoading = false;
+    this->mHistoryBatched = false;
+}
+
+MegaChatRoomHandler::~MegaChatRoomHandler()
+{
 }
 
 void MegaChatRoomHandler::addChatRoomListener(MegaChatRoomListener *listener)
@@ -4230,6 +4772,13 @@ void MegaChatRoomHandler::removeChatRoomListener(MegaChatRoomListener *listener)
 
 void MegaChatRoomHandler::fireOnChatRoomUpdate(MegaChatRoom *chat)
 {
+    // typing notifications aren't kept in the chat list
+    int typingChanges = MegaChatRoom::CHANGE_TYPE_USER_TYPING | MegaChatRoom::CHANGE_TYPE_USER_STOP_TYPING;
+    if (!chat->getChanges() || (chat->getChanges() & ~typingChanges))
+    {
+        chatApiImpl->updateChatListSnapshot(chatid, false, true);
+    }
+
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
     {
         (*it)->onChatRoomUpdate(chatApi, chat);
@@ -4240,6 +4789,9 @@ void MegaChatRoomHandler::fireOnChatRoomUpdate(MegaChatRoom *chat)
 
 void MegaChatRoomHandler::fireOnMessageLoaded(MegaChatMessage *msg)
 {
+    // keep the order of the notifications if a batch of history is pending
+    flushHistoryBatch();
+
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
     {
         (*it)->onMessageLoaded(chatApi, msg);
@@ -4248,6 +4800,45 @@ void MegaChatRoomHandler::fireOnMessageLoaded(MegaChatMessage *msg)
     delete msg;
 }
 
+void MegaChatRoomHandler::fireOnMessagesLoaded(MegaChatMessageList *msgs)
+{
+    for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
+    {
+        (*it)->onMessagesLoaded(chatApi, msgs);
+    }
+
+    delete msgs;
+}
+
+void MegaChatRoomHandler::flushHistoryBatch(bool force)
+{
+    if (mHistoryBatch.empty() && !force)
+    {
+        return;
+    }
+
+    MegaChatMessageListPrivate *batch = new MegaChatMessageListPrivate();
+    batch->reserve(mHistoryBatch.size());
+    for (auto it = mHistoryBatch.begin(); it != mHistoryBatch.end(); it++)
+    {
+        // messages removed in the meantime (i.e. by a truncate) are skipped
+        Message *msg = mChat ? mChat->findOrNull(it->first) : NULL;
+        if (msg)
+        {
+            batch->addMessage(new MegaChatMessagePrivate(*msg, it->second, it->first));
+        }
+    }
+    mHistoryBatch.clear();
+    fireOnMessagesLoaded(batch);
+}
+
+void MegaChatRoomHandler::stopHistoryBatch()
+{
+    // the rest of the current chunk, if any, is delivered message by message
+    mHistoryLoading = false;
+    flushHistoryBatch();
+}
+
 void MegaChatRoomHandler::fireOnMessageReceived(MegaChatMessage *msg)
 {
     for(set<MegaChatRoomListener *>::iterator it = roomListeners.begin(); it != roomListeners.end() ; it++)
@@ -4314,87 +4905,64 @@ void MegaChatRoomHandler::onLastMessageTsUpdated(uint32_t ts)
 
 void MegaChatRoomHandler::onHistoryReloaded()
 {
+    // messages of a partially loaded chunk are not valid anymore
+    mHistoryBatch.clear();
+    mHistoryLoading = false;
+
     MegaChatRoomPrivate *chat = (MegaChatRoomPrivate *) chatApiImpl->getChatRoom(chatid);
     fireOnHistoryReloaded(chat);
 }
 
-bool MegaChatRoomHandler::isRevoked(MegaChatHandle h)
+std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessage *message)
 {
-    auto it = attachmentsAccess.find(h);
-    if (it != attachmentsAccess.end())
+    set <MegaChatHandle> *msgToUpdate = NULL;
+    if (!mChat)
     {
-        return !it->second;
+        return NULL;
     }
 
-    return false;
-}
-
-void MegaChatRoomHandler::handleHistoryMessage(MegaChatMessage *message)
-{
+    // the message is already in the node index of the db, so compare
+    // with the access granted/revoked by the previous messages
+    std::vector<MegaChatHandle> nodes;
+    chatd::NodeAccess newAccess = chatd::kNodeAccessUnknown;
     if (message->getType() == MegaChatMessage::TYPE_NODE_ATTACHMENT)
     {
         MegaNodeList *nodeList = message->getMegaNodeList();
-        for (int i = 0; i < nodeList->size(); i++)
+        for (int i = 0; nodeList && i < nodeList->size(); i++)
         {
-            MegaChatHandle h = nodeList->get(i)->getHandle();
-            auto itAccess = attachmentsAccess.find(h);
-            if (itAccess == attachmentsAccess.end())
-            {
-                attachmentsAccess[h] = true;
-            }
-            attachmentsIds[h].insert(message->getMsgId());
+            nodes.push_back(nodeList->get(i)->getHandle());
         }
+        newAccess = chatd::kNodeAccessGranted;
     }
     else if (message->getType() == MegaChatMessage::TYPE_REVOKE_NODE_ATTACHMENT)
     {
-        MegaChatHandle h = message->getHandleOfAction();
-        auto itAccess = attachmentsAccess.find(h);
-        if (itAccess == attachmentsAccess.end())
-        {
-            attachmentsAccess[h] = false;
-        }
+        nodes.push_back(message->getHandleOfAction());
+        newAccess = chatd::kNodeAccessRevoked;
     }
-}
-
-std::set<MegaChatHandle> *MegaChatRoomHandler::handleNewMessage(MegaChatMessage *message)
-{
-    set <MegaChatHandle> *msgToUpdate = NULL;
 
-    // new messages overwrite any current access to nodes
-    if (message->getType() == MegaChatMessage::TYPE_NODE_ATTACHMENT)
+    for (auto h: nodes)
     {
-        MegaNodeList *nodeList = message->getMegaNodeList();
-        for (int i = 0; i < nodeList->size(); i++)
+        chatd::NodeAccess oldAccess = mChat->nodeAccess(h, message->getMsgIndex());
+        if (oldAccess == chatd::kNodeAccessUnknown || oldAccess == newAccess)
         {
-            MegaChatHandle h = nodeList->get(i)->getHandle();
-            auto itAccess = attachmentsAccess.find(h);
-            if (itAccess != attachmentsAccess.end() && !itAccess->second)
-            {
-                // access changed from revoked to granted --> update attachment messages
-                if (!msgToUpdate)
-                {
-                    msgToUpdate = new set <MegaChatHandle>;
-                }
-                msgToUpdate->insert(attachmentsIds[h].begin(), attachmentsIds[h].end());
-            }
-            attachmentsAccess[h] = true;
-            attachmentsIds[h].insert(message->getMsgId());
+            continue;
         }
-    }
-    else if (message->getType() == MegaChatMessage::TYPE_REVOKE_NODE_ATTACHMENT)
-    {
-        MegaChatHandle h = message->getHandleOfAction();
-        auto itAccess = attachmentsAccess.find(h);
-        if (itAccess != attachmentsAccess.end() && itAccess->second)
+
+        // access changed from revoked to granted or viceversa --> update attachment messages
+        std::vector<karere::Id> msgids;
+        mChat->nodeAttachmentMsgids(h, msgids);
+        for (auto& msgid: msgids)
         {
-            // access changed from granted to revoked --> update attachment messages
+            if (msgid == message->getMsgId())
+            {
+                continue;
+            }
             if (!msgToUpdate)
             {
                 msgToUpdate = new set <MegaChatHandle>;
             }
-            msgToUpdate->insert(attachmentsIds[h].begin(), attachmentsIds[h].end());
+            msgToUpdate->insert(msgid);
         }
-        attachmentsAccess[h] = false;
     }
 
     return msgToUpdate;
@@ -4429,8 +4997,8 @@ void MegaChatRoomHandler::init(Chat &chat, DbInterface *&)
     mChat = &chat;
     mRoom = chatApiImpl->findChatRoom(chatid);
 
-    attachmentsAccess.clear();
-    attachmentsIds.clear();
+    mHistoryBatch.clear();
+    mHistoryLoading = false;
     mChat->resetListenerState();
 }
 
@@ -4438,8 +5006,8 @@ void MegaChatRoomHandler::onDestroy()
 {
     mChat = NULL;
     mRoom = NULL;
-    attachmentsAccess.clear();
-    attachmentsIds.clear();
+    mHistoryBatch.clear();
+    mHistoryLoading = false;
 }
 
 void MegaChatRoomHandler::onRecvNewMessage(Idx idx, Message &msg, Message::Status status)
@@ -4475,14 +5043,33 @@ void MegaChatRoomHandler::onRecvNewMessage(Idx idx, Message &msg, Message::Statu
 
 void MegaChatRoomHandler::onRecvHistoryMessage(Idx idx, Message &msg, Message::Status status, bool isLocal)
 {
-    MegaChatMessagePrivate *message = new MegaChatMessagePrivate(msg, status, idx);
-    handleHistoryMessage(message);
+    if (!mHistoryLoading)
+    {
+        // first message of the chunk
+        mHistoryLoading = true;
+        mHistoryBatched = chatApiImpl->isBatchedHistoryLoading();
+    }
 
-    fireOnMessageLoaded(message);
+    if (mHistoryBatched)
+    {
+        mHistoryBatch.emplace_back(idx, status);
+        return;
+    }
+
+    fireOnMessageLoaded(new MegaChatMessagePrivate(msg, status, idx));
 }
 
 void MegaChatRoomHandler::onHistoryDone(chatd::HistSource /*source*/)
 {
+    bool batched = mHistoryLoading ? mHistoryBatched : chatApiImpl->isBatchedHistoryLoading();
+    mHistoryLoading = false;
+    if (batched)
+    {
+        // the chunk is always notified, even if empty, as it signals the end of the loading
+        flushHistoryBatch(true);
+        return;
+    }
+
     fireOnMessageLoaded(NULL);
 }
 
@@ -5579,10 +6166,9 @@ MegaChatMessagePrivate::MegaChatMessagePrivate(const MegaChatMessage *msg)
 
 MegaChatMessagePrivate::MegaChatMessagePrivate(const Message &msg, Message::Status status, Idx index)
 {
-    string tmp(msg.buf(), msg.size());
-
     if (msg.type == TYPE_NORMAL || msg.type == TYPE_CHAT_TITLE)
     {
+        string tmp(msg.buf(), msg.size());
         this->msg = msg.size() ? MegaApi::strdup(tmp.c_str()) : NULL;
     }
     else    // for other types, content is irrelevant
@@ -5615,32 +6201,19 @@ MegaChatMessagePrivate::MegaChatMessagePrivate(const Message &msg, Message::Stat
             this->hAction = mngInfo.target;
             break;
         }
-        case MegaChatMessage::TYPE_NODE_ATTACHMENT:
-        {
-            megaNodeList = JSonUtils::parseAttachNodeJSon(msg.toText().c_str());
-            break;
-        }
         case MegaChatMessage::TYPE_REVOKE_NODE_ATTACHMENT:
         {
             this->hAction = MegaApi::base64ToHandle(msg.toText().c_str());
             break;
         }
+        case MegaChatMessage::TYPE_NODE_ATTACHMENT:
         case MegaChatMessage::TYPE_CONTACT_ATTACHMENT:
-        {
-            megaChatUsers = JSonUtils::parseAttachContactJSon(msg.toText().c_str());
-            break;
-        }
         case MegaChatMessage::TYPE_CONTAINS_META:
         {
-             if (msg.toText().length() > 2)
-             {
-                 mContainsMeta = JSonUtils::parseContainsMeta(msg.toText().c_str());
-             }
-             else
-             {
-                 mContainsMeta = new MegaChatContainsMetaPrivate();
-             }
-             break;
+            // parsing the JSON is expensive, do it only if the app reads those fields
+            mJsonContent = msg.toText();
+            mJsonPending = true;
+            break;
         }
         case MegaChatMessage::TYPE_CALL_ENDED:
         {
@@ -5865,8 +6438,51 @@ int MegaChatMessagePrivate::convertEndCallTermCodeToUI(const Message::CallEndedI
     return code;
 }
 
+void MegaChatMessagePrivate::decodeJsonContent() const
+{
+    if (!mJsonPending)
+    {
+        return;
+    }
+
+    std::call_once(mJsonDecoded, [this]()
+    {
+        switch (type)
+        {
+            case MegaChatMessage::TYPE_NODE_ATTACHMENT:
+            {
+                megaNodeList = JSonUtils::parseAttachNodeJSon(mJsonContent.c_str());
+                break;
+            }
+            case MegaChatMessage::TYPE_CONTACT_ATTACHMENT:
+            {
+                megaChatUsers = JSonUtils::parseAttachContactJSon(mJsonContent.c_str());
+                break;
+            }
+            case MegaChatMessage::TYPE_CONTAINS_META:
+            {
+                if (mJsonContent.length() > 2)
+                {
+                    mContainsMeta = JSonUtils::parseContainsMeta(mJsonContent.c_str());
+                }
+                else
+                {
+                    mContainsMeta = new MegaChatContainsMetaPrivate();
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        mJsonContent.clear();
+    });
+}
+
 unsigned int MegaChatMessagePrivate::getUsersCount() const
 {
+    decodeJsonContent();
+
     unsigned int size = 0;
     if (megaChatUsers != NULL)
     {
@@ -5878,6 +6494,8 @@ unsigned int MegaChatMessagePrivate::getUsersCount() const
 
 MegaChatHandle MegaChatMessagePrivate::getUserHandle(unsigned int index) const
 {
+    decodeJsonContent();
+
     if (!megaChatUsers || index >= megaChatUsers->size())
     {
         return MEGACHAT_INVALID_HANDLE;
@@ -5888,6 +6506,8 @@ MegaChatHandle MegaChatMessagePrivate::getUserHandle(unsigned int index) const
 
 const char *MegaChatMessagePrivate::getUserName(unsigned int index) const
 {
+    decodeJsonContent();
+
     if (!megaChatUsers || index >= megaChatUsers->size())
     {
         return NULL;
@@ -5898,6 +6518,8 @@ const char *MegaChatMessagePrivate::getUserName(unsigned int index) const
 
 const char *MegaChatMessagePrivate::getUserEmail(unsigned int index) const
 {
+    decodeJsonContent();
+
     if (!megaChatUsers || index >= megaChatUsers->size())
     {
         return NULL;
@@ -5908,11 +6530,15 @@ const char *MegaChatMessagePrivate::getUserEmail(unsigned int index) const
 
 MegaNodeList *MegaChatMessagePrivate::getMegaNodeList() const
 {
+    decodeJsonContent();
+
     return megaNodeList;
 }
 
 const MegaChatContainsMeta *MegaChatMessagePrivate::getContainsMeta() const
 {
+    decodeJsonContent();
+
     return mContainsMeta;
 }
 
@@ -6354,6 +6980,51 @@ void MegaChatListItemListPrivate::addChatListItem(MegaChatListItem *item)
     list.push_back(item);
 }
 
+MegaChatMessageListPrivate::MegaChatMessageListPrivate()
+{
+}
+
+MegaChatMessageListPrivate::~MegaChatMessageListPrivate()
+{
+}
+
+MegaChatMessageListPrivate::MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list)
+    : list(list->list)
+{
+}
+
+MegaChatMessageListPrivate *MegaChatMessageListPrivate::copy() const
+{
+    return new MegaChatMessageListPrivate(this);
+}
+
+const MegaChatMessage *MegaChatMessageListPrivate::get(unsigned int i) const
+{
+    if (i >= size())
+    {
+        return NULL;
+    }
+    else
+    {
+        return list.at(i).get();
+    }
+}
+
+unsigned int MegaChatMessageListPrivate::size() const
+{
+    return list.size();
+}
+
+void MegaChatMessageListPrivate::addMessage(MegaChatMessage *msg)
+{
+    list.push_back(std::shared_ptr<const MegaChatMessage>(msg));
+}
+
+void MegaChatMessageListPrivate::reserve(unsigned int count)
+{
+    list.reserve(count);
+}
+
 MegaChatPresenceConfigPrivate::MegaChatPresenceConfigPrivate(const MegaChatPresenceConfigPrivate &config)
 {
     this->status = config.getOnlineStatus();
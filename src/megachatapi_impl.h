@@ -45,6 +45,11 @@
 #include "net/websocketsIO.h"
 
 #include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <thread>
 
 #ifdef USE_LIBWEBSOCKETS
 
@@ -361,6 +366,7 @@ class MegaChatRoomHandler :public karere::IApp::IChatHandler
 {
 public:
     MegaChatRoomHandler(MegaChatApiImpl *chatApiImpl, MegaChatApi *chatApi, MegaChatHandle chatid);
+    virtual ~MegaChatRoomHandler();
 
     void addChatRoomListener(MegaChatRoomListener *listener);
     void removeChatRoomListener(MegaChatRoomListener *listener);
@@ -368,9 +374,14 @@ public:
     // MegaChatRoomListener callbacks
     void fireOnChatRoomUpdate(MegaChatRoom *chat);
     void fireOnMessageLoaded(MegaChatMessage *msg);
+    void fireOnMessagesLoaded(MegaChatMessageList *msgs);
     void fireOnMessageReceived(MegaChatMessage *msg);
     void fireOnMessageUpdate(MegaChatMessage *msg);
     void fireOnHistoryReloaded(MegaChatRoom *chat);
+    // delivers the messages batched so far, if any (or an empty list if forced)
+    void flushHistoryBatch(bool force = false);
+    // delivers the messages batched so far, and the rest of the chunk one by one
+    void stopHistoryBatch();
 
     // karere::IApp::IChatHandler implementation
 #ifndef KARERE_DISABLE_WEBRTC
@@ -412,10 +423,7 @@ public:
     virtual void onLastMessageTsUpdated(uint32_t ts);
     virtual void onHistoryReloaded();
 
-    bool isRevoked(MegaChatHandle h);
-    // update access to attachments
-    void handleHistoryMessage(MegaChatMessage *message);
-    // update access to attachments, returns messages requiring updates (you take ownership)
+    // returns attachment messages whose access has changed (you take ownership)
     std::set<MegaChatHandle> *handleNewMessage(MegaChatMessage *msg);
 
 protected:
@@ -430,9 +438,13 @@ private:
 
     std::set<MegaChatRoomListener *> roomListeners;
 
-    // nodes with granted/revoked access from loaded messsages
-    std::map<MegaChatHandle, bool> attachmentsAccess;  // handle, access
-    std::map<MegaChatHandle, std::set<MegaChatHandle>> attachmentsIds;    // nodehandle, msgids
+    // history messages of the current chunk, when delivered in batches (see MegaChatApi::setBatchedHistoryLoading).
+    // Only their index and status are kept, the messages are built when the chunk is notified
+    std::vector<std::pair<chatd::Idx, chatd::Message::Status>> mHistoryBatch;
+
+    // a chunk of history is being loaded, and whether it's delivered in a batch (read once per chunk)
+    bool mHistoryLoading;
+    bool mHistoryBatched;
 };
 
 class LoggerHandler : public karere::Logger::ILoggerBackend
@@ -715,10 +727,36 @@ private:
     bool deleted;
     int priv;               // certain messages need additional info, like priv changes
     int code;               // generic field for additional information (ie. the reason of manual sending)
-    std::vector<MegaChatAttachedUser> *megaChatUsers = NULL;
-    mega::MegaNodeList *megaNodeList = NULL;
+    // attachments and meta are parsed from mJsonContent on first access (see decodeJsonContent()).
+    // The getters are const and the app may call them from several threads, hence the once_flag
+    mutable std::vector<MegaChatAttachedUser> *megaChatUsers = NULL;
+    mutable mega::MegaNodeList *megaNodeList = NULL;
     mega::MegaHandleList *megaHandleList = NULL;
-    const MegaChatContainsMeta *mContainsMeta = NULL;
+    mutable const MegaChatContainsMeta *mContainsMeta = NULL;
+    mutable std::string mJsonContent;
+    bool mJsonPending = false;
+    mutable std::once_flag mJsonDecoded;
+
+    void decodeJsonContent() const;
+};
+
+class MegaChatMessageListPrivate :  public MegaChatMessageList
+{
+public:
+    MegaChatMessageListPrivate();
+    virtual ~MegaChatMessageListPrivate();
+    virtual MegaChatMessageListPrivate *copy() const;
+
+    virtual const MegaChatMessage *get(unsigned int i) const;
+    virtual unsigned int size() const;
+
+    void addMessage(MegaChatMessage*);
+    void reserve(unsigned int count);
+
+private:
+    MegaChatMessageListPrivate(const MegaChatMessageListPrivate *list);
+    // messages are immutable once in a list, so copies of the list share them
+    std::vector<std::shared_ptr<const MegaChatMessage>> list;
 };
 
 //Thread safe request queue
@@ -752,6 +790,132 @@ public:
     size_t size();
 };
 
+/** Immutable copy of the chat list and the rooms' metadata, so that the app's
+ * threads can read it without taking the sdkMutex. The changes are collected
+ * while the karere thread runs, and a new one is published with all of them at
+ * the end of each turn of the loop, or before that if the thread that made the
+ * changes reads the list (i.e. from the listeners that are notified about them).
+ *
+ * To keep publishing cheap, the bulk of the entries (\c base) is shared between
+ * snapshots, and each one only copies the entries changed since that base was
+ * built (\c changes). Once there are more than \c kMaxChanges of them, they are
+ * merged into a new base.
+ */
+class ChatListSnapshot
+{
+public:
+    struct Entry
+    {
+        std::shared_ptr<const MegaChatListItemPrivate> item;    // NULL if the chat was removed
+        std::shared_ptr<const MegaChatRoomPrivate> room;
+        uint64_t version = 0;   // version of the snapshot in which the entry was last updated
+    };
+    typedef std::pair<int64_t, MegaChatHandle> ActivityKey;
+    typedef std::map<MegaChatHandle, Entry> EntryMap;
+    struct Base
+    {
+        EntryMap entries;
+        // (last activity ts, chatid) of every entry, most recent first
+        std::vector<ActivityKey> byLastActivity;
+    };
+    enum { kMaxChanges = 64, kMaxRemoved = 256 };
+
+    // incremented every time a new snapshot is published
+    uint64_t version = 0;
+    std::shared_ptr<const Base> base;
+    // entries changed since \c base was built, with an empty item for the removed ones
+    EntryMap changes;
+    // chats removed from the list, kept to report them in deltas. Only the last
+    // \c kMaxRemoved are kept. Shared between snapshots, and copied when it changes
+    std::shared_ptr<const EntryMap> removed;
+    // removals before this version may have been dropped, so deltas from older
+    // versions are incomplete
+    uint64_t removedSince = 0;
+
+    ChatListSnapshot(): base(std::make_shared<Base>()), removed(std::make_shared<EntryMap>()) {}
+    const Entry *find(MegaChatHandle chatid) const;
+    /** Replaces the entry of \c chatid, or removes it if \c entry has no item */
+    void set(MegaChatHandle chatid, const Entry &entry);
+
+    /** Calls \c func for every entry, by chatid */
+    template <class F>
+    void forEach(F&& func) const
+    {
+        auto baseIt = base->entries.begin();
+        auto changeIt = changes.begin();
+        while (changeIt != changes.end())
+        {
+            for (; baseIt != base->entries.end() && baseIt->first < changeIt->first; baseIt++)
+            {
+                func(baseIt->second);
+            }
+            if (baseIt != base->entries.end() && baseIt->first == changeIt->first)
+            {
+                baseIt++;   // superseded by the change
+            }
+            if (changeIt->second.item)
+            {
+                func(changeIt->second);
+            }
+            changeIt++;
+        }
+        for (; baseIt != base->entries.end(); baseIt++)
+        {
+            func(baseIt->second);
+        }
+    }
+
+    /** Calls \c func for at most \c count entries, by last activity, skipping the first \c offset */
+    template <class F>
+    void forEachByLastActivity(size_t offset, size_t count, F&& func) const
+    {
+        std::vector<ActivityKey> changed;
+        for (auto it = changes.begin(); it != changes.end(); it++)
+        {
+            if (it->second.item)
+            {
+                changed.push_back(activityKey(it->second));
+            }
+        }
+        std::sort(changed.begin(), changed.end(), std::greater<ActivityKey>());
+
+        auto baseIt = base->byLastActivity.begin();
+        auto changeIt = changed.begin();
+        for (size_t pos = 0; count > 0; pos++)
+        {
+            while (baseIt != base->byLastActivity.end() && changes.count(baseIt->second))
+            {
+                baseIt++;   // superseded by a change
+            }
+
+            MegaChatHandle chatid;
+            if (changeIt != changed.end()
+                    && (baseIt == base->byLastActivity.end() || *changeIt > *baseIt))
+            {
+                chatid = (changeIt++)->second;
+            }
+            else if (baseIt != base->byLastActivity.end())
+            {
+                chatid = (baseIt++)->second;
+            }
+            else
+            {
+                break;
+            }
+
+            if (pos >= offset)
+            {
+                func(*find(chatid));
+                count--;
+            }
+        }
+    }
+
+protected:
+    static ActivityKey activityKey(const Entry &entry);
+    void compact();
+};
+
 class MegaChatApiImpl :
         public karere::IApp,
         public karere::IApp::IChatListHandler
@@ -770,6 +934,11 @@ private:
     WebsocketsIO *websocketsIO;
     karere::Client *mClient;
     bool terminating;
+    bool mBatchedHistoryLoading;
+    int mStorageProfile;
+    unsigned int mHistoryRetention;
+    int mHistoryStorage;
+    unsigned int mHistoryPrefetch;
 
     mega::MegaThread thread;
     int threadExit;
@@ -794,6 +963,27 @@ private:
     int reqtag;
     std::map<int, MegaChatRequestPrivate *> requestMap;
 
+    // last published chat list, read by the getters without holding sdkMutex. It is
+    // only replaced with sdkMutex held, so holders of sdkMutex can read it without a copy
+    std::shared_ptr<const ChatListSnapshot> mChatListSnapshot;
+    // only protects the copy and swap of the snapshot pointer, never held while building it
+    mega::MegaMutex mChatListSnapshotMutex;
+
+    // change of a chat not published yet in the snapshot
+    struct ChatListChange
+    {
+        karere::ChatRoom *room = NULL;  // NULL if the chat was removed
+        bool item = false;              // the list item has to be rebuilt
+        bool roomInfo = false;          // the room has to be rebuilt
+    };
+    // changes since the last published snapshot, by chatid. Protected by sdkMutex
+    std::map<MegaChatHandle, ChatListChange> mChatListChanges;
+    // true while there are changes in mChatListChanges
+    std::atomic<bool> mChatListDirty;
+    // thread that holds sdkMutex while making changes to the chat list, which publishes
+    // them when it reads the snapshot. Default-constructed (no thread) otherwise
+    std::atomic<std::thread::id> mChatListWriter;
+
 #ifndef KARERE_DISABLE_WEBRTC
     std::set<MegaChatCallListener *> callListeners;
     std::set<MegaChatVideoListener *> localVideoListeners;
@@ -807,6 +997,12 @@ private:
 
     static int convertInitState(int state);
 
+    std::shared_ptr<const ChatListSnapshot> chatListSnapshot();
+    /** Publishes a snapshot with the changes of the chat list made since the last one,
+     * if any. Must be called with sdkMutex held */
+    void publishChatListSnapshot();
+    void resetChatListSnapshot();
+
     MegaChatMessage *prepareAttachNodesMessage(std::string buffer, MegaChatHandle chatid);
 
 public:
@@ -827,6 +1023,16 @@ public:
     MegaChatRoomHandler* getChatRoomHandler(MegaChatHandle chatid);
     void removeChatRoomHandler(MegaChatHandle chatid);
 
+    /** Records a change of the chat, to be published in the next chat list snapshot.
+     * \c item and \c roomInfo tell whether its list item and/or its room have changed.
+     * Must be called with sdkMutex held, before notifying the change to the app */
+    void updateChatListSnapshot(karere::ChatRoom &room, bool item, bool roomInfo);
+    /** As above, for a chat that is in the list of the client, or is being added to it */
+    void updateChatListSnapshot(MegaChatHandle chatid, bool item, bool roomInfo);
+    /** Records the removal of the chat, to be published in the next chat list snapshot.
+     * Must be called with sdkMutex held, before the room is deleted */
+    void removeFromChatListSnapshot(MegaChatHandle chatid);
+
     karere::ChatRoom *findChatRoom(MegaChatHandle chatid);
     karere::ChatRoom *findChatRoomByUser(MegaChatHandle userhandle);
     chatd::Message *findMessage(MegaChatHandle chatid, MegaChatHandle msgid);
@@ -931,6 +1137,9 @@ public:
     MegaChatListItemList *getActiveChatListItems();
     MegaChatListItemList *getInactiveChatListItems();
     MegaChatListItemList *getUnreadChatListItems();
+    int64_t getChatListVersion();
+    MegaChatListItemList *getChatListItemsChangedSince(int64_t version);
+    MegaChatListItemList *getChatListItemsByLastActivity(unsigned int offset, unsigned int count);
     MegaChatHandle getChatHandleByUser(MegaChatHandle userhandle);
 
     // Chatrooms management
@@ -945,6 +1154,8 @@ public:
     void closeChatRoom(MegaChatHandle chatid, MegaChatRoomListener *listener = NULL);
 
     int loadMessages(MegaChatHandle chatid, int count);
+    void setBatchedHistoryLoading(bool enable);
+    bool isBatchedHistoryLoading();
     bool isFullHistoryLoaded(MegaChatHandle chatid);
     MegaChatMessage *getMessage(MegaChatHandle chatid, MegaChatHandle msgid);
     MegaChatMessage *getManualSendingMessage(MegaChatHandle chatid, MegaChatHandle rowid);
@@ -955,6 +1166,13 @@ public:
     void attachNode(MegaChatHandle chatid, MegaChatHandle nodehandle, MegaChatRequestListener *listener = NULL);
     void revokeAttachment(MegaChatHandle chatid, MegaChatHandle handle, MegaChatRequestListener *listener = NULL);
     bool isRevoked(MegaChatHandle chatid, MegaChatHandle nodeHandle);
+    MegaChatMessageList *getNodeAttachmentMessages(MegaChatHandle chatid, int beforeIndex, unsigned int count);
+    MegaChatMessageList *getMessagesAround(MegaChatHandle chatid, MegaChatHandle msgid, unsigned int before, unsigned int after);
+    MegaChatMessageList *getMessagesAroundTime(MegaChatHandle chatid, int64_t ts, unsigned int before, unsigned int after);
+    /** Max number of messages at each side of a window of getMessagesAround() */
+    enum { kMaxHistoryWindow = 1000 };
+    MegaChatMessageList *getHistoryWindow(karere::ChatRoom *chatroom, chatd::Idx idx, unsigned int before, unsigned int after);
+    void searchMessages(MegaChatHandle chatid, const char *query, unsigned int limit, long long cursor, MegaChatRequestListener *listener = NULL);
     MegaChatMessage *editMessage(MegaChatHandle chatid, MegaChatHandle msgid, const char* msg);
     MegaChatMessage *removeRichLink(MegaChatHandle chatid, MegaChatHandle msgid);
     bool setMessageSeen(MegaChatHandle chatid, MegaChatHandle msgid);
@@ -965,6 +1183,10 @@ public:
     void sendStopTypingNotification(MegaChatHandle chatid, MegaChatRequestListener *listener = NULL);
     bool isMessageReceptionConfirmationActive() const;
     void saveCurrentState();
+    void setStorageProfile(int profile);
+    void setHistoryRetention(unsigned int seconds);
+    void setHistoryStorage(int storage);
+    void setHistoryPrefetch(unsigned int count);
     void pushReceived(bool beep, MegaChatRequestListener *listener = NULL);
 
 #ifndef KARERE_DISABLE_WEBRTC
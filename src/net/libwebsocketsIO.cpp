@@ -17,6 +17,71 @@ static struct lws_protocols protocols[] =
     { NULL, NULL, 0, 0 } /* terminator */
 };
 
+#ifndef LWS_WITHOUT_EXTENSIONS
+// wraps the permessage-deflate implementation of libwebsockets to know when it's
+// negotiated, and the size of the compressed data
+static int pmDeflateCallback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+                             enum lws_extension_callback_reasons reason, void *user, void *in, size_t len)
+{
+    // for payload callbacks, `len` is the lws_write_protocol of the frame
+    bool isData = ((len & 0x1f) == LWS_WRITE_TEXT) || ((len & 0x1f) == LWS_WRITE_BINARY) || ((len & 0x1f) == LWS_WRITE_CONTINUATION);
+
+#if LWS_LIBRARY_VERSION_NUMBER >= 3002000
+    struct lws_ext_pm_deflate_rx_ebufs *ebufs = (struct lws_ext_pm_deflate_rx_ebufs *)in;
+    size_t inLen = (reason == LWS_EXT_CB_PAYLOAD_RX && ebufs) ? ebufs->eb_in.len : 0;
+#else
+    struct lws_tokens *ebuf = (struct lws_tokens *)in;
+    size_t inLen = (reason == LWS_EXT_CB_PAYLOAD_RX && ebuf) ? ebuf->token_len : 0;
+#endif
+
+    int ret = lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+
+    LibwebsocketsClient *client = wsi ? (LibwebsocketsClient *)lws_wsi_user(wsi) : NULL;
+    if (!client || ret < 0)
+    {
+        return ret;
+    }
+
+    switch (reason)
+    {
+        case LWS_EXT_CB_CLIENT_CONSTRUCT:
+            client->wsCompressionCb();
+            break;
+        case LWS_EXT_CB_PAYLOAD_RX:
+#if LWS_LIBRARY_VERSION_NUMBER >= 3002000
+            // the input may be consumed in several calls
+            client->wsWireDataReceived(inLen - ebufs->eb_in.len);
+#else
+            client->wsWireDataReceived(inLen);
+#endif
+            break;
+        case LWS_EXT_CB_PAYLOAD_TX:
+            if (isData)
+            {
+#if LWS_LIBRARY_VERSION_NUMBER >= 3002000
+                client->wsWireDataSent(ebufs->eb_out.len);
+#else
+                client->wsWireDataSent(ebuf->token_len);
+#endif
+            }
+            break;
+        default:
+            break;
+    }
+    return ret;
+}
+
+static const struct lws_extension extensions[] =
+{
+    {
+        "permessage-deflate",
+        pmDeflateCallback,
+        "permessage-deflate; client_max_window_bits"
+    },
+    { NULL, NULL, NULL } /* terminator */
+};
+#endif
+
 LibwebsocketsIO::LibwebsocketsIO(::mega::Mutex *mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx) : WebsocketsIO(mutex, api, ctx)
 {
     struct lws_context_creation_info info;
@@ -26,6 +91,11 @@ LibwebsocketsIO::LibwebsocketsIO(::mega::Mutex *mutex, ::mega::Waiter* waiter, :
     info.protocols = protocols;
     info.gid = -1;
     info.uid = -1;
+    info.user = this;
+#ifndef LWS_WITHOUT_EXTENSIONS
+    // only offered in the connections if enabled by setCompression()
+    info.extensions = extensions;
+#endif
     info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
     info.options |= LWS_SERVER_OPTION_DISABLE_OS_CA_CERTS;
     info.options |= LWS_SERVER_OPTION_LIBUV;
@@ -108,6 +178,7 @@ bool LibwebsocketsIO::wsResolveDNS(const char *hostname, std::function<void (int
 WebsocketsClientImpl *LibwebsocketsIO::wsConnect(const char *ip, const char *host, int port, const char *path, bool ssl, WebsocketsClient *client)
 {
     LibwebsocketsClient *libwebsocketsClient = new LibwebsocketsClient(mutex, client);
+    libwebsocketsClient->offerCompression = mCompression;
     
     std::string cip = ip;
     if (cip[0] == '[')
@@ -338,6 +409,16 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
 
     switch (reason)
     {
+        case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_CLIENT_VERIFY_CERTS:
+        {
+            // called once, when the SSL context for client connections is created
+            LibwebsocketsIO *io = (LibwebsocketsIO *)lws_context_user(lws_get_context(wsi));
+            if (io)
+            {
+                io->mTlsSessions.attach((SSL_CTX *)user);
+            }
+            break;
+        }
         case LWS_CALLBACK_OPENSSL_PERFORM_SERVER_CERT_VERIFICATION:
         {
             if (check_public_key((X509_STORE_CTX*)user))
@@ -346,6 +427,12 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
             }
             break;
         }
+        case LWS_CALLBACK_CLIENT_CONFIRM_EXTENSION_SUPPORTED:
+        {
+            // non-zero to not offer the extension in this connection
+            LibwebsocketsClient* client = (LibwebsocketsClient*)user;
+            return !client || !client->offerCompression;
+        }
         case LWS_CALLBACK_CLIENT_ESTABLISHED:
         {
             LibwebsocketsClient* client = (LibwebsocketsClient*)user;
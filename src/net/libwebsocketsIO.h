@@ -7,6 +7,7 @@
 #include <functional>
 
 #include "net/websocketsIO.h"
+#include "net/tlsSessionCache.h"
 
 // Websockets network layer implementation based on libwebsocket
 class LibwebsocketsIO : public WebsocketsIO
@@ -14,6 +15,7 @@ class LibwebsocketsIO : public WebsocketsIO
 public:
     struct lws_context *wscontext;
     uv_loop_t* eventloop;
+    TlsSessionCache mTlsSessions;
 
     LibwebsocketsIO(::mega::Mutex *mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx);
     virtual ~LibwebsocketsIO();
@@ -52,6 +54,7 @@ protected:
     
 public:
     struct lws *wsi;
+    bool offerCompression = false;
     static int wsCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *data, size_t len);
 };
 
@@ -33,6 +33,7 @@ LibwsIO::LibwsIO(::mega::Mutex *mutex, ::mega::Waiter* waiter, ::mega::MegaApi *
         }, NULL);
     });
     //ws_set_log_level(LIBWS_TRACE);
+    attachTlsSessionCache();
 }
 
 LibwsIO::~LibwsIO()
@@ -47,6 +48,18 @@ void LibwsIO::addevents(::mega::Waiter* waiter, int)
 
 }
 
+void LibwsIO::attachTlsSessionCache()
+{
+#ifdef LIBWS_WITH_OPENSSL
+    // libws may create its SSL context on the first SSL connection
+    if (wscontext.ssl_ctx && wscontext.ssl_ctx != mTlsCtx)
+    {
+        mTlsCtx = wscontext.ssl_ctx;
+        mTlsSessions.attach(wscontext.ssl_ctx);
+    }
+#endif
+}
+
 bool LibwsIO::wsResolveDNS(const char *hostname, std::function<void (int, std::vector<std::string>&, std::vector<std::string>&)> f)
 {
     mApi.call(&::mega::MegaApi::queryDNS, hostname)
@@ -74,6 +87,10 @@ bool LibwsIO::wsResolveDNS(const char *hostname, std::function<void (int, std::v
 WebsocketsClientImpl *LibwsIO::wsConnect(const char *ip, const char *host, int port, const char *path, bool ssl, WebsocketsClient *client)
 {
     int result;
+    if (mCompression)
+    {
+        WEBSOCKETS_LOG_DEBUG("permessage-deflate is not supported by libws, connecting without compression");
+    }
     LibwsClient *libwsClient = new LibwsClient(mutex, client, appCtx);
     
     result = ws_init(&libwsClient->mWebSocket, &wscontext);
@@ -122,6 +139,12 @@ WebsocketsClientImpl *LibwsIO::wsConnect(const char *ip, const char *host, int p
         delete libwsClient;
         return NULL;
     }
+
+    if (ssl)
+    {
+        // the TLS handshake starts once the TCP connection is established
+        attachTlsSessionCache();
+    }
     return libwsClient;
 }
 
@@ -3,6 +3,7 @@
 
 #include <libws.h>
 #include "net/websocketsIO.h"
+#include "net/tlsSessionCache.h"
 #include "trackDelete.h"
 #include <mega/waiter.h>
 #include <functional>
@@ -18,6 +19,9 @@ public:
 
 protected:
     ws_base_s wscontext;
+    TlsSessionCache mTlsSessions;
+    void *mTlsCtx = nullptr;    // SSL_CTX of libws the session cache is attached to
+    void attachTlsSessionCache();
     virtual bool wsResolveDNS(const char *hostname, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> f);
     virtual WebsocketsClientImpl *wsConnect(const char *ip, const char *host,
                                            int port, const char *path, bool ssl,
@@ -0,0 +1,203 @@
+#include "net/tlsSessionCache.h"
+#include "net/websocketsIO.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <time.h>
+
+using namespace std;
+
+TlsSessionCache::~TlsSessionCache()
+{
+    clear();
+}
+
+void TlsSessionCache::attach(SSL_CTX *ctx)
+{
+    if (!ctx)
+    {
+        WEBSOCKETS_LOG_WARNING("No SSL context to attach the TLS session cache to");
+        return;
+    }
+
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined (LIBRESSL_VERSION_NUMBER) || defined (OPENSSL_IS_BORINGSSL)
+    // a session set from the info callback is not used by these versions
+    WEBSOCKETS_LOG_WARNING("TLS session resumption is not supported with this SSL library");
+#else
+
+    SSL_CTX_set_ex_data(ctx, exDataIndex(), this);
+    // the sessions are only stored here, indexed by host (the internal cache is for servers)
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &TlsSessionCache::onNewSession);
+
+    // the session must be set before the ClientHello is sent, but the backends don't give
+    // access to the SSL object before the handshake, so it's done at its start
+    mPrevInfoCb = SSL_CTX_get_info_callback(ctx);
+    SSL_CTX_set_info_callback(ctx, &TlsSessionCache::onInfo);
+#endif
+}
+
+void TlsSessionCache::clear()
+{
+    lock_guard<mutex> lock(mMutex);
+    for (auto &it: mSessions)
+    {
+        SSL_SESSION_free(it.second);
+    }
+    mSessions.clear();
+}
+
+void TlsSessionCache::put(const string &host, SSL_SESSION *session)
+{
+    lock_guard<mutex> lock(mMutex);
+    auto it = mSessions.find(host);
+    if (it != mSessions.end())
+    {
+        SSL_SESSION_free(it->second);
+        it->second = session;
+        return;
+    }
+
+    if (mSessions.size() >= kMaxSessions)
+    {
+        // evict the one closest to expire
+        auto oldest = mSessions.begin();
+        for (auto it = mSessions.begin(); it != mSessions.end(); it++)
+        {
+            if (SSL_SESSION_get_time(it->second) + SSL_SESSION_get_timeout(it->second)
+                    < SSL_SESSION_get_time(oldest->second) + SSL_SESSION_get_timeout(oldest->second))
+            {
+                oldest = it;
+            }
+        }
+        SSL_SESSION_free(oldest->second);
+        mSessions.erase(oldest);
+    }
+    mSessions[host] = session;
+}
+
+bool TlsSessionCache::resume(const string &host, SSL *ssl)
+{
+    lock_guard<mutex> lock(mMutex);
+    auto it = mSessions.find(host);
+    if (it == mSessions.end())
+    {
+        return false;
+    }
+
+    SSL_SESSION *session = it->second;
+    if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) <= time(NULL))
+    {
+        WEBSOCKETS_LOG_DEBUG("TLS session for %s has expired", host.c_str());
+        SSL_SESSION_free(session);
+        mSessions.erase(it);
+        return false;
+    }
+
+    // SSL_set_session() takes its own reference
+    bool ok = SSL_set_session(ssl, session);
+#ifdef TLS1_3_VERSION
+    if (SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION)
+    {
+        // TLS 1.3 tickets are single-use. The server sends new ones after the handshake
+        SSL_SESSION_free(session);
+        mSessions.erase(it);
+    }
+#endif
+    if (ok)
+    {
+        WEBSOCKETS_LOG_DEBUG("Resuming TLS session for %s", host.c_str());
+    }
+    return ok;
+}
+
+int TlsSessionCache::exDataIndex()
+{
+    static int index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    return index;
+}
+
+string TlsSessionCache::sessionKey(const SSL *ssl)
+{
+    const char *servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if (servername && servername[0])
+    {
+        return servername;
+    }
+
+    int fd = SSL_get_fd(ssl);
+    if (fd < 0)
+    {
+        return string();
+    }
+
+    sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(fd, (sockaddr *)&addr, &addrlen))
+    {
+        return string();
+    }
+
+    char straddr[INET6_ADDRSTRLEN];
+    straddr[0] = 0;
+    int port;
+    if (addr.ss_family == AF_INET)
+    {
+        sockaddr_in *addr4 = (sockaddr_in *)&addr;
+        inet_ntop(AF_INET, &addr4->sin_addr, straddr, sizeof(straddr));
+        port = ntohs(addr4->sin_port);
+    }
+    else if (addr.ss_family == AF_INET6)
+    {
+        sockaddr_in6 *addr6 = (sockaddr_in6 *)&addr;
+        inet_ntop(AF_INET6, &addr6->sin6_addr, straddr, sizeof(straddr));
+        port = ntohs(addr6->sin6_port);
+    }
+    else
+    {
+        return string();
+    }
+    return string(straddr) + ":" + to_string(port);
+}
+
+int TlsSessionCache::onNewSession(SSL *ssl, SSL_SESSION *session)
+{
+    TlsSessionCache *self = (TlsSessionCache *)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), exDataIndex());
+    string host = sessionKey(ssl);
+    if (!self || host.empty())
+    {
+        return 0;   // not kept, OpenSSL frees it
+    }
+
+    self->put(host, session);
+    return 1;
+}
+
+void TlsSessionCache::onInfo(const SSL *cssl, int where, int ret)
+{
+    // some OpenSSL versions take a non-const SSL in the functions below
+    SSL *ssl = const_cast<SSL *>(cssl);
+    TlsSessionCache *self = (TlsSessionCache *)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), exDataIndex());
+    if (!self)
+    {
+        return;
+    }
+
+    if ((where & SSL_CB_HANDSHAKE_START) && !SSL_is_server(ssl) && SSL_in_before(ssl))
+    {
+        string host = sessionKey(ssl);
+        if (host.size())
+        {
+            self->resume(host, ssl);
+        }
+    }
+    else if ((where & SSL_CB_HANDSHAKE_DONE) && !SSL_is_server(ssl))
+    {
+        WEBSOCKETS_LOG_DEBUG("TLS handshake completed (%s)", SSL_session_reused(ssl) ? "resumed" : "full");
+    }
+
+    if (self->mPrevInfoCb)
+    {
+        self->mPrevInfoCb(cssl, where, ret);
+    }
+}
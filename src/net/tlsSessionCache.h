@@ -0,0 +1,41 @@
+#ifndef tlsSessionCache_h
+#define tlsSessionCache_h
+
+#include <openssl/ssl.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Client-side TLS session cache, shared by the websockets backends.
+// Once attached to the SSL_CTX that a backend uses for its client connections, the
+// sessions (or session tickets) negotiated with each host are kept, and set on the next
+// connection to the same host, so that reconnections do an abbreviated handshake.
+// The host is taken from the SNI of the connection, or the peer address if there's none.
+// Requires OpenSSL 1.1.0 or newer, with older versions attach() does nothing.
+class TlsSessionCache
+{
+public:
+    enum { kMaxSessions = 32 };
+
+    TlsSessionCache() {}
+    ~TlsSessionCache();
+    void attach(SSL_CTX *ctx);
+    void clear();
+
+protected:
+    std::mutex mMutex;
+    std::map<std::string, SSL_SESSION *> mSessions;
+    void (*mPrevInfoCb)(const SSL *ssl, int where, int ret) = nullptr;
+
+    // takes ownership of `session`
+    void put(const std::string &host, SSL_SESSION *session);
+    // sets the cached session for `host` (if any and not expired) in `ssl`
+    bool resume(const std::string &host, SSL *ssl);
+
+    static int exDataIndex();
+    static std::string sessionKey(const SSL *ssl);
+    static int onNewSession(SSL *ssl, SSL_SESSION *session);
+    static void onInfo(const SSL *ssl, int where, int ret);
+};
+
+#endif /* tlsSessionCache_h */
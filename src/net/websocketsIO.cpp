@@ -12,6 +12,36 @@ WebsocketsIO::~WebsocketsIO()
     
 }
 
+void WebsocketsIO::refreshDnsCache()
+{
+    for (const std::string &host: mDnsCache.hosts())
+    {
+        WEBSOCKETS_LOG_DEBUG("Resolving %s in advance", host.c_str());
+        auto wptr = weakHandle();
+        wsResolveDNS(host.c_str(), [wptr, this, host](int status, std::vector<std::string> &ipsv4, std::vector<std::string> &ipsv6)
+        {
+            if (wptr.deleted())
+            {
+                return;
+            }
+
+            if (status < 0 || (ipsv4.empty() && ipsv6.empty()))
+            {
+                WEBSOCKETS_LOG_WARNING("Failed to resolve %s in advance. Error code: %d", host.c_str(), status);
+                return;
+            }
+
+            // if a connection is using the old IPs, it will notice the change on its own next
+            // resolution, by comparing them with the IP it's using, and reconnect
+            if (!mDnsCache.isMatch(host, ipsv4, ipsv6))
+            {
+                mDnsCache.set(host, ipsv4.size() ? ipsv4.at(0) : "",
+                              ipsv6.size() ? ipsv6.at(0) : "");
+            }
+        });
+    }
+}
+
 WebsocketsClientImpl::WebsocketsClientImpl(::mega::Mutex *mutex, WebsocketsClient *client)
 {
     this->mutex = mutex;
@@ -49,7 +79,7 @@ void WebsocketsClientImpl::wsConnectCb()
 {
     ScopedLock lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Connection established");
-    client->wsConnectCb();
+    client->wsConnectCbPrivate(this);
 }
 
 void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len)
@@ -65,16 +95,39 @@ void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preas
         WEBSOCKETS_LOG_DEBUG("Connection closed by server");
     }
 
-    client->wsCloseCbPrivate(errcode, errtype, preason, reason_len);
+    client->wsCloseCbPrivate(this, errcode, errtype, preason, reason_len);
 }
 
 void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
 {
     ScopedLock lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Received %d bytes", len);
+    WebsocketsStats &stats = client->mStats;
+    stats.msgsRecv++;
+    stats.payloadRecv += len;
+    if (!compressed)
+    {
+        stats.wireRecv += len;
+    }
     client->wsHandleMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsCompressionCb()
+{
+    WEBSOCKETS_LOG_DEBUG("Using permessage-deflate");
+    compressed = true;
+}
+
+void WebsocketsClientImpl::wsWireDataSent(size_t len)
+{
+    client->mStats.wireSent += len;
+}
+
+void WebsocketsClientImpl::wsWireDataReceived(size_t len)
+{
+    client->mStats.wireRecv += len;
+}
+
 WebsocketsClient::WebsocketsClient()
 {
     ctx = NULL;
@@ -83,6 +136,7 @@ WebsocketsClient::WebsocketsClient()
 
 WebsocketsClient::~WebsocketsClient()
 {
+    cancelFallback();
     delete ctx;
     ctx = NULL;
 }
@@ -92,7 +146,7 @@ bool WebsocketsClient::wsResolveDNS(WebsocketsIO *websocketIO, const char *hostn
     return websocketIO->wsResolveDNS(hostname, f);
 }
 
-bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *host, int port, const char *path, bool ssl)
+bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, const char *host, int port, const char *path, bool ssl, const char *fallbackIp)
 {
     thread_id = pthread_self();
     
@@ -104,13 +158,82 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
         WEBSOCKETS_LOG_ERROR("Valid context at connect()");
         delete ctx;
     }
+    cancelFallback();
+
+    mConnectIO = websocketIO;
+    mIp = ip;
+    mFallbackIp = fallbackIp ? fallbackIp : "";
+    mHost = host;
+    mPort = port;
+    mPath = path;
+    mSsl = ssl;
 
     ctx = websocketIO->wsConnect(ip, host, port, path, ssl, this);
     if (!ctx)
     {
         WEBSOCKETS_LOG_WARNING("Immediate error in wsConnect");
+        return mFallbackIp.size() && startFallback();
+    }
+
+    if (mFallbackIp.size())
+    {
+        mFallbackTimer = karere::setTimeout([this]()
+        {
+            mFallbackTimer = 0;
+            if (!wsIsConnected())
+            {
+                WEBSOCKETS_LOG_DEBUG("No connection to %s after %d ms, racing it with %s", mIp.c_str(), kHappyEyeballsDelay, mFallbackIp.c_str());
+                startFallback();
+            }
+        }, kHappyEyeballsDelay, websocketIO->appCtx);
+    }
+    return true;
+}
+
+bool WebsocketsClient::startFallback()
+{
+    assert(!mFallbackCtx && mFallbackIp.size());
+    if (mFallbackTimer)
+    {
+        karere::cancelTimeout(mFallbackTimer, mConnectIO->appCtx);
+        mFallbackTimer = 0;
+    }
+
+    WEBSOCKETS_LOG_DEBUG("Connecting to %s (%s)  port %d  path: %s   ssl: %d", mHost.c_str(), mFallbackIp.c_str(), mPort, mPath.c_str(), mSsl);
+    WebsocketsClientImpl *fallback = mConnectIO->wsConnect(mFallbackIp.c_str(), mHost.c_str(), mPort, mPath.c_str(), mSsl, this);
+    if (!fallback)
+    {
+        WEBSOCKETS_LOG_WARNING("Immediate error in wsConnect to fallback IP %s", mFallbackIp.c_str());
+        mFallbackIp.clear();
+        return false;
+    }
+
+    if (ctx)
+    {
+        mFallbackCtx = fallback;
+    }
+    else    // the attempt to the first IP failed already
+    {
+        ctx = fallback;
+        mIp = mFallbackIp;
+        mFallbackIp.clear();
+    }
+    return true;
+}
+
+void WebsocketsClient::cancelFallback()
+{
+    if (mFallbackTimer)
+    {
+        karere::cancelTimeout(mFallbackTimer, mConnectIO->appCtx);
+        mFallbackTimer = 0;
+    }
+    if (mFallbackCtx)
+    {
+        mFallbackCtx->wsDisconnect(true);
+        delete mFallbackCtx;
+        mFallbackCtx = NULL;
     }
-    return ctx != NULL;
 }
 
 bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
@@ -126,12 +249,21 @@ bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
     assert (thread_id == pthread_self());
     
     WEBSOCKETS_LOG_DEBUG("Sending %d bytes", len);
+    bool compressed = ctx->isCompressed();
     bool result = ctx->wsSendMessage(msg, len);
     if (!result)
     {
         WEBSOCKETS_LOG_WARNING("Immediate error in wsSendMessage");
+        return false;
     }
-    return result;
+
+    mStats.msgsSent++;
+    mStats.payloadSent += len;
+    if (!compressed)
+    {
+        mStats.wireSent += len;
+    }
+    return true;
 }
 
 void WebsocketsClient::wsDisconnect(bool immediate)
@@ -144,6 +276,7 @@ void WebsocketsClient::wsDisconnect(bool immediate)
     }
 
     assert (thread_id == pthread_self());
+    cancelFallback();
     ctx->wsDisconnect(immediate);
 
     if (immediate)
@@ -153,6 +286,11 @@ void WebsocketsClient::wsDisconnect(bool immediate)
     }
 }
 
+bool WebsocketsClient::wsIsCompressed() const
+{
+    return ctx && ctx->isCompressed();
+}
+
 bool WebsocketsClient::wsIsConnected()
 {
     if (!ctx)
@@ -164,13 +302,76 @@ bool WebsocketsClient::wsIsConnected()
     return ctx->wsIsConnected();
 }
 
-void WebsocketsClient::wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len)
+void WebsocketsClient::wsConnectCbPrivate(WebsocketsClientImpl *impl)
+{
+    if (impl == mFallbackCtx)   // the fallback IP won the race
+    {
+        std::swap(ctx, mFallbackCtx);
+        std::swap(mIp, mFallbackIp);
+    }
+    else if (impl != ctx)
+    {
+        return;
+    }
+
+    if (isRacing())
+    {
+        WEBSOCKETS_LOG_DEBUG("Connected to %s first, dropping the attempt to %s", mIp.c_str(), mFallbackIp.c_str());
+    }
+    cancelFallback();
+    mFallbackIp.clear();
+    wsConnectCb();
+}
+
+void WebsocketsClient::wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len)
 {
     if (!ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
     {
         return;
     }
 
+    if (impl != ctx && impl != mFallbackCtx)
+    {
+        return;
+    }
+
+    // a failed connection attempt is not reported while the other one is still in progress
+    if (isRacing())
+    {
+        WEBSOCKETS_LOG_DEBUG("Connection attempt to %s failed", (impl == ctx) ? mIp.c_str() : mFallbackIp.c_str());
+        if (impl == mFallbackCtx)
+        {
+            delete mFallbackCtx;
+            mFallbackCtx = NULL;
+            mFallbackIp.clear();
+            return;
+        }
+
+        delete ctx;
+        ctx = NULL;
+        if (mFallbackCtx)
+        {
+            ctx = mFallbackCtx;
+            mFallbackCtx = NULL;
+            mIp = mFallbackIp;
+            mFallbackIp.clear();
+            return;
+        }
+        if (startFallback())    // don't wait for the timer
+        {
+            return;
+        }
+        WEBSOCKETS_LOG_DEBUG("Socket was closed gracefully or by server");
+        wsCloseCb(errcode, errtype, preason, reason_len);
+        return;
+    }
+
+    if (ctx->isCompressed())
+    {
+        WEBSOCKETS_LOG_DEBUG("Compression ratio (total): sent %.2f (%llu/%llu bytes), received %.2f (%llu/%llu bytes)",
+                             mStats.sendRatio(), (unsigned long long)mStats.wireSent, (unsigned long long)mStats.payloadSent,
+                             mStats.recvRatio(), (unsigned long long)mStats.wireRecv, (unsigned long long)mStats.payloadRecv);
+    }
     delete ctx;
     ctx = NULL;
 
@@ -189,6 +390,7 @@ bool DNScache::set(const std::string &url, const std::string &ipv4, const std::s
         record.resolveTs = time(NULL);
 
         mRecords[url] = record;
+        saveRecord(url, record);
 
         return true;
     }
@@ -199,6 +401,10 @@ bool DNScache::set(const std::string &url, const std::string &ipv4, const std::s
 void DNScache::clear(const std::string &url)
 {
     mRecords.erase(url);
+    if (mDb)
+    {
+        mDb->query("delete from dns_cache where host = ?", url);
+    }
 }
 
 bool DNScache::get(const std::string &url, std::string &ipv4, std::string &ipv6)
@@ -228,9 +434,34 @@ void DNScache::connectDone(const std::string &url, const std::string &ip)
         {
             it->second.connectIpv6Ts = time(NULL);
         }
+        else
+        {
+            return;
+        }
+        it->second.connectFailures = 0;
+        saveRecord(url, it->second);
     }
 }
 
+bool DNScache::connectFailed(const std::string &url)
+{
+    auto it = mRecords.find(url);
+    if (it == mRecords.end())
+    {
+        return false;
+    }
+
+    if (++it->second.connectFailures < kMaxConnectFailures)
+    {
+        return false;
+    }
+
+    WEBSOCKETS_LOG_WARNING("%u consecutive connection failures to the cached IPs of %s, discarding them",
+                           it->second.connectFailures, url.c_str());
+    clear(url);
+    return true;
+}
+
 time_t DNScache::age(const std::string &url)
 {
     auto it = mRecords.find(url);
@@ -273,3 +504,79 @@ bool DNScache::isMatch(const std::string &url, const std::string &ipv4, const st
 
     return match;
 }
+
+bool DNScache::isResolved(const std::string &ip, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6)
+{
+    return (std::find(ipsv4.begin(), ipsv4.end(), ip) != ipsv4.end())
+            || (std::find(ipsv6.begin(), ipsv6.end(), ip) != ipsv6.end());
+}
+
+bool DNScache::preferIpv6(const std::string &url, bool defaultValue)
+{
+    auto it = mRecords.find(url);
+    if (it == mRecords.end()
+            || (!it->second.connectIpv4Ts && !it->second.connectIpv6Ts))
+    {
+        return defaultValue;
+    }
+
+    return it->second.connectIpv6Ts > it->second.connectIpv4Ts;
+}
+
+std::vector<std::string> DNScache::hosts() const
+{
+    std::vector<std::string> result;
+    result.reserve(mRecords.size());
+    for (auto &record: mRecords)
+    {
+        result.push_back(record.first);
+    }
+    return result;
+}
+
+void DNScache::setDb(SqliteDb *db)
+{
+    mDb = db;
+    if (!mDb)
+    {
+        return;
+    }
+
+    time_t minTs = time(NULL) - kRecordTtl;
+    mDb->query("delete from dns_cache where max(resolve_ts, connect_ipv4_ts, connect_ipv6_ts) < ?", (int64_t)minTs);
+
+    SqliteStmt stmt(*mDb, "select host, ipv4, ipv6, resolve_ts, connect_ipv4_ts, connect_ipv6_ts from dns_cache");
+    while (stmt.step())
+    {
+        std::string url = stmt.stringCol(0);
+        DNSrecord record;
+        record.ipv4 = stmt.stringCol(1);
+        record.ipv6 = stmt.stringCol(2);
+        record.resolveTs = stmt.int64Col(3);
+        record.connectIpv4Ts = stmt.int64Col(4);
+        record.connectIpv6Ts = stmt.int64Col(5);
+
+        auto it = mRecords.find(url);
+        if (it == mRecords.end() || it->second.resolveTs < record.resolveTs)
+        {
+            mRecords[url] = record;
+        }
+    }
+
+    // the records resolved before having a db (or newer than the persisted ones)
+    for (auto &record: mRecords)
+    {
+        saveRecord(record.first, record.second);
+    }
+}
+
+void DNScache::saveRecord(const std::string &url, const DNSrecord &record)
+{
+    if (!mDb)
+    {
+        return;
+    }
+
+    mDb->query("insert or replace into dns_cache(host, ipv4, ipv6, resolve_ts, connect_ipv4_ts, connect_ipv6_ts) values(?,?,?,?,?,?)",
+               url, record.ipv4, record.ipv6, (int64_t)record.resolveTs, (int64_t)record.connectIpv4Ts, (int64_t)record.connectIpv6Ts);
+}
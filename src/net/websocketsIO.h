@@ -8,6 +8,8 @@
 #include <mega/thread.h>
 #include "base/logger.h"
 #include "sdkApi.h"
+#include "db.h"
+#include "base/timers.hpp"
 
 #define WEBSOCKETS_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
 #define WEBSOCKETS_LOG_INFO(fmtString,...) KARERE_LOG_INFO(krLogChannel_websockets, fmtString, ##__VA_ARGS__)
@@ -20,6 +22,11 @@ class WebsocketsClientImpl;
 class DNScache
 {
 public:
+    // records not resolved again in this time are not loaded from the db
+    enum { kRecordTtl = 7 * 24 * 3600 };
+    // consecutive failed connections to the cached IPs of a host before the record is dropped
+    enum { kMaxConnectFailures = 3 };
+
     DNScache() {}
     // returns false if ipv4 and ipv6 for the given url already match the ones in cache, true if not (so they are updated)
     bool set(const std::string &url, const std::string &ipv4, const std::string &ipv6);
@@ -27,9 +34,21 @@ public:
     // returns true if hit in cache, false if there's no record for the given url
     bool get(const std::string &url, std::string &ipv4, std::string &ipv6);
     void connectDone(const std::string &url, const std::string &ip);
+    // returns true if the record has been dropped after too many failures, so the next connection resolves the host again
+    bool connectFailed(const std::string &url);
     time_t age(const std::string &url);
     bool isMatch(const std::string &url, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6);
     bool isMatch(const std::string &url, const std::string &ipv4, const std::string &ipv6);
+    // returns true if `ip` is one of the resolved IPs
+    static bool isResolved(const std::string &ip, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6);
+    // returns true if the last successful connection to the url was through IPv6, or `defaultValue` if there's none yet
+    bool preferIpv6(const std::string &url, bool defaultValue);
+    // hosts of all the records, i.e. to resolve them again in advance
+    std::vector<std::string> hosts() const;
+
+    // loads the records persisted in `db` (if newer than the ones in memory) and keeps it
+    // updated from now on. Pass NULL to stop using it (i.e. before closing the db)
+    void setDb(SqliteDb *db);
 private:
     struct DNSrecord
     {
@@ -38,24 +57,54 @@ private:
         time_t resolveTs = 0;       // can be used to invalidate IP addresses by age
         time_t connectIpv4Ts = 0;   // can be used for heuristics based on last successful connection
         time_t connectIpv6Ts = 0;   // can be used for heuristics based on last successful connection
+        unsigned connectFailures = 0;   // since the last successful connection (not persisted)
     };
 
     std::map<std::string, DNSrecord> mRecords;
+    SqliteDb *mDb = nullptr;
+
+    void saveRecord(const std::string &url, const DNSrecord &record);
+};
+
+// Traffic counters of a websocket connection. The payload is the data of the messages, and the
+// wire bytes are the payload of their frames, after compression (the same if not compressed)
+struct WebsocketsStats
+{
+    uint64_t msgsSent = 0;
+    uint64_t payloadSent = 0;
+    uint64_t wireSent = 0;
+    uint64_t msgsRecv = 0;
+    uint64_t payloadRecv = 0;
+    uint64_t wireRecv = 0;
+
+    // wire bytes per payload byte (1 if there's no traffic or it's not compressed)
+    double sendRatio() const { return payloadSent ? (double)wireSent / payloadSent : 1; }
+    double recvRatio() const { return payloadRecv ? (double)wireRecv / payloadRecv : 1; }
 };
 
 // Generic websockets network layer
-class WebsocketsIO : public mega::EventTrigger
+class WebsocketsIO : public mega::EventTrigger, public karere::DeleteTrackable
 {
 public:
     WebsocketsIO(::mega::Mutex *mutex, ::mega::MegaApi *megaApi, void *ctx);
     virtual ~WebsocketsIO();
 
     DNScache mDnsCache;
+
+    // enables the negotiation of permessage-deflate (RFC 7692) in the next connections, if the
+    // backend supports it. Disabled by default
+    void setCompression(bool enable) { mCompression = enable; }
+    bool compressionEnabled() const { return mCompression; }
+
+    // resolves again all the hosts in the DNS cache, so that the addresses are up to date
+    // by the time the connections are (re)established
+    void refreshDnsCache();
     
 protected:
     ::mega::Mutex *mutex;
     MyMegaApi mApi;
     void *appCtx;
+    bool mCompression = false;
     
     // This function is protected to prevent a wrong direct usage
     // It must be only used from WebsocketClient
@@ -71,24 +120,59 @@ protected:
 // It's needed to subclass this class in order to receive callbacks
 class WebsocketsClient
 {
+public:
+    // RFC 8305 "Connection Attempt Delay": time to wait for the first connection attempt
+    // before racing it with one to the IP of the other family
+    enum { kHappyEyeballsDelay = 250 };
+
 private:
     WebsocketsClientImpl *ctx;
     pthread_t thread_id;
 
+    // state of the connection attempt to the fallback IP (see wsConnect())
+    WebsocketsClientImpl *mFallbackCtx = nullptr;
+    megaHandle mFallbackTimer = 0;
+    WebsocketsIO *mConnectIO = nullptr;
+    std::string mIp;
+    std::string mFallbackIp;
+    std::string mHost;
+    int mPort = 0;
+    std::string mPath;
+    bool mSsl = false;
+
+    WebsocketsStats mStats;
+
+    bool isRacing() const { return mFallbackCtx || mFallbackTimer; }
+    bool startFallback();
+    void cancelFallback();
+
 public:
     WebsocketsClient();
     virtual ~WebsocketsClient();
     bool wsResolveDNS(WebsocketsIO *websocketIO, const char *hostname, std::function<void(int, std::vector<std::string>&, std::vector<std::string>&)> f);
+    // If `fallbackIp` is provided, and connecting to `ip` doesn't succeed in kHappyEyeballsDelay ms
+    // (or fails before that), a connection to `fallbackIp` is attempted in parallel, and the first one
+    // to connect is used. wsConnectCb() and wsCloseCb() are called once for both attempts.
     bool wsConnect(WebsocketsIO *websocketIO, const char *ip,
-                   const char *host, int port, const char *path, bool ssl);
+                   const char *host, int port, const char *path, bool ssl, const char *fallbackIp = NULL);
+    // IP of the current connection or connection attempt
+    const std::string &wsConnectedIp() const { return mIp; }
     bool wsSendMessage(char *msg, size_t len);  // returns true on success, false if error
     void wsDisconnect(bool immediate);
     bool wsIsConnected();
-    void wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len);
+    // whether permessage-deflate is in use in the current connection
+    bool wsIsCompressed() const;
+    // counters of all the connections since the creation of the client or the last reset
+    const WebsocketsStats &wsStats() const { return mStats; }
+    void wsResetStats() { mStats = WebsocketsStats(); }
+    void wsConnectCbPrivate(WebsocketsClientImpl *impl);
+    void wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len);
 
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
     virtual void wsHandleMsgCb(char *data, size_t len) = 0;
+
+    friend WebsocketsClientImpl;
 };
 
 
@@ -98,6 +182,7 @@ protected:
     WebsocketsClient *client;
     ::mega::Mutex *mutex;
     bool disconnecting;
+    bool compressed = false;
     
 public:
     WebsocketsClientImpl(::mega::Mutex *mutex, WebsocketsClient *client);
@@ -105,6 +190,13 @@ public:
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
+
+    // to be called by the backends when permessage-deflate is negotiated, and with the
+    // size of each compressed frame payload sent and received from then on
+    void wsCompressionCb();
+    void wsWireDataSent(size_t len);
+    void wsWireDataReceived(size_t len);
+    bool isCompressed() const { return compressed; }
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
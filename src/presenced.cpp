@@ -45,6 +45,10 @@ Client::connect(const std::string& url, Id myHandle, IdRefMap&& currentPeers,
 
 void Client::pushPeers()
 {
+    // the whole set is sent, so any pending change is already included
+    mPeersToAdd.clear();
+    mPeersToDel.clear();
+
     Command cmd(OP_ADDPEERS, 4 + mCurrentPeers.size()*8);
     cmd.append<uint32_t>(mCurrentPeers.size());
     for (auto& peer: mCurrentPeers)
@@ -59,6 +63,7 @@ void Client::pushPeers()
 
 void Client::wsConnectCb()
 {
+    mTargetIp = wsConnectedIp();
     PRESENCED_LOG_DEBUG("Presenced connected to %s", mTargetIp.c_str());
     mDNScache.connectDone(mUrl.host, mTargetIp);
     setConnState(kConnected);
@@ -94,6 +99,11 @@ void Client::onSocketClose(int errcode, int errtype, const std::string& reason)
     usingipv6 = !usingipv6;
     mTargetIp.clear();
 
+    if (oldState == kConnecting && mDNScache.connectFailed(mUrl.host))
+    {
+        PRESENCED_LOG_WARNING("Cached IPs discarded, will be resolved again");
+    }
+
     if (oldState < kLoggedIn) //tell retry controller that the connect attempt failed
     {
         assert(!mLoginPromise.succeeded());
@@ -259,19 +269,23 @@ Client::reconnect(const std::string& url)
                     return;
                 }
 
-                if (mDNScache.isMatch(mUrl.host, ipsv4, ipsv6))
+                // compare with the IP in use rather than with the cache, which may have been
+                // updated meanwhile by WebsocketsIO::refreshDnsCache()
+                bool match = mTargetIp.empty()
+                        ? mDNScache.isMatch(mUrl.host, ipsv4, ipsv6)
+                        : DNScache::isResolved(mTargetIp, ipsv4, ipsv6);
+                if (match)
                 {
-                    PRESENCED_LOG_DEBUG("DNS resolve matches cached IPs.");
+                    PRESENCED_LOG_DEBUG("DNS resolve matches the IP in use.");
                 }
                 else
                 {
                     // update DNS cache
-                    bool ret = mDNScache.set(mUrl.host,
-                                             ipsv4.size() ? ipsv4.at(0) : "",
-                                             ipsv6.size() ? ipsv6.at(0) : "");
-                    assert(!ret);
+                    mDNScache.set(mUrl.host,
+                                  ipsv4.size() ? ipsv4.at(0) : "",
+                                  ipsv6.size() ? ipsv6.at(0) : "");
 
-                    PRESENCED_LOG_WARNING("DNS resolve doesn't match cached IPs. Forcing reconnect...");
+                    PRESENCED_LOG_WARNING("DNS resolve doesn't match the IP in use (%s). Forcing reconnect...", mTargetIp.c_str());
                     onSocketClose(0, 0, "DNS resolve doesn't match cached IPs (presenced)");
                 }
             });
@@ -306,8 +320,10 @@ Client::reconnect(const std::string& url)
                 mTsLastRecv = time(NULL);
                 mHeartbeatEnabled = true;
                 login();
+                karereClient->rescheduleHeartbeat();
             });
-        }, wptr, karereClient->appCtx, nullptr, 0, 0, KARERE_RECONNECT_DELAY_MAX, KARERE_RECONNECT_DELAY_INITIAL);
+        }, wptr, karereClient->appCtx, nullptr, 0, 0, KARERE_RECONNECT_DELAY_MAX, KARERE_RECONNECT_DELAY_INITIAL,
+        &karereClient->reconnectScheduler(), []() { return karere::rh::ReconnectScheduler::kPriorityTop; });
     }
     KR_EXCEPTION_TO_PROMISE(kPromiseErrtype_presenced);
 }
@@ -366,6 +382,32 @@ void Client::heartbeat()
     }
 }
 
+time_t Client::nextHeartbeatTs()
+{
+    if (!mHeartbeatEnabled)
+        return 0;
+
+    // the earliest time at which heartbeat() has something to do
+    time_t next = mTsLastSend + kKeepaliveSendInterval + 1;
+    time_t ts = mTsLastPingSent
+            ? mTsLastPingSent + kKeepaliveReplyTimeout + 1
+            : mTsLastRecv + kKeepaliveSendInterval;
+    if (ts < next)
+    {
+        next = ts;
+    }
+    // once the user is set inactive, there's nothing to do until there's activity
+    if (mLastSentUserActive && autoAwayInEffect())
+    {
+        ts = mTsLastUserActivity + mConfig.mAutoawayTimeout + 1;
+        if (ts < next)
+        {
+            next = ts;
+        }
+    }
+    return next;
+}
+
 void Client::disconnect()
 {
     setConnState(kDisconnected);
@@ -382,7 +424,10 @@ void Client::doConnect()
     string ipv4, ipv6;
     bool cachedIPs = mDNScache.get(mUrl.host, ipv4, ipv6);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+    // start with the IP family that connected last time, and race it with the other one (if any)
+    bool ipv6First = mDNScache.preferIpv6(mUrl.host, usingipv6) && ipv6.size();
+    mTargetIp = (ipv6First || ipv4.empty()) ? ipv6 : ipv4;
+    const string& fallbackIp = (mTargetIp == ipv4) ? ipv6 : ipv4;
 
     setConnState(kConnecting);
     PRESENCED_LOG_DEBUG("Connecting to presenced using the IP: %s", mTargetIp.c_str());
@@ -391,37 +436,12 @@ void Client::doConnect()
           mUrl.host.c_str(),
           mUrl.port,
           mUrl.path.c_str(),
-          mUrl.isSecure);
+          mUrl.isSecure,
+          fallbackIp.size() ? fallbackIp.c_str() : NULL);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)    // immediate failure for both IP families
     {
         PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            PRESENCED_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(karereClient->websocketIO, mTargetIp.c_str(),
-                          mUrl.host.c_str(),
-                          mUrl.port,
-                          mUrl.path.c_str(),
-                          mUrl.isSecure))
-            {
-                return;
-            }
-            PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-        }
-
         onSocketClose(0, 0, "Websocket error on wsConnect (presenced)");
     }
 }
@@ -566,6 +586,11 @@ bool Client::sendUserActive(bool active, bool force)
     if (!sent)
         return false;
     mLastSentUserActive = active;
+    if (active)
+    {
+        // the autoaway timeout starts again
+        karereClient->rescheduleHeartbeat();
+    }
     return true;
 }
 
@@ -656,7 +681,7 @@ void Client::handleMessage(const StaticBuffer& buf)
                 READ_ID(userid, 1);
                 PRESENCED_LOG_DEBUG("recv PEERSTATUS - user '%s' with presence %s",
                     ID_CSTR(userid), Presence::toString(pres));
-                CALL_LISTENER(onPresenceChange, userid, pres);
+                onPeerStatus(userid, pres);
                 break;
             }
             case OP_PREFS:
@@ -680,6 +705,8 @@ void Client::handleMessage(const StaticBuffer& buf)
                     {
                         PRESENCED_LOG_DEBUG("recv PREFS from another client: %s", mConfig.toString().c_str());
                     }
+                    // the autoaway settings may have changed
+                    karereClient->rescheduleHeartbeat();
                 }
                 mPrefsAckWait = false;
                 configChanged();
@@ -717,6 +744,7 @@ void Client::setConnState(ConnState newState)
 
     if (newState == kDisconnected)
     {
+        cancelPresenceDebounce();
         // if disconnected, we don't really know the presence status anymore
         for (auto it = mCurrentPeers.begin(); it != mCurrentPeers.end(); it++)
         {
@@ -730,7 +758,12 @@ void Client::addPeer(karere::Id peer)
     int result = mCurrentPeers.insert(peer);
     if (result == 1) //refcount = 1, wasnt there before
     {
-        sendCommand(Command(OP_ADDPEERS)+(uint32_t)(1)+peer);
+        // if its removal is still pending, the server has it already
+        if (!mPeersToDel.erase(peer))
+        {
+            mPeersToAdd.insert(peer);
+        }
+        schedulePeersFlush();
     }
 }
 void Client::removePeer(karere::Id peer, bool force)
@@ -757,6 +790,126 @@ void Client::removePeer(karere::Id peer, bool force)
         assert(it->second == 0);
     }
     mCurrentPeers.erase(it);
-    sendCommand(Command(OP_DELPEERS)+(uint32_t)(1)+peer);
+    auto debounceIt = mPresenceDebounce.find(peer);
+    if (debounceIt != mPresenceDebounce.end())
+    {
+        if (debounceIt->second.timer)
+        {
+            cancelTimeout(debounceIt->second.timer, karereClient->appCtx);
+        }
+        mPresenceDebounce.erase(debounceIt);
+    }
+    // if its addition is still pending, the server never had it
+    if (!mPeersToAdd.erase(peer))
+    {
+        mPeersToDel.insert(peer);
+    }
+    schedulePeersFlush();
+}
+
+void Client::schedulePeersFlush()
+{
+    if (mPeersFlushPending)
+        return;
+
+    mPeersFlushPending = true;
+    auto wptr = weakHandle();
+    marshallCall([wptr, this]()
+    {
+        if (wptr.deleted())
+            return;
+
+        mPeersFlushPending = false;
+        flushPeers();
+    }, karereClient->appCtx);
+}
+
+void Client::flushPeers()
+{
+    if (mConnState < kConnected)
+    {
+        // the whole set of peers is sent upon login. Once connected, login() has been
+        // sent already, and pushPeers() cleared the changes made before it
+        mPeersToAdd.clear();
+        mPeersToDel.clear();
+        return;
+    }
+
+    if (!mPeersToDel.empty())
+    {
+        sendPeers(OP_DELPEERS, mPeersToDel);
+        mPeersToDel.clear();
+    }
+    if (!mPeersToAdd.empty())
+    {
+        sendPeers(OP_ADDPEERS, mPeersToAdd);
+        mPeersToAdd.clear();
+    }
+}
+
+void Client::sendPeers(uint8_t opcode, const karere::SetOfIds& peers)
+{
+    Command cmd(opcode, 4 + peers.size()*8);
+    cmd.append<uint32_t>(peers.size());
+    for (auto& peer: peers)
+    {
+        cmd.append<uint64_t>(peer);
+    }
+    sendCommand(std::move(cmd));
+}
+
+void Client::onPeerStatus(karere::Id userid, karere::Presence pres)
+{
+    if (userid == mMyHandle)
+    {
+        CALL_LISTENER(onPresenceChange, userid, pres);
+        return;
+    }
+
+    auto& entry = mPresenceDebounce[userid];
+    if (entry.timer)
+    {
+        // notified recently, the last change will be notified when the timer fires
+        entry.pending = pres;
+        return;
+    }
+
+    if (entry.notified.raw() != pres.raw())
+    {
+        entry.notified = pres;
+        CALL_LISTENER(onPresenceChange, userid, pres);
+    }
+
+    auto wptr = weakHandle();
+    entry.timer = setTimeout([wptr, this, userid]()
+    {
+        if (wptr.deleted())
+            return;
+
+        auto it = mPresenceDebounce.find(userid);
+        assert(it != mPresenceDebounce.end());
+        PresenceDebounce& entry = it->second;
+        entry.timer = 0;
+        Presence pres = entry.pending;
+        if (!pres.isValid() || pres.raw() == entry.notified.raw())
+        {
+            return; // no change during the interval
+        }
+        // notify the last change and keep debouncing
+        entry.pending = Presence::kInvalid;
+        onPeerStatus(userid, pres);
+    }, kPresenceDebounceMs, karereClient->appCtx);
+}
+
+void Client::cancelPresenceDebounce()
+{
+    for (auto& entry: mPresenceDebounce)
+    {
+        if (entry.second.timer)
+        {
+            cancelTimeout(entry.second.timer, karereClient->appCtx);
+        }
+    }
+    mPresenceDebounce.clear();
 }
 }
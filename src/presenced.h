@@ -197,14 +197,14 @@ public:
     friend class Client;
 };
 
-class Command: public Buffer
+class Command: public SmallBuffer<32>
 {
 private:
     Command(const Command&) = delete;
 public:
-    Command(): Buffer(){}
-    Command(Command&& other): Buffer(std::forward<Buffer>(other)) {assert(!other.buf() && !other.bufSize() && !other.dataSize());}
-    Command(uint8_t opcode, uint8_t reserve=10): Buffer(reserve+1) { write(0, opcode); }
+    Command(): SmallBuffer(){}
+    Command(Command&& other): SmallBuffer(std::forward<SmallBuffer>(other)) {assert(!other.buf() && !other.bufSize() && !other.dataSize());}
+    Command(uint8_t opcode, size_t reserve=10): SmallBuffer(reserve+1) { write(0, opcode); }
     template<class T>
     Command&& operator+(const T& val)
     {
@@ -249,6 +249,8 @@ public:
         kLoggedIn
     };
     enum: uint16_t { kProtoVersion = 0x0001 };
+    /** Changes of the presence of a peer are notified at most once in this time (the last one) */
+    enum { kPresenceDebounceMs = 1000 };
 
 protected:
     ConnState mConnState = kConnNew;
@@ -272,6 +274,17 @@ protected:
     time_t mTsLastSend = 0;
     bool mPrefsAckWait = false;
     IdRefMap mCurrentPeers;
+    /** Changes to the peers not sent yet. They are sent once per event loop turn, in batch */
+    karere::SetOfIds mPeersToAdd;
+    karere::SetOfIds mPeersToDel;
+    bool mPeersFlushPending = false;
+    struct PresenceDebounce
+    {
+        karere::Presence notified;
+        karere::Presence pending;
+        megaHandle timer = 0;
+    };
+    std::map<karere::Id, PresenceDebounce> mPresenceDebounce;
     void initWebsocketCtx();
     void setConnState(ConnState newState);
 
@@ -293,6 +306,11 @@ protected:
     void setOnlineConfig(Config Config);
     void pingWithPresence();
     void pushPeers();
+    void schedulePeersFlush();
+    void flushPeers();
+    void sendPeers(uint8_t opcode, const karere::SetOfIds& peers);
+    void onPeerStatus(karere::Id userid, karere::Presence pres);
+    void cancelPresenceDebounce();
     void configChanged();
     std::string prefsString() const;
     bool sendKeepalive(time_t now=0);
@@ -320,6 +338,9 @@ public:
      * Must be called externally in order to have all clients
      * perform pings at a single moment, to reduce mobile radio wakeup frequency */
     void heartbeat();
+    /** @brief The time at which \c heartbeat() has to be called next, or 0 if
+     * not needed (i.e. not connected) */
+    time_t nextHeartbeatTs();
     void signalActivity(bool force = false);
     bool autoAwayInEffect();
     void addPeer(karere::Id peer);
@@ -1169,12 +1169,14 @@ ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key
 {
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
-    auto keyCmd = new KeyCommand(Id::null());
     SetOfIds users = *mParticipants;
     if (extraUser)
     {
         users.insert(extraUser);
     }
+    // keys are normally AES-encrypted to the size of a block, RSA-encrypted ones will make it grow
+    auto keyCmd = new KeyCommand(Id::null(), CHATD_KEYID_UNCONFIRMED,
+        KeyCommand::sizeFor(users.size(), AES::BLOCKSIZE));
     std::vector<Promise<void>> promises;
     promises.reserve(users.size());
 
@@ -189,7 +189,10 @@ void UserAttrCache::dbWriteNull(UserAttrPair key)
     UACACHE_LOG_DEBUG("dbWriteNull attr %s as NULL", key.toString().c_str());
 }
 
-UserAttrCache::UserAttrCache(Client& aClient): mClient(aClient)
+UserAttrCache::UserAttrCache(Client& aClient): mClient(aClient),
+    mFetchQueue(kMaxParallelFetches,
+        [this](const UserAttrPair& key) { return dispatchQueuedFetch(key); },
+        [this](std::function<void()>&& func) { marshallCall(std::move(func), mClient.appCtx); })
 {
     //load all attributes from db
     SqliteStmt stmt(mClient.db, "select userid, type, data from userattrs");
@@ -387,28 +390,47 @@ UserAttrCache::Handle UserAttrCache::getAttr(uint64_t userHandle, unsigned type,
 
 void UserAttrCache::fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
-    if (!mIsLoggedIn && !(key.attrType & USER_ATTR_FLAG_COMPOSITE))
+    if (key.attrType & USER_ATTR_FLAG_COMPOSITE)
+    {
+        // composite attributes don't talk to the API themselves, but request
+        // their components via the cache, so they are queued there
+        assert(key.attrType == USER_ATTR_FULLNAME);
+        fetchUserFullName(key, item);
         return;
+    }
+    if (!mIsLoggedIn)
+        return; // will be fetched by onLogin(), as the item stays pending
+
+    if (!mFetchQueue.push(key))
+        UACACHE_LOG_DEBUG("Attr %s is already queued for fetching", key.toString().c_str());
+}
+
+promise::Promise<void> UserAttrCache::dispatchQueuedFetch(const UserAttrPair& key)
+{
+    auto it = find(key);
+    if ((it == end()) || (it->second->pending == kCacheFetchNotPending))
+        return _Void(); //removed from cache or already resolved meanwhile
+
+    return dispatchFetch(key, it->second);
+}
+
+promise::Promise<void> UserAttrCache::dispatchFetch(UserAttrPair key, std::shared_ptr<UserAttrCacheItem> item)
+{
     switch (key.attrType)
     {
-        case USER_ATTR_FULLNAME:
-            fetchUserFullName(key, item);
-            break;
         case USER_ATTR_RSA_PUBKEY:
-            fetchRsaPubkey(key, item);
-            break;
+            return fetchRsaPubkey(key, item);
         case USER_ATTR_EMAIL:
-            fetchEmail(key, item);
-            break;
+            return fetchEmail(key, item);
         default:
-            fetchStandardAttr(key, item);
-            break;
+            return fetchStandardAttr(key, item);
     }
 }
-void UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+
+promise::Promise<void> UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserAttribute,
+    return mClient.api.call(&::mega::MegaApi::getUserAttribute,
         key.user.toString().c_str(), (int)key.attrType)
     .then([wptr, this, key, item](ReqResult result)
     {
@@ -424,10 +446,10 @@ void UserAttrCache::fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttr
     });
 }
 
-void UserAttrCache::fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+promise::Promise<void> UserAttrCache::fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserEmail,
+    return mClient.api.call(&::mega::MegaApi::getUserEmail,
         key.user.val)
     .then([wptr, this, key, item](ReqResult result)
     {
@@ -508,10 +530,10 @@ void UserAttrCache::fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttr
     });
 }
 
-void UserAttrCache::fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
+promise::Promise<void> UserAttrCache::fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item)
 {
     auto wptr = weakHandle();
-    mClient.api.call(&::mega::MegaApi::getUserData, key.user.toString().c_str())
+    return mClient.api.call(&::mega::MegaApi::getUserData, key.user.toString().c_str())
     .fail([wptr, this, key, item](const promise::Error& err)
     {
         wptr.throwIfDeleted();
@@ -559,6 +581,8 @@ void UserAttrCache::onLogin()
 void UserAttrCache::onLogOut()
 {
     mIsLoggedIn = false;
+    // queued items remain pending, and will be re-queued by onLogin()
+    mFetchQueue.clear();
 }
 
 promise::Promise<Buffer*>
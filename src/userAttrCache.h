@@ -6,6 +6,7 @@
 #include <list>
 #include <promise.h>
 #include <base/trackDelete.h>
+#include <base/fetchQueue.h>
 
 #define UACACHE_LOG_DEBUG(fmtString,...) KARERE_LOG_DEBUG(krLogChannel_uacache, fmtString, ##__VA_ARGS__)
 
@@ -124,17 +125,30 @@ class UserAttrCache: public std::map<UserAttrPair, std::shared_ptr<UserAttrCache
                      public mega::MegaGlobalListener, public karere::DeleteTrackable
 {
 protected:
+    /** Maximum number of attribute requests to the API that can be in flight at the same time */
+    enum { kMaxParallelFetches = 8 };
     Client& mClient;
     bool mIsLoggedIn = false;
+    /** Attributes waiting to be sent to the API */
+    FetchQueue<UserAttrPair> mFetchQueue;
     void dbWrite(UserAttrPair key, const Buffer& data);
     void dbWriteNull(UserAttrPair key);
     void dbInvalidateItem(UserAttrPair item);
+    /** Queues the attribute for fetching. Misses are collected during the current
+     * event loop turn and sent to the API in the next one, with at most
+     * \c kMaxParallelFetches requests in flight */
     void fetchAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    /** Called by \c mFetchQueue for each attribute */
+    promise::Promise<void> dispatchQueuedFetch(const UserAttrPair& key);
+    /** Sends the actual request for the attribute. The returned promise is
+     * resolved or rejected when the item has been updated and its callbacks called.
+     * Virtual so that the API backend can be replaced, i.e. by a mock in tests */
+    virtual promise::Promise<void> dispatchFetch(UserAttrPair key, std::shared_ptr<UserAttrCacheItem> item);
 //actual attrib fetch backend functions
     void fetchUserFullName(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
-    void fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    promise::Promise<void> fetchStandardAttr(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    promise::Promise<void> fetchRsaPubkey(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
+    promise::Promise<void> fetchEmail(UserAttrPair key, std::shared_ptr<UserAttrCacheItem>& item);
 //==
     void onUserAttrChange(uint64_t userid, int changed);
     void onUserAttrChange(mega::MegaUser& user);
@@ -158,7 +172,7 @@ public:
      */
     typedef UserAttrReqCb::WeakRefHandle Handle;
     UserAttrCache(Client& aClient);
-    ~UserAttrCache();
+    virtual ~UserAttrCache();
     /** @brief gets the attribute \c attrType of user \c user. When the attribute
      * is successfully obtained, the callback \c will be called with a Buffer object, containing
      * the attribute data. If there is an error obraining the attribute, the callback
@@ -0,0 +1,188 @@
+/* Measures the construction of chatd commands and the growth of Buffer: Command
+ * (a SmallBuffer with inline storage), CommandBuilder, KeyCommand::sizeFor() and the
+ * geometric growth of Buffer::grow(), against a Buffer that grows to the exact size
+ * of every append, as before them. The exact growth is modelled with
+ * Buffer::reserve(), which still sizes the buffer exactly.
+ *
+ * Usage: buffer_bench [rounds]
+ */
+
+#include "../../src/chatdMsg.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+using namespace chatd;
+using namespace karere;
+
+class Timer
+{
+public:
+    Timer(): mStart(std::chrono::steady_clock::now()) {}
+    double us() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - mStart).count();
+    }
+protected:
+    std::chrono::steady_clock::time_point mStart;
+};
+
+/** A Buffer that reallocates to the exact size on every append */
+class ExactBuffer: public Buffer
+{
+public:
+    ExactBuffer(): Buffer(0) {}
+    template <class T>
+    ExactBuffer& add(T val)
+    {
+        reserve(sizeof(T));
+        append(val);
+        return *this;
+    }
+    ExactBuffer& add(const void* data, size_t len)
+    {
+        reserve(len);
+        append(data, len);
+        return *this;
+    }
+};
+
+static bool sameData(const StaticBuffer& a, const StaticBuffer& b)
+{
+    return a.dataSize() == b.dataSize() && !memcmp(a.buf(), b.buf(), a.dataSize());
+}
+
+/** Runs \c func \c rounds times and prints the time per run */
+template <class F>
+static double bench(const char* name, unsigned rounds, F&& func)
+{
+    Timer timer;
+    for (unsigned i = 0; i < rounds; i++)
+    {
+        func(i);
+    }
+    double us = timer.us() / rounds;
+    printf("%-34s %10.4f us\n", name, us);
+    return us;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned rounds = (argc > 1) ? atoi(argv[1]) : 100000;
+    if (!rounds)
+    {
+        printf("Usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+    size_t sink = 0;
+    Id chatid(0x0102030405060708);
+
+    // SEEN, as sent by Chat::setMessageSeen()
+    bench("SEEN, exact growth", rounds, [&](unsigned i)
+    {
+        ExactBuffer cmd;
+        cmd.add<uint8_t>(OP_SEEN).add(chatid.val).add<uint64_t>(i);
+        sink += cmd.dataSize() + cmd.read<uint8_t>(9);
+    });
+    bench("SEEN, Command + fields", rounds, [&](unsigned i)
+    {
+        Command cmd = Command(OP_SEEN) + chatid + Id(i);
+        sink += cmd.dataSize() + cmd.read<uint8_t>(9);
+    });
+    bench("SEEN, CommandBuilder", rounds, [&](unsigned i)
+    {
+        Command cmd = CommandBuilder::build(OP_SEEN, chatid, Id(i));
+        sink += cmd.dataSize() + cmd.read<uint8_t>(9);
+    });
+    {
+        ExactBuffer exact;
+        exact.add<uint8_t>(OP_SEEN).add(chatid.val).add<uint64_t>(1);
+        ok = sameData(exact, CommandBuilder::build(OP_SEEN, chatid, Id(1)))
+                && sameData(exact, Command(OP_SEEN) + chatid + Id(1));
+    }
+
+    // JOINRANGEHIST, as sent by Chat::joinRangeHist()
+    bench("JOINRANGEHIST, exact growth", rounds, [&](unsigned i)
+    {
+        ExactBuffer cmd;
+        cmd.add<uint8_t>(OP_JOINRANGEHIST).add(chatid.val).add<uint64_t>(i).add<uint64_t>(i + 1000);
+        sink += cmd.dataSize() + cmd.read<uint8_t>(17);
+    });
+    bench("JOINRANGEHIST, CommandBuilder", rounds, [&](unsigned i)
+    {
+        Command cmd = CommandBuilder::build(OP_JOINRANGEHIST, chatid, Id(i), Id(i + 1000));
+        sink += cmd.dataSize() + cmd.read<uint8_t>(17);
+    });
+    {
+        ExactBuffer exact;
+        exact.add<uint8_t>(OP_JOINRANGEHIST).add(chatid.val).add<uint64_t>(1).add<uint64_t>(1001);
+        ok = ok && sameData(exact, CommandBuilder::build(OP_JOINRANGEHIST, chatid, Id(1), Id(1001)))
+                && sameData(exact, Command(OP_JOINRANGEHIST) + chatid + Id(1) + Id(1001));
+    }
+
+    // NEWKEY for all the participants of a group, as built by strongvelope
+    enum { kKeyCount = 200, kKeyLen = 16 };
+    char key[kKeyLen] = {};
+    unsigned keyRounds = rounds / 100 + 1;
+    bench("NEWKEY 200 keys, exact growth", keyRounds, [&](unsigned i)
+    {
+        ExactBuffer cmd;
+        cmd.add<uint8_t>(OP_NEWKEY).add(chatid.val).add<uint32_t>(CHATD_KEYID_UNCONFIRMED).add<uint32_t>(0);
+        for (unsigned k = 0; k < kKeyCount; k++)
+        {
+            cmd.add<uint64_t>(k).add<uint16_t>(kKeyLen).add(key, kKeyLen);
+        }
+        sink += cmd.dataSize();
+    });
+    bench("NEWKEY 200 keys, KeyCommand", keyRounds, [&](unsigned i)
+    {
+        KeyCommand cmd(chatid);
+        for (unsigned k = 0; k < kKeyCount; k++)
+        {
+            cmd.addKey(Id(k), key, kKeyLen);
+        }
+        sink += cmd.dataSize();
+    });
+    bench("NEWKEY 200 keys, sizeFor()", keyRounds, [&](unsigned i)
+    {
+        KeyCommand cmd(chatid, CHATD_KEYID_UNCONFIRMED, KeyCommand::sizeFor(kKeyCount, kKeyLen));
+        for (unsigned k = 0; k < kKeyCount; k++)
+        {
+            cmd.addKey(Id(k), key, kKeyLen);
+        }
+        ok = ok && (cmd.bufSize() == KeyCommand::sizeFor(kKeyCount, kKeyLen));
+        sink += cmd.dataSize();
+    });
+
+    // a 4KB buffer written byte by byte, i.e. a serialized attribute
+    bench("4KB byte by byte, exact growth", keyRounds, [&](unsigned i)
+    {
+        ExactBuffer buf;
+        for (unsigned b = 0; b < 4096; b++)
+        {
+            buf.add<uint8_t>(b);
+        }
+        sink += buf.dataSize();
+    });
+    bench("4KB byte by byte, Buffer::grow()", keyRounds, [&](unsigned i)
+    {
+        Buffer buf;
+        for (unsigned b = 0; b < 4096; b++)
+        {
+            buf.append<uint8_t>(b);
+        }
+        ok = ok && (buf.bufSize() < 2 * 4096);
+        sink += buf.dataSize();
+    });
+
+    if (!ok || !sink)
+    {
+        printf("unexpected results\n");
+        return 1;
+    }
+    return 0;
+}
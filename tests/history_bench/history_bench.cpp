@@ -0,0 +1,277 @@
+/* Compares the two storages of the history of a chat (see Client::setHistoryStorage()):
+ * the history table of the SQLite cache, with the queries of ChatdSqliteDb, and the
+ * memory-mapped karere::HistoryStore used by ChatdSegmentDb.
+ *
+ * Usage: history_bench [messages] [dir]
+ */
+
+#include "../../src/buffer.h"
+#include "../../src/db.h"
+#include "../../src/historyStore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace karere
+{
+extern const char* gDbSchema;
+}
+using namespace karere;
+
+enum
+{
+    kChatid = 1234,
+    kMyUserid = 1,
+    kPageSize = 32,
+    kLookups = 100000,
+    kUnreadCounts = 1000,
+    kChecks = 100,
+    kTypeNormal = 1,
+    kTypeAttachment = 0x10
+};
+
+struct TestMsg
+{
+    uint64_t msgid;
+    uint64_t userid;
+    uint32_t ts;
+    uint8_t type;
+    std::string data;
+};
+
+class Timer
+{
+public:
+    Timer(): mStart(std::chrono::steady_clock::now()) {}
+    double ms() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - mStart).count();
+    }
+protected:
+    std::chrono::steady_clock::time_point mStart;
+};
+
+static void report(const char* storage, const char* test, double ms, unsigned ops)
+{
+    printf("%-8s %-16s %10.1f ms %12.0f ops/s\n", storage, test, ms, ops / (ms / 1000));
+}
+
+static uint8_t unreadFlags(const TestMsg& msg)
+{
+    return (msg.userid != kMyUserid) ? HistoryStore::kFlagUnread : 0;
+}
+
+/** Text messages of 10-200 bytes, and some attachments with a JSON of ~300 bytes */
+static void generate(unsigned count, std::vector<TestMsg>& msgs)
+{
+    std::mt19937_64 rng(1);
+    msgs.resize(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        TestMsg& msg = msgs[i];
+        msg.msgid = rng() | 1;
+        msg.userid = 1 + rng() % 4;
+        msg.ts = 1500000000 + i * 30;
+        msg.type = (rng() % 20) ? kTypeNormal : kTypeAttachment;
+        size_t size = (msg.type == kTypeNormal) ? 10 + rng() % 190 : 300;
+        msg.data.resize(size);
+        for (auto& c: msg.data)
+        {
+            c = 'a' + rng() % 26;
+        }
+    }
+}
+
+static void benchSqlite(const std::string& path, const std::vector<TestMsg>& msgs)
+{
+    remove(path.c_str());
+    remove((path + "-wal").c_str());
+    remove((path + "-shm").c_str());
+    SqliteDb db;
+    if (!db.open(path.c_str(), false))
+    {
+        printf("Can't open %s\n", path.c_str());
+        exit(1);
+    }
+    db.simpleQuery(gDbSchema);
+    db.commit();
+
+    // ChatdSqliteDb::addMsgToHistory(), with a commit every 1000 messages
+    Timer ingest;
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        const TestMsg& msg = msgs[i];
+        db.query("insert into history"
+            "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted, compression) "
+            "values(?,?,?,?,?,?,?,?,?,?,?,?)", (int)i, kChatid, msg.msgid, 0, msg.type, msg.userid,
+            msg.ts, 0, StaticBuffer(msg.data.data(), msg.data.size()), 0, 0, 0);
+        if (i % 1000 == 999)
+            db.commit();
+    }
+    db.commit();
+    report("sqlite", "ingest", ingest.ms(), msgs.size());
+
+    // the continuity check that addMsgToHistory() does before each insert, which counts the
+    // rows of the chat. Timed apart with the whole history, it would make the ingest quadratic
+    Timer check;
+    for (unsigned i = 0; i < kChecks; i++)
+    {
+        SqliteStmt stmt(db, "select min(idx), max(idx), count(*) from history where chatid = ?");
+        stmt << kChatid;
+        stmt.step();
+    }
+    report("sqlite", "ingestCheck", check.ms(), kChecks);
+
+    // ChatdSqliteDb::fetchDbHistory(), from the newest message to the oldest
+    Timer paging;
+    size_t fetched = 0;
+    for (int idx = (int)msgs.size() - 1; idx >= 0; idx -= kPageSize)
+    {
+        SqliteStmt stmt(db, "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted, compression from history "
+            "where chatid = ?1 and idx <= ?2 order by idx desc limit ?3");
+        stmt << kChatid << idx << kPageSize;
+        while (stmt.step())
+        {
+            Buffer buf;
+            stmt.blobCol(4, buf);
+            fetched += buf.dataSize() ? 1 : 0;
+        }
+    }
+    report("sqlite", "paging", paging.ms(), msgs.size());
+
+    // ChatdSqliteDb::getIdxOfMsgid()
+    std::mt19937_64 rng(2);
+    Timer lookups;
+    unsigned found = 0;
+    SqliteStmt stmtIdx(db, "select idx from history where chatid = ? and msgid = ?");
+    for (unsigned i = 0; i < kLookups; i++)
+    {
+        stmtIdx.reset().clearBind();
+        stmtIdx << kChatid << msgs[rng() % msgs.size()].msgid;
+        found += stmtIdx.step() ? 1 : 0;
+    }
+    report("sqlite", "getIdxOfMsgid", lookups.ms(), kLookups);
+
+    // ChatdSqliteDb::getUnreadMsgCountAfterIdx(), from a position in the last 1000 messages
+    Timer unread;
+    unsigned count = 0;
+    for (unsigned i = 0; i < kUnreadCounts; i++)
+    {
+        int idx = (int)msgs.size() - 1 - (int)(rng() % 1000);
+        SqliteStmt stmt(db, "select count(*) from history where (chatid = ?1)"
+                "and (userid != ?2)"
+                "and not (updated != 0 and length(data) = 0)"
+                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
+                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9) and (idx > ?)");
+        stmt << kChatid << kMyUserid << 0 << 3 << 4 << kTypeNormal << kTypeAttachment << 0x11 << 0x12 << idx;
+        stmt.step();
+        count += stmt.intCol(0);
+    }
+    report("sqlite", "unreadCount", unread.ms(), kUnreadCounts);
+    db.close();
+
+    if (fetched != msgs.size() || found != kLookups || !count)
+    {
+        printf("sqlite: unexpected results\n");
+        exit(1);
+    }
+}
+
+static void benchStore(const std::string& dir, const std::vector<TestMsg>& msgs)
+{
+    HistoryStore::remove(dir);
+    HistoryStore store;
+    if (!store.open(dir))
+    {
+        printf("Can't open %s\n", dir.c_str());
+        exit(1);
+    }
+
+    Timer ingest;
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        const TestMsg& msg = msgs[i];
+        HistoryStore::Record rec;
+        rec.msgid = msg.msgid;
+        rec.userid = msg.userid;
+        rec.ts = msg.ts;
+        rec.type = msg.type;
+        rec.data = msg.data.data();
+        rec.dataSize = (uint32_t)msg.data.size();
+        store.add((int32_t)i, rec, unreadFlags(msg));
+    }
+    report("store", "ingest", ingest.ms(), msgs.size());
+
+    // reopened, as when the app starts
+    store.close();
+    Timer open;
+    if (!store.open(dir))
+    {
+        printf("Can't reopen %s\n", dir.c_str());
+        exit(1);
+    }
+    report("store", "open", open.ms(), 1);
+
+    Timer paging;
+    size_t fetched = 0;
+    for (int idx = (int)msgs.size() - 1; idx >= 0; idx -= kPageSize)
+    {
+        for (int i = idx; i > idx - kPageSize && i >= 0; i--)
+        {
+            HistoryStore::Record rec;
+            if (!store.get(i, rec))
+                break;
+            Buffer buf;
+            buf.assign(rec.data, rec.dataSize);
+            fetched += buf.dataSize() ? 1 : 0;
+        }
+    }
+    report("store", "paging", paging.ms(), msgs.size());
+
+    std::mt19937_64 rng(2);
+    Timer lookups;
+    unsigned found = 0;
+    for (unsigned i = 0; i < kLookups; i++)
+    {
+        found += (store.find(msgs[rng() % msgs.size()].msgid) != HistoryStore::kIdxInvalid) ? 1 : 0;
+    }
+    report("store", "getIdxOfMsgid", lookups.ms(), kLookups);
+
+    Timer unread;
+    unsigned count = 0;
+    for (unsigned i = 0; i < kUnreadCounts; i++)
+    {
+        int idx = (int)msgs.size() - 1 - (int)(rng() % 1000);
+        count += store.count(idx, HistoryStore::kFlagUnread);
+    }
+    report("store", "unreadCount", unread.ms(), kUnreadCounts);
+    store.close();
+
+    if (fetched != msgs.size() || found != kLookups || !count)
+    {
+        printf("store: unexpected results\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 100000;
+    std::string dir = (argc > 2) ? argv[2] : ".";
+    if (!count)
+    {
+        printf("Usage: %s [messages] [dir]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<TestMsg> msgs;
+    generate(count, msgs);
+    printf("%u messages\n", count);
+    benchSqlite(dir + "/history_bench.db", msgs);
+    benchStore(dir + "/history_bench.store", msgs);
+    return 0;
+}
@@ -0,0 +1,140 @@
+/* Measures a flood of marshalled calls from a worker thread to the app's thread, with
+ * the messages allocated from karere::MsgPool (as marshallCall() and setTimer() do)
+ * against plain new/delete. The app's queue is modelled as in MegaChatApiImpl: an
+ * EventQueue-like deque under a mutex, and a notify of the waiter for every post. The
+ * producer waits when the consumer is \c backlog messages behind, as with a socket
+ * that stops being read while the app is busy.
+ *
+ * Usage: marshall_bench [messages] [backlog]
+ */
+
+#include "../../src/base/msgPool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace karere;
+
+class Timer
+{
+public:
+    Timer(): mStart(std::chrono::steady_clock::now()) {}
+    double us() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - mStart).count();
+    }
+protected:
+    std::chrono::steady_clock::time_point mStart;
+};
+
+/** The message of a typical marshallCall(), i.e. a lambda that captures a weak handle,
+ * \c this and a couple of values */
+struct Msg
+{
+    void (*func)(void*);
+    void* wptr;
+    void* self;
+    uint64_t id;
+    int value;
+};
+struct HeapMsg: public Msg {};
+struct PoolMsg: public Msg, public MsgPoolAllocated {};
+
+/** The app's queue and waiter */
+struct AppQueue
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<void*> events;
+    unsigned backlog;
+
+    void post(void* msg)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return events.size() < backlog; });
+        events.push_back(msg);
+        cond.notify_all();
+    }
+    void* pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]() { return !events.empty(); });
+        void* msg = events.front();
+        events.pop_front();
+        cond.notify_all();
+        return msg;
+    }
+};
+
+template <class M>
+static void process(void* ptr)
+{
+    M* msg = static_cast<M*>(ptr);
+    msg->value++;
+    delete msg;
+}
+
+/** Posts \c count messages from a worker thread and processes them in the current one,
+ * returning the time per message in us */
+template <class M>
+static double flood(unsigned count, unsigned backlog, uint64_t& checksum)
+{
+    AppQueue queue;
+    queue.backlog = backlog;
+    Timer timer;
+    std::thread producer([&queue, count]()
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            M* msg = new M;
+            msg->func = process<M>;
+            msg->wptr = msg->self = &queue;
+            msg->id = i;
+            msg->value = 0;
+            queue.post(msg);
+        }
+    });
+    for (unsigned i = 0; i < count; i++)
+    {
+        Msg* msg = static_cast<Msg*>(queue.pop());
+        checksum += msg->id;
+        msg->func(msg);
+    }
+    producer.join();
+    return timer.us() / count;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    unsigned backlog = (argc > 2) ? atoi(argv[2]) : 1024;
+    if (!count || !backlog)
+    {
+        printf("Usage: %s [messages] [backlog]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%u messages of %zu bytes, backlog of %u\n", count, sizeof(Msg), backlog);
+    uint64_t heapSum = 0;
+    uint64_t poolSum = 0;
+    // the first round warms up the shared pool, as after a while of running
+    flood<PoolMsg>(count / 10 + 1, backlog, poolSum);
+    poolSum = 0;
+    double heapUs = flood<HeapMsg>(count, backlog, heapSum);
+    double poolUs = flood<PoolMsg>(count, backlog, poolSum);
+    printf("heap %8.4f us per message, %6.2f M messages/s\n", heapUs, 1 / heapUs);
+    printf("pool %8.4f us per message, %6.2f M messages/s\n", poolUs, 1 / poolUs);
+
+    uint64_t expected = (uint64_t)count * (count - 1) / 2;
+    if (heapSum != expected || poolSum != expected)
+    {
+        printf("unexpected results\n");
+        return 1;
+    }
+    return 0;
+}
@@ -135,6 +135,9 @@ char *MegaChatApiTest::login(unsigned int accountIndex, const char *session, con
     {
         ASSERT_CHAT_TEST(initStateValue == MegaChatApi::INIT_OFFLINE_SESSION,
                          "Wrong chat initialization state. Expected: " + std::to_string(MegaChatApi::INIT_OFFLINE_SESSION) + "   Received: " + std::to_string(initStateValue));
+
+        // the chats loaded from the cache must be available as soon as the state is notified
+        checkChatList(accountIndex);
     }
 
     // 2. login
@@ -154,6 +157,7 @@ char *MegaChatApiTest::login(unsigned int accountIndex, const char *session, con
     initStateValue = initState[accountIndex];
     ASSERT_CHAT_TEST(initStateValue == MegaChatApi::INIT_ONLINE_SESSION,
                      "Wrong chat initialization state. Expected: " + std::to_string(MegaChatApi::INIT_ONLINE_SESSION) + "   Received: " + std::to_string(initStateValue));
+    checkChatList(accountIndex);
 
     // 4. Connect to chat servers
     bool *flagRequestConnect = &requestFlagsChat[accountIndex][MegaChatRequest::TYPE_CONNECT]; *flagRequestConnect = false;
@@ -585,10 +589,17 @@ bool MegaChatApiTest::TEST_ResumeSession(unsigned int accountIndex)
 //    }
 
     // ___ Resume an existing session ___
+    MegaChatListItemList *list = megaChatApi[accountIndex]->getChatListItems();
+    unsigned int numChats = list->size();
+    delete list; list = NULL;
     logout(accountIndex, false); // keeps session alive
     char *tmpSession = login(accountIndex, session);
     ASSERT_CHAT_TEST(!strcmp(session, tmpSession), "Bad session key");
     delete [] tmpSession;   tmpSession = NULL;
+    list = megaChatApi[accountIndex]->getChatListItems();
+    ASSERT_CHAT_TEST(list->size() == numChats, "Wrong number of chats after resuming the session. Expected: "
+                     + std::to_string(numChats) + "   Received: " + std::to_string(list->size()));
+    delete list; list = NULL;
 
     checkEmail(accountIndex);
 
@@ -628,7 +639,7 @@ bool MegaChatApiTest::TEST_ResumeSession(unsigned int accountIndex)
                      "Wrong chat initialization state. Expected: " + std::to_string(MegaChatApi::INIT_ONLINE_SESSION) + "   Received: " + std::to_string(initStateValue));
 
     // check there's a list of chats already available
-    MegaChatListItemList *list = megaChatApi[accountIndex]->getChatListItems();
+    list = megaChatApi[accountIndex]->getChatListItems();
     ASSERT_CHAT_TEST(list->size(), "Chat list item is empty");
     delete list; list = NULL;
 
@@ -946,12 +957,24 @@ void MegaChatApiTest::TEST_GetChatRoomsAndMessages(unsigned int accountIndex)
         chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
         ASSERT_CHAT_TEST(megaChatApi[accountIndex]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(accountIndex+1));
         buffer << "Loading messages locally for chat " << chatroom->getTitle() << " (id: " << chatroom->getChatId() << ")" << endl;
-        loadHistory(accountIndex, chatid, chatroomListener);
+        int msgCount = loadHistory(accountIndex, chatid, chatroomListener);
 
         // Close the chatroom
         megaChatApi[accountIndex]->closeChatRoom(chatid, chatroomListener);
         delete chatroomListener;
 
+        // Load it again with the history prefetch, which must return the same messages
+        megaChatApi[accountIndex]->setHistoryPrefetch(64);
+        chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+        ASSERT_CHAT_TEST(megaChatApi[accountIndex]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(accountIndex+1));
+        buffer << "Loading messages with prefetch for chat " << chatroom->getTitle() << " (id: " << chatroom->getChatId() << ")" << endl;
+        int prefetchMsgCount = loadHistory(accountIndex, chatid, chatroomListener);
+        ASSERT_CHAT_TEST(prefetchMsgCount == msgCount, "Wrong number of messages with the history prefetch. Expected: "
+                         + std::to_string(msgCount) + "   Received: " + std::to_string(prefetchMsgCount));
+        megaChatApi[accountIndex]->closeChatRoom(chatid, chatroomListener);
+        delete chatroomListener;
+        megaChatApi[accountIndex]->setHistoryPrefetch(0);
+
         delete chatroom;
         chatroom = NULL;
     }
@@ -2883,6 +2906,50 @@ void MegaChatApiTest::checkEmail(unsigned int indexAccount)
     myEmail = NULL;
 }
 
+void MegaChatApiTest::checkChatList(unsigned int accountIndex)
+{
+    // the list items and the rooms must be available for every chat, without waiting
+    // for any update of the list
+    MegaChatListItemList *items = megaChatApi[accountIndex]->getChatListItems();
+    MegaChatRoomList *chats = megaChatApi[accountIndex]->getChatRooms();
+    ASSERT_CHAT_TEST(items->size() == chats->size(), "Chat list items and rooms don't match. Items: "
+                     + std::to_string(items->size()) + "   Rooms: " + std::to_string(chats->size()));
+
+    for (unsigned int i = 0; i < items->size(); i++)
+    {
+        MegaChatHandle chatid = items->get(i)->getChatId();
+        MegaChatListItem *item = megaChatApi[accountIndex]->getChatListItem(chatid);
+        ASSERT_CHAT_TEST(item, "Chat list item not found: " + std::to_string(chatid));
+        delete item; item = NULL;
+
+        MegaChatRoom *chatroom = megaChatApi[accountIndex]->getChatRoom(chatid);
+        ASSERT_CHAT_TEST(chatroom, "Chatroom not found: " + std::to_string(chatid));
+        delete chatroom; chatroom = NULL;
+    }
+
+    // the delta since the beginning must be the whole list, and so the list by activity
+    ASSERT_CHAT_TEST(!items->size() || megaChatApi[accountIndex]->getChatListVersion() > 0,
+                     "Chat list version not updated after loading the chats");
+    MegaChatListItemList *delta = megaChatApi[accountIndex]->getChatListItemsChangedSince(0);
+    ASSERT_CHAT_TEST(delta, "No delta of the chat list since version 0");
+    ASSERT_CHAT_TEST(delta->size() == items->size(), "Wrong delta of the chat list since version 0. Expected: "
+                     + std::to_string(items->size()) + "   Received: " + std::to_string(delta->size()));
+    delete delta; delta = NULL;
+
+    MegaChatListItemList *byActivity = megaChatApi[accountIndex]->getChatListItemsByLastActivity(0, items->size());
+    ASSERT_CHAT_TEST(byActivity->size() == items->size(), "Wrong number of chats by last activity. Expected: "
+                     + std::to_string(items->size()) + "   Received: " + std::to_string(byActivity->size()));
+    for (unsigned int i = 1; i < byActivity->size(); i++)
+    {
+        ASSERT_CHAT_TEST(byActivity->get(i - 1)->getLastTimestamp() >= byActivity->get(i)->getLastTimestamp(),
+                         "Chats not sorted by last activity");
+    }
+    delete byActivity; byActivity = NULL;
+
+    delete chats; chats = NULL;
+    delete items; items = NULL;
+}
+
 string MegaChatApiTest::dateToString()
 {
     time_t rawTime;
@@ -220,6 +220,7 @@ private:
                                                TestChatRoomListener *chatroomListener, megachat::MegaChatHandle messageId = megachat::MEGACHAT_INVALID_HANDLE);
 
     void checkEmail(unsigned int indexAccount);
+    void checkChatList(unsigned int accountIndex);
     std::string dateToString();
     megachat::MegaChatMessage *attachNode(unsigned int a1, unsigned int a2, megachat::MegaChatHandle chatid,
                                     mega::MegaNode *nodeToSend, TestChatRoomListener* chatroomListener);
@@ -0,0 +1,266 @@
+/* Measures the full-text search of the local history (see Client::searchMessages()),
+ * with the queries of ChatdSqliteDb that maintain the index, against a scan of the
+ * history table, which is what an app has to do without it.
+ * Requires SQLite with FTS5.
+ *
+ * Usage: search_bench [messages] [dir]
+ */
+
+#include "../../src/buffer.h"
+#include "../../src/db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace karere
+{
+extern const char* gDbSchema;
+}
+using namespace karere;
+
+enum
+{
+    kChats = 100,
+    kPageSize = 50,
+    kMaxPages = 20,
+    kTruncateCount = 5000,
+    kTypeNormal = 1,
+    kSearchChat = 7,
+    kAllChats = 0
+};
+
+static const char* gWords[] = {"hello", "world", "meeting", "tomorrow", "project", "release",
+    "café", "naïve", "budget", "review", "lunch", "deploy", "server", "photo", "holiday",
+    "invoice", "contract", "weekend", "design", "bug"};
+
+struct TestMsg
+{
+    uint64_t chatid;
+    uint64_t msgid;
+    int idx;
+    uint32_t ts;
+    std::string text;
+};
+
+struct Hit
+{
+    uint64_t chatid;
+    uint64_t msgid;
+};
+
+class Timer
+{
+public:
+    Timer(): mStart(std::chrono::steady_clock::now()) {}
+    double ms() const
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - mStart).count();
+    }
+protected:
+    std::chrono::steady_clock::time_point mStart;
+};
+
+/** 3-14 words from a small vocabulary, each followed by a random number, so that
+ * there are both common and rare terms. Three messages per second, round-robin
+ * among the chats */
+static void generate(unsigned count, std::vector<TestMsg>& msgs)
+{
+    std::mt19937 rng(1);
+    msgs.resize(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        TestMsg& msg = msgs[i];
+        msg.chatid = 1 + i % kChats;
+        msg.msgid = 1000000000ull + i;
+        msg.idx = (int)(i / kChats);
+        msg.ts = 1500000000 + i / 3;
+        unsigned words = 3 + rng() % 12;
+        for (unsigned w = 0; w < words; w++)
+        {
+            msg.text.append(gWords[rng() % (sizeof(gWords) / sizeof(gWords[0]))]).append(" ");
+            msg.text.append(std::to_string(rng() % 100000)).append(" ");
+        }
+    }
+}
+
+/** ChatdSqliteDb::addMsgToHistory() and addMsgToTextIndex() */
+static void addMsg(SqliteDb& db, const TestMsg& msg)
+{
+    db.query("insert into history"
+        "(idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted, compression) "
+        "values(?,?,?,?,?,?,?,?,?,?,?,?)", msg.idx, msg.chatid, msg.msgid, 0, kTypeNormal, (uint64_t)5,
+        msg.ts, 0, StaticBuffer(msg.text.data(), msg.text.size()), (uint64_t)0, 0, 0);
+
+    int64_t minRowid = (int64_t)msg.ts << 24;
+    db.query("insert into text_index(rowid, chatid, msgid, idx, ts) values("
+        "(select coalesce(max(rowid) + 1, ?1) from text_index where rowid between ?1 and ?2), ?3, ?4, ?5, ?6)",
+        minRowid, minRowid + (1 << 24) - 1, msg.chatid, msg.msgid, msg.idx, msg.ts);
+    int64_t rowid = sqlite3_last_insert_rowid(db);
+    db.query("insert into text_search(rowid, text) values(?,?)", rowid, msg.text);
+}
+
+/** Client::searchMessages(), with the query already converted to quoted prefixes */
+static uint64_t search(SqliteDb& db, const std::string& match, uint64_t chatid, unsigned limit,
+                       uint64_t cursor, std::vector<Hit>& hits)
+{
+    std::string sql = "select s.rowid, i.chatid, i.msgid, i.idx, i.ts from text_search s "
+            "join text_index i on i.rowid = s.rowid where text_search match ?1";
+    if (chatid != kAllChats)
+        sql += " and i.chatid = ?2";
+    if (cursor)
+        sql += " and s.rowid < ?3";
+    sql += " order by s.rowid desc limit ?4";
+
+    SqliteStmt stmt(db, sql);
+    stmt.bind(1, match);
+    if (chatid != kAllChats)
+        stmt.bind(2, chatid);
+    if (cursor)
+        stmt.bind(3, cursor);
+    stmt.bind(4, limit);
+
+    unsigned count = 0;
+    uint64_t last = 0;
+    while (stmt.step())
+    {
+        hits.push_back(Hit{stmt.uint64Col(1), stmt.uint64Col(2)});
+        last = stmt.uint64Col(0);
+        count++;
+    }
+    return (count < limit) ? 0 : last;
+}
+
+static void benchQuery(SqliteDb& db, const char* match, uint64_t chatid)
+{
+    std::vector<Hit> hits;
+    Timer first;
+    uint64_t cursor = search(db, match, chatid, kPageSize, 0, hits);
+    double firstMs = first.ms();
+    size_t firstHits = hits.size();
+
+    Timer next;
+    unsigned pages = 0;
+    while (cursor && pages < kMaxPages)
+    {
+        cursor = search(db, match, chatid, kPageSize, cursor, hits);
+        pages++;
+    }
+    printf("%-36s %-4s first page %7.1f ms (%zu hits), %2u more pages %7.1f ms/page\n",
+           match, (chatid == kAllChats) ? "all" : "one", firstMs, firstHits, pages,
+           pages ? next.ms() / pages : 0.0);
+}
+
+/** Pages of a query must return exactly the rows of a plain count */
+static bool checkPaging(SqliteDb& db, const char* match)
+{
+    std::vector<Hit> hits;
+    uint64_t cursor = 0;
+    do
+    {
+        cursor = search(db, match, kAllChats, 7, cursor, hits);
+    } while (cursor);
+
+    SqliteStmt stmt(db, "select count(*) from text_search where text_search match ?");
+    stmt << match;
+    stmt.step();
+    printf("paging %s 7 hits at a time: %zu hits, %d matches\n", match, hits.size(), stmt.intCol(0));
+    return (int)hits.size() == stmt.intCol(0);
+}
+
+/** Without the index: decode the history of a chat, newest first, until there are \c limit hits */
+static void benchScan(SqliteDb& db, const char* word, unsigned limit)
+{
+    Timer scan;
+    unsigned found = 0;
+    SqliteStmt stmt(db, "select data from history where chatid = ? order by idx desc");
+    stmt << (uint64_t)kSearchChat;
+    while (stmt.step())
+    {
+        Buffer buf;
+        stmt.blobCol(0, buf);
+        std::string text(buf.buf(), buf.dataSize());
+        if (text.find(word) != std::string::npos && ++found == limit)
+            break;
+    }
+    printf("scan one chat for %-18s %7.1f ms (%u hits)\n", word, scan.ms(), found);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 100000;
+    std::string dir = (argc > 2) ? argv[2] : ".";
+    if (!count)
+    {
+        printf("Usage: %s [messages] [dir]\n", argv[0]);
+        return 1;
+    }
+
+    std::string path = dir + "/search_bench.db";
+    remove(path.c_str());
+    remove((path + "-wal").c_str());
+    remove((path + "-shm").c_str());
+    SqliteDb db;
+    if (!db.open(path.c_str(), false))
+    {
+        printf("Can't open %s\n", path.c_str());
+        return 1;
+    }
+    db.simpleQuery(gDbSchema);
+    try
+    {
+        db.simpleQuery("CREATE VIRTUAL TABLE text_search USING fts5(text, tokenize = 'unicode61 remove_diacritics 1')");
+    }
+    catch (std::exception& e)
+    {
+        printf("SQLite was built without FTS5: %s\n", e.what());
+        return 1;
+    }
+    db.commit();
+
+    std::vector<TestMsg> msgs;
+    generate(count, msgs);
+    printf("%u messages in %d chats\n", count, kChats);
+
+    Timer ingest;
+    for (size_t i = 0; i < msgs.size(); i++)
+    {
+        addMsg(db, msgs[i]);
+        if (i % 1000 == 999)
+            db.commit();
+    }
+    db.commit();
+    printf("ingest (history + index) %7.1f ms\n", ingest.ms());
+
+    benchQuery(db, "\"hello\"*", kAllChats);
+    benchQuery(db, "\"hello\"*", kSearchChat);
+    benchQuery(db, "\"cafe\"*", kAllChats);
+    benchQuery(db, "\"12345\"*", kAllChats);
+    benchQuery(db, "\"meet\"* \"tomorrow\"* \"budget\"*", kSearchChat);
+    benchQuery(db, "\"zzz\"*", kAllChats);
+    bool pagingOk = checkPaging(db, "\"12345\"*");
+
+    benchScan(db, "hello", kPageSize);
+    benchScan(db, "12345", ~0u);
+
+    // ChatdSqliteDb::truncateHistory()
+    Timer truncate;
+    db.query("delete from text_search where rowid in (select rowid from text_index where chatid = ? and idx < ?)",
+             (uint64_t)kSearchChat, (int)kTruncateCount);
+    db.query("delete from text_index where chatid = ? and idx < ?", (uint64_t)kSearchChat, (int)kTruncateCount);
+    db.query("delete from history where chatid = ? and idx < ?", (uint64_t)kSearchChat, (int)kTruncateCount);
+    db.commit();
+    printf("truncate %d messages of one chat %7.1f ms\n", kTruncateCount, truncate.ms());
+    db.close();
+
+    if (!pagingOk)
+    {
+        printf("unexpected results\n");
+        return 1;
+    }
+    return 0;
+}
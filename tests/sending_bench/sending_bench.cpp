@@ -0,0 +1,303 @@
+/* Measures the lookups in the send queue of a chat (see chatd::Chat::mSending) with the
+ * indexes of Chat, mSendingByXid and mSendingEdits, against the scans of the queue that
+ * they replaced. Chat can't be created without a connection, so the queue is modelled
+ * here with the same containers, and the same updates of the indexes as
+ * Chat::addToSendingIndex(), removeFromSendingIndex() and msgConfirm().
+ *
+ * Usage: sending_bench [items] [rounds]
+ */
+
+#include "../../src/karereId.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+using namespace karere;
+
+enum: uint8_t { OP_NEWMSG = 2, OP_MSGUPD = 6, OP_MSGUPDX = 8 };
+
+struct Message
+{
+    Id id;
+    uint16_t updated;
+};
+
+struct SendingItem
+{
+    uint8_t opcode;
+    Message* msg;
+    bool isEdit() const { return opcode == OP_MSGUPD || opcode == OP_MSGUPDX; }
+};
+typedef std::list<SendingItem> OutputQueue;
+
+class Timer
+{
+public:
+    Timer(): mStart(std::chrono::steady_clock::now()) {}
+    double us() const
+    {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - mStart).count();
+    }
+protected:
+    std::chrono::steady_clock::time_point mStart;
+};
+
+/** The send queue and its indexes, as in Chat */
+struct SendQueue
+{
+    std::vector<Message> messages;
+    OutputQueue sending;
+    std::unordered_map<Id, OutputQueue::iterator> sendingByXid;
+    std::unordered_map<Id, std::vector<OutputQueue::iterator>> sendingEdits;
+    std::map<Id, Message*> pendingEdits;
+
+    void updatePendingEdit(Id id)
+    {
+        auto edits = sendingEdits.find(id);
+        if (edits == sendingEdits.end())
+            pendingEdits.erase(id);
+        else
+            pendingEdits[id] = edits->second.back()->msg;
+    }
+    void push(uint8_t opcode, Message* msg)
+    {
+        auto it = sending.insert(sending.end(), SendingItem{opcode, msg});
+        if (opcode == OP_NEWMSG)
+        {
+            sendingByXid[msg->id] = it;
+        }
+        else
+        {
+            sendingEdits[msg->id].push_back(it);
+            updatePendingEdit(msg->id);
+        }
+    }
+    /** The NEWMSG of \c msgxid leaves the queue, and its MSGUPDX become MSGUPD of \c msgid */
+    void confirm(Id msgxid, Id msgid)
+    {
+        auto newmsg = sendingByXid.find(msgxid);
+        if (newmsg != sendingByXid.end())
+        {
+            sending.erase(newmsg->second);
+            sendingByXid.erase(newmsg);
+        }
+        auto edits = sendingEdits.find(msgxid);
+        if (edits == sendingEdits.end())
+            return;
+
+        auto items = std::move(edits->second);
+        sendingEdits.erase(edits);
+        auto& msgidEdits = sendingEdits[msgid];
+        for (auto it: items)
+        {
+            it->msg->id = msgid;
+            it->opcode = OP_MSGUPD;
+            msgidEdits.push_back(it);
+        }
+        updatePendingEdit(msgxid);
+        updatePendingEdit(msgid);
+    }
+
+    // the scans of the queue, as before the indexes
+    bool scanHasEdit(Id msgid) const
+    {
+        for (auto& item: sending)
+        {
+            if (item.msg->id == msgid && item.isEdit())
+                return true;
+        }
+        return false;
+    }
+    Message* scanByXid(Id msgxid) const
+    {
+        for (auto& item: sending)
+        {
+            if (item.msg->id == msgxid && item.opcode != OP_MSGUPD)
+                return item.msg;
+        }
+        return nullptr;
+    }
+    void scanConfirm(Id msgxid, Id msgid)
+    {
+        for (auto it = sending.begin(); it != sending.end();)
+        {
+            if (it->opcode == OP_NEWMSG && it->msg->id == msgxid)
+            {
+                it = sending.erase(it);
+                continue;
+            }
+            if (it->opcode == OP_MSGUPDX && it->msg->id == msgxid)
+            {
+                it->msg->id = msgid;
+                it->opcode = OP_MSGUPD;
+            }
+            it++;
+        }
+    }
+
+    // the lookups with the indexes
+    bool hasEdit(Id msgid) const { return sendingEdits.find(msgid) != sendingEdits.end(); }
+    Message* byXid(Id msgxid) const
+    {
+        auto it = sendingByXid.find(msgxid);
+        return (it == sendingByXid.end()) ? nullptr : it->second->msg;
+    }
+};
+
+enum { kMsgidBase = 1000000, kMsgxidBase = 2000000 };
+
+/** Queues \c count items: 60% NEWMSG, 30% MSGUPD of the visible messages and 10%
+ * MSGUPDX of the queued NEWMSGs, shuffled as if they were made in any order offline */
+static void fill(SendQueue& queue, unsigned count, unsigned visible)
+{
+    std::mt19937 rng(1);
+    queue.messages.resize(count);
+    std::vector<Id> newmsgs;
+    for (unsigned i = 0; i < count; i++)
+    {
+        Message& msg = queue.messages[i];
+        msg.updated = (uint16_t)(i + 1);
+        unsigned kind = rng() % 10;
+        if (kind < 6 || newmsgs.empty())
+        {
+            msg.id = kMsgxidBase + i;
+            newmsgs.push_back(msg.id);
+            queue.push(OP_NEWMSG, &msg);
+        }
+        else if (kind < 9)
+        {
+            msg.id = kMsgidBase + rng() % visible;
+            queue.push(OP_MSGUPD, &msg);
+        }
+        else
+        {
+            msg.id = newmsgs[rng() % newmsgs.size()];
+            queue.push(OP_MSGUPDX, &msg);
+        }
+    }
+}
+
+/** The indexes must give the same results as the scans */
+static bool check(SendQueue& queue, unsigned visible)
+{
+    for (unsigned i = 0; i < visible; i++)
+    {
+        Id msgid = kMsgidBase + i;
+        if (queue.hasEdit(msgid) != queue.scanHasEdit(msgid)
+            || queue.hasEdit(msgid) != (queue.pendingEdits.find(msgid) != queue.pendingEdits.end()))
+        {
+            return false;
+        }
+    }
+    for (auto& msg: queue.messages)
+    {
+        if (queue.byXid(msg.id) != queue.scanByXid(msg.id))
+            return false;
+    }
+    // pendingEdits() has the latest edit of each message
+    for (auto& edit: queue.pendingEdits)
+    {
+        Message* latest = nullptr;
+        for (auto& item: queue.sending)
+        {
+            if (item.isEdit() && item.msg->id == edit.first)
+                latest = item.msg;
+        }
+        if (latest != edit.second)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned count = (argc > 1) ? atoi(argv[1]) : 1000;
+    unsigned rounds = (argc > 2) ? atoi(argv[2]) : 100;
+    unsigned visible = count;
+    if (!count || !rounds)
+    {
+        printf("Usage: %s [items] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    SendQueue queue;
+    Timer fillTime;
+    fill(queue, count, visible);
+    printf("%u queued items, %zu NEWMSG, %zu messages with edits, %u visible messages\n",
+           count, queue.sendingByXid.size(), queue.sendingEdits.size(), visible);
+    printf("queue with the indexes %9.1f us\n", fillTime.us());
+    bool ok = check(queue, visible);
+
+    // Chat::getMsgStatus() of each visible message
+    unsigned found = 0;
+    Timer scanStatus;
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (unsigned i = 0; i < visible; i++)
+            found += queue.scanHasEdit(kMsgidBase + i);
+    }
+    double scanStatusUs = scanStatus.us();
+    Timer indexStatus;
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (unsigned i = 0; i < visible; i++)
+            found += queue.hasEdit(kMsgidBase + i);
+    }
+    double indexStatusUs = indexStatus.us();
+    unsigned lookups = rounds * visible;
+    printf("getMsgStatus  scan %8.4f us, index %8.4f us per message\n",
+           scanStatusUs / lookups, indexStatusUs / lookups);
+
+    // Chat::getMsgByXid() of each queued message
+    Timer scanXid;
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (auto& msg: queue.messages)
+            found += (queue.scanByXid(msg.id) != nullptr);
+    }
+    double scanXidUs = scanXid.us();
+    Timer indexXid;
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (auto& msg: queue.messages)
+            found += (queue.byXid(msg.id) != nullptr);
+    }
+    double indexXidUs = indexXid.us();
+    lookups = rounds * count;
+    printf("getMsgByXid   scan %8.4f us, index %8.4f us per message\n",
+           scanXidUs / lookups, indexXidUs / lookups);
+
+    // msgConfirm() of all the NEWMSGs, which rewrites their MSGUPDX into MSGUPD
+    std::vector<Id> xids;
+    for (auto& it: queue.sendingByXid)
+        xids.push_back(it.first);
+    std::sort(xids.begin(), xids.end());
+    SendQueue scanned;
+    fill(scanned, count, visible);
+    Timer scanConfirm;
+    for (size_t i = 0; i < xids.size(); i++)
+        scanned.scanConfirm(xids[i], kMsgidBase + visible + i);
+    double scanConfirmUs = scanConfirm.us();
+    Timer indexConfirm;
+    for (size_t i = 0; i < xids.size(); i++)
+        queue.confirm(xids[i], kMsgidBase + visible + i);
+    double indexConfirmUs = indexConfirm.us();
+    printf("msgConfirm    scan %8.4f us, index %8.4f us per message\n",
+           scanConfirmUs / xids.size(), indexConfirmUs / xids.size());
+    ok = ok && check(queue, visible + (unsigned)xids.size());
+
+    if (!ok || !found)
+    {
+        printf("unexpected results\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+//#define TESTLOOP_LOG_DONES
+//#define TESTLOOP_DEBUG
+
+#include <asyncTest-framework.h>
+#include <promise.h>
+#include <fetchQueue.h>
+
+TESTS_INIT();
+using namespace promise;
+using namespace karere;
+
+/** A FetchQueue with a mock backend: dispatched keys are recorded, and their
+ * promises are resolved or rejected by the test. The flush runs via the test loop,
+ * as it would via marshallCall(). The checks are scheduled after it */
+struct MockQueue: public FetchQueue<int>
+{
+    std::vector<int> dispatched;
+    std::map<int, Promise<void>> pending;
+    bool completeSync = false;
+    MockQueue(test::EventLoop& loop, unsigned maxInFlight)
+    : FetchQueue<int>(maxInFlight,
+        [this](const int& key)
+        {
+            dispatched.push_back(key);
+            if (completeSync)
+                return Promise<void>(_Void());
+            Promise<void> pms;
+            pending[key] = pms;
+            return pms;
+        },
+        [&loop](std::function<void()>&& func)
+        {
+            loop.schedCall(std::move(func), 0, 0);
+        })
+    {}
+    void resolve(int key)
+    {
+        auto pms = pending[key];
+        pending.erase(key);
+        pms.resolve();
+    }
+    void reject(int key)
+    {
+        auto pms = pending[key];
+        pending.erase(key);
+        pms.reject("test error");
+    }
+};
+
+int main()
+{
+
+TestGroup("FetchQueue")
+{
+  asyncTest("Requests in the same turn are merged and dispatched in the next one, in order", {"flush"})
+  {
+      auto queue = std::make_shared<MockQueue>(loop, 8);
+      check(queue->push(1));
+      check(queue->push(2));
+      check(!queue->push(1));
+      check(queue->push(3));
+      check(!queue->push(2));
+      check(queue->queued() == 3);
+      check(queue->dispatched.empty());
+      loop.schedCall([&, queue]()
+      {
+          check((queue->dispatched == std::vector<int>{1, 2, 3}));
+          check(queue->queued() == 0);
+          check(queue->inFlight() == 3);
+          queue->resolve(1);
+          queue->resolve(2);
+          queue->resolve(3);
+          doneOrError(queue->inFlight() == 0, "flush");
+      }, 10);
+  });
+  asyncTest("A key can be queued again once it was dispatched", {"flush"})
+  {
+      auto queue = std::make_shared<MockQueue>(loop, 8);
+      queue->push(1);
+      loop.schedCall([&, queue]()
+      {
+          check(queue->push(1));
+          loop.schedCall([&, queue]()
+          {
+              doneOrError((queue->dispatched == std::vector<int>{1, 1}), "flush");
+          }, 10);
+      }, 10);
+  });
+  asyncTest("Completions dispatch the next keys, in order, up to maxInFlight", {"flush"})
+  {
+      auto queue = std::make_shared<MockQueue>(loop, 2);
+      for (int i = 1; i <= 5; i++)
+      {
+          queue->push(i);
+      }
+      loop.schedCall([&, queue]()
+      {
+          check((queue->dispatched == std::vector<int>{1, 2}));
+          check(queue->inFlight() == 2);
+          check(queue->queued() == 3);
+          queue->resolve(2);
+          check((queue->dispatched == std::vector<int>{1, 2, 3}));
+          queue->reject(1); //a failed request must also free its slot
+          check((queue->dispatched == std::vector<int>{1, 2, 3, 4}));
+          check(queue->inFlight() == 2);
+          queue->resolve(3);
+          queue->resolve(4);
+          check((queue->dispatched == std::vector<int>{1, 2, 3, 4, 5}));
+          queue->resolve(5);
+          check(queue->inFlight() == 0);
+          doneOrError(queue->queued() == 0, "flush");
+      }, 10);
+  });
+  asyncTest("Synchronous completions don't exceed maxInFlight or recurse", {"flush"})
+  {
+      auto queue = std::make_shared<MockQueue>(loop, 2);
+      queue->completeSync = true;
+      for (int i = 1; i <= 100; i++)
+      {
+          queue->push(i);
+      }
+      loop.schedCall([&, queue]()
+      {
+          check(queue->dispatched.size() == 100);
+          for (int i = 0; i < 100; i++)
+          {
+              check(queue->dispatched[i] == i + 1);
+          }
+          doneOrError(queue->inFlight() == 0, "flush");
+      }, 10);
+  });
+  asyncTest("clear() on close drops the queued keys, and they can be queued again", {"flush", "requeue"})
+  {
+      auto queue = std::make_shared<MockQueue>(loop, 1);
+      queue->push(1);
+      queue->push(2);
+      queue->push(3);
+      loop.schedCall([&, queue]()
+      {
+          check((queue->dispatched == std::vector<int>{1}));
+          queue->clear(); //i.e. on logout
+          check(queue->queued() == 0);
+          queue->resolve(1); //the request in flight completes as usual
+          check((queue->dispatched == std::vector<int>{1}));
+          check(queue->inFlight() == 0);
+          loop.done("flush");
+
+          check(queue->push(2)); //i.e. on login
+          check(queue->push(3));
+          loop.schedCall([&, queue]()
+          {
+              check((queue->dispatched == std::vector<int>{1, 2}));
+              queue->resolve(2);
+              check((queue->dispatched == std::vector<int>{1, 2, 3}));
+              queue->resolve(3);
+              doneOrError(queue->inFlight() == 0, "requeue");
+          }, 10);
+      }, 10);
+  });
+  asyncTest("Deleting the queue cancels the scheduled flush and the pending completions", {"flush"})
+  {
+      auto queue = new MockQueue(loop, 1);
+      queue->push(1);
+      queue->push(2);
+      loop.schedCall([&, queue]()
+      {
+          check((queue->dispatched == std::vector<int>{1}));
+          auto pms = queue->pending[1];
+          queue->push(3);
+          delete queue;
+          pms.resolve(); //must not touch the deleted queue
+          loop.schedCall([&]() { loop.done("flush"); }, 10);
+      }, 10);
+  });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1,216 @@
+//#define TESTLOOP_LOG_DONES
+//#define TESTLOOP_DEBUG
+
+/* Built with the stubs/ include dir first, so that retryHandler.h runs its timers
+ * on the virtual clock of stubs/base/timers.hpp */
+#include <asyncTest-framework.h>
+#include <base/retryHandler.h>
+#include <vector>
+
+TESTS_INIT();
+using namespace karere;
+
+namespace test
+{
+int64_t gVirtualNow = 0;
+bool gVirtualLog = false;
+}
+
+/** The simulated network: down until \c outageEnd, then each connect attempt
+ * succeeds after \c latency ms. The attempts made while it is down fail after
+ * \c failTime ms. If \c hang is set, the attempts never complete */
+struct FakeNetwork
+{
+    int64_t outageEnd = 30000;
+    unsigned latency = 300;
+    unsigned failTime = 200;
+    bool hang = false;
+    int running = 0;
+    int maxRunning = 0;
+};
+
+template <class Func>
+rh::IRetryController* createController(const std::string& name, Func&& func,
+    DeleteTrackable::Handle wptr, rh::ReconnectScheduler* scheduler, std::function<int()>&& priority)
+{
+    auto ctrl = new rh::RetryController<Func, std::nullptr_t>(name, std::forward<Func>(func), nullptr, 0, wptr,
+        nullptr, 10000, 0, 1000);
+    if (scheduler)
+        ctrl->setScheduler(*scheduler, std::move(priority));
+    ctrl->start();
+    return ctrl;
+}
+
+/** A connection that retries, as the chatd shards do. Deleting it aborts its attempts */
+struct Shard: public DeleteTrackable
+{
+    int no;
+    int priority;
+    int64_t connectedAt = -1;
+    int attempts = 0;
+    std::unique_ptr<rh::IRetryController> retryCtrl;
+    Shard(int aNo, int aPriority): no(aNo), priority(aPriority) {}
+    void connect(FakeNetwork& net, rh::ReconnectScheduler* scheduler)
+    {
+        retryCtrl.reset(createController("shard" + std::to_string(no), [this, &net](int, DeleteTrackable::Handle)
+        {
+            promise::Promise<void> pms;
+            attempts++;
+            net.running++;
+            net.maxRunning = std::max(net.maxRunning, net.running);
+            if (net.hang)
+                return pms;
+
+            bool up = test::gVirtualNow >= net.outageEnd;
+            setTimeout([this, &net, pms, up]() mutable
+            {
+                net.running--;
+                if (up)
+                {
+                    connectedAt = test::gVirtualNow;
+                    pms.resolve();
+                }
+                else
+                {
+                    pms.reject("network is down");
+                }
+            }, up ? net.latency : net.failTime, nullptr);
+            return pms;
+        }, weakHandle(), scheduler, [this]() { return priority; }));
+    }
+};
+
+/** Connects \c count shards while the network is down, and runs the virtual loop
+ * until all of them are connected. The shards with \c no % 5 == 0 have priority 1 */
+struct Simulation
+{
+    FakeNetwork net;
+    rh::ReconnectScheduler scheduler;
+    std::vector<std::unique_ptr<Shard>> shards;
+    Simulation(unsigned maxConcurrent)
+    : scheduler(nullptr, maxConcurrent)
+    {
+        test::VirtualLoop::instance().reset();
+    }
+    ~Simulation()
+    {
+        shards.clear();
+        test::VirtualLoop::instance().reset();
+    }
+    void run(int count, bool useScheduler, int64_t until = 600000)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            shards.emplace_back(new Shard(i, (i % 5 == 0) ? 1 : 0));
+            shards.back()->connect(net, useScheduler ? &scheduler : nullptr);
+        }
+        test::VirtualLoop::instance().run(until);
+    }
+    /** Time from the end of the outage until all the shards (or the ones with the
+     * given priority) were connected, or -1 if any of them is not */
+    int64_t connectedIn(int priority = -1) const
+    {
+        int64_t last = 0;
+        for (auto& shard: shards)
+        {
+            if ((priority >= 0) && (shard->priority != priority))
+                continue;
+            if (shard->connectedAt < 0)
+                return -1;
+            last = std::max(last, shard->connectedAt);
+        }
+        return last - net.outageEnd;
+    }
+};
+
+int main()
+{
+
+TestGroup("ReconnectScheduler")
+{
+  syncTest("The attempts in flight are capped, and all the shards connect")
+  {
+      Simulation sim(4);
+      sim.run(32, true);
+      check(sim.net.maxRunning == 4);
+      check(sim.connectedIn() >= 0);
+      check(sim.scheduler.running() == 0);
+      check(sim.scheduler.queued() == 0);
+      auto& stats = sim.scheduler.stats();
+      check(stats.reconnects == 32);
+      check(stats.attempts == stats.failures + stats.reconnects);
+      check(stats.maxQueued >= 28);
+      check(stats.slotTimeouts == 0);
+  });
+  syncTest("Once an attempt succeeds, the waiting shards reconnect without their backoff")
+  {
+      Simulation legacy(4);
+      legacy.run(32, false);
+      Simulation sim(4);
+      sim.run(32, true);
+      check(sim.scheduler.stats().wakeups > 0);
+      check(legacy.connectedIn() > 0);
+      check(sim.connectedIn() > 0);
+      // 8 rounds of 4 connects of 300 ms, plus the wait of the first one after the outage
+      check(sim.connectedIn() < sim.connectedIn(1) + 8 * 300 + 1);
+      check(sim.connectedIn() < legacy.connectedIn());
+  });
+  syncTest("Once the network is back, the shards with a higher priority connect first")
+  {
+      Simulation sim(4);
+      sim.run(32, true);
+      int64_t prio = sim.connectedIn(1);
+      check(prio >= 0);
+      // only the attempts that were already in flight when the first one succeeded
+      // can go before them
+      int before = 0;
+      for (auto& shard: sim.shards)
+      {
+          if ((shard->priority == 0) && (shard->connectedAt - sim.net.outageEnd < prio))
+          {
+              before++;
+          }
+      }
+      check(before <= 4);
+  });
+  syncTest("An attempt that doesn't finish frees its slot after kSlotTimeout")
+  {
+      Simulation sim(2);
+      sim.net.hang = true;
+      sim.run(3, true, rh::ReconnectScheduler::kSlotTimeout - 1);
+      check(sim.net.running == 2);
+      check(sim.scheduler.queued() == 1);
+      test::VirtualLoop::instance().run(rh::ReconnectScheduler::kSlotTimeout);
+      check(sim.net.running == 3);
+      check(sim.scheduler.stats().slotTimeouts == 2);
+      check(sim.scheduler.queued() == 0);
+  });
+  syncTest("Deleting the shards cancels their attempts and frees their slots")
+  {
+      Simulation sim(2);
+      sim.net.hang = true;
+      sim.run(5, true, 1000);
+      check(sim.scheduler.running() == 2);
+      check(sim.scheduler.queued() == 3);
+      sim.shards.clear();
+      check(sim.scheduler.running() == 0);
+      check(sim.scheduler.queued() == 0);
+  });
+  syncTest("The backoff is a decorrelated jitter between base and 3x the previous wait, capped")
+  {
+      rh::ReconnectScheduler scheduler(nullptr);
+      check(scheduler.backoff(0, 0, 10000) == 0);
+      unsigned wait = 0;
+      for (int i = 0; i < 1000; i++)
+      {
+          unsigned prev = wait;
+          wait = scheduler.backoff(prev, 1000, 10000);
+          check(wait >= 1000);
+          check(wait <= std::max(1000u, prev * 3));
+          check(wait <= 10000);
+      }
+  });
+});
+
+return test::gNumFailed;
+}
@@ -0,0 +1 @@
+/* Stub of base/gcm.h for the unit tests, the timers don't use the GUI call marshaller */
@@ -0,0 +1,82 @@
+#ifndef KARERE_TEST_STUB_TIMERS_H
+#define KARERE_TEST_STUB_TIMERS_H
+/* Stub of base/timers.hpp for the unit tests. The timers run on a virtual clock:
+ * test::VirtualLoop::run() calls them in order of their deadline, advancing the
+ * clock to each one, so a test can simulate minutes of timeouts instantly and
+ * deterministically */
+
+#include <stdint.h>
+#include <map>
+#include <functional>
+#include <karereCommon.h>
+
+typedef unsigned long megaHandle;
+
+namespace test
+{
+class VirtualLoop
+{
+public:
+    static VirtualLoop& instance()
+    {
+        static VirtualLoop loop;
+        return loop;
+    }
+    megaHandle add(std::function<void()>&& func, unsigned ms)
+    {
+        megaHandle handle = ++mLastHandle;
+        mTimers.emplace(gVirtualNow + ms, std::make_pair(handle, std::move(func)));
+        return handle;
+    }
+    bool cancel(megaHandle handle)
+    {
+        for (auto it = mTimers.begin(); it != mTimers.end(); it++)
+        {
+            if (it->second.first == handle)
+            {
+                mTimers.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+    /** Runs the timers until there are none left, or the clock passes \c until */
+    void run(int64_t until)
+    {
+        while (!mTimers.empty() && (mTimers.begin()->first <= until))
+        {
+            auto it = mTimers.begin();
+            gVirtualNow = it->first;
+            auto func = std::move(it->second.second);
+            mTimers.erase(it);
+            func();
+        }
+    }
+    /** Drops the pending timers and resets the clock */
+    void reset()
+    {
+        mTimers.clear();
+        gVirtualNow = 0;
+    }
+    size_t pending() const { return mTimers.size(); }
+
+protected:
+    std::multimap<int64_t, std::pair<megaHandle, std::function<void()>>> mTimers;
+    megaHandle mLastHandle = 0;
+};
+}
+
+namespace karere
+{
+template <class CB>
+static inline megaHandle setTimeout(CB&& callback, unsigned time, void* /*appCtx*/)
+{
+    return test::VirtualLoop::instance().add(std::function<void()>(std::forward<CB>(callback)), time);
+}
+static inline bool cancelTimeout(megaHandle handle, void* /*appCtx*/)
+{
+    return test::VirtualLoop::instance().cancel(handle);
+}
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef KARERE_TEST_STUB_COMMON_H
+#define KARERE_TEST_STUB_COMMON_H
+/* Stub of karereCommon.h for the unit tests: the time is virtual, see base/timers.hpp */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace test
+{
+extern int64_t gVirtualNow;
+extern bool gVirtualLog;
+}
+static inline int64_t timestampMs() { return test::gVirtualNow; }
+
+#define KR_VIRTUAL_LOG(level, fmtString,...) \
+    do { if (test::gVirtualLog) printf("[%6lld] " level " " fmtString "\n", (long long)test::gVirtualNow, ##__VA_ARGS__); } while(0)
+#define KR_LOG_WARNING(fmtString,...) KR_VIRTUAL_LOG("W", fmtString, ##__VA_ARGS__)
+#define KR_LOG_DEBUG(fmtString,...) KR_VIRTUAL_LOG("D", fmtString, ##__VA_ARGS__)
+
+#endif